@@ -0,0 +1,114 @@
+/*
+ *  PCM - Volumio FIFO plugin - DSD to PCM decimation benchmark
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Runs the DSD to PCM conversion over ten seconds of stereo DSD_U8 for
+ * each DSD rate and PCM output rate, and reports how many times faster
+ * than real time it ran. Anything close to 1x will not keep up on the
+ * target board once the rest of the system is busy.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "volumiofifo_dsp.h"
+
+#define BENCH_CHANNELS 2
+#define BENCH_SECONDS 10
+#define BENCH_CHUNK 4096
+
+static double _bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int _bench_run(unsigned int dsd, unsigned int pcm_rate) {
+	// DSD_U8 carries one byte, so 8 bits, per channel per frame
+	unsigned int byte_rate = 44100 * dsd / 8;
+	// Enough input for the deepest decimation to fill the output chunk
+	static unsigned char in[BENCH_CHUNK * 16 * BENCH_CHANNELS];
+	static int32_t out[BENCH_CHUNK * BENCH_CHANNELS];
+	volumiofifo_dsp_t *dsp;
+	unsigned long total = 0, produced = 0, seed = 1;
+	double start, elapsed;
+	unsigned int i;
+
+	dsp = calloc(1, sizeof(*dsp));
+	if(dsp == NULL)
+		return -ENOMEM;
+
+	dsp->in_channels = BENCH_CHANNELS;
+	dsp->out_channels = BENCH_CHANNELS;
+	dsp->in.phys_bytes = 1;
+	dsp->in.width = 8;
+	dsp->out.phys_bytes = 4;
+	dsp->out.width = 32;
+	dsp->out.is_signed = 1;
+	dsp->dsd = VOLUMIOFIFO_DSD_U8;
+	if(_snd_pcm_volumiofifo_dsp_dsd_pcm(dsp, byte_rate, pcm_rate) < 0) {
+		free(dsp);
+		return -EINVAL;
+	}
+	_snd_pcm_volumiofifo_dsp_configure(dsp);
+	_snd_pcm_volumiofifo_dsp_reset(dsp);
+
+	// Pseudo random bits cost the filters as much as real music does
+	for(i = 0; i < sizeof(in); i++) {
+		seed = seed * 1103515245 + 12345;
+		in[i] = seed >> 16;
+	}
+
+	start = _bench_now();
+	while(total < (unsigned long) byte_rate * BENCH_SECONDS) {
+		unsigned int frames = _snd_pcm_volumiofifo_dsp_max_input(dsp, BENCH_CHUNK);
+
+		produced += _snd_pcm_volumiofifo_dsp_process(dsp, in, out, frames);
+		total += frames;
+	}
+	elapsed = _bench_now() - start;
+
+	printf("DSD%-4u -> %6u Hz: %lu frames in %.3f s, %.1fx real time\n",
+			dsd, pcm_rate, produced, elapsed,
+			(double) total / byte_rate / elapsed);
+
+	free(dsp);
+	return 0;
+}
+
+int main(void) {
+	static const unsigned int dsd_rates[] = { 64, 128, 256 };
+	static const unsigned int pcm_rates[] = { 88200, 176400 };
+	unsigned int i, j;
+
+	for(i = 0; i < sizeof(dsd_rates) / sizeof(dsd_rates[0]); i++) {
+		for(j = 0; j < sizeof(pcm_rates) / sizeof(pcm_rates[0]); j++) {
+			if(_bench_run(dsd_rates[i], pcm_rates[j]) < 0)
+				fprintf(stderr, "DSD%u to %u Hz is not supported\n", dsd_rates[i], pcm_rates[j]);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,504 @@
+/*
+ *  PCM - Volumio FIFO plugin - end to end throughput benchmark
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Plays a sine through alsa-lib into a temporary fifo, as fast as a reader
+ * thread can empty it, once through the volumiofifo plugin built alongside
+ * this benchmark and once through the stock file plugin, for every format
+ * the plugin accepts by default at each rate, channel count and period size.
+ * For each it reports the frames played a second and the CPU time the
+ * playing thread, alsa-lib and the plugin used for each second of audio.
+ * The reader's CPU time is left out, it is the same for both plugins.
+ *
+ * Usage: volumiofifo_e2e_bench [-s seconds] [-F formats] [-r rates] [-c channels]
+ *            [-p period_frames] [-P plugin] [-l plugin_library] [-C] [option=value ...]
+ *
+ * The lists are comma separated, the buffer is always four periods. The
+ * options are added to the volumiofifo PCM's definition, e.g. volume 0.5
+ * is given as volume=0.5. -C prints comma separated values, for keeping
+ * the results of each build to compare.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <alsa/asoundlib.h>
+
+#ifndef VOLUMIOFIFO_BENCH_PLUGIN
+#define VOLUMIOFIFO_BENCH_PLUGIN "libasound_module_pcm_volumiofifo.so"
+#endif
+
+#define BENCH_MAX_LIST 64
+#define BENCH_PERIODS 4
+#define BENCH_READ_BYTES 65536
+
+static const unsigned int bench_default_rates[] = { 44100, 48000, 96000, 192000 };
+static const unsigned int bench_default_channels[] = { 1, 2, 6, 8 };
+static const unsigned int bench_default_periods[] = { 256, 1024, 4096 };
+
+/* The PCMs defined by bench_config, in the order of the results */
+static const char *bench_plugins[] = { "volumiofifo", "file" };
+#define BENCH_PLUGINS (sizeof(bench_plugins) / sizeof(bench_plugins[0]))
+
+typedef struct bench_reader {
+	pthread_t thread;
+	int fd;
+	volatile int stop;
+} bench_reader_t;
+
+typedef struct bench_result {
+	/* 0 if the PCM did not accept the case, or failed */
+	int played;
+	double frames_per_s;
+	double cpu_ms_per_s;
+	unsigned int xruns;
+} bench_result_t;
+
+static void bench_usage(void) {
+	fprintf(stderr, "Usage: volumiofifo_e2e_bench [-s seconds] [-F formats] [-r rates] [-c channels] "
+			"[-p period_frames] [-P plugin] [-l plugin_library] [-C] [option=value ...]\n");
+}
+
+static uint64_t bench_clock_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_parse_list(const char *arg, unsigned int *values, unsigned int *count) {
+	char *end;
+
+	*count = 0;
+	while(*arg) {
+		if(*count == BENCH_MAX_LIST)
+			return -EINVAL;
+		values[(*count)++] = strtoul(arg, &end, 10);
+		if(end == arg || values[*count - 1] == 0 || (*end != ',' && *end != '\0'))
+			return -EINVAL;
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return *count > 0 ? 0 : -EINVAL;
+}
+
+static void *bench_reader_thread(void *arg) {
+	bench_reader_t *reader = arg;
+	static char buf[BENCH_READ_BYTES];
+	struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+
+	while(!reader->stop) {
+		ssize_t count;
+
+		if(poll(&pfd, 1, 10) <= 0)
+			continue;
+		count = read(reader->fd, buf, sizeof(buf));
+		// With no writer the fifo is always readable, at its end
+		if(count == 0)
+			usleep(1000);
+	}
+	return NULL;
+}
+
+static int bench_config(snd_config_t **config, const char *library, const char *fifo, char **settings,
+		int count) {
+	snd_input_t *input;
+	char *text, *at;
+	size_t size;
+	int err, i;
+
+	size = 512 + 3 * strlen(fifo) + strlen(library);
+	for(i = 0; i < count; i++)
+		size += strlen(settings[i]) + 2;
+	text = malloc(size);
+	if(text == NULL)
+		return -ENOMEM;
+
+	at = text + sprintf(text, "pcm_type.volumiofifo { lib \"%s\" }\n"
+			"pcm.bench_file { type file slave.pcm { type null } file \"%s\" format \"raw\" }\n"
+			"pcm.bench_volumiofifo { type volumiofifo fifo \"%s\"", library, fifo, fifo);
+	for(i = 0; i < count; i++) {
+		char *equals = strchr(settings[i], '=');
+
+		at += sprintf(at, " %.*s %s", (int) (equals - settings[i]), settings[i], equals + 1);
+	}
+	strcpy(at, " }\n");
+
+	err = snd_config_top(config);
+	if(err < 0)
+		goto out;
+	err = snd_input_buffer_open(&input, text, -1);
+	if(err < 0) {
+		snd_config_delete(*config);
+		goto out;
+	}
+	err = snd_config_load(*config, input);
+	snd_input_close(input);
+	if(err < 0)
+		snd_config_delete(*config);
+out:
+	free(text);
+	return err;
+}
+
+static int bench_open(snd_pcm_t **pcm, snd_config_t *config, const char *plugin) {
+	char name[32];
+
+	snprintf(name, sizeof(name), "bench_%s", plugin);
+	return snd_pcm_open_lconf(pcm, name, SND_PCM_STREAM_PLAYBACK, 0, config);
+}
+
+/* One period of a sine, identical on every channel, in the given format */
+static void bench_fill(snd_pcm_format_t format, unsigned int rate, unsigned int channels,
+		snd_pcm_uframes_t frames, unsigned char *out) {
+	int width = snd_pcm_format_width(format);
+	int bytes = snd_pcm_format_physical_width(format) / 8;
+	int little = snd_pcm_format_little_endian(format) == 1;
+	snd_pcm_uframes_t f;
+	unsigned int c;
+	int b;
+
+	for(f = 0; f < frames; f++) {
+		double sample = 0.5 * sin(2 * M_PI * 997.0 * f / rate);
+		uint64_t bits;
+
+		if(snd_pcm_format_float(format) == 1 && bytes == 4) {
+			float value = sample;
+			uint32_t word;
+
+			memcpy(&word, &value, sizeof(word));
+			bits = word;
+		} else if(snd_pcm_format_float(format) == 1) {
+			memcpy(&bits, &sample, sizeof(bits));
+		} else {
+			int64_t value = (int64_t) (sample * ((1LL << (width - 1)) - 1));
+
+			if(snd_pcm_format_unsigned(format) == 1)
+				value += 1LL << (width - 1);
+			bits = (uint64_t) value;
+		}
+		for(c = 0; c < channels; c++) {
+			for(b = 0; b < bytes; b++)
+				*out++ = bits >> (8 * (little ? b : bytes - 1 - b));
+		}
+	}
+}
+
+static int bench_play(snd_config_t *config, const char *plugin, bench_reader_t *reader,
+		snd_pcm_format_t format, unsigned int rate, unsigned int channels,
+		snd_pcm_uframes_t period_size, double seconds, bench_result_t *result) {
+	snd_pcm_uframes_t buffer_size = period_size * BENCH_PERIODS;
+	snd_pcm_uframes_t frames = seconds * rate, played = 0;
+	uint64_t wall_ns, cpu_ns, reader_ns;
+	snd_pcm_hw_params_t *hw_params;
+	clockid_t reader_clock;
+	unsigned char *block;
+	snd_pcm_t *pcm;
+	int err;
+
+	memset(result, 0, sizeof(*result));
+	err = bench_open(&pcm, config, plugin);
+	if(err < 0)
+		return err;
+
+	snd_pcm_hw_params_alloca(&hw_params);
+	snd_pcm_hw_params_any(pcm, hw_params);
+	// A case the PCM will not take exactly is skipped rather than converted
+	if((err = snd_pcm_hw_params_set_rate_resample(pcm, hw_params, 0)) < 0 ||
+			(err = snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+			(err = snd_pcm_hw_params_set_format(pcm, hw_params, format)) < 0 ||
+			(err = snd_pcm_hw_params_set_channels(pcm, hw_params, channels)) < 0 ||
+			(err = snd_pcm_hw_params_set_rate(pcm, hw_params, rate, 0)) < 0 ||
+			(err = snd_pcm_hw_params_set_period_size(pcm, hw_params, period_size, 0)) < 0 ||
+			(err = snd_pcm_hw_params_set_buffer_size(pcm, hw_params, buffer_size)) < 0 ||
+			(err = snd_pcm_hw_params(pcm, hw_params)) < 0) {
+		snd_pcm_close(pcm);
+		return 0;
+	}
+
+	block = malloc(snd_pcm_frames_to_bytes(pcm, period_size));
+	if(block == NULL) {
+		snd_pcm_close(pcm);
+		return -ENOMEM;
+	}
+	bench_fill(format, rate, channels, period_size, block);
+
+	pthread_getcpuclockid(reader->thread, &reader_clock);
+	wall_ns = bench_clock_ns(CLOCK_MONOTONIC);
+	cpu_ns = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	reader_ns = bench_clock_ns(reader_clock);
+
+	while(played < frames) {
+		snd_pcm_sframes_t written = snd_pcm_writei(pcm, block, period_size);
+
+		if(written == -EPIPE) {
+			result->xruns++;
+			written = snd_pcm_recover(pcm, written, 1);
+		}
+		if(written < 0) {
+			err = written;
+			goto out;
+		}
+		played += written;
+	}
+	err = snd_pcm_drain(pcm);
+	if(err < 0)
+		goto out;
+
+	wall_ns = bench_clock_ns(CLOCK_MONOTONIC) - wall_ns;
+	reader_ns = bench_clock_ns(reader_clock) - reader_ns;
+	cpu_ns = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns;
+	cpu_ns = cpu_ns > reader_ns ? cpu_ns - reader_ns : 0;
+
+	result->played = 1;
+	result->frames_per_s = played * 1e9 / wall_ns;
+	result->cpu_ms_per_s = cpu_ns / 1e6 / ((double) played / rate);
+
+out:
+	free(block);
+	snd_pcm_close(pcm);
+	return err;
+}
+
+/* The formats the volumiofifo PCM offers, which are the default list unless the options change it */
+static int bench_formats(snd_config_t *config, snd_pcm_format_t *formats, unsigned int *count) {
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_t *pcm;
+	int format, err;
+
+	err = bench_open(&pcm, config, bench_plugins[0]);
+	if(err < 0)
+		return err;
+	snd_pcm_hw_params_alloca(&hw_params);
+	snd_pcm_hw_params_any(pcm, hw_params);
+	*count = 0;
+	for(format = 0; format <= SND_PCM_FORMAT_LAST && *count < BENCH_MAX_LIST; format++) {
+		if(snd_pcm_hw_params_test_format(pcm, hw_params, format) == 0)
+			formats[(*count)++] = format;
+	}
+	snd_pcm_close(pcm);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned int rates[BENCH_MAX_LIST], channels[BENCH_MAX_LIST], periods[BENCH_MAX_LIST];
+	unsigned int rate_count, channel_count, period_count, format_count = 0;
+	snd_pcm_format_t formats[BENCH_MAX_LIST];
+	const char *library = VOLUMIOFIFO_BENCH_PLUGIN, *only_plugin = NULL, *format_arg = NULL;
+	char dir[] = "/tmp/volumiofifo-bench-XXXXXX", fifo[sizeof(dir) + 8];
+	bench_reader_t reader = { .fd = -1 };
+	snd_config_t *config = NULL;
+	unsigned int f, r, c, p, i;
+	double seconds = 1;
+	int opt, csv = 0, status = 1, err;
+
+	rate_count = sizeof(bench_default_rates) / sizeof(bench_default_rates[0]);
+	memcpy(rates, bench_default_rates, sizeof(bench_default_rates));
+	channel_count = sizeof(bench_default_channels) / sizeof(bench_default_channels[0]);
+	memcpy(channels, bench_default_channels, sizeof(bench_default_channels));
+	period_count = sizeof(bench_default_periods) / sizeof(bench_default_periods[0]);
+	memcpy(periods, bench_default_periods, sizeof(bench_default_periods));
+
+	while((opt = getopt(argc, argv, "s:F:r:c:p:P:l:C")) != -1) {
+		switch(opt) {
+			case 's':
+				seconds = atof(optarg);
+				break;
+			case 'F':
+				format_arg = optarg;
+				break;
+			case 'r':
+				if(bench_parse_list(optarg, rates, &rate_count) < 0) {
+					bench_usage();
+					return 1;
+				}
+				break;
+			case 'c':
+				if(bench_parse_list(optarg, channels, &channel_count) < 0) {
+					bench_usage();
+					return 1;
+				}
+				break;
+			case 'p':
+				if(bench_parse_list(optarg, periods, &period_count) < 0) {
+					bench_usage();
+					return 1;
+				}
+				break;
+			case 'P':
+				only_plugin = optarg;
+				break;
+			case 'l':
+				library = optarg;
+				break;
+			case 'C':
+				csv = 1;
+				break;
+			default:
+				bench_usage();
+				return 1;
+		}
+	}
+	if(seconds <= 0) {
+		bench_usage();
+		return 1;
+	}
+	for(i = optind; i < argc; i++) {
+		if(strchr(argv[i], '=') == NULL || argv[i][0] == '=') {
+			fprintf(stderr, "Options are option=value, not %s\n", argv[i]);
+			return 1;
+		}
+		if(strncmp(argv[i], "fifo=", 5) == 0) {
+			fprintf(stderr, "The benchmark plays into its own fifo\n");
+			return 1;
+		}
+	}
+
+	if(mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Failed to create a directory for the fifo, error %d\n", errno);
+		return 1;
+	}
+	snprintf(fifo, sizeof(fifo), "%s/fifo", dir);
+	if(mkfifo(fifo, 0600) < 0) {
+		fprintf(stderr, "Failed to create the fifo %s, error %d\n", fifo, errno);
+		rmdir(dir);
+		return 1;
+	}
+
+	err = bench_config(&config, library, fifo, argv + optind, argc - optind);
+	if(err < 0) {
+		fprintf(stderr, "Failed to build the configuration, error %d\n", err);
+		goto out;
+	}
+
+	if(format_arg) {
+		char *list = strdup(format_arg), *name, *save = NULL;
+
+		for(name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+			if(format_count == BENCH_MAX_LIST ||
+					(formats[format_count++] = snd_pcm_format_value(name)) == SND_PCM_FORMAT_UNKNOWN) {
+				fprintf(stderr, "Unknown format %s, or too many formats\n", name);
+				free(list);
+				goto out;
+			}
+		}
+		free(list);
+	} else {
+		err = bench_formats(config, formats, &format_count);
+		if(err < 0) {
+			fprintf(stderr, "Failed to open the volumiofifo PCM with %s, error %d\n", library, err);
+			goto out;
+		}
+	}
+
+	// Opened before any writer, so the fifo is never without a reader
+	reader.fd = open(fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(reader.fd < 0) {
+		fprintf(stderr, "Failed to open the fifo to read, error %d\n", errno);
+		goto out;
+	}
+	err = pthread_create(&reader.thread, NULL, bench_reader_thread, &reader);
+	if(err != 0) {
+		fprintf(stderr, "Failed to start the reader, error %d\n", err);
+		close(reader.fd);
+		reader.fd = -1;
+		goto out;
+	}
+
+	if(csv) {
+		printf("plugin,format,rate,channels,period,buffer,frames_per_s,cpu_ms_per_s,xruns\n");
+	} else {
+		printf("%.1f s of a sine per case, buffer %u periods, cpu is ms per second of audio\n", seconds,
+				BENCH_PERIODS);
+		printf("%-12s %6s %3s %6s", "format", "rate", "ch", "period");
+		for(i = 0; i < BENCH_PLUGINS; i++) {
+			if(only_plugin == NULL || strcmp(only_plugin, bench_plugins[i]) == 0)
+				printf(" %12s %7s %6s", bench_plugins[i], "cpu", "xruns");
+		}
+		printf("\n");
+	}
+
+	for(f = 0; f < format_count; f++) {
+		for(r = 0; r < rate_count; r++) {
+			for(c = 0; c < channel_count; c++) {
+				for(p = 0; p < period_count; p++) {
+					bench_result_t results[BENCH_PLUGINS];
+					int any = 0;
+
+					for(i = 0; i < BENCH_PLUGINS; i++) {
+						results[i].played = 0;
+						if(only_plugin && strcmp(only_plugin, bench_plugins[i]) != 0)
+							continue;
+						err = bench_play(config, bench_plugins[i], &reader, formats[f], rates[r],
+								channels[c], periods[p], seconds, &results[i]);
+						if(err < 0)
+							fprintf(stderr, "%s %s %u Hz %u channels period %u failed, error %d\n",
+									bench_plugins[i], snd_pcm_format_name(formats[f]), rates[r],
+									channels[c], periods[p], err);
+						any |= results[i].played;
+					}
+					if(!any)
+						continue;
+
+					if(!csv)
+						printf("%-12s %6u %3u %6u", snd_pcm_format_name(formats[f]), rates[r],
+								channels[c], periods[p]);
+					for(i = 0; i < BENCH_PLUGINS; i++) {
+						if(only_plugin && strcmp(only_plugin, bench_plugins[i]) != 0)
+							continue;
+						if(csv && results[i].played)
+							printf("%s,%s,%u,%u,%u,%u,%.0f,%.3f,%u\n", bench_plugins[i],
+									snd_pcm_format_name(formats[f]), rates[r], channels[c],
+									periods[p], periods[p] * BENCH_PERIODS,
+									results[i].frames_per_s, results[i].cpu_ms_per_s,
+									results[i].xruns);
+						else if(!csv && results[i].played)
+							printf(" %12.0f %7.2f %6u", results[i].frames_per_s,
+									results[i].cpu_ms_per_s, results[i].xruns);
+						else if(!csv)
+							printf(" %12s %7s %6s", "-", "-", "-");
+					}
+					if(!csv)
+						printf("\n");
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	status = 0;
+
+	reader.stop = 1;
+	pthread_join(reader.thread, NULL);
+	close(reader.fd);
+out:
+	if(config)
+		snd_config_delete(config);
+	unlink(fifo);
+	rmdir(dir);
+	return status;
+}
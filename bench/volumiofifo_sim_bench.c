@@ -0,0 +1,426 @@
+/*
+ *  PCM - Volumio FIFO plugin - simulated playback scenarios
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Plays through the plugin for every pairing of a client behaviour with a
+ * reader behaviour, against the simulated fifo and under the virtual clock
+ * of volumiofifo_sim.h, and reports what the listener and the system would
+ * see: xruns, underruns of the reader, wakeups, system calls and the audio
+ * queued between the client and the reader. Nothing waits, so a minute of
+ * playback takes milliseconds, and the same seed gives the same results on
+ * every run, so a change to the plugin's scheduling can be compared before
+ * and after.
+ *
+ * Usage: volumiofifo_sim_bench [-s seconds] [-S seed] [-f fifo_bytes] [-r rate]
+ *            [-p period_frames] [-b buffer_frames] [-C client] [-R reader] [-c] [option=value ...]
+ *
+ * -c also checks what should hold whatever the options: a steady client
+ * with a steady reader never underruns, every drain finishes unless nothing
+ * reads the fifo, and a second run with the same seed gives the same
+ * results. The exit status is 1 if any check fails, for use from ctest.
+ *
+ * The client plays S16_LE stereo. The options are plugin options, e.g.
+ * lead_in_frames=1024, but the reader reads at the client's byte rate so
+ * options changing the fifo's rate or sample size will starve or flood it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "volumiofifo_sim.h"
+
+#define BENCH_FIFO "/volumiofifo-sim-bench"
+#define BENCH_CHANNELS 2
+/* Leave room before the clock's start for anything subtracting from it */
+#define BENCH_START_NS 1000000000ULL
+#define BENCH_DRAIN_NS 5000000000ULL
+
+typedef struct bench_client {
+	const char *name;
+	/* Seconds of audio the source produces a second, 0 for as fast as it is taken */
+	double speed;
+	/* Frames given to each write, in periods, 0 for all the room in the buffer */
+	unsigned int periods;
+	/* Each write comes up to this late */
+	uint64_t jitter_ns;
+} bench_client_t;
+
+static const bench_client_t bench_clients[] = {
+	/* A player decoding a file, always ahead of the fifo */
+	{ "steady", 0, 1, 0 },
+	/* A player topping up the buffer, woken late by whatever else the system is doing */
+	{ "jittery", 0, 0, 40000000 },
+	/* A source which cannot keep up, such as a starved network stream */
+	{ "slow", 0.98, 1, 0 },
+	/* A live stream arriving in large blocks, some of them late */
+	{ "bursty", 1.0, 16, 100000000 },
+};
+
+typedef struct bench_reader {
+	const char *name;
+	/* 0 if nothing reads the fifo */
+	int reads;
+	double ppm;
+	unsigned int burst;
+	uint64_t jitter_ns;
+	uint64_t stall_every_ns;
+	uint64_t stall_ns;
+} bench_reader_t;
+
+static const bench_reader_t bench_readers[] = {
+	/* A sound card clocked exactly at the client's rate */
+	{ "steady", 1, 0, 1, 0, 0, 0 },
+	/* A player whose reads are woken late by the scheduler */
+	{ "jittery", 1, 0, 1, 5000000, 0, 0 },
+	/* A sound card whose clock runs slow */
+	{ "slow", 1, -500, 1, 0, 0, 0 },
+	/* A sender taking several chunks at a time */
+	{ "bursty", 1, 0, 8, 0, 0, 0 },
+	/* A reader which stops now and then, e.g. to reconnect */
+	{ "stalling", 1, 0, 1, 0, 5000000000ULL, 300000000 },
+	/* Nothing opens the fifo to read it */
+	{ "absent", 0, 0, 1, 0, 0, 0 },
+};
+
+/* Plugin options that need something the simulation does not have */
+static const char *bench_unsupported[] = { "fifo", "mix", "loopback", "control", "record_dir" };
+
+typedef struct bench_options {
+	uint64_t seconds;
+	uint64_t seed;
+	unsigned int fifo_size;
+	unsigned int rate;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+	char **settings;
+	int count;
+} bench_options_t;
+
+typedef struct bench_result {
+	uint64_t xruns;
+	uint64_t underruns;
+	uint64_t wakeups;
+	uint64_t idle_wakeups;
+	uint64_t syscalls;
+	uint64_t writes;
+	uint64_t eagains;
+	/* The audio queued ahead of the reader, sampled after each write */
+	uint64_t queued_samples;
+	double queued_total_ms;
+	double queued_max_ms;
+	/* UINT64_MAX if the drain did not finish */
+	uint64_t drain_ns;
+	uint64_t real_ns;
+} bench_result_t;
+
+static void bench_usage(void) {
+	fprintf(stderr, "Usage: volumiofifo_sim_bench [-s seconds] [-S seed] [-f fifo_bytes] [-r rate] "
+			"[-p period_frames] [-b buffer_frames] [-C client] [-R reader] [-c] [option=value ...]\n");
+}
+
+/**
+ * Check a result, and a second run of the same pairing, against what must
+ * hold for any options
+ *
+ * Returns the number of checks failed
+ */
+static int bench_check(const bench_client_t *client, const bench_reader_t *reader, const bench_result_t *result,
+		const bench_result_t *again) {
+	bench_result_t first = *result, second = *again;
+	int failed = 0;
+
+	if(strcmp(client->name, "steady") == 0 && strcmp(reader->name, "steady") == 0 &&
+			(result->xruns > 0 || result->underruns > 0)) {
+		fprintf(stderr, "FAIL %s client with %s reader: %llu xruns and %llu underruns, expected none\n",
+				client->name, reader->name, (unsigned long long) result->xruns,
+				(unsigned long long) result->underruns);
+		failed++;
+	}
+	if(reader->reads && result->drain_ns == UINT64_MAX) {
+		fprintf(stderr, "FAIL %s client with %s reader: the drain did not finish\n", client->name, reader->name);
+		failed++;
+	}
+
+	// Only the real time taken may differ
+	first.real_ns = 0;
+	second.real_ns = 0;
+	if(memcmp(&first, &second, sizeof(first)) != 0) {
+		fprintf(stderr, "FAIL %s client with %s reader: a second run with the same seed differs\n",
+				client->name, reader->name);
+		failed++;
+	}
+
+	return failed;
+}
+
+static snd_config_t *bench_config(const bench_options_t *options) {
+	snd_config_t *config = volumiofifo_sim_config_new();
+	int i;
+
+	// The flight recorder's dumps would go to /tmp
+	if(config == NULL || volumiofifo_sim_config_set(config, "fifo=" BENCH_FIFO) < 0 ||
+			volumiofifo_sim_config_set(config, "flight_recorder=0") < 0) {
+		volumiofifo_sim_config_free(config);
+		return NULL;
+	}
+	for(i = 0; i < options->count; i++) {
+		if(volumiofifo_sim_config_set(config, options->settings[i]) < 0) {
+			volumiofifo_sim_config_free(config);
+			return NULL;
+		}
+	}
+	return config;
+}
+
+static int bench_run(const bench_options_t *options, const bench_client_t *client, const bench_reader_t *reader,
+		bench_result_t *result) {
+	const char fill[] = { 0x5a, 0x5a, 0xa5, 0xa5 };
+	unsigned int frame_bytes = BENCH_CHANNELS * 2;
+	snd_pcm_uframes_t block = client->periods * options->period_size;
+	uint64_t end_ns = BENCH_START_NS + options->seconds * 1000000000ULL;
+	uint64_t drain_start_ns, k;
+	volumiofifo_sim_t sim;
+	snd_config_t *config;
+	snd_pcm_ioplug_t *io;
+	snd_pcm_t *pcm;
+	int err, i;
+
+	memset(result, 0, sizeof(*result));
+	volumiofifo_sim_init(&sim, BENCH_FIFO, options->fifo_size, BENCH_START_NS);
+	config = bench_config(options);
+	if(config == NULL)
+		return -EINVAL;
+	err = volumiofifo_sim_pcm_open(&pcm, config);
+	volumiofifo_sim_config_free(config);
+	if(err < 0)
+		return err;
+	io = volumiofifo_sim_pcm_io(pcm);
+
+	err = volumiofifo_sim_pcm_hw_params(pcm, SND_PCM_FORMAT_S16_LE, options->rate, BENCH_CHANNELS,
+			options->period_size, options->buffer_size, fill, sizeof(fill));
+	if(err < 0)
+		goto out;
+
+	if(reader->reads) {
+		volumiofifo_sim_reader(&sim, (double) options->rate * frame_bytes, (options->rate / 100) * frame_bytes,
+				reader->ppm);
+		sim.reader.burst = reader->burst;
+		sim.reader.jitter_ns = reader->jitter_ns;
+		sim.reader.seed = options->seed ^ 0x5245414445520000ULL;
+		sim.reader.stall_every_ns = reader->stall_every_ns;
+		sim.reader.stall_ns = reader->stall_ns;
+	}
+	// The reader only reads once audio arrives, so cannot underrun before the start
+	sim.expect_audio = 1;
+
+	err = volumiofifo_sim_pcm_prepare(pcm);
+	if(err < 0)
+		goto out;
+
+	result->real_ns = volumiofifo_sim_real_ns();
+	for(k = 0; sim.now_ns < end_ns; k++) {
+		uint64_t ready_ns = sim.now_ns;
+		snd_pcm_sframes_t written;
+		double queued_ms;
+
+		// When the source has the next block ready
+		if(client->speed > 0)
+			ready_ns = BENCH_START_NS + (uint64_t) ((k + 1) * block * 1e9 / (options->rate * client->speed));
+		if(client->jitter_ns > 0)
+			ready_ns += volumiofifo_sim_random(options->seed, k) % client->jitter_ns;
+		if(ready_ns >= end_ns)
+			break;
+		volumiofifo_sim_set_time(&sim, ready_ns);
+
+		if(client->periods == 0) {
+			// As snd_pcm_avail
+			volumiofifo_sim_pcm_hw_ptr_update(pcm);
+			block = snd_pcm_ioplug_avail(io, io->hw_ptr, io->appl_ptr);
+			if(block < options->period_size)
+				block = options->period_size;
+		}
+		written = volumiofifo_sim_pcm_writei(&sim, pcm, block, end_ns);
+		if(written == -EPIPE) {
+			// As snd_pcm_recover
+			result->xruns++;
+			err = volumiofifo_sim_pcm_prepare(pcm);
+			if(err < 0)
+				goto out;
+			continue;
+		}
+		if(written < 0) {
+			err = written;
+			goto out;
+		}
+
+		queued_ms = (snd_pcm_ioplug_hw_avail(io, io->hw_ptr, io->appl_ptr) + (double) sim.level / frame_bytes) *
+				1000.0 / options->rate;
+		result->queued_samples++;
+		result->queued_total_ms += queued_ms;
+		if(queued_ms > result->queued_max_ms)
+			result->queued_max_ms = queued_ms;
+	}
+
+	// The last read is a short one
+	sim.expect_audio = 0;
+	drain_start_ns = sim.now_ns;
+	err = volumiofifo_sim_pcm_drain(&sim, pcm, sim.now_ns + BENCH_DRAIN_NS);
+	result->drain_ns = err == 0 ? sim.now_ns - drain_start_ns : UINT64_MAX;
+	if(err == -ETIMEDOUT)
+		err = 0;
+	result->real_ns = volumiofifo_sim_real_ns() - result->real_ns;
+
+	result->underruns = sim.reader.underruns;
+	result->wakeups = sim.wakeups;
+	result->idle_wakeups = sim.idle_wakeups;
+	for(i = 0; i < VOLUMIOFIFO_SIM_SYSCALLS; i++)
+		result->syscalls += sim.syscalls[i];
+	result->writes = sim.writes;
+	result->eagains = sim.eagains;
+
+out:
+	volumiofifo_sim_pcm_close(pcm);
+	return err;
+}
+
+int main(int argc, char **argv) {
+	bench_options_t options = {
+		.seconds = 60,
+		.seed = 1,
+		.fifo_size = 65536,
+		.rate = 44100,
+		.period_size = 1024,
+		.buffer_size = 4096,
+	};
+	const char *only_client = NULL, *only_reader = NULL;
+	unsigned int c, r, u;
+	int check = 0, failed = 0, opt, i;
+
+	while((opt = getopt(argc, argv, "s:S:f:r:p:b:C:R:c")) != -1) {
+		switch(opt) {
+			case 's':
+				options.seconds = strtoull(optarg, NULL, 10);
+				break;
+			case 'S':
+				options.seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'f':
+				options.fifo_size = atoi(optarg);
+				break;
+			case 'r':
+				options.rate = atoi(optarg);
+				break;
+			case 'p':
+				options.period_size = atoi(optarg);
+				break;
+			case 'b':
+				options.buffer_size = atoi(optarg);
+				break;
+			case 'C':
+				only_client = optarg;
+				break;
+			case 'R':
+				only_reader = optarg;
+				break;
+			case 'c':
+				check = 1;
+				break;
+			default:
+				bench_usage();
+				return 1;
+		}
+	}
+	if(options.seconds == 0 || options.rate < 100 || options.fifo_size == 0 || options.period_size == 0 ||
+			options.buffer_size < options.period_size) {
+		bench_usage();
+		return 1;
+	}
+
+	for(i = optind; i < argc; i++) {
+		for(u = 0; u < sizeof(bench_unsupported) / sizeof(bench_unsupported[0]); u++) {
+			size_t length = strlen(bench_unsupported[u]);
+			if(strncmp(argv[i], bench_unsupported[u], length) == 0 && argv[i][length] == '=') {
+				fprintf(stderr, "The option %s cannot be simulated\n", bench_unsupported[u]);
+				return 1;
+			}
+		}
+		if(strchr(argv[i], '=') == NULL) {
+			fprintf(stderr, "Options are option=value, not %s\n", argv[i]);
+			return 1;
+		}
+	}
+	options.settings = argv + optind;
+	options.count = argc - optind;
+
+	printf("%llu s of S16_LE stereo at %u Hz, period %lu, buffer %lu, fifo %u bytes, seed %llu\n",
+			(unsigned long long) options.seconds, options.rate, options.period_size, options.buffer_size,
+			options.fifo_size, (unsigned long long) options.seed);
+	printf("%-8s %-9s %6s %9s %8s %8s %9s %8s %8s %9s %9s %9s %8s\n", "client", "reader", "xruns",
+			"underruns", "wakeups", "idle", "syscalls", "writes", "EAGAIN", "queued ms", "max ms",
+			"drain ms", "speedup");
+
+	for(c = 0; c < sizeof(bench_clients) / sizeof(bench_clients[0]); c++) {
+		if(only_client && strcmp(only_client, bench_clients[c].name) != 0)
+			continue;
+		for(r = 0; r < sizeof(bench_readers) / sizeof(bench_readers[0]); r++) {
+			bench_result_t result;
+			char drain[16];
+			int err;
+
+			if(only_reader && strcmp(only_reader, bench_readers[r].name) != 0)
+				continue;
+			err = bench_run(&options, &bench_clients[c], &bench_readers[r], &result);
+			if(err < 0) {
+				fprintf(stderr, "%s client with %s reader failed, error %d\n", bench_clients[c].name,
+						bench_readers[r].name, err);
+				return 1;
+			}
+			if(check) {
+				bench_result_t again;
+
+				err = bench_run(&options, &bench_clients[c], &bench_readers[r], &again);
+				if(err < 0) {
+					fprintf(stderr, "%s client with %s reader failed, error %d\n", bench_clients[c].name,
+							bench_readers[r].name, err);
+					return 1;
+				}
+				failed += bench_check(&bench_clients[c], &bench_readers[r], &result, &again);
+			}
+
+			if(result.drain_ns == UINT64_MAX)
+				snprintf(drain, sizeof(drain), "timeout");
+			else
+				snprintf(drain, sizeof(drain), "%.1f", result.drain_ns / 1e6);
+			printf("%-8s %-9s %6llu %9llu %8llu %8llu %9llu %8llu %8llu %9.1f %9.1f %9s %7.0fx\n",
+					bench_clients[c].name, bench_readers[r].name, (unsigned long long) result.xruns,
+					(unsigned long long) result.underruns, (unsigned long long) result.wakeups,
+					(unsigned long long) result.idle_wakeups, (unsigned long long) result.syscalls,
+					(unsigned long long) result.writes, (unsigned long long) result.eagains,
+					result.queued_samples ? result.queued_total_ms / result.queued_samples : 0,
+					result.queued_max_ms, drain,
+					result.real_ns ? options.seconds * 1e9 / result.real_ns : 0);
+		}
+	}
+
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,654 @@
+/*
+ *  PCM - Volumio FIFO plugin - fifo write strategy benchmark
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Moves audio from a ring, standing in for the ALSA buffer, to a reader
+ * thread on another core in each of the ways the plugin could:
+ *
+ *  chunked   write() calls of whole frames up to PIPE_BUF, split at the end
+ *            of the ring, as _snd_pcm_volumiofifo_write does today
+ *  single    one write() for each side of the end of the ring
+ *  writev    one writev() with both sides of the end of the ring
+ *  vmsplice  one vmsplice() with both sides, which hands the pipe the ring's
+ *            pages, so is only safe if nothing overwrites them before they
+ *            are read, which alsa-lib does not promise
+ *  shm       a copy into a shared memory ring, with a futex to wait on
+ *
+ * The writer always offers the whole ring from its position, as the plugin
+ * does when the client keeps the buffer full, and waits for room as the
+ * plugin's poll descriptor would. For each frame size, pipe capacity and
+ * reader it reports the wall and writer CPU time per frame, the writer's
+ * system calls and waits for room, the writes which ended part way through
+ * a frame, which the plugin could not allow without keeping the rest of the
+ * frame, and the writer's cache misses when perf_event_open is permitted.
+ *
+ * Usage: volumiofifo_write_bench [-m MiB] [-t seconds] [-r rate] [-b buffer_frames]
+ *            [-f frame_bytes] [-q pipe_bytes] [-W strategies] [-R readers] [-C]
+ *
+ * The lists are comma separated. The max reader reads as fast as it can and
+ * each run moves -m MiB, the realtime reader reads every 10ms at -r frames
+ * a second and each run lasts -t seconds.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#define BENCH_MAX_LIST 32
+#define BENCH_READ_BYTES 65536
+#define BENCH_PACE_NS 10000000ULL
+
+enum { BENCH_CHUNKED, BENCH_SINGLE, BENCH_WRITEV, BENCH_VMSPLICE, BENCH_SHM, BENCH_STRATEGIES };
+static const char *bench_strategies[BENCH_STRATEGIES] = { "chunked", "single", "writev", "vmsplice", "shm" };
+
+enum { BENCH_MAX, BENCH_REALTIME, BENCH_READERS };
+static const char *bench_readers[BENCH_READERS] = { "max", "realtime" };
+
+static const unsigned int bench_default_frames[] = { 1, 2, 4, 6, 8, 16, 24, 32, 64, 128 };
+static const unsigned int bench_default_pipes[] = { 4096, 65536, 1048576 };
+
+/* The shared ring, positions are bytes and wrap at 2^32, the capacity is a power of two */
+typedef struct bench_shm_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t reader_waiting;
+	uint32_t writer_waiting;
+	uint32_t closed;
+	uint32_t capacity;
+	unsigned char data[];
+} bench_shm_ring_t;
+
+typedef struct bench_reader {
+	pthread_t thread;
+	int strategy;
+	int fd;
+	bench_shm_ring_t *ring;
+	/* 0 to read as fast as possible */
+	double bytes_per_s;
+	int cpu;
+	uint64_t received;
+} bench_reader_t;
+
+typedef struct bench_writer {
+	int strategy;
+	int fd;
+	bench_shm_ring_t *ring;
+	unsigned int frame_bytes;
+	uint64_t syscalls;
+	uint64_t waits;
+	uint64_t torn;
+} bench_writer_t;
+
+typedef struct bench_result {
+	double wall_ns_per_frame;
+	double cpu_ns_per_frame;
+	double syscalls_per_mib;
+	double waits_per_mib;
+	uint64_t torn;
+	/* -1 if perf_event_open is not permitted */
+	double misses_per_kib;
+} bench_result_t;
+
+static void bench_usage(void) {
+	fprintf(stderr, "Usage: volumiofifo_write_bench [-m MiB] [-t seconds] [-r rate] [-b buffer_frames] "
+			"[-f frame_bytes] [-q pipe_bytes] [-W strategies] [-R readers] [-C]\n");
+}
+
+static uint64_t bench_clock_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_parse_list(const char *arg, unsigned int *values, unsigned int *count) {
+	char *end;
+
+	*count = 0;
+	while(*arg) {
+		if(*count == BENCH_MAX_LIST)
+			return -EINVAL;
+		values[(*count)++] = strtoul(arg, &end, 10);
+		if(end == arg || values[*count - 1] == 0 || (*end != ',' && *end != '\0'))
+			return -EINVAL;
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return *count > 0 ? 0 : -EINVAL;
+}
+
+/* A mask of the names given from the list of names */
+static int bench_parse_names(const char *arg, const char **names, unsigned int count, unsigned int *mask) {
+	char *list = strdup(arg), *name, *save = NULL;
+	unsigned int i;
+	int err = 0;
+
+	if(list == NULL)
+		return -ENOMEM;
+	*mask = 0;
+	for(name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		for(i = 0; i < count && strcmp(name, names[i]) != 0; i++)
+			;
+		if(i == count) {
+			fprintf(stderr, "Unknown choice %s\n", name);
+			err = -EINVAL;
+			break;
+		}
+		*mask |= 1U << i;
+	}
+	free(list);
+	return err == 0 && *mask == 0 ? -EINVAL : err;
+}
+
+static void bench_pin(int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static long bench_futex(uint32_t *addr, int op, uint32_t value) {
+	// Bounded, so a missed wakeup costs time rather than the run
+	struct timespec timeout = { 0, 10000000 };
+
+	return syscall(SYS_futex, addr, op, value, op == FUTEX_WAIT ? &timeout : NULL, NULL, 0);
+}
+
+/* Copies up to size bytes into the ring, returns the bytes copied */
+static size_t bench_shm_write(bench_writer_t *writer, const unsigned char *buf, size_t size) {
+	bench_shm_ring_t *ring = writer->ring;
+	uint32_t head = ring->head;
+	uint32_t room = ring->capacity - (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST));
+	uint32_t at = head & (ring->capacity - 1);
+	uint32_t first;
+
+	// Whole frames, as a reader of the ring could not find a frame's start otherwise
+	room -= room % writer->frame_bytes;
+	if(size > room)
+		size = room;
+	first = size < ring->capacity - at ? size : ring->capacity - at;
+	memcpy(ring->data + at, buf, first);
+	memcpy(ring->data, buf + first, size - first);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+	if(size > 0 && __atomic_load_n(&ring->reader_waiting, __ATOMIC_SEQ_CST)) {
+		bench_futex(&ring->head, FUTEX_WAKE, 1);
+		writer->syscalls++;
+	}
+	return size;
+}
+
+/* Reads up to size bytes from the ring, waiting for some, returns 0 once the writer is done */
+static size_t bench_shm_read(bench_shm_ring_t *ring, unsigned char *buf, size_t size) {
+	uint32_t tail = ring->tail;
+	uint32_t head, at, first;
+
+	for(;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		if(head != tail)
+			break;
+		if(__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+			return 0;
+		__atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail &&
+				!__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+			bench_futex(&ring->head, FUTEX_WAIT, tail);
+		__atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_SEQ_CST);
+	}
+
+	if(size > head - tail)
+		size = head - tail;
+	at = tail & (ring->capacity - 1);
+	first = size < ring->capacity - at ? size : ring->capacity - at;
+	memcpy(buf, ring->data + at, first);
+	memcpy(buf + first, ring->data, size - first);
+	__atomic_store_n(&ring->tail, tail + size, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->writer_waiting, __ATOMIC_SEQ_CST))
+		bench_futex(&ring->tail, FUTEX_WAKE, 1);
+	return size;
+}
+
+static void *bench_reader_thread(void *arg) {
+	bench_reader_t *reader = arg;
+	size_t chunk = reader->bytes_per_s > 0 ? reader->bytes_per_s * BENCH_PACE_NS / 1e9 : BENCH_READ_BYTES;
+	uint64_t due_ns = bench_clock_ns(CLOCK_MONOTONIC);
+	unsigned char *buf;
+	int done = 0;
+
+	bench_pin(reader->cpu);
+	if(chunk == 0)
+		chunk = 1;
+	buf = malloc(chunk);
+	if(buf == NULL)
+		return NULL;
+
+	while(!done) {
+		size_t got = 0;
+
+		// A paced reader takes its chunk then sleeps, as a sound card's period would
+		while(got < chunk) {
+			ssize_t count = reader->strategy == BENCH_SHM ?
+					(ssize_t) bench_shm_read(reader->ring, buf + got, chunk - got) :
+					read(reader->fd, buf + got, chunk - got);
+
+			if(count <= 0) {
+				done = 1;
+				break;
+			}
+			got += count;
+			if(reader->bytes_per_s == 0)
+				break;
+		}
+		reader->received += got;
+
+		if(reader->bytes_per_s > 0 && !done) {
+			struct timespec ts;
+
+			due_ns += BENCH_PACE_NS;
+			ts.tv_sec = due_ns / 1000000000ULL;
+			ts.tv_nsec = due_ns % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* As _snd_pcm_volumiofifo_write, atomic writes of whole frames until the pipe is full */
+static ssize_t bench_write_chunked(bench_writer_t *writer, const unsigned char *buf, size_t size) {
+	size_t chunk_size = PIPE_BUF - (PIPE_BUF % writer->frame_bytes);
+	size_t written = 0;
+
+	while(written < size) {
+		size_t to_write = size - written > chunk_size ? chunk_size : size - written;
+		ssize_t err = write(writer->fd, buf + written, to_write);
+
+		writer->syscalls++;
+		if(err < 0) {
+			if(errno == EAGAIN)
+				break;
+			return written > 0 ? (ssize_t) written : -errno;
+		}
+		written += err;
+	}
+	return written;
+}
+
+static ssize_t bench_write_single(bench_writer_t *writer, const unsigned char *buf, size_t size) {
+	ssize_t err = write(writer->fd, buf, size);
+
+	writer->syscalls++;
+	if(err < 0)
+		return errno == EAGAIN ? 0 : -errno;
+	return err;
+}
+
+/* Moves up to want bytes from pos in the ring, wrapping at its end, returns the bytes moved */
+static ssize_t bench_transfer(bench_writer_t *writer, const unsigned char *ring, size_t ring_bytes, size_t pos,
+		size_t want) {
+	size_t first = want < ring_bytes - pos ? want : ring_bytes - pos;
+	struct iovec iov[2] = {
+		{ (void *) (ring + pos), first },
+		{ (void *) ring, want - first },
+	};
+	int parts = want > first ? 2 : 1;
+	ssize_t moved, more;
+
+	switch(writer->strategy) {
+		case BENCH_CHUNKED:
+		case BENCH_SINGLE:
+			moved = writer->strategy == BENCH_CHUNKED ? bench_write_chunked(writer, ring + pos, first) :
+					bench_write_single(writer, ring + pos, first);
+			if(moved == (ssize_t) first && parts == 2) {
+				more = writer->strategy == BENCH_CHUNKED ? bench_write_chunked(writer, ring, want - first) :
+						bench_write_single(writer, ring, want - first);
+				if(more > 0)
+					moved += more;
+			}
+			return moved;
+		case BENCH_WRITEV:
+			moved = writev(writer->fd, iov, parts);
+			break;
+		case BENCH_VMSPLICE:
+			moved = vmsplice(writer->fd, iov, parts, SPLICE_F_NONBLOCK);
+			break;
+		default:
+			moved = bench_shm_write(writer, ring + pos, first);
+			if(moved == (ssize_t) first && parts == 2)
+				moved += bench_shm_write(writer, ring, want - first);
+			return moved;
+	}
+	writer->syscalls++;
+	if(moved < 0)
+		return errno == EAGAIN ? 0 : -errno;
+	return moved;
+}
+
+/* Waits for room, as the plugin's poll descriptor does */
+static void bench_wait(bench_writer_t *writer) {
+	writer->waits++;
+	writer->syscalls++;
+	if(writer->strategy == BENCH_SHM) {
+		bench_shm_ring_t *ring = writer->ring;
+		uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+		__atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+		if(ring->capacity - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST)) < writer->frame_bytes)
+			bench_futex(&ring->tail, FUTEX_WAIT, tail);
+		__atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST);
+	} else {
+		struct pollfd pfd = { .fd = writer->fd, .events = POLLOUT };
+
+		poll(&pfd, 1, -1);
+	}
+}
+
+/* Counts the writer thread's cache misses, including the kernel's if permitted */
+static int bench_perf_open(int *kernel) {
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	*kernel = fd >= 0;
+	if(fd < 0) {
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	return fd;
+}
+
+static int bench_run(int strategy, unsigned int frame_bytes, unsigned int pipe_bytes, int reader_kind,
+		double seconds, uint64_t mib, unsigned int rate, unsigned int buffer_frames, int perf_fd, int cpus,
+		bench_result_t *result) {
+	bench_writer_t writer = { .strategy = strategy, .fd = -1, .frame_bytes = frame_bytes };
+	bench_reader_t reader = { .strategy = strategy, .fd = -1, .cpu = cpus > 1 ? 1 : 0 };
+	size_t ring_bytes = (size_t) buffer_frames * frame_bytes;
+	uint64_t total, sent = 0, wall_ns, cpu_ns, misses = 0;
+	size_t shm_bytes = 0, pos = 0;
+	unsigned char *ring;
+	int fds[2], err = 0;
+	size_t i;
+
+	memset(result, 0, sizeof(*result));
+	if(reader_kind == BENCH_REALTIME) {
+		reader.bytes_per_s = (double) rate * frame_bytes;
+		total = (uint64_t) (seconds * rate) * frame_bytes;
+	} else {
+		total = mib << 20;
+		total -= total % frame_bytes;
+	}
+
+	// Audio-like bytes, the content does not change the cost of moving them
+	ring = malloc(ring_bytes);
+	if(ring == NULL)
+		return -ENOMEM;
+	for(i = 0; i < ring_bytes; i++)
+		ring[i] = i * 0x9e3779b1U >> 24;
+
+	if(strategy == BENCH_SHM) {
+		shm_bytes = sizeof(bench_shm_ring_t) + pipe_bytes;
+		writer.ring = mmap(NULL, shm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if(writer.ring == MAP_FAILED) {
+			free(ring);
+			return -errno;
+		}
+		writer.ring->capacity = pipe_bytes;
+		reader.ring = writer.ring;
+	} else {
+		if(pipe2(fds, O_CLOEXEC) < 0) {
+			free(ring);
+			return -errno;
+		}
+		if(fcntl(fds[1], F_SETPIPE_SZ, pipe_bytes) < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+			err = -errno;
+			close(fds[0]);
+			close(fds[1]);
+			free(ring);
+			return err;
+		}
+		reader.fd = fds[0];
+		writer.fd = fds[1];
+	}
+
+	err = pthread_create(&reader.thread, NULL, bench_reader_thread, &reader);
+	if(err != 0) {
+		err = -err;
+		goto out;
+	}
+
+	if(perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	wall_ns = bench_clock_ns(CLOCK_MONOTONIC);
+	cpu_ns = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	while(sent < total) {
+		size_t want = total - sent < ring_bytes ? total - sent : ring_bytes;
+		ssize_t moved = bench_transfer(&writer, ring, ring_bytes, pos, want);
+
+		if(moved < 0) {
+			err = moved;
+			break;
+		}
+		if(moved == 0) {
+			bench_wait(&writer);
+			continue;
+		}
+		if(moved % frame_bytes != 0)
+			writer.torn++;
+		sent += moved;
+		pos = (pos + moved) % ring_bytes;
+	}
+
+	cpu_ns = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns;
+	if(perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if(read(perf_fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = 0;
+	}
+
+	// The reader finishes at the end of the data, which is when the audio was delivered
+	if(strategy == BENCH_SHM) {
+		__atomic_store_n(&writer.ring->closed, 1, __ATOMIC_SEQ_CST);
+		bench_futex(&writer.ring->head, FUTEX_WAKE, 1);
+	} else {
+		close(writer.fd);
+		writer.fd = -1;
+	}
+	pthread_join(reader.thread, NULL);
+	wall_ns = bench_clock_ns(CLOCK_MONOTONIC) - wall_ns;
+
+	if(err == 0 && reader.received != sent) {
+		fprintf(stderr, "%s sent %llu bytes but the reader received %llu\n", bench_strategies[strategy],
+				(unsigned long long) sent, (unsigned long long) reader.received);
+		err = -EIO;
+	}
+	if(err == 0 && sent > 0) {
+		double frames = (double) sent / frame_bytes;
+
+		result->wall_ns_per_frame = wall_ns / frames;
+		result->cpu_ns_per_frame = cpu_ns / frames;
+		result->syscalls_per_mib = writer.syscalls * 1048576.0 / sent;
+		result->waits_per_mib = writer.waits * 1048576.0 / sent;
+		result->torn = writer.torn;
+		result->misses_per_kib = perf_fd >= 0 ? misses * 1024.0 / sent : -1;
+	}
+
+out:
+	if(strategy == BENCH_SHM) {
+		munmap(writer.ring, shm_bytes);
+	} else {
+		if(writer.fd >= 0)
+			close(writer.fd);
+		close(reader.fd);
+	}
+	free(ring);
+	return err;
+}
+
+int main(int argc, char **argv) {
+	unsigned int frames[BENCH_MAX_LIST], pipes[BENCH_MAX_LIST];
+	unsigned int frame_count, pipe_count, strategies = (1U << BENCH_STRATEGIES) - 1;
+	unsigned int readers = (1U << BENCH_READERS) - 1;
+	unsigned int rate = 48000, buffer_frames = 4096, s, f, q, r;
+	uint64_t mib = 64;
+	double seconds = 0.2;
+	int opt, csv = 0, perf_fd, kernel, cpus;
+	struct utsname uts;
+
+	frame_count = sizeof(bench_default_frames) / sizeof(bench_default_frames[0]);
+	memcpy(frames, bench_default_frames, sizeof(bench_default_frames));
+	pipe_count = sizeof(bench_default_pipes) / sizeof(bench_default_pipes[0]);
+	memcpy(pipes, bench_default_pipes, sizeof(bench_default_pipes));
+
+	while((opt = getopt(argc, argv, "m:t:r:b:f:q:W:R:C")) != -1) {
+		int err = 0;
+
+		switch(opt) {
+			case 'm':
+				mib = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				seconds = atof(optarg);
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'b':
+				buffer_frames = atoi(optarg);
+				break;
+			case 'f':
+				err = bench_parse_list(optarg, frames, &frame_count);
+				break;
+			case 'q':
+				err = bench_parse_list(optarg, pipes, &pipe_count);
+				break;
+			case 'W':
+				err = bench_parse_names(optarg, bench_strategies, BENCH_STRATEGIES, &strategies);
+				break;
+			case 'R':
+				err = bench_parse_names(optarg, bench_readers, BENCH_READERS, &readers);
+				break;
+			case 'C':
+				csv = 1;
+				break;
+			default:
+				err = -EINVAL;
+				break;
+		}
+		if(err < 0) {
+			bench_usage();
+			return 1;
+		}
+	}
+	if(mib == 0 || seconds <= 0 || rate == 0 || buffer_frames == 0 || optind != argc) {
+		bench_usage();
+		return 1;
+	}
+	for(q = 0; q < pipe_count; q++) {
+		// Pipes are whole pages, and the shared ring's positions wrap at a power of two
+		if(pipes[q] < 4096 || (pipes[q] & (pipes[q] - 1)) != 0) {
+			fprintf(stderr, "Pipe sizes must be a power of two of at least 4096 bytes, not %u\n", pipes[q]);
+			return 1;
+		}
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	bench_pin(0);
+	perf_fd = bench_perf_open(&kernel);
+	if(uname(&uts) < 0)
+		strcpy(uts.machine, "unknown");
+
+	if(csv) {
+		printf("strategy,frame_bytes,pipe_bytes,reader,wall_ns_per_frame,cpu_ns_per_frame,"
+				"syscalls_per_mib,waits_per_mib,torn,misses_per_kib\n");
+	} else {
+		printf("%s, %d cpus, reader on cpu %d, cache misses %s, buffer %u frames, %llu MiB or %.1f s at %u Hz\n",
+				uts.machine, cpus, cpus > 1 ? 1 : 0, perf_fd < 0 ? "unavailable" :
+				kernel ? "of user and kernel" : "of user space only", buffer_frames,
+				(unsigned long long) mib, seconds, rate);
+		printf("%-8s %5s %7s %-8s %9s %9s %10s %9s %6s %10s\n", "strategy", "frame", "pipe", "reader",
+				"ns/frame", "cpu ns", "calls/MiB", "waits/MiB", "torn", "misses/KiB");
+	}
+
+	for(r = 0; r < BENCH_READERS; r++) {
+		if(!(readers & (1U << r)))
+			continue;
+		for(f = 0; f < frame_count; f++) {
+			for(q = 0; q < pipe_count; q++) {
+				for(s = 0; s < BENCH_STRATEGIES; s++) {
+					bench_result_t result;
+					char misses[16];
+					int err;
+
+					if(!(strategies & (1U << s)))
+						continue;
+					err = bench_run(s, frames[f], pipes[q], r, seconds, mib, rate, buffer_frames, perf_fd,
+							cpus, &result);
+					if(err < 0) {
+						fprintf(stderr, "%s with %u byte frames and a %u byte pipe failed, error %d\n",
+								bench_strategies[s], frames[f], pipes[q], err);
+						continue;
+					}
+
+					if(result.misses_per_kib < 0)
+						snprintf(misses, sizeof(misses), csv ? "" : "-");
+					else
+						snprintf(misses, sizeof(misses), "%.2f", result.misses_per_kib);
+					printf(csv ? "%s,%u,%u,%s,%.2f,%.2f,%.1f,%.1f,%llu,%s\n" :
+							"%-8s %5u %7u %-8s %9.2f %9.2f %10.1f %9.1f %6llu %10s\n",
+							bench_strategies[s], frames[f], pipes[q], bench_readers[r],
+							result.wall_ns_per_frame, result.cpu_ns_per_frame, result.syscalls_per_mib,
+							result.waits_per_mib, (unsigned long long) result.torn, misses);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+	if(perf_fd >= 0)
+		close(perf_fd);
+	return 0;
+}
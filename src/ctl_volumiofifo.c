@@ -0,0 +1,297 @@
+/*
+ *  Control - Volumio FIFO volume plugin
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+#include <alsa/control_external.h>
+#include "volumiofifo_shm.h"
+
+typedef struct snd_ctl_volumiofifo {
+	snd_ctl_ext_t ext;
+	char *elem_name;
+	long resolution;
+	double min_dB;
+	double max_dB;
+	unsigned int tlv[4];
+	volumiofifo_volume_page_t *volume;
+} snd_ctl_volumiofifo_t;
+
+/* The gain for a control value, dB linear like softvol with 0 as mute */
+static float _snd_ctl_volumiofifo_gain(snd_ctl_volumiofifo_t *volumio, long value) {
+	if(value <= 0)
+		return 0.0f;
+
+	double dB = volumio->min_dB + (volumio->max_dB - volumio->min_dB) * value / volumio->resolution;
+	return (float) pow(10.0, dB / 20.0);
+}
+
+static void _snd_ctl_volumiofifo_store(snd_ctl_volumiofifo_t *volumio, long value) {
+	float gain = _snd_ctl_volumiofifo_gain(volumio, value);
+	uint32_t bits;
+
+	memcpy(&bits, &gain, sizeof(bits));
+	__atomic_store_n(&volumio->volume->value, (int32_t) value, __ATOMIC_RELAXED);
+	__atomic_store_n(&volumio->volume->gain_bits, bits, __ATOMIC_RELAXED);
+	__atomic_store_n(&volumio->volume->initialised, 1, __ATOMIC_RELEASE);
+}
+
+static void snd_ctl_volumiofifo_close(snd_ctl_ext_t *ext) {
+	snd_ctl_volumiofifo_t *volumio = ext->private_data;
+
+	_snd_pcm_volumiofifo_shm_unmap(volumio->volume, sizeof(*volumio->volume));
+	free(volumio->elem_name);
+	free(volumio);
+}
+
+static int snd_ctl_volumiofifo_elem_count(snd_ctl_ext_t *ext) {
+	return 1;
+}
+
+static int snd_ctl_volumiofifo_elem_list(snd_ctl_ext_t *ext, unsigned int offset, snd_ctl_elem_id_t *id) {
+	snd_ctl_volumiofifo_t *volumio = ext->private_data;
+
+	if(offset != 0)
+		return -EINVAL;
+
+	snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
+	snd_ctl_elem_id_set_name(id, volumio->elem_name);
+	return 0;
+}
+
+static snd_ctl_ext_key_t snd_ctl_volumiofifo_find_elem(snd_ctl_ext_t *ext, const snd_ctl_elem_id_t *id) {
+	snd_ctl_volumiofifo_t *volumio = ext->private_data;
+
+	if(strcmp(snd_ctl_elem_id_get_name(id), volumio->elem_name) == 0)
+		return 0;
+	return SND_CTL_EXT_KEY_NOT_FOUND;
+}
+
+static int snd_ctl_volumiofifo_get_attribute(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
+		int *type, unsigned int *acc, unsigned int *count) {
+	if(key != 0)
+		return -EINVAL;
+
+	*type = SND_CTL_ELEM_TYPE_INTEGER;
+	*acc = SND_CTL_EXT_ACCESS_READWRITE | SND_CTL_EXT_ACCESS_TLV_READ;
+	*count = 1;
+	return 0;
+}
+
+static int snd_ctl_volumiofifo_get_integer_info(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key,
+		long *imin, long *imax, long *istep) {
+	snd_ctl_volumiofifo_t *volumio = ext->private_data;
+
+	if(key != 0)
+		return -EINVAL;
+
+	*imin = 0;
+	*imax = volumio->resolution;
+	*istep = 1;
+	return 0;
+}
+
+static int snd_ctl_volumiofifo_read_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long *value) {
+	snd_ctl_volumiofifo_t *volumio = ext->private_data;
+
+	if(key != 0)
+		return -EINVAL;
+
+	*value = __atomic_load_n(&volumio->volume->value, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int snd_ctl_volumiofifo_write_integer(snd_ctl_ext_t *ext, snd_ctl_ext_key_t key, long *value) {
+	snd_ctl_volumiofifo_t *volumio = ext->private_data;
+	long val = *value;
+
+	if(key != 0)
+		return -EINVAL;
+
+	if(val < 0)
+		val = 0;
+	else if(val > volumio->resolution)
+		val = volumio->resolution;
+
+	if(val == __atomic_load_n(&volumio->volume->value, __ATOMIC_RELAXED))
+		return 0;
+
+	_snd_ctl_volumiofifo_store(volumio, val);
+	return 1;
+}
+
+static int snd_ctl_volumiofifo_read_event(snd_ctl_ext_t *ext, snd_ctl_elem_id_t *id, unsigned int *event_mask) {
+	return -EAGAIN;
+}
+
+static const snd_ctl_ext_callback_t volumiofifo_ctl_callback = {
+	.close = snd_ctl_volumiofifo_close,
+	.elem_count = snd_ctl_volumiofifo_elem_count,
+	.elem_list = snd_ctl_volumiofifo_elem_list,
+	.find_elem = snd_ctl_volumiofifo_find_elem,
+	.get_attribute = snd_ctl_volumiofifo_get_attribute,
+	.get_integer_info = snd_ctl_volumiofifo_get_integer_info,
+	.read_integer = snd_ctl_volumiofifo_read_integer,
+	.write_integer = snd_ctl_volumiofifo_write_integer,
+	.read_event = snd_ctl_volumiofifo_read_event,
+};
+
+SND_CTL_PLUGIN_DEFINE_FUNC(volumiofifo)
+{
+	snd_config_iterator_t i, next;
+	const char *fifo_name = NULL, *elem_name = "Volumio FIFO Playback Volume";
+	long resolution = 256;
+	double min_dB = -51.0, max_dB = 0.0;
+	char shm_name[NAME_MAX];
+	int err;
+	snd_ctl_volumiofifo_t *volumio = NULL;
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *id;
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
+			continue;
+		if (strcmp(id, "fifo") == 0) {
+			if (snd_config_get_string(n, &fifo_name) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "name") == 0) {
+			if (snd_config_get_string(n, &elem_name) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "resolution") == 0) {
+			if (snd_config_get_integer(n, &resolution) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			if(resolution < 2 || resolution > 1024) {
+				SNDERR("Resolution must be >= 2 and <= 1024");
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "min_dB") == 0) {
+			if (snd_config_get_ireal(n, &min_dB) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (strcmp(id, "max_dB") == 0) {
+			if (snd_config_get_ireal(n, &max_dB) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+		SNDERR("Unknown field %s", id);
+		return -EINVAL;
+	}
+
+	if(!fifo_name) {
+		SNDERR("A fifo location must be provided");
+		return -EINVAL;
+	}
+
+	if(min_dB >= max_dB || max_dB > 12.0) {
+		SNDERR("The volume range must have min_dB < max_dB <= 12.0");
+		return -EINVAL;
+	}
+
+	err = _snd_pcm_volumiofifo_shm_name(fifo_name, "volume", shm_name, sizeof(shm_name));
+	if(err < 0) {
+		SNDERR("The fifo name %s is too long for a volume control", fifo_name);
+		return err;
+	}
+
+	volumio = calloc(1, sizeof(*volumio));
+	if (! volumio) {
+		SNDERR("cannot allocate");
+		return -ENOMEM;
+	}
+
+	volumio->resolution = resolution;
+	volumio->min_dB = min_dB;
+	volumio->max_dB = max_dB;
+
+	volumio->elem_name = strdup(elem_name);
+	if (volumio->elem_name == NULL) {
+		SNDERR("cannot allocate");
+		err = -ENOMEM;
+		goto error;
+	}
+
+	volumio->volume = _snd_pcm_volumiofifo_shm_map(shm_name, sizeof(*volumio->volume), 1);
+	if (volumio->volume == NULL) {
+		SNDERR("Failed to map the volume control %s", shm_name);
+		err = -errno;
+		goto error;
+	}
+
+	if(!__atomic_load_n(&volumio->volume->initialised, __ATOMIC_ACQUIRE)) {
+		volumio->volume->magic = VOLUMIOFIFO_VOLUME_MAGIC;
+		volumio->volume->version = VOLUMIOFIFO_VOLUME_VERSION;
+		// Start at 0dB, or as near as the range allows
+		_snd_ctl_volumiofifo_store(volumio, max_dB <= 0.0 ? resolution :
+				lrint(resolution * -min_dB / (max_dB - min_dB)));
+	}
+
+	volumio->tlv[0] = SND_CTL_TLVT_DB_MINMAX_MUTE;
+	volumio->tlv[1] = 2 * sizeof(int);
+	volumio->tlv[2] = (int) (min_dB * 100);
+	volumio->tlv[3] = (int) (max_dB * 100);
+
+	volumio->ext.version = SND_CTL_EXT_VERSION;
+	volumio->ext.card_idx = -1;
+	strncpy(volumio->ext.id, "volumiofifo", sizeof(volumio->ext.id) - 1);
+	strncpy(volumio->ext.driver, "Volumio FIFO", sizeof(volumio->ext.driver) - 1);
+	strncpy(volumio->ext.name, "Volumio FIFO", sizeof(volumio->ext.name) - 1);
+	snprintf(volumio->ext.longname, sizeof(volumio->ext.longname), "Volumio FIFO %s", fifo_name);
+	strncpy(volumio->ext.mixername, "Volumio FIFO", sizeof(volumio->ext.mixername) - 1);
+	volumio->ext.poll_fd = -1;
+	volumio->ext.callback = &volumiofifo_ctl_callback;
+	volumio->ext.private_data = volumio;
+	volumio->ext.tlv.p = volumio->tlv;
+
+	err = snd_ctl_ext_create(&volumio->ext, name, mode);
+	if (err < 0)
+		goto error;
+
+	*handlep = volumio->ext.handle;
+	return 0;
+
+ error:
+	_snd_pcm_volumiofifo_shm_unmap(volumio->volume, sizeof(*volumio->volume));
+	free(volumio->elem_name);
+	free(volumio);
+	return err;
+}
+
+SND_CTL_PLUGIN_SYMBOL(volumiofifo);
@@ -21,14 +21,39 @@
 
 #define _GNU_SOURCE
 #include <limits.h>
+#include <math.h>
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/timerfd.h>
+#include <sys/uio.h>
+#include "volumiofifo_control.h"
+#include "volumiofifo_dsp.h"
+#include "volumiofifo_flight.h"
+#include "volumiofifo_log.h"
+#include "volumiofifo_loop.h"
+#include "volumiofifo_mix.h"
+#include "volumiofifo_session.h"
+#include "volumiofifo_shm.h"
+#include "volumiofifo_stream.h"
+#include "volumiofifo_trace.h"
+
+/* Count into the stats page, if the PCM keeps one */
+#define VOLUMIOFIFO_STAT(volumio, field, n) do { \
+		if((volumio)->stats) \
+			__atomic_fetch_add(&(volumio)->stats->field, (n), __ATOMIC_RELAXED); \
+	} while(0)
+
+/* Queue a debug message, formatted and emitted later by the log's thread */
+#define VOLUMIOFIFO_DEBUG(volumio, ...) _snd_pcm_volumiofifo_log((volumio)->log, __VA_ARGS__)
 
 typedef struct snd_pcm_volumiofifo {
 	snd_pcm_ioplug_t io;
 	char debug;
+	// Set whenever debug is
+	volumiofifo_log_t *log;
 	char *fifo_name;
 	char clear_on_drop;
 	snd_pcm_uframes_t lead_in_frames;
@@ -38,30 +63,692 @@ typedef struct snd_pcm_volumiofifo {
 	snd_pcm_sframes_t ptr;
 	snd_pcm_uframes_t boundary;
 	int drained;
+
+	// The format written to the fifo, which may differ from the client format
+	snd_pcm_format_t fifo_format;
+	unsigned int fifo_channels;
+	unsigned int fifo_rate;
+	int fifo_frame_bytes;
+
+	// Processing between the client buffer and the fifo, NULL if unused
+	volumiofifo_dsp_t *dsp;
+	int dsp_active;
+	char *out_buf;
+	int out_len;
+	int out_pos;
+
+	// Requantise to this format on the way to the fifo, if known
+	snd_pcm_format_t output_format;
+
+	// Frame DSD as DoP in this format
+	int dop;
+	snd_pcm_format_t dop_format;
+
+	// Convert DSD to PCM at this rate, or 0 to leave it alone
+	unsigned int dsd_pcm_rate;
+
+	// Software volume, shared with the volumiofifo control plugin
+	volumiofifo_volume_page_t *volume;
+	long volume_ramp_ms;
+
+	// Level metering for UI meters, NULL if unused
+	volumiofifo_meter_page_t *meter_page;
+	volumiofifo_meter_t *meter;
+	long meter_period_ms;
+	unsigned int meter_period_frames;
+	uint64_t meter_total;
+	// Set while the fifo carries PCM and a reader is watching
+	int meter_enabled;
+	int meter_active;
+	uint32_t meter_heartbeat;
+	unsigned int meter_idle_frames;
+
+	// Visualizer tap, NULL if unused
+	volumiofifo_tap_page_t *tap_page;
+	size_t tap_page_size;
+	volumiofifo_tap_t *tap;
+	// Locked for as long as the PCM writes the ring
+	int tap_fd;
+	// The ring layout, the page header is writable by anyone so is never trusted
+	unsigned int tap_frames;
+	unsigned int tap_channels;
+	int tap_enabled;
+	int tap_active;
+	uint32_t tap_heartbeat;
+	unsigned int tap_idle_frames;
+
+	// Stop writing after standby_ms of digital silence, 0 if unused
+	long standby_ms;
+	long standby_wakeup_ms;
+	int silence_check;
+	uint64_t silence_pattern;
+	snd_pcm_uframes_t standby_frames;
+	snd_pcm_uframes_t silence_frames;
+	int standby;
+	// Silent frames the clock allows to be discarded while in standby
+	snd_pcm_uframes_t standby_budget;
+	struct timespec standby_time;
+
+	// The current timer period, 0 if disarmed
+	long timer_ms;
+
+	// Mix with other PCMs on the same fifo rather than writing to it, NULL if unused
+	volumiofifo_mixer_t *mixer;
+	snd_pcm_format_t mix_format;
+	unsigned int mix_rate;
+	unsigned int mix_channels;
+	// Wakeup interval when writing to a shared memory ring, which cannot be polled
+	long ring_wakeup_ms;
+
+	// Set when the PCM is one end of a shared memory loopback instead of using a fifo
+	volumiofifo_loop_t *loop;
+
+	// Frames written to the fifo since open
+	uint64_t stream_frames;
+
+	// Framed fifo, where every write is a packet
+	int framed;
+	// Set from prepare until the format packet has been written
+	int stream_format_pending;
+	uint32_t stream_seq;
+	// Send timed audio packets, with a timing block of stream_timing_bytes
+	int timestamps;
+	int stream_timing_bytes;
+
+	// Set when events are sent to the reader over a socket
+	volumiofifo_control_t *control;
+
+	// Set when counters are kept in shared memory
+	volumiofifo_stats_page_t *stats;
+	char *stats_name;
+	uint64_t drain_start_ns;
+
+	// The flight recorder, dumped to files by its own thread
+	volumiofifo_flight_t *flight;
+	// Bytes in the fifo at the last wakeup, when stats, the recorder or the tracepoints want it
+	int fifo_bytes;
+	unsigned int drain_timeout_ms;
+	int drain_dumped;
+
+	// Every callback is recorded here for volumiofifo-replay, NULL if unused
+	volumiofifo_session_t *session;
+	// Callbacks the session is inside, those within another are nested
+	unsigned int session_depth;
+
+	// Capture only. Bytes of a frame that has not fully arrived yet
+	char capture_partial[VOLUMIOFIFO_MAX_CHANNELS * 8];
+	int capture_partial_len;
+	int capture_frame_bytes;
+	// Set when the last wakeup found less than a period, wake on the timer until it fills
+	int capture_starved;
+	long capture_wakeup_ms;
 } snd_pcm_volumiofifo_t;
 
-static int _snd_pcm_volumiofifo_set_timer(snd_pcm_volumiofifo_t *volumio, int on) {
+static void _snd_pcm_volumiofifo_layout(snd_pcm_format_t format, volumiofifo_sample_layout_t *layout) {
+	layout->phys_bytes = snd_pcm_format_physical_width(format) / 8;
+	layout->width = snd_pcm_format_width(format);
+	layout->is_signed = snd_pcm_format_signed(format) == 1;
+	layout->big_endian = snd_pcm_format_big_endian(format) == 1;
+	layout->is_float = snd_pcm_format_float(format) == 1;
+}
+
+static volumiofifo_dsd_t _snd_pcm_volumiofifo_dsd_layout(snd_pcm_format_t format) {
+	switch(format) {
+		case SND_PCM_FORMAT_DSD_U8:
+			return VOLUMIOFIFO_DSD_U8;
+		case SND_PCM_FORMAT_DSD_U16_LE:
+			return VOLUMIOFIFO_DSD_U16_LE;
+		case SND_PCM_FORMAT_DSD_U16_BE:
+			return VOLUMIOFIFO_DSD_U16_BE;
+		case SND_PCM_FORMAT_DSD_U32_LE:
+			return VOLUMIOFIFO_DSD_U32_LE;
+		case SND_PCM_FORMAT_DSD_U32_BE:
+			return VOLUMIOFIFO_DSD_U32_BE;
+		default:
+			return VOLUMIOFIFO_DSD_NONE;
+	}
+}
+
+/**
+ * Read the gain requested by the volume control. Until a control has been
+ * opened the volume is left at unity.
+ */
+static float _snd_pcm_volumiofifo_volume_gain(snd_pcm_volumiofifo_t *volumio) {
+	volumiofifo_volume_page_t *page = volumio->volume;
+	uint32_t bits;
+	float gain;
+
+	if(!__atomic_load_n(&page->initialised, __ATOMIC_ACQUIRE))
+		return 1.0f;
+
+	bits = __atomic_load_n(&page->gain_bits, __ATOMIC_RELAXED);
+	memcpy(&gain, &bits, sizeof(gain));
+	return gain;
+}
+
+/**
+ * Decide whether the next frames need processing, picking up any volume
+ * change first. Output already processed must be finished in order.
+ */
+static inline int _snd_pcm_volumiofifo_processing(snd_pcm_volumiofifo_t *volumio) {
+	if(!volumio->dsp_active)
+		return 0;
+
+	if(volumio->volume)
+		_snd_pcm_volumiofifo_dsp_set_gain(volumio->dsp, _snd_pcm_volumiofifo_volume_gain(volumio));
+
+	return volumio->out_len > 0 || _snd_pcm_volumiofifo_dsp_needed(volumio->dsp);
+}
+
+/**
+ * Track a heartbeat bumped by the readers of a shared memory page. A
+ * reader that has not touched it for a second is assumed to have gone.
+ *
+ * Returns non-zero while a reader is around
+ */
+static int _snd_pcm_volumiofifo_reader_alive(snd_pcm_volumiofifo_t *volumio, uint32_t *heartbeat,
+		uint32_t *last, unsigned int *idle_frames, unsigned int frames) {
+	uint32_t now = __atomic_load_n(heartbeat, __ATOMIC_RELAXED);
+
+	if(now != *last) {
+		*last = now;
+		*idle_frames = 0;
+		return 1;
+	}
+	if(*idle_frames < volumio->fifo_rate) {
+		*idle_frames += frames;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Publish the levels for the period just finished, then decide whether
+ * the next period is worth measuring
+ */
+static void _snd_pcm_volumiofifo_meter_publish(snd_pcm_volumiofifo_t *volumio) {
+	volumiofifo_meter_page_t *page = volumio->meter_page;
+	volumiofifo_meter_t *meter = volumio->meter;
+	unsigned int c;
+
+	volumio->meter_total += meter->frames;
+
+	if(volumio->meter_active) {
+		uint32_t seq = page->seq;
+
+		__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		page->rate = volumio->fifo_rate;
+		page->channels = meter->channels;
+		page->period_frames = volumio->meter_period_frames;
+		page->frames = volumio->meter_total;
+		for(c = 0; c < meter->channels; c++) {
+			page->peak[c] = meter->peak[c];
+			page->rms[c] = sqrt(meter->sum_squares[c] / meter->frames);
+		}
+
+		__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+
+	volumio->meter_active = _snd_pcm_volumiofifo_reader_alive(volumio, &page->heartbeat,
+			&volumio->meter_heartbeat, &volumio->meter_idle_frames, meter->frames);
+
+	_snd_pcm_volumiofifo_dsp_meter_reset(meter);
+}
+
+/**
+ * Meter frames on their way to the fifo while they are still in cache.
+ * Without a reader this only counts the frames.
+ */
+static inline void _snd_pcm_volumiofifo_meter(snd_pcm_volumiofifo_t *volumio, const void *buf, unsigned int frames) {
+	if(!volumio->meter_enabled)
+		return;
+
+	if(volumio->meter_active)
+		_snd_pcm_volumiofifo_dsp_meter(volumio->meter, buf, frames);
+	else
+		volumio->meter->frames += frames;
+
+	if(volumio->meter->frames >= volumio->meter_period_frames)
+		_snd_pcm_volumiofifo_meter_publish(volumio);
+}
+
+/**
+ * Copy frames on their way to the fifo into the visualizer ring, unless
+ * nobody is watching. Old frames are overwritten whether or not they have
+ * been read.
+ */
+static void _snd_pcm_volumiofifo_tap(snd_pcm_volumiofifo_t *volumio, const void *buf, unsigned int frames) {
+	volumiofifo_tap_page_t *page = volumio->tap_page;
+
+	if(!volumio->tap_enabled)
+		return;
+
+	volumio->tap_active = _snd_pcm_volumiofifo_reader_alive(volumio, &page->heartbeat,
+			&volumio->tap_heartbeat, &volumio->tap_idle_frames, frames);
+	if(!volumio->tap_active)
+		return;
+
+	uint64_t pos = page->write_end;
+	unsigned int produced = _snd_pcm_volumiofifo_dsp_tap_max_output(volumio->tap, frames);
+
+	__atomic_store_n(&page->write_start, pos + produced, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	produced = _snd_pcm_volumiofifo_dsp_tap(volumio->tap, buf, frames, page->data, volumio->tap_frames - 1, pos);
+
+	__atomic_store_n(&page->write_end, pos + produced, __ATOMIC_RELEASE);
+}
+
+/**
+ * Work out what will be written to the fifo for the negotiated hw params
+ * and set up any processing needed to get there
+ */
+static int _snd_pcm_volumiofifo_setup_output(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
+	volumio->fifo_format = io->format;
+	volumio->fifo_channels = io->channels;
+	volumio->fifo_rate = io->rate;
+	volumio->dsp_active = 0;
+	volumio->out_len = 0;
+	volumio->out_pos = 0;
+
+	if(volumio->dsp != NULL) {
+		volumiofifo_dsp_t *dsp = volumio->dsp;
+		int linear = snd_pcm_format_linear(io->format) == 1 || snd_pcm_format_float(io->format) == 1;
+		volumiofifo_dsd_t dsd = _snd_pcm_volumiofifo_dsd_layout(io->format);
+		int dsd_pcm = dsd != VOLUMIOFIFO_DSD_NONE && volumio->dsd_pcm_rate > 0;
+
+		if(dsp->matrix_enabled) {
+			if(io->channels != dsp->in_channels) {
+				SNDERR("PCM %s has %u channels but the channel matrix expects %u",
+						snd_pcm_name(io->pcm), io->channels, dsp->in_channels);
+				return -EINVAL;
+			}
+			if(!linear && !dsd_pcm) {
+				SNDERR("PCM %s cannot apply a channel matrix to format %s",
+						snd_pcm_name(io->pcm), snd_pcm_format_name(io->format));
+				return -EINVAL;
+			}
+			volumio->fifo_channels = dsp->out_channels;
+		} else {
+			dsp->in_channels = io->channels;
+			dsp->out_channels = io->channels;
+		}
+
+		dsp->dsd = dsd;
+		dsp->dsd_pcm = 0;
+
+		if(dsd != VOLUMIOFIFO_DSD_NONE && volumio->dop) {
+			// Each DoP sample carries 16 DSD bits per channel
+			volumio->fifo_format = volumio->dop_format;
+			if(dsd == VOLUMIOFIFO_DSD_U8)
+				volumio->fifo_rate = io->rate / 2;
+			else if(dsd == VOLUMIOFIFO_DSD_U32_LE || dsd == VOLUMIOFIFO_DSD_U32_BE)
+				volumio->fifo_rate = io->rate * 2;
+		} else if(dsd_pcm) {
+			// The first decimation stage produces one sample per DSD byte
+			unsigned int stage_rate = io->rate * (snd_pcm_format_physical_width(io->format) / 8);
+
+			if(_snd_pcm_volumiofifo_dsp_dsd_pcm(dsp, stage_rate, volumio->dsd_pcm_rate) < 0) {
+				SNDERR("PCM %s cannot convert %s at %u Hz to %u Hz PCM",
+						snd_pcm_name(io->pcm), snd_pcm_format_name(io->format), io->rate,
+						volumio->dsd_pcm_rate);
+				return -EINVAL;
+			}
+			volumio->fifo_format = volumio->output_format != SND_PCM_FORMAT_UNKNOWN ?
+					volumio->output_format : SND_PCM_FORMAT_S32_LE;
+			volumio->fifo_rate = volumio->dsd_pcm_rate;
+		} else if(linear) {
+			dsp->dsd = VOLUMIOFIFO_DSD_NONE;
+			if(volumio->output_format != SND_PCM_FORMAT_UNKNOWN)
+				volumio->fifo_format = volumio->output_format;
+		} else {
+			// Formats we cannot interpret, such as DSD, pass through untouched
+			if(volumio->debug)
+				VOLUMIOFIFO_DEBUG(volumio, "PCM %s passes format %s through without processing",
+						snd_pcm_name(io->pcm), snd_pcm_format_name(io->format));
+			goto done;
+		}
+
+		_snd_pcm_volumiofifo_layout(io->format, &dsp->in);
+		_snd_pcm_volumiofifo_layout(volumio->fifo_format, &dsp->out);
+		_snd_pcm_volumiofifo_dsp_configure(dsp);
+		dsp->ramp_frames = volumio->fifo_rate * volumio->volume_ramp_ms / 1000;
+		if(volumio->volume)
+			_snd_pcm_volumiofifo_dsp_set_gain(dsp, _snd_pcm_volumiofifo_volume_gain(volumio));
+		_snd_pcm_volumiofifo_dsp_reset(dsp);
+		volumio->dsp_active = 1;
+	}
+
+ done:
+	volumio->fifo_frame_bytes = snd_pcm_format_size(volumio->fifo_format, volumio->fifo_channels);
+
+	if(volumio->meter != NULL) {
+		// DoP frames look like PCM but are not worth metering
+		int dop = volumio->dsp_active && volumio->dsp->dsd != VOLUMIOFIFO_DSD_NONE && !volumio->dsp->dsd_pcm;
+
+		volumio->meter_enabled = !dop && (snd_pcm_format_linear(volumio->fifo_format) == 1 ||
+				snd_pcm_format_float(volumio->fifo_format) == 1);
+		_snd_pcm_volumiofifo_layout(volumio->fifo_format, &volumio->meter->layout);
+		volumio->meter->channels = volumio->fifo_channels;
+		volumio->meter_period_frames = volumio->fifo_rate * volumio->meter_period_ms / 1000;
+		if(volumio->meter_period_frames == 0)
+			volumio->meter_period_frames = 1;
+		_snd_pcm_volumiofifo_dsp_meter_reset(volumio->meter);
+	}
+
+	if(volumio->tap != NULL) {
+		int dop = volumio->dsp_active && volumio->dsp->dsd != VOLUMIOFIFO_DSD_NONE && !volumio->dsp->dsd_pcm;
+
+		volumio->tap_enabled = !dop && (snd_pcm_format_linear(volumio->fifo_format) == 1 ||
+				snd_pcm_format_float(volumio->fifo_format) == 1);
+		_snd_pcm_volumiofifo_layout(volumio->fifo_format, &volumio->tap->layout);
+		volumio->tap->channels = volumio->fifo_channels;
+		volumio->tap->phase = 0;
+		volumio->tap->sum[0] = 0.0f;
+		volumio->tap->sum[1] = 0.0f;
+		__atomic_store_n(&volumio->tap_page->rate,
+				volumio->tap_enabled ? volumio->fifo_rate / volumio->tap->decimation : 0, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+static int _snd_pcm_volumiofifo_set_timer(snd_pcm_volumiofifo_t *volumio, long ms) {
 	struct itimerspec timer;
 
-	timer.it_value.tv_sec = 0;
-	timer.it_value.tv_nsec = on == 1 ? 25 * 1000000 : 0;
+	timer.it_value.tv_sec = ms / 1000;
+	timer.it_value.tv_nsec = (ms % 1000) * 1000000;
+
+	timer.it_interval = timer.it_value;
 
-	timer.it_interval.tv_sec = 0;
-	timer.it_interval.tv_nsec = on == 1 ? 25 * 1000000 : 0;
+	volumio->timer_ms = ms;
 
 	return timerfd_settime(volumio->timer_fd, 0, &timer, NULL);
 }
 
+/**
+ * Enter or leave standby. In standby digital silence is discarded at the
+ * rate of the clock rather than written, letting the fifo run dry so that
+ * readers go idle, and the client is woken by a coarse timer.
+ */
+static int _snd_pcm_volumiofifo_set_standby(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio, int standby) {
+	if(volumio->standby == standby)
+		return 0;
+
+	// Leaving standby keeps the timer going, the client may still be polling it
+	if(standby && _snd_pcm_volumiofifo_set_timer(volumio, volumio->standby_wakeup_ms) < 0)
+		return -errno;
+
+	if(volumio->debug)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s is %s standby", snd_pcm_name(io->pcm), standby ? "entering" : "leaving");
+
+	volumio->standby = standby;
+	volumio->silence_frames = 0;
+	volumio->standby_budget = 0;
+	clock_gettime(CLOCK_MONOTONIC, &volumio->standby_time);
+
+	if(volumio->meter_page)
+		__atomic_store_n(&volumio->meter_page->standby, standby, __ATOMIC_RELAXED);
+	if(volumio->stats)
+		__atomic_store_n(&volumio->stats->standby, standby, __ATOMIC_RELAXED);
+	if(volumio->control) {
+		_snd_pcm_volumiofifo_control_send(volumio->control,
+				standby ? VOLUMIOFIFO_CONTROL_STANDBY : VOLUMIOFIFO_CONTROL_ACTIVE, volumio->stream_frames);
+	}
+
+	return 0;
+}
+
+/**
+ * Allow for the time that has passed since the budget was last topped up
+ */
+static void _snd_pcm_volumiofifo_standby_budget(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
+	struct timespec now;
+	int64_t elapsed_ns;
+	snd_pcm_uframes_t frames;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ns = (int64_t) (now.tv_sec - volumio->standby_time.tv_sec) * 1000000000 +
+			(now.tv_nsec - volumio->standby_time.tv_nsec);
+	frames = elapsed_ns * io->rate / 1000000000;
+	if(frames == 0)
+		return;
+
+	// Move the reference on by exactly the frames granted so no time is lost to rounding
+	elapsed_ns = (int64_t) frames * 1000000000 / io->rate;
+	volumio->standby_time.tv_sec += elapsed_ns / 1000000000;
+	volumio->standby_time.tv_nsec += elapsed_ns % 1000000000;
+	if(volumio->standby_time.tv_nsec >= 1000000000) {
+		volumio->standby_time.tv_sec++;
+		volumio->standby_time.tv_nsec -= 1000000000;
+	}
+
+	volumio->standby_budget += frames;
+	if(volumio->standby_budget > io->buffer_size)
+		volumio->standby_budget = io->buffer_size;
+}
+
+/**
+ * Count client frames of digital silence just sent to the fifo, entering
+ * standby once there have been enough
+ */
+static void _snd_pcm_volumiofifo_watch_silence(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		const void *buf, snd_pcm_uframes_t frames) {
+	if(!volumio->silence_check || frames == 0)
+		return;
+
+	if(!_snd_pcm_volumiofifo_dsp_is_silent(buf, snd_pcm_frames_to_bytes(io->pcm, frames), volumio->silence_pattern)) {
+		volumio->silence_frames = 0;
+		return;
+	}
+
+	volumio->silence_frames += frames;
+	if(volumio->silence_frames >= volumio->standby_frames &&
+			_snd_pcm_volumiofifo_set_standby(io, volumio, 1) < 0) {
+		// Without a timer the client would spin on the empty fifo, so keep writing
+		SNDERR("PCM %s failed to arm the standby timer", snd_pcm_name(io->pcm));
+	}
+}
+
+/* Called by the log's thread */
+static void _snd_pcm_volumiofifo_log_emit(const char *line) {
+	SNDERR("%s", line);
+}
+
 /* Called outside lock */
+static uint64_t _snd_pcm_volumiofifo_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline void _snd_pcm_volumiofifo_stat_state(snd_pcm_volumiofifo_t *volumio, snd_pcm_state_t state) {
+	if(volumio->stats)
+		__atomic_store_n(&volumio->stats->state, state, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add a duration to a stats total, keeping the longest
+ */
+static inline void _snd_pcm_volumiofifo_stat_duration(uint64_t *count, uint64_t *total, uint64_t *max,
+		uint64_t ns) {
+	__atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(total, ns, __ATOMIC_RELAXED);
+	if(ns > __atomic_load_n(max, __ATOMIC_RELAXED))
+		__atomic_store_n(max, ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * Client frames not yet handed to the fifo, for tracing
+ */
+static inline snd_pcm_sframes_t _snd_pcm_volumiofifo_buffered(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
+	snd_pcm_sframes_t buffered;
+
+	if(volumio->ptr < 0)
+		return 0;
+	buffered = io->appl_ptr - volumio->ptr;
+	return buffered < 0 ? buffered + (snd_pcm_sframes_t) volumio->boundary : buffered;
+}
+
+/**
+ * Add an event to the flight recorder
+ */
+static inline void _snd_pcm_volumiofifo_record(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		unsigned int type, int result) {
+	if(volumio->flight)
+		_snd_pcm_volumiofifo_flight_record(volumio->flight, type, io->state, volumio->ptr, io->appl_ptr,
+				result, volumio->fifo_bytes);
+}
+
+static const char *_snd_pcm_volumiofifo_state_name(unsigned int state) {
+	return snd_pcm_state_name(state);
+}
+
+/**
+ * Report each flight recorder dump once its thread has written it
+ */
+static void _snd_pcm_volumiofifo_flight_report(const volumiofifo_flight_context_t *context, const char *path,
+		int err) {
+	if(err < 0)
+		SNDERR("PCM %s %s, and the flight recorder could not be written to %s, error %d",
+				context->pcm, context->reason, path, err);
+	else
+		SNDERR("PCM %s %s, the last events are in %s", context->pcm, context->reason, path);
+}
+
+/**
+ * Write out the flight recorder after something has gone wrong. Only the
+ * events are copied here, the file is written by the recorder's thread.
+ */
+static void _snd_pcm_volumiofifo_flight_dump_now(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		const char *reason) {
+	volumiofifo_flight_context_t context = {
+		.reason = reason,
+		.pcm = snd_pcm_name(io->pcm),
+		.fifo = volumio->fifo_name,
+		.format = snd_pcm_format_name(volumio->fifo_format),
+		.rate = volumio->fifo_rate,
+		.channels = volumio->fifo_channels,
+		.buffer_size = io->buffer_size,
+		.period_size = io->period_size,
+	};
+
+	if(volumio->flight == NULL)
+		return;
+
+	_snd_pcm_volumiofifo_flight_dump(volumio->flight, &context);
+}
+
+/**
+ * Begin the session record of a callback or a write, as it is entered
+ */
+static inline void _snd_pcm_volumiofifo_session_enter(snd_pcm_ioplug_t *io, volumiofifo_session_call_t *call,
+		unsigned int type, uint32_t arg) {
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+
+	// alsa-lib calls back into the plugin from within callbacks, when it syncs
+	call->type = volumio->session_depth++ > 0 ? type | VOLUMIOFIFO_SESSION_NESTED : type;
+	call->state = io->state;
+	call->arg = arg;
+	call->time_ns = _snd_pcm_volumiofifo_now_ns();
+	call->hw_ptr = io->hw_ptr;
+	call->appl_ptr = io->appl_ptr;
+}
+
+/**
+ * Complete a session record with its result and add it to the recording
+ */
+static inline void _snd_pcm_volumiofifo_session_exit(snd_pcm_volumiofifo_t *volumio, volumiofifo_session_call_t *call,
+		int64_t result) {
+	call->result = result;
+	volumio->session_depth--;
+	_snd_pcm_volumiofifo_session_add(volumio->session, (volumiofifo_session_record_t *) call);
+}
+
+/**
+ * Record a write to the fifo which started at start_ns, if the session is being recorded
+ */
+static inline void _snd_pcm_volumiofifo_session_fifo_write(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		uint64_t start_ns, int bytes, int result) {
+	volumiofifo_session_call_t call;
+	// The caller has yet to look at errno
+	int saved_errno = errno;
+
+	if(volumio->session == NULL)
+		return;
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_WRITE, bytes);
+	call.time_ns = start_ns;
+	_snd_pcm_volumiofifo_session_exit(volumio, &call, result);
+	errno = saved_errno;
+}
+
+/* Fire a tracepoint with the pointer arguments every probe carries */
+#define VOLUMIOFIFO_TRACE_PCM(name, io, volumio, arg) \
+	VOLUMIOFIFO_TRACE(name, (volumio)->ptr, (io)->appl_ptr, _snd_pcm_volumiofifo_buffered(io, volumio), arg, \
+			(volumio)->fifo_bytes)
+
+/**
+ * Count a value into its log2 histogram bucket
+ */
+static inline void _snd_pcm_volumiofifo_stat_histogram(volumiofifo_histogram_t *histogram, uint64_t value) {
+	int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+
+	if(bucket >= VOLUMIOFIFO_HISTOGRAM_BUCKETS)
+		bucket = VOLUMIOFIFO_HISTOGRAM_BUCKETS - 1;
+	__atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Log the percentiles of a histogram, as the PCM closes
+ */
+static void _snd_pcm_volumiofifo_stat_dump(const char *fifo_name, const char *what,
+		const volumiofifo_histogram_t *histogram, const char *unit) {
+	uint64_t count = 0;
+	int i;
+
+	for(i = 0; i < VOLUMIOFIFO_HISTOGRAM_BUCKETS; i++)
+		count += histogram->buckets[i];
+	if(count == 0)
+		return;
+
+	SNDERR("FIFO %s %s: %llu samples, p50 <= %llu%s p99 <= %llu%s p99.9 <= %llu%s max <= %llu%s",
+			fifo_name, what, (unsigned long long) count,
+			(unsigned long long) _snd_pcm_volumiofifo_histogram_percentile(histogram, 0.5), unit,
+			(unsigned long long) _snd_pcm_volumiofifo_histogram_percentile(histogram, 0.99), unit,
+			(unsigned long long) _snd_pcm_volumiofifo_histogram_percentile(histogram, 0.999), unit,
+			(unsigned long long) _snd_pcm_volumiofifo_histogram_percentile(histogram, 1), unit);
+}
+
+/**
+ * Account for bytes of whole fifo frames leaving the plugin
+ */
+static inline void _snd_pcm_volumiofifo_count_written(snd_pcm_volumiofifo_t *volumio, int bytes) {
+	volumio->stream_frames += bytes / volumio->fifo_frame_bytes;
+	VOLUMIOFIFO_STAT(volumio, bytes_written, bytes);
+	VOLUMIOFIFO_STAT(volumio, frames_written, bytes / volumio->fifo_frame_bytes);
+}
+
+/**
+ * Whether the descriptors needed to move audio have been closed
+ */
+static inline int _snd_pcm_volumiofifo_closed(snd_pcm_volumiofifo_t *volumio) {
+	if(volumio->loop)
+		return volumio->timer_fd == -1;
+	return volumio->fifo_out_fd == -1 || volumio->fifo_in_fd == -1;
+}
+
 static int snd_pcm_volumiofifo_prepare(snd_pcm_ioplug_t *io) {
 	snd_pcm_volumiofifo_t *volumio = io->private_data;
 
 	int err = 0;
 
 	if(volumio->debug)
-		SNDERR("PCM prepare called. PCM state is %s", snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM prepare called. PCM state is %s", snd_pcm_state_name(io->state));
 
-	if(volumio->fifo_out_fd == -1 || volumio->fifo_in_fd == -1) {
+	if(_snd_pcm_volumiofifo_closed(volumio)) {
 		err = -EBADFD;
 	}
 
@@ -77,8 +764,90 @@ static int snd_pcm_volumiofifo_prepare(snd_pcm_ioplug_t *io) {
 		err = snd_pcm_sw_params_get_boundary(params, &volumio->boundary);
 	}
 
+	if(err == 0) {
+		err = _snd_pcm_volumiofifo_setup_output(io, volumio);
+	}
+
+	if(err == 0 && io->stream == SND_PCM_STREAM_CAPTURE) {
+		int frame_bytes = snd_pcm_frames_to_bytes(io->pcm, 1);
+
+		// A partial frame is only useful if the frames are the same size
+		if(frame_bytes != volumio->capture_frame_bytes) {
+			volumio->capture_frame_bytes = frame_bytes;
+			volumio->capture_partial_len = 0;
+		}
+		volumio->capture_starved = 0;
+		volumio->capture_wakeup_ms = io->period_size * 500 / io->rate;
+		if(volumio->capture_wakeup_ms < 1)
+			volumio->capture_wakeup_ms = 1;
+		else if(volumio->capture_wakeup_ms > 25)
+			volumio->capture_wakeup_ms = 25;
+	}
+
+	if(err == 0 && volumio->stats) {
+		volumiofifo_stats_page_t *stats = volumio->stats;
+
+		__atomic_store_n(&stats->format, volumio->fifo_format, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->rate, volumio->fifo_rate, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->channels, volumio->fifo_channels, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->frame_bytes, volumio->fifo_frame_bytes, __ATOMIC_RELAXED);
+		_snd_pcm_volumiofifo_stat_state(volumio, SND_PCM_STATE_PREPARED);
+	}
+
+	if(err == 0 && volumio->framed) {
+		// The format goes ahead of the first audio written at this format
+		volumio->stream_format_pending = 1;
+		volumio->stream_timing_bytes = sizeof(volumiofifo_stream_timing_t);
+		if(volumio->stream_timing_bytes % volumio->fifo_frame_bytes)
+			volumio->stream_timing_bytes += volumio->fifo_frame_bytes -
+					volumio->stream_timing_bytes % volumio->fifo_frame_bytes;
+	}
+
+	if(err == 0 && volumio->loop) {
+		err = _snd_pcm_volumiofifo_loop_prepare(volumio->loop, volumio->fifo_format, volumio->fifo_rate,
+				volumio->fifo_channels, volumio->fifo_frame_bytes);
+		if(err < 0) {
+			SNDERR("PCM %s must use the same format, rate and channels as the other end of loopback %s",
+					snd_pcm_name(io->pcm), volumio->fifo_name);
+		}
+	}
+
+	if(err == 0 && volumio->mixer) {
+		if(volumio->fifo_format != volumio->mix_format || volumio->fifo_channels != volumio->mix_channels ||
+				volumio->fifo_rate != volumio->mix_rate) {
+			SNDERR("PCM %s must produce %s, %u channels at %u Hz to mix into the fifo %s",
+					snd_pcm_name(io->pcm), snd_pcm_format_name(volumio->mix_format), volumio->mix_channels,
+					volumio->mix_rate, volumio->fifo_name);
+			err = -EINVAL;
+		} else {
+			// Start clean, an xrun or a prepare without a drop may leave frames in the ring
+			_snd_pcm_volumiofifo_mix_discard(volumio->mixer);
+		}
+	}
+
+	if(err == 0 && (volumio->mixer || volumio->loop)) {
+		// Nothing wakes the client when the ring drains, so poll it twice a period
+		volumio->ring_wakeup_ms = io->period_size * 500 / io->rate;
+		if(volumio->ring_wakeup_ms < 1)
+			volumio->ring_wakeup_ms = 1;
+		else if(volumio->ring_wakeup_ms > 25)
+			volumio->ring_wakeup_ms = 25;
+	}
+
+	if(err == 0) {
+		int phys = snd_pcm_format_physical_width(io->format);
+
+		_snd_pcm_volumiofifo_set_standby(io, volumio, 0);
+		volumio->silence_frames = 0;
+		volumio->standby_frames = io->rate * volumio->standby_ms / 1000;
+		volumio->silence_pattern = snd_pcm_format_silence_64(io->format);
+		// Packed 24 bit silence does not repeat every 8 bytes unless it is zero
+		volumio->silence_check = volumio->standby_ms > 0 && phys > 0 &&
+				(64 % phys == 0 || volumio->silence_pattern == 0);
+	}
+
 	if(volumio->debug)
-		SNDERR("PCM %s boundary is %lu frames", snd_pcm_name(io->pcm), volumio->boundary);
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s boundary is %lu frames", snd_pcm_name(io->pcm), volumio->boundary);
 
 	if(err == 0) {
 		err = _snd_pcm_volumiofifo_set_timer(volumio, 0);
@@ -86,73 +855,348 @@ static int snd_pcm_volumiofifo_prepare(snd_pcm_ioplug_t *io) {
 		_snd_pcm_volumiofifo_set_timer(volumio, 0);
 	}
 
+	volumio->drain_start_ns = 0;
+	volumio->drain_dumped = 0;
+
+	VOLUMIOFIFO_TRACE_PCM(prepare, io, volumio, err);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_PREPARE, err);
+
 	return err;
 }
 
-static inline int _snd_pcm_volumiofifo_chunk_size(snd_pcm_ioplug_t *io) {
-	return PIPE_BUF - (PIPE_BUF % snd_pcm_frames_to_bytes(io->pcm, 1));
+static inline int _snd_pcm_volumiofifo_chunk_size(snd_pcm_volumiofifo_t *volumio) {
+	// A framed packet must fit its header in the same atomic write
+	int room = volumio->framed ? PIPE_BUF - sizeof(volumiofifo_stream_packet_t) : PIPE_BUF;
+	if(volumio->timestamps)
+		room -= volumio->stream_timing_bytes;
+	return room - (room % volumio->fifo_frame_bytes);
 }
 
 /**
- * Transfer as much as possible to the fifo, up to the provided size
+ * Write one packet to a framed fifo, its payload being an optional prefix
+ * then the data. The packet is no longer than PIPE_BUF, so it is either
+ * written whole or not at all.
  *
- * Returns the frames transferred, 0 if nothing transfered or -ve on error
+ * Returns the data bytes written or -ve on error, -EAGAIN if the fifo is full
  */
-static snd_pcm_sframes_t _snd_pcm_volumiofifo_transfer(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
-		void* buf, snd_pcm_uframes_t size) {
+static int _snd_pcm_volumiofifo_write_packet(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio, uint16_t type,
+		const void *prefix, int prefix_length, const void *data, int length) {
+	volumiofifo_stream_packet_t packet = {
+		.magic = VOLUMIOFIFO_STREAM_MAGIC,
+		.version = VOLUMIOFIFO_STREAM_VERSION,
+		.type = type,
+		.seq = volumio->stream_seq,
+		.length = prefix_length + length,
+	};
+	struct iovec iov[3] = {
+		{ &packet, sizeof(packet) },
+		{ (void *) prefix, prefix_length },
+		{ (void *) data, length },
+	};
+
+	uint64_t start_ns = volumio->stats || volumio->session ? _snd_pcm_volumiofifo_now_ns() : 0;
+	ssize_t err = writev(volumio->fifo_out_fd, iov, 3);
+
+	if(volumio->stats) {
+		VOLUMIOFIFO_STAT(volumio, writes, 1);
+		_snd_pcm_volumiofifo_stat_histogram(&volumio->stats->write_ns, _snd_pcm_volumiofifo_now_ns() - start_ns);
+	}
+	VOLUMIOFIFO_TRACE_PCM(fifo_write, io, volumio, err < 0 ? -errno : err);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_WRITE, err < 0 ? -errno : err);
+	_snd_pcm_volumiofifo_session_fifo_write(io, volumio, start_ns, sizeof(packet) + prefix_length + length,
+			err < 0 ? -errno : err);
+	if(err < 0) {
+		if(errno == EAGAIN)
+			VOLUMIOFIFO_STAT(volumio, eagains, 1);
+		return -errno;
+	}
+	volumio->stream_seq++;
+
+	return length;
+}
+
+/**
+ * Write one timed audio packet to a framed fifo, stamped with the current
+ * time and the client frames queued behind it
+ *
+ * Returns as _snd_pcm_volumiofifo_write_packet
+ */
+static int _snd_pcm_volumiofifo_write_timed(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		const void *data, int length) {
+	// Big enough for the timing block padded to the largest frame
+	unsigned char block[sizeof(volumiofifo_stream_timing_t) + VOLUMIOFIFO_MAX_CHANNELS * 8] = { 0 };
+	volumiofifo_stream_timing_t *timing = (volumiofifo_stream_timing_t *) block;
+
+	timing->time_ns = _snd_pcm_volumiofifo_now_ns();
+	timing->frame = volumio->stream_frames;
+	timing->delay = volumio->ptr < 0 ? 0 : snd_pcm_ioplug_hw_avail(io, volumio->ptr, io->appl_ptr);
+	timing->bytes = volumio->stream_timing_bytes;
+
+	return _snd_pcm_volumiofifo_write_packet(io, volumio, VOLUMIOFIFO_STREAM_TIMED_AUDIO,
+			block, volumio->stream_timing_bytes, data, length);
+}
+
+/**
+ * As _snd_pcm_volumiofifo_write, for a framed fifo. Any pending format
+ * packet is written first, and nothing else is written until it has been.
+ *
+ * Returns the audio bytes written, 0 if nothing written or -ve on error
+ */
+static int _snd_pcm_volumiofifo_write_framed(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		const char *buf, int size_bytes) {
 
-	snd_pcm_sframes_t written = 0;
 	int err = 0;
+	int chunk_size = _snd_pcm_volumiofifo_chunk_size(volumio);
+
+	int written_bytes = 0;
+
+	if(volumio->stream_format_pending) {
+		volumiofifo_stream_format_t format = {
+			.format = volumio->fifo_format,
+			.rate = volumio->fifo_rate,
+			.channels = volumio->fifo_channels,
+			.frame_bytes = volumio->fifo_frame_bytes,
+			.frame = volumio->stream_frames,
+		};
+
+		err = _snd_pcm_volumiofifo_write_packet(io, volumio, VOLUMIOFIFO_STREAM_FORMAT, NULL, 0,
+				&format, sizeof(format));
+		if(err == -EAGAIN) {
+			return 0;
+		} else if(err < 0) {
+			SNDERR("Write of the format to pcm %s failed with err %d",
+					snd_pcm_name(io->pcm), err);
+			return -EPIPE;
+		}
+		volumio->stream_format_pending = 0;
+	}
+
+	while(written_bytes < size_bytes) {
+		int to_write = size_bytes - written_bytes;
+		if(to_write > chunk_size)
+			to_write = chunk_size;
+		if(volumio->timestamps)
+			err = _snd_pcm_volumiofifo_write_timed(io, volumio, buf + written_bytes, to_write);
+		else
+			err = _snd_pcm_volumiofifo_write_packet(io, volumio, VOLUMIOFIFO_STREAM_AUDIO, NULL, 0,
+					buf + written_bytes, to_write);
+		if(err == -EAGAIN) {
+			if (volumio->debug >= 2)
+				VOLUMIOFIFO_DEBUG(volumio, "PCM %s has filled the fifo %s. Receieved EAGAIN",
+						snd_pcm_name(io->pcm), volumio->fifo_name);
+			break;
+		} else if(err < 0) {
+			SNDERR("Write to pcm %s failed with err %d",
+					snd_pcm_name(io->pcm), err);
+			if (written_bytes == 0) {
+				return -EPIPE;
+			}
+			break;
+		}
+		written_bytes += err;
+		_snd_pcm_volumiofifo_count_written(volumio, err);
+	}
+
+	if(written_bytes > 0 && written_bytes < size_bytes)
+		VOLUMIOFIFO_STAT(volumio, partial_writes, 1);
+
+	return written_bytes;
+}
+
+/**
+ * Write as much as possible to the fifo, up to the provided number of bytes.
+ * Writes are split into chunks of whole fifo frames no bigger than PIPE_BUF
+ * so that each one is atomic.
+ *
+ * Returns the bytes written, 0 if nothing written or -ve on error
+ */
+static int _snd_pcm_volumiofifo_write(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		const char *buf, int size_bytes) {
 
-	int size_bytes = snd_pcm_frames_to_bytes(io->pcm, size);
-	int chunk_size = _snd_pcm_volumiofifo_chunk_size(io);
+	int err = 0;
+	int chunk_size = _snd_pcm_volumiofifo_chunk_size(volumio);
 
 	int written_bytes = 0;
 
+	if(volumio->mixer) {
+		// The ring takes whole frames, and a full ring behaves like a full fifo
+		written_bytes = _snd_pcm_volumiofifo_mix_write(volumio->mixer, buf, size_bytes / volumio->fifo_frame_bytes)
+				* volumio->fifo_frame_bytes;
+		_snd_pcm_volumiofifo_count_written(volumio, written_bytes);
+		return written_bytes;
+	}
+
+	if(volumio->framed) {
+		return _snd_pcm_volumiofifo_write_framed(io, volumio, buf, size_bytes);
+	}
+
+	if(volumio->loop) {
+		written_bytes = _snd_pcm_volumiofifo_loop_write(volumio->loop, buf, size_bytes / volumio->fifo_frame_bytes)
+				* volumio->fifo_frame_bytes;
+		_snd_pcm_volumiofifo_count_written(volumio, written_bytes);
+		return written_bytes;
+	}
+
 	do {
 		int to_write = size_bytes - written_bytes;
-		err = write(volumio->fifo_out_fd, buf + written_bytes,
-				to_write > chunk_size ? chunk_size : to_write);
+		uint64_t start_ns = volumio->stats || volumio->session ? _snd_pcm_volumiofifo_now_ns() : 0;
+		if(to_write > chunk_size)
+			to_write = chunk_size;
+		err = write(volumio->fifo_out_fd, buf + written_bytes, to_write);
+		if (volumio->stats) {
+			VOLUMIOFIFO_STAT(volumio, writes, 1);
+			_snd_pcm_volumiofifo_stat_histogram(&volumio->stats->write_ns,
+					_snd_pcm_volumiofifo_now_ns() - start_ns);
+		}
+		VOLUMIOFIFO_TRACE_PCM(fifo_write, io, volumio, err < 0 ? -errno : err);
+		_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_WRITE, err < 0 ? -errno : err);
+		_snd_pcm_volumiofifo_session_fifo_write(io, volumio, start_ns, to_write, err < 0 ? -errno : err);
 		if (err == -1) {
 			if (errno == EAGAIN) {
+				VOLUMIOFIFO_STAT(volumio, eagains, 1);
 				if (volumio->debug >= 2)
-					SNDERR("PCM %s has filled the fifo %s. Receieved EAGAIN",
+					VOLUMIOFIFO_DEBUG(volumio, "PCM %s has filled the fifo %s. Receieved EAGAIN",
 							snd_pcm_name(io->pcm), volumio->fifo_name);
 				break;
 			} else {
 				SNDERR("Write to pcm %s failed with err %d",
 						snd_pcm_name(io->pcm), err);
 				if (written_bytes == 0) {
-					written = -EPIPE;
+					return -EPIPE;
 				}
 				break;
 			}
 		} else {
 			written_bytes += err;
 		}
-		written = snd_pcm_bytes_to_frames(io->pcm, written_bytes);
 	} while (written_bytes < size_bytes);
 
-	return written;
+	// Each chunk is whole frames and pipe writes of up to PIPE_BUF are all or nothing
+	_snd_pcm_volumiofifo_count_written(volumio, written_bytes);
+	if(written_bytes > 0 && written_bytes < size_bytes)
+		VOLUMIOFIFO_STAT(volumio, partial_writes, 1);
+
+	return written_bytes;
 }
 
 /**
- * Transfer as much as possible to the fifo, up to the provided size,
- * copes with wrapping at the buffer boundary
- *
- * Returns the frames transferred, 0 if nothing transfered or -ve on error
+ * Write any processed output which did not fit in the fifo last time
  *
- * Must be called in lock to avoid duplicate writes and messing up the pointer
+ * Returns 0 or -ve on error. Output may still be pending after a successful flush
  */
-static snd_pcm_sframes_t _snd_pcm_volumiofifo_transfer_wrap(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio, snd_pcm_uframes_t size) {
-
-	snd_pcm_sframes_t written = 0;
+static int _snd_pcm_volumiofifo_flush(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
 
-	snd_pcm_uframes_t offset = volumio->ptr % io->buffer_size;
+	if(volumio->out_pos < volumio->out_len) {
+		int written = _snd_pcm_volumiofifo_write(io, volumio, volumio->out_buf + volumio->out_pos,
+				volumio->out_len - volumio->out_pos);
+		if(written < 0) {
+			return written;
+		}
+		volumio->out_pos += written;
+		if(volumio->out_pos == volumio->out_len) {
+			volumio->out_pos = 0;
+			volumio->out_len = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Transfer as much as possible to the fifo, up to the provided size
+ *
+ * When processing is active the client frames are converted a chunk at a
+ * time. A chunk which cannot be written yet is kept in the output buffer
+ * and its client frames are counted as transferred.
+ *
+ * Returns the frames transferred, 0 if nothing transfered or -ve on error
+ */
+static snd_pcm_sframes_t _snd_pcm_volumiofifo_transfer(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		void* buf, snd_pcm_uframes_t size) {
+
+	if(volumio->standby) {
+		snd_pcm_uframes_t frames = size > volumio->standby_budget ? volumio->standby_budget : size;
+
+		if(frames == 0) {
+			return 0;
+		}
+		if(_snd_pcm_volumiofifo_dsp_is_silent(buf, snd_pcm_frames_to_bytes(io->pcm, frames),
+				volumio->silence_pattern)) {
+			volumio->standby_budget -= frames;
+			return frames;
+		}
+		// Real audio, write it straight away
+		int err = _snd_pcm_volumiofifo_set_standby(io, volumio, 0);
+		if(err < 0) {
+			return err;
+		}
+	}
+
+	if(!_snd_pcm_volumiofifo_processing(volumio)) {
+		int written_bytes = _snd_pcm_volumiofifo_write(io, volumio, buf,
+				snd_pcm_frames_to_bytes(io->pcm, size));
+		if(written_bytes < 0) {
+			_snd_pcm_volumiofifo_flight_dump_now(io, volumio, "failed to write to the fifo");
+			return written_bytes;
+		}
+		_snd_pcm_volumiofifo_meter(volumio, buf, written_bytes / volumio->fifo_frame_bytes);
+		_snd_pcm_volumiofifo_tap(volumio, buf, written_bytes / volumio->fifo_frame_bytes);
+		_snd_pcm_volumiofifo_watch_silence(io, volumio, buf, snd_pcm_bytes_to_frames(io->pcm, written_bytes));
+		return snd_pcm_bytes_to_frames(io->pcm, written_bytes);
+	}
+
+	snd_pcm_uframes_t consumed = 0;
+	snd_pcm_uframes_t chunk_frames = _snd_pcm_volumiofifo_chunk_size(volumio) / volumio->fifo_frame_bytes;
+
+	for(;;) {
+		int err = _snd_pcm_volumiofifo_flush(io, volumio);
+		if(err < 0) {
+			_snd_pcm_volumiofifo_flight_dump_now(io, volumio, "failed to write to the fifo");
+			return consumed > 0 ? (snd_pcm_sframes_t) consumed : err;
+		}
+		if(volumio->out_len > 0 || consumed == size) {
+			break;
+		}
+
+		// Processing may change the number of frames, e.g. DoP packing
+		snd_pcm_uframes_t frames = size - consumed;
+		snd_pcm_uframes_t max_frames = _snd_pcm_volumiofifo_dsp_max_input(volumio->dsp, chunk_frames);
+		if(frames > max_frames) {
+			frames = max_frames;
+		}
+
+		char *in = (char *) buf + snd_pcm_frames_to_bytes(io->pcm, consumed);
+		unsigned int produced = _snd_pcm_volumiofifo_dsp_process(volumio->dsp, in, volumio->out_buf, frames);
+		volumio->out_len = produced * volumio->fifo_frame_bytes;
+		volumio->out_pos = 0;
+		consumed += frames;
+
+		// The processed output may be dithered, so look at what the client sent
+		_snd_pcm_volumiofifo_watch_silence(io, volumio, in, frames);
+
+		_snd_pcm_volumiofifo_meter(volumio, volumio->out_buf, produced);
+		_snd_pcm_volumiofifo_tap(volumio, volumio->out_buf, produced);
+	}
+
+	return consumed;
+}
+
+/**
+ * Transfer as much as possible to the fifo, up to the provided size,
+ * copes with wrapping at the buffer boundary
+ *
+ * Returns the frames transferred, 0 if nothing transfered or -ve on error
+ *
+ * Must be called in lock to avoid duplicate writes and messing up the pointer
+ */
+static snd_pcm_sframes_t _snd_pcm_volumiofifo_transfer_wrap(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio, snd_pcm_uframes_t size) {
+
+	snd_pcm_sframes_t written = 0;
+
+	snd_pcm_uframes_t offset = volumio->ptr % io->buffer_size;
 	snd_pcm_uframes_t remaining = io->buffer_size - offset;
 
 	if (volumio->debug >= 2)
-			SNDERR("PCM %s is requesting %d frames to be transferred with %d frames before wrapping.",
+			VOLUMIOFIFO_DEBUG(volumio, "PCM %s is requesting %lu frames to be transferred with %lu frames before wrapping.",
 									snd_pcm_name(io->pcm), size, remaining);
 
 	const snd_pcm_channel_area_t *areas = snd_pcm_ioplug_mmap_areas(io);
@@ -163,7 +1207,7 @@ static snd_pcm_sframes_t _snd_pcm_volumiofifo_transfer_wrap(snd_pcm_ioplug_t *io
 		written = _snd_pcm_volumiofifo_transfer(io, volumio, buf, remaining);
 		if(written == remaining) {
 			if (volumio->debug >= 2)
-					SNDERR("PCM %s wrote up to the end of the area. Wrapping and attempting %d more frames.",
+					VOLUMIOFIFO_DEBUG(volumio, "PCM %s wrote up to the end of the area. Wrapping and attempting %lu more frames.",
 								snd_pcm_name(io->pcm), size - remaining);
 			buf = areas->addr + (areas->first / 8);
 			written = _snd_pcm_volumiofifo_transfer(io, volumio, buf, size - remaining);
@@ -179,17 +1223,17 @@ static snd_pcm_sframes_t _snd_pcm_volumiofifo_transfer_wrap(snd_pcm_ioplug_t *io
 	}
 
 	if (volumio->debug >= 2)
-		SNDERR("PCM %s has transferred %d frames to the fifo %s.",
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s has transferred %ld frames to the fifo %s.",
 								snd_pcm_name(io->pcm), written, volumio->fifo_name);
 
 	return written;
 }
 
 /* Must be called in lock to avoid duplicate writes and messing up the pointer */
-static int _snd_pcm_volumiofifo_advance(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
+static int _snd_pcm_volumiofifo_move_pointer(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
 
 	if(volumio->debug > 1)
-		SNDERR("PCM %s is trying to advance its hw pointer. PCM state is %s",
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s is trying to advance its hw pointer. PCM state is %s",
 			snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
 
 	switch(io->state) {
@@ -207,12 +1251,30 @@ static int _snd_pcm_volumiofifo_advance(snd_pcm_ioplug_t *io, snd_pcm_volumiofif
 
 	if(volumio->ptr < 0) {
 		if(volumio->debug > 1)
-			SNDERR("PCM %s cannot advance its hw pointer as the pointer is %lld.",
+			VOLUMIOFIFO_DEBUG(volumio, "PCM %s cannot advance its hw pointer as the pointer is %ld.",
 				snd_pcm_name(io->pcm), volumio->ptr);
 		// We have already hit an overrun
 		return 0;
 	}
 
+	if(volumio->out_len > 0) {
+		int err = _snd_pcm_volumiofifo_flush(io, volumio);
+		if(err < 0) {
+			SNDERR("PCM %s failed to write pending output.",
+				snd_pcm_name(io->pcm));
+			volumio->ptr = -EPIPE;
+			return err;
+		}
+		if(volumio->out_len > 0) {
+			// The fifo is still full
+			return 0;
+		}
+	}
+
+	if(volumio->standby) {
+		_snd_pcm_volumiofifo_standby_budget(io, volumio);
+	}
+
 	snd_pcm_uframes_t available = snd_pcm_ioplug_avail(io, volumio->ptr, io->appl_ptr);
 	snd_pcm_sframes_t buffered = io->buffer_size - available;
 
@@ -226,6 +1288,8 @@ static int _snd_pcm_volumiofifo_advance(snd_pcm_ioplug_t *io, snd_pcm_volumiofif
 			written = _snd_pcm_volumiofifo_transfer_wrap(io, volumio, buffered);
 			if(written == buffered) {
 				volumio->drained = 1;
+				VOLUMIOFIFO_TRACE_PCM(drain, io, volumio, written);
+				_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_DRAIN, written);
 				// Hold back one frame of the pointer so that draining waits
 				// for the fifo to empty
 				written -=1;
@@ -248,6 +1312,25 @@ static int _snd_pcm_volumiofifo_advance(snd_pcm_ioplug_t *io, snd_pcm_volumiofif
 	return 0;
 }
 
+/* Must be called in lock to avoid duplicate writes and messing up the pointer */
+static int _snd_pcm_volumiofifo_advance(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
+	if(volumio->stats == NULL)
+		return _snd_pcm_volumiofifo_move_pointer(io, volumio);
+
+	snd_pcm_sframes_t ptr = volumio->ptr;
+	uint64_t start_ns = _snd_pcm_volumiofifo_now_ns();
+	int err = _snd_pcm_volumiofifo_move_pointer(io, volumio);
+
+	_snd_pcm_volumiofifo_stat_histogram(&volumio->stats->advance_ns, _snd_pcm_volumiofifo_now_ns() - start_ns);
+	if(ptr >= 0 && volumio->ptr >= 0) {
+		snd_pcm_sframes_t moved = volumio->ptr - ptr;
+		_snd_pcm_volumiofifo_stat_histogram(&volumio->stats->advance_frames,
+				moved < 0 ? moved + volumio->boundary : moved);
+	}
+
+	return err;
+}
+
 /* Called in lock */
 static int snd_pcm_volumiofifo_start(snd_pcm_ioplug_t *io) {
 	snd_pcm_volumiofifo_t *volumio = io->private_data;
@@ -255,7 +1338,7 @@ static int snd_pcm_volumiofifo_start(snd_pcm_ioplug_t *io) {
 	int err = 0;
 
 	if(volumio->debug)
-		SNDERR("PCM %s start called. PCM state is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s start called. PCM state is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
 
 	// Set running before advancing the pointer
 	err = snd_pcm_ioplug_set_state(io, SND_PCM_STATE_RUNNING);
@@ -265,11 +1348,17 @@ static int snd_pcm_volumiofifo_start(snd_pcm_ioplug_t *io) {
 		if(volumio->lead_in_frames > 0) {
 			// Use a silent lead-in initially to help avoid
 			// completely draining immediately
-			char buf[snd_pcm_frames_to_bytes(io->pcm, volumio->lead_in_frames)];
+			char buf[volumio->lead_in_frames * volumio->fifo_frame_bytes];
 
-			err = snd_pcm_format_set_silence(io->format, buf, io->period_size * io->channels);
+			if(volumio->dsp_active && volumio->dsp->dsd != VOLUMIOFIFO_DSD_NONE && !volumio->dsp->dsd_pcm) {
+				// Zeros would knock a DoP decoder back to PCM
+				_snd_pcm_volumiofifo_dsp_dsd_silence(volumio->dsp, buf, volumio->lead_in_frames);
+			} else {
+				err = snd_pcm_format_set_silence(volumio->fifo_format, buf,
+						volumio->lead_in_frames * volumio->fifo_channels);
+			}
 			if(err == 0) {
-				_snd_pcm_volumiofifo_transfer(io, volumio, buf, io->period_size);
+				_snd_pcm_volumiofifo_write(io, volumio, buf, sizeof(buf));
 			}
 		}
 
@@ -277,6 +1366,10 @@ static int snd_pcm_volumiofifo_start(snd_pcm_ioplug_t *io) {
 			err = _snd_pcm_volumiofifo_advance(io, volumio);
 		}
 	}
+
+	VOLUMIOFIFO_TRACE_PCM(start, io, volumio, err);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_START, err);
+
 	return err;
 }
 
@@ -291,7 +1384,10 @@ static snd_pcm_sframes_t snd_pcm_volumiofifo_transfer(snd_pcm_ioplug_t *io,
 	int err = 0;
 
 	if(volumio->debug)
-		SNDERR("PCM %s transfer called. PCM state is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s transfer called. PCM state is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
+
+	VOLUMIOFIFO_TRACE_PCM(transfer, io, volumio, size);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_TRANSFER, size);
 
 	err = _snd_pcm_volumiofifo_advance(io, volumio);
 
@@ -303,7 +1399,7 @@ static int snd_pcm_volumiofifo_clear_pipe(snd_pcm_ioplug_t *io) {
 
 	int err = 0;
 
-	int chunk_size = _snd_pcm_volumiofifo_chunk_size(io);
+	int chunk_size = _snd_pcm_volumiofifo_chunk_size(volumio);
 
 	char *buf = malloc(chunk_size);
 	if(buf == NULL) {
@@ -335,15 +1431,34 @@ static int snd_pcm_volumiofifo_clear_pipe(snd_pcm_ioplug_t *io) {
 static int snd_pcm_volumiofifo_stop(snd_pcm_ioplug_t *io) {
 	snd_pcm_volumiofifo_t *volumio = io->private_data;
 	int err = 0;
+	// A completed drain leaves the pointer at -EPIPE, anything else is a drop
+	int drained = volumio->drained == 1 && volumio->ptr == -EPIPE;
+	uint64_t stop_start_ns = volumio->stats ? _snd_pcm_volumiofifo_now_ns() : 0;
 
 	if(volumio->debug)
-		SNDERR("PCM stop called. PCM state is %s", snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM stop called. PCM state is %s", snd_pcm_state_name(io->state));
+
+	VOLUMIOFIFO_TRACE_PCM(stop, io, volumio, drained);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_STOP, drained);
+
+	// Anything not yet in the fifo is dropped, including this PCM's frames in the mixer ring
+	volumio->out_len = 0;
+	volumio->out_pos = 0;
+	if(volumio->mixer && !drained)
+		_snd_pcm_volumiofifo_mix_discard(volumio->mixer);
+
+	if(volumio->control) {
+		_snd_pcm_volumiofifo_control_send(volumio->control,
+				drained ? VOLUMIOFIFO_CONTROL_STOP : VOLUMIOFIFO_CONTROL_FLUSH, volumio->stream_frames);
+	}
 
-	if(volumio->fifo_in_fd == -1) {
+	if(_snd_pcm_volumiofifo_closed(volumio)) {
 		err = -EPIPE;
-	} else if(volumio->clear_on_drop == 1){
+	} else if(volumio->clear_on_drop == 1 && volumio->mixer == NULL && volumio->loop == NULL){
+		// With a mixer the fifo holds other clients' audio too, so it is left alone. A loopback
+		// ring belongs to the capture end once written.
 		if(volumio->debug)
-			SNDERR("PCM %s is clearing fifo %s", snd_pcm_name(io->pcm), volumio->fifo_name);
+			VOLUMIOFIFO_DEBUG(volumio, "PCM %s is clearing fifo %s", snd_pcm_name(io->pcm), volumio->fifo_name);
 		err = snd_pcm_volumiofifo_clear_pipe(io);
 	}
 	if(err == 0) {
@@ -352,6 +1467,23 @@ static int snd_pcm_volumiofifo_stop(snd_pcm_ioplug_t *io) {
 		_snd_pcm_volumiofifo_set_timer(volumio, 0);
 	}
 
+	if(volumio->stats) {
+		volumiofifo_stats_page_t *stats = volumio->stats;
+		uint64_t now = _snd_pcm_volumiofifo_now_ns();
+
+		// A drain runs from when the client asks until the fifo has emptied, a drop is just this call
+		if(drained && volumio->drain_start_ns != 0) {
+			_snd_pcm_volumiofifo_stat_duration(&stats->drains, &stats->drain_ns, &stats->drain_max_ns,
+					now - volumio->drain_start_ns);
+		} else if(io->state == SND_PCM_STATE_RUNNING || io->state == SND_PCM_STATE_DRAINING ||
+				io->state == SND_PCM_STATE_PAUSED || io->state == SND_PCM_STATE_XRUN) {
+			_snd_pcm_volumiofifo_stat_duration(&stats->drops, &stats->drop_ns, &stats->drop_max_ns,
+					now - stop_start_ns);
+		}
+		volumio->drain_start_ns = 0;
+		_snd_pcm_volumiofifo_stat_state(volumio, SND_PCM_STATE_SETUP);
+	}
+
 	return err;
 }
 
@@ -367,13 +1499,17 @@ static int snd_pcm_volumiofifo_free(snd_pcm_ioplug_t *io)
 	snd_pcm_volumiofifo_t *volumio = io->private_data;
 
 	if(volumio->debug)
-		SNDERR("PCM %s free called, releasing FIFO %s. State is %s",
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s free called, releasing FIFO %s. State is %s",
 				snd_pcm_name(io->pcm), volumio->fifo_name, snd_pcm_state_name(io->state));
 
 	snd_pcm_volumiofifo_close_fd(&volumio->fifo_out_fd);
 	snd_pcm_volumiofifo_close_fd(&volumio->fifo_in_fd);
 	snd_pcm_volumiofifo_close_fd(&volumio->timer_fd);
 
+	// Let the other end choose new stream parameters
+	if(volumio->loop)
+		_snd_pcm_volumiofifo_loop_release(volumio->loop);
+
 	return 0;
 }
 
@@ -383,17 +1519,74 @@ static int snd_pcm_volumiofifo_close(snd_pcm_ioplug_t *io)
 	snd_pcm_volumiofifo_t *volumio = io->private_data;
 
 	if(volumio->debug)
-		SNDERR("PCM close called. State is %s", snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM close called. State is %s", snd_pcm_state_name(io->state));
+
+	// A dump still being written names the fifo in its header
+	if(volumio->flight) {
+		_snd_pcm_volumiofifo_flight_close(volumio->flight);
+		free(volumio->flight);
+	}
 
 	if (volumio->fifo_name != NULL) {
 		free(volumio->fifo_name);
 		volumio->fifo_name = NULL;
 	}
 
+	// The mixer thread may be writing to the fifo
+	if(volumio->mixer) {
+		_snd_pcm_volumiofifo_mix_close(volumio->mixer);
+		free(volumio->mixer);
+	}
+
+	if(volumio->loop) {
+		_snd_pcm_volumiofifo_loop_close(volumio->loop);
+		free(volumio->loop);
+	}
+
+	if(volumio->control) {
+		_snd_pcm_volumiofifo_control_close(volumio->control);
+		free(volumio->control);
+	}
+
+	// Emit the rest of the debug before the histograms
+	if(volumio->log) {
+		_snd_pcm_volumiofifo_log_close(volumio->log);
+		free(volumio->log);
+	}
+
+	if(volumio->stats && volumio->debug) {
+		_snd_pcm_volumiofifo_stat_dump(volumio->stats->fifo, "pointer advance", &volumio->stats->advance_ns, "ns");
+		_snd_pcm_volumiofifo_stat_dump(volumio->stats->fifo, "frames per advance", &volumio->stats->advance_frames, "");
+		_snd_pcm_volumiofifo_stat_dump(volumio->stats->fifo, "write", &volumio->stats->write_ns, "ns");
+		_snd_pcm_volumiofifo_stat_dump(volumio->stats->fifo, "wakeup delay", &volumio->stats->wakeup_ns, "ns");
+	}
+
+	_snd_pcm_volumiofifo_shm_unmap(volumio->stats, sizeof(*volumio->stats));
+	if(volumio->stats_name) {
+		shm_unlink(volumio->stats_name);
+		free(volumio->stats_name);
+	}
+
+	if(volumio->session) {
+		int err = _snd_pcm_volumiofifo_session_close(volumio->session);
+		if(err < 0)
+			SNDERR("The session recording for PCM %s is incomplete, error %d", snd_pcm_name(io->pcm), err);
+		free(volumio->session);
+	}
+
 	snd_pcm_volumiofifo_close_fd(&volumio->fifo_out_fd);
 	snd_pcm_volumiofifo_close_fd(&volumio->fifo_in_fd);
 	snd_pcm_volumiofifo_close_fd(&volumio->timer_fd);
+	snd_pcm_volumiofifo_close_fd(&volumio->tap_fd);
 
+	_snd_pcm_volumiofifo_shm_unmap(volumio->volume, sizeof(*volumio->volume));
+	_snd_pcm_volumiofifo_shm_unmap(volumio->meter_page, sizeof(*volumio->meter_page));
+	_snd_pcm_volumiofifo_shm_unmap(volumio->tap_page, volumio->tap_page_size);
+
+	free(volumio->tap);
+	free(volumio->meter);
+	free(volumio->dsp);
+	free(volumio->out_buf);
 	free(volumio);
 
 	return 0;
@@ -411,20 +1604,72 @@ static snd_pcm_sframes_t snd_pcm_volumiofifo_pointer(snd_pcm_ioplug_t *io)
 	int err = 0;
 
 	if(volumio->debug >= 2)
-		SNDERR("PCM pointer called. State is %s", snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM pointer called. State is %s", snd_pcm_state_name(io->state));
 
 
-	if(volumio->fifo_out_fd == -1 || volumio->fifo_in_fd == -1) {
+	if(_snd_pcm_volumiofifo_closed(volumio)) {
 		volumio->ptr = -EBADFD;
 		return -EBADFD;
 	}
 
+	_snd_pcm_volumiofifo_stat_state(volumio, io->state);
+
 	if(io->state == SND_PCM_STATE_XRUN) {
+		if(volumio->ptr != -EPIPE) {
+			VOLUMIOFIFO_STAT(volumio, xruns, 1);
+			VOLUMIOFIFO_TRACE_PCM(xrun, io, volumio, io->hw_ptr);
+			_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_XRUN, io->hw_ptr);
+			_snd_pcm_volumiofifo_flight_dump_now(io, volumio, "underran");
+		}
 		volumio->ptr = -EPIPE;
 		return -EPIPE;
 	}
 
-	if(io->state == SND_PCM_STATE_DRAINING && volumio->drained == 1) {
+	if(io->state == SND_PCM_STATE_DRAINING && (volumio->stats || volumio->flight)) {
+		if(volumio->drain_start_ns == 0) {
+			volumio->drain_start_ns = _snd_pcm_volumiofifo_now_ns();
+		} else if(!volumio->drain_dumped && volumio->flight && volumio->drain_timeout_ms > 0 &&
+				_snd_pcm_volumiofifo_now_ns() - volumio->drain_start_ns > volumio->drain_timeout_ms * 1000000ULL) {
+			volumio->drain_dumped = 1;
+			_snd_pcm_volumiofifo_flight_dump_now(io, volumio, "is taking too long to drain");
+		}
+	}
+
+	if(io->state == SND_PCM_STATE_DRAINING && volumio->drained == 1 && volumio->out_len > 0) {
+		err = _snd_pcm_volumiofifo_flush(io, volumio);
+		if(err < 0) {
+			SNDERR("PCM %s is unable to write pending output. Error was %d",
+					snd_pcm_name(io->pcm), err);
+			volumio->ptr = -EPIPE;
+		} else if(volumio->debug > 1) {
+			VOLUMIOFIFO_DEBUG(volumio, "PCM %s must wait for pending output to reach the fifo %s",
+					snd_pcm_name(io->pcm), volumio->fifo_name);
+		}
+	} else if(io->state == SND_PCM_STATE_DRAINING && volumio->drained == 1 && volumio->mixer) {
+		// Other clients may keep the fifo busy, so stop once the mixer has taken everything
+		if(_snd_pcm_volumiofifo_mix_pending(volumio->mixer) == 0) {
+			if(volumio->debug > 1) {
+				VOLUMIOFIFO_DEBUG(volumio, "Draining complete for PCM %s.",
+						snd_pcm_name(io->pcm));
+			}
+			volumio->ptr = -EPIPE;
+		} else if(volumio->debug > 1) {
+			VOLUMIOFIFO_DEBUG(volumio, "PCM %s must wait for the mixer to take its output",
+					snd_pcm_name(io->pcm));
+		}
+	} else if(io->state == SND_PCM_STATE_DRAINING && volumio->drained == 1 && volumio->loop) {
+		// Nothing is left to wait for once the capture end has read everything, or has gone
+		if(_snd_pcm_volumiofifo_loop_pending(volumio->loop) == 0) {
+			if(volumio->debug > 1) {
+				VOLUMIOFIFO_DEBUG(volumio, "Draining complete for PCM %s.",
+						snd_pcm_name(io->pcm));
+			}
+			volumio->ptr = -EPIPE;
+		} else if(volumio->debug > 1) {
+			VOLUMIOFIFO_DEBUG(volumio, "PCM %s must wait for the capture end of loopback %s",
+					snd_pcm_name(io->pcm), volumio->fifo_name);
+		}
+	} else if(io->state == SND_PCM_STATE_DRAINING && volumio->drained == 1) {
 		struct pollfd pfd;
 		pfd.fd = volumio->fifo_in_fd;
 		pfd.events = POLLIN;
@@ -440,13 +1685,13 @@ static snd_pcm_sframes_t snd_pcm_volumiofifo_pointer(snd_pcm_ioplug_t *io)
 
 		if((pfd.revents & POLLIN) == 0) {
 			if(volumio->debug > 1) {
-				SNDERR("Draining complete for PCM %s.",
+				VOLUMIOFIFO_DEBUG(volumio, "Draining complete for PCM %s.",
 						snd_pcm_name(io->pcm));
 			}
 			volumio->ptr = -EPIPE;
 		} else {
 			if(volumio->debug > 1) {
-				SNDERR("PCM %s must wait for the fifo %s to drain",
+				VOLUMIOFIFO_DEBUG(volumio, "PCM %s must wait for the fifo %s to drain",
 						snd_pcm_name(io->pcm), volumio->fifo_name);
 			}
 		}
@@ -460,10 +1705,13 @@ static snd_pcm_sframes_t snd_pcm_volumiofifo_pointer(snd_pcm_ioplug_t *io)
 	}
 
 	if(volumio->debug > 1) {
-		SNDERR("Moving pointer for PCM %s from %d to %d. Application pointer is %d",
+		VOLUMIOFIFO_DEBUG(volumio, "Moving pointer for PCM %s from %lu to %ld. Application pointer is %lu",
 				snd_pcm_name(io->pcm), io->hw_ptr, volumio->ptr, io->appl_ptr);
 	}
 
+	VOLUMIOFIFO_TRACE_PCM(pointer, io, volumio, io->hw_ptr);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_POINTER, io->hw_ptr);
+
 	return volumio->ptr;
 }
 
@@ -473,7 +1721,7 @@ static int snd_pcm_volumiofifo_poll_descriptors_count(snd_pcm_ioplug_t *io)
 	snd_pcm_volumiofifo_t *volumio = io->private_data;
 
 	if(volumio->debug >= 2)
-		SNDERR("PCM poll descriptors count called. State is %s", snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM poll descriptors count called. State is %s", snd_pcm_state_name(io->state));
 
 	return 1;
 }
@@ -485,15 +1733,30 @@ static int snd_pcm_volumiofifo_poll_descriptors(snd_pcm_ioplug_t *io, struct pol
 	int err = 0;
 
 	if(volumio->debug >= 2)
-		SNDERR("PCM poll descriptors called. State is %s", snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM poll descriptors called. State is %s", snd_pcm_state_name(io->state));
 
 	if(nfds == 1) {
 		if(io->state == SND_PCM_STATE_DRAINING && volumio->drained == 1) {
-			err = _snd_pcm_volumiofifo_set_timer(volumio, 1);
+			err = _snd_pcm_volumiofifo_set_timer(volumio, 25);
+			pfds[0].fd = volumio->timer_fd;
+			pfds[0].events = POLLIN;
+			pfds[0].revents = 0;
+		} else if(volumio->standby) {
+			// The empty fifo would always be writeable, so wake on the timer instead
+			if(volumio->timer_ms != volumio->standby_wakeup_ms)
+				err = _snd_pcm_volumiofifo_set_timer(volumio, volumio->standby_wakeup_ms);
+			pfds[0].fd = volumio->timer_fd;
+			pfds[0].events = POLLIN;
+			pfds[0].revents = 0;
+		} else if(volumio->mixer || volumio->loop) {
+			if(volumio->timer_ms != volumio->ring_wakeup_ms)
+				err = _snd_pcm_volumiofifo_set_timer(volumio, volumio->ring_wakeup_ms);
 			pfds[0].fd = volumio->timer_fd;
 			pfds[0].events = POLLIN;
 			pfds[0].revents = 0;
 		} else {
+			if(volumio->timer_ms != 0)
+				err = _snd_pcm_volumiofifo_set_timer(volumio, 0);
 			pfds[0].fd = volumio->fifo_out_fd;
 			pfds[0].events = POLLOUT;
 			pfds[0].revents = 0;
@@ -516,12 +1779,41 @@ static int snd_pcm_volumiofifo_poll_revents(snd_pcm_ioplug_t *io, struct pollfd
 	int err = 0;
 
 	if(volumio->debug >= 2)
-		SNDERR("PCM %s revents called. State is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s revents called. State is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
 
 	if(nfds != 1 || (pfds[0].fd != volumio->fifo_out_fd && pfds[0].fd != volumio->timer_fd)) {
 		return -EINVAL;
 	}
 
+	if(pfds[0].fd == volumio->timer_fd && (pfds[0].revents & POLLIN)) {
+		// Consume the expiries so the next poll waits for the next tick
+		uint64_t expiries;
+		if(read(volumio->timer_fd, &expiries, sizeof(expiries)) < 0) {
+			if(errno != EAGAIN)
+				return -errno;
+		} else if(volumio->stats && volumio->timer_ms > 0) {
+			// The timer is periodic, so the time to the next expiry gives the time since the last
+			struct itimerspec timer;
+			if(timerfd_gettime(volumio->timer_fd, &timer) == 0) {
+				int64_t late_ns = (int64_t) expiries * volumio->timer_ms * 1000000
+						- ((int64_t) timer.it_value.tv_sec * 1000000000 + timer.it_value.tv_nsec);
+				_snd_pcm_volumiofifo_stat_histogram(&volumio->stats->wakeup_ns, late_ns > 0 ? late_ns : 0);
+			}
+		}
+	}
+
+	// The tracepoints carry the fifo level too, whenever they are built in
+	if(volumio->stats || volumio->flight || VOLUMIOFIFO_TRACE_ENABLED) {
+		int queued;
+
+		VOLUMIOFIFO_STAT(volumio, wakeups, 1);
+		if(volumio->fifo_in_fd >= 0 && ioctl(volumio->fifo_in_fd, FIONREAD, &queued) == 0) {
+			volumio->fifo_bytes = queued;
+			if(volumio->stats)
+				__atomic_store_n(&volumio->stats->fifo_bytes, queued, __ATOMIC_RELAXED);
+		}
+	}
+
 	switch(io->state) {
 		case SND_PCM_STATE_RUNNING:
 		case SND_PCM_STATE_DRAINING:
@@ -539,130 +1831,1256 @@ static int snd_pcm_volumiofifo_poll_revents(snd_pcm_ioplug_t *io, struct pollfd
 
 	if(err >= io->period_size) {
 		if(volumio->debug >= 2)
-			SNDERR("PCM revents POLLOUT");
+			VOLUMIOFIFO_DEBUG(volumio, "PCM revents POLLOUT");
 		*revents = POLLOUT;
 		err = 0;
 	} else if(err > 0) {
 		if(volumio->debug >= 2)
-			SNDERR("PCM revents skipping this wakeup");
+			VOLUMIOFIFO_DEBUG(volumio, "PCM revents skipping this wakeup");
+		VOLUMIOFIFO_STAT(volumio, wasted_wakeups, 1);
 		*revents = 0;
 		err = 0;
 	}
 
+	VOLUMIOFIFO_TRACE_PCM(poll_revents, io, volumio, err < 0 ? err : *revents);
+	_snd_pcm_volumiofifo_record(io, volumio, VOLUMIOFIFO_FLIGHT_WAKEUP, err < 0 ? err : *revents);
+
 	return err;
 }
 
-static const snd_pcm_ioplug_callback_t volumiofifo_playback_callback = {
-	.prepare = snd_pcm_volumiofifo_prepare,
-	.start = snd_pcm_volumiofifo_start,
-	.transfer = snd_pcm_volumiofifo_transfer,
-	.stop = snd_pcm_volumiofifo_stop,
-	.pointer = snd_pcm_volumiofifo_pointer,
-	.hw_free = snd_pcm_volumiofifo_free,
-	.close = snd_pcm_volumiofifo_close,
-	.poll_descriptors_count = snd_pcm_volumiofifo_poll_descriptors_count,
-	.poll_descriptors = snd_pcm_volumiofifo_poll_descriptors,
-	.poll_revents = snd_pcm_volumiofifo_poll_revents,
-};
+/**
+ * Read as many whole frames as possible from the fifo into the capture
+ * buffer, up to the provided size. Bytes of a frame that has only partly
+ * arrived are kept aside until the rest of it is read.
+ *
+ * Returns the frames read, 0 if nothing read or -ve on error
+ */
+static snd_pcm_sframes_t _snd_pcm_volumiofifo_capture_read(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio,
+		snd_pcm_uframes_t size) {
 
-SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
+	const snd_pcm_channel_area_t *areas = snd_pcm_ioplug_mmap_areas(io);
+	int frame_bytes = volumio->capture_frame_bytes;
+	snd_pcm_uframes_t done = 0;
+
+	while(done < size) {
+		snd_pcm_uframes_t offset = (volumio->ptr + done) % io->buffer_size;
+		snd_pcm_uframes_t frames = size - done;
+		if(frames > io->buffer_size - offset) {
+			frames = io->buffer_size - offset;
+		}
+
+		char *buf = (char *)areas->addr + ((areas->first + areas->step * offset) / 8);
+
+		if(volumio->loop) {
+			// The ring only ever holds whole frames
+			unsigned int got = _snd_pcm_volumiofifo_loop_read(volumio->loop, buf, frames);
+			done += got;
+			if(got < frames) {
+				break;
+			}
+			continue;
+		}
+
+		int partial = volumio->capture_partial_len;
+		ssize_t want = frames * frame_bytes - partial;
+
+		memcpy(buf, volumio->capture_partial, partial);
+		ssize_t got = read(volumio->fifo_in_fd, buf + partial, want);
+		if(got < 0) {
+			if(errno == EAGAIN) {
+				break;
+			}
+			SNDERR("Read from pcm %s failed with errno %d", snd_pcm_name(io->pcm), errno);
+			return done > 0 ? (snd_pcm_sframes_t) done : -EPIPE;
+		}
+
+		int total = partial + got;
+		volumio->capture_partial_len = total % frame_bytes;
+		memcpy(volumio->capture_partial, buf + total - volumio->capture_partial_len, volumio->capture_partial_len);
+		done += total / frame_bytes;
+
+		if(got < want) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Move the capture pointer on by whatever the fifo can supply
+ *
+ * Called in lock
+ */
+static int _snd_pcm_volumiofifo_capture_advance(snd_pcm_ioplug_t *io, snd_pcm_volumiofifo_t *volumio) {
+
+	switch(io->state) {
+		case SND_PCM_STATE_RUNNING:
+			break;
+		case SND_PCM_STATE_XRUN:
+			volumio->ptr = -EPIPE;
+			return 0;
+		default:
+			return 0;
+	}
+
+	if(volumio->ptr < 0) {
+		return 0;
+	}
+
+	snd_pcm_uframes_t captured = snd_pcm_ioplug_avail(io, volumio->ptr, io->appl_ptr);
+	if(captured >= io->buffer_size) {
+		// The client is not keeping up, leave the rest in the fifo
+		return 0;
+	}
+
+	snd_pcm_sframes_t read = _snd_pcm_volumiofifo_capture_read(io, volumio, io->buffer_size - captured);
+	if(read < 0) {
+		SNDERR("PCM %s failed to advance its hw pointer.",
+			snd_pcm_name(io->pcm));
+		volumio->ptr = -EPIPE;
+		return read;
+	}
+
+	volumio->ptr += read;
+	if(volumio->ptr >= volumio->boundary) {
+		volumio->ptr -= volumio->boundary;
+	}
+
+	return 0;
+}
+
+/* Called in lock */
+static int snd_pcm_volumiofifo_capture_start(snd_pcm_ioplug_t *io) {
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+
+	int err = 0;
+
+	if(volumio->debug)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s capture start called. PCM state is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
+
+	err = snd_pcm_ioplug_set_state(io, SND_PCM_STATE_RUNNING);
+	if(err == 0) {
+		err = _snd_pcm_volumiofifo_capture_advance(io, volumio);
+	}
+	return err;
+}
+
+/* Called in lock */
+static snd_pcm_sframes_t snd_pcm_volumiofifo_capture_transfer(snd_pcm_ioplug_t *io,
+	      const snd_pcm_channel_area_t *areas,
+	      snd_pcm_uframes_t offset,
+	      snd_pcm_uframes_t size)
 {
-	snd_config_iterator_t i, next;
-	const char *fifo_name = 0;
-	unsigned int formats[64];
-	int format_count = 0, format_append = 0, clear_on_drop = 1;
-	long debug = 0, lead_in_frames = 0;
-	int err;
-	snd_pcm_volumiofifo_t *volumio = NULL;
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
 
-	const snd_pcm_access_t access_list[] = {
-		SND_PCM_ACCESS_RW_INTERLEAVED,
-		SND_PCM_ACCESS_MMAP_INTERLEAVED
-	};
+	int err = _snd_pcm_volumiofifo_capture_advance(io, volumio);
 
-	if(stream == SND_PCM_STREAM_CAPTURE) {
-		SNDERR("The Volumio ALSA fifo plugin is playback only");
-		err = -EINVAL;
-		goto error;
+	return err == 0 ? size : err;
+}
+
+/* Called in lock */
+static int snd_pcm_volumiofifo_capture_stop(snd_pcm_ioplug_t *io) {
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+
+	if(volumio->debug)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM capture stop called. PCM state is %s", snd_pcm_state_name(io->state));
+
+	// Anything still in the fifo is left for the next start
+	return _snd_pcm_volumiofifo_set_timer(volumio, 0);
+}
+
+/* Called in lock */
+static snd_pcm_sframes_t snd_pcm_volumiofifo_capture_pointer(snd_pcm_ioplug_t *io)
+{
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+
+	if(volumio->debug >= 2)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM capture pointer called. State is %s", snd_pcm_state_name(io->state));
+
+	if(_snd_pcm_volumiofifo_closed(volumio)) {
+		volumio->ptr = -EBADFD;
+		return -EBADFD;
 	}
 
-	snd_config_for_each(i, next, conf) {
-		snd_config_t *n = snd_config_iterator_entry(i);
-		const char *id;
-		const char *tmp;
-		if (snd_config_get_id(n, &id) < 0)
+	if(io->state == SND_PCM_STATE_XRUN) {
+		volumio->ptr = -EPIPE;
+		return -EPIPE;
+	}
+
+	if(io->state == SND_PCM_STATE_RUNNING) {
+		int err = _snd_pcm_volumiofifo_capture_advance(io, volumio);
+		if(err < 0) {
+			SNDERR("PCM %s is unable to advance the pointer. Error was %d",
+					snd_pcm_name(io->pcm), err);
+		}
+	}
+
+	return volumio->ptr;
+}
+
+/* Called outside lock */
+static int snd_pcm_volumiofifo_capture_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfds, unsigned int nfds)
+{
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+	int err = 0;
+
+	if(volumio->debug >= 2)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM capture poll descriptors called. State is %s", snd_pcm_state_name(io->state));
+
+	if(nfds != 1) {
+		return -EINVAL;
+	}
+
+	if(volumio->loop) {
+		// The ring cannot be polled, so check it twice a period
+		if(volumio->timer_ms != volumio->ring_wakeup_ms)
+			err = _snd_pcm_volumiofifo_set_timer(volumio, volumio->ring_wakeup_ms);
+		pfds[0].fd = volumio->timer_fd;
+	} else if(volumio->capture_starved) {
+		// Waking for every small write to the fifo would be wasteful, so poll the fifo on a timer
+		if(volumio->timer_ms != volumio->capture_wakeup_ms)
+			err = _snd_pcm_volumiofifo_set_timer(volumio, volumio->capture_wakeup_ms);
+		pfds[0].fd = volumio->timer_fd;
+	} else {
+		if(volumio->timer_ms != 0)
+			err = _snd_pcm_volumiofifo_set_timer(volumio, 0);
+		pfds[0].fd = volumio->fifo_in_fd;
+	}
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+
+	return err == 0 ? 1 : -errno;
+}
+
+/* Called outside lock */
+static int snd_pcm_volumiofifo_capture_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds, unsigned int nfds, unsigned short *revents)
+{
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+	int err = 0;
+
+	if(volumio->debug >= 2)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM %s capture revents called. State is %s", snd_pcm_name(io->pcm), snd_pcm_state_name(io->state));
+
+	if(nfds != 1 || (pfds[0].fd != volumio->fifo_in_fd && pfds[0].fd != volumio->timer_fd)) {
+		return -EINVAL;
+	}
+
+	if(pfds[0].fd == volumio->timer_fd && (pfds[0].revents & POLLIN)) {
+		uint64_t expiries;
+		if(read(volumio->timer_fd, &expiries, sizeof(expiries)) < 0 && errno != EAGAIN) {
+			return -errno;
+		}
+	}
+
+	if(io->state == SND_PCM_STATE_RUNNING) {
+		err = snd_pcm_hwsync(io->pcm);
+		if(err == 0) {
+			err = snd_pcm_ioplug_avail(io, io->hw_ptr, io->appl_ptr);
+		}
+	} else {
+		err = io->period_size;
+	}
+
+	if(err >= (int) io->period_size) {
+		volumio->capture_starved = 0;
+		*revents = POLLIN;
+		err = 0;
+	} else if(err >= 0) {
+		if(volumio->debug >= 2)
+			VOLUMIOFIFO_DEBUG(volumio, "PCM capture revents skipping this wakeup");
+		volumio->capture_starved = 1;
+		*revents = 0;
+		err = 0;
+	}
+
+	return err;
+}
+
+static const snd_pcm_ioplug_callback_t volumiofifo_capture_callback = {
+	.prepare = snd_pcm_volumiofifo_prepare,
+	.start = snd_pcm_volumiofifo_capture_start,
+	.transfer = snd_pcm_volumiofifo_capture_transfer,
+	.stop = snd_pcm_volumiofifo_capture_stop,
+	.pointer = snd_pcm_volumiofifo_capture_pointer,
+	.hw_free = snd_pcm_volumiofifo_free,
+	.close = snd_pcm_volumiofifo_close,
+	.poll_descriptors_count = snd_pcm_volumiofifo_poll_descriptors_count,
+	.poll_descriptors = snd_pcm_volumiofifo_capture_poll_descriptors,
+	.poll_revents = snd_pcm_volumiofifo_capture_poll_revents,
+};
+
+/*
+ * Tell the reader, which may hold plenty of audio of its own. Only used
+ * with a control socket.
+ *
+ * Called in lock
+ */
+static int snd_pcm_volumiofifo_pause(snd_pcm_ioplug_t *io, int enable)
+{
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+
+	if(volumio->debug)
+		VOLUMIOFIFO_DEBUG(volumio, "PCM pause called with %d. PCM state is %s", enable, snd_pcm_state_name(io->state));
+
+	_snd_pcm_volumiofifo_control_send(volumio->control,
+			enable ? VOLUMIOFIFO_CONTROL_PAUSE : VOLUMIOFIFO_CONTROL_RESUME, volumio->stream_frames);
+
+	return 0;
+}
+
+/*
+ * The frames queued in the PCM as of the last pointer update, plus the
+ * frames in the fifo and those the reader says that it holds. Only used
+ * with a control socket, without one alsa-lib works out the delay itself.
+ *
+ * Called in lock
+ */
+static int snd_pcm_volumiofifo_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
+{
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+	snd_pcm_sframes_t fifo_frames = (volumio->out_len - volumio->out_pos) / volumio->fifo_frame_bytes;
+	uint32_t depth;
+	int queued;
+
+	if(io->state == SND_PCM_STATE_XRUN) {
+		return -EPIPE;
+	}
+
+	if(ioctl(volumio->fifo_in_fd, FIONREAD, &queued) == 0) {
+		if(volumio->framed) {
+			// Take off a header for each packet the bytes could fill, exact while the packets are full
+			int overhead = sizeof(volumiofifo_stream_packet_t) +
+					(volumio->timestamps ? volumio->stream_timing_bytes : 0);
+			int packet_bytes = _snd_pcm_volumiofifo_chunk_size(volumio) + overhead;
+			queued -= (queued + packet_bytes - 1) / packet_bytes * overhead;
+			if(queued < 0)
+				queued = 0;
+		}
+		fifo_frames += queued / volumio->fifo_frame_bytes;
+	}
+	// Ignore a reader which has stopped reporting
+	if(_snd_pcm_volumiofifo_control_depth(volumio->control, 1000000000, &depth)) {
+		fifo_frames += depth;
+	}
+
+	// The fifo only runs at a different rate when the plugin converts DSD
+	*delayp = snd_pcm_ioplug_hw_avail(io, io->hw_ptr, io->appl_ptr) + fifo_frames * io->rate / volumio->fifo_rate;
+	return 0;
+}
+
+static const snd_pcm_ioplug_callback_t volumiofifo_playback_callback = {
+	.prepare = snd_pcm_volumiofifo_prepare,
+	.start = snd_pcm_volumiofifo_start,
+	.transfer = snd_pcm_volumiofifo_transfer,
+	.stop = snd_pcm_volumiofifo_stop,
+	.pointer = snd_pcm_volumiofifo_pointer,
+	.hw_free = snd_pcm_volumiofifo_free,
+	.close = snd_pcm_volumiofifo_close,
+	.poll_descriptors_count = snd_pcm_volumiofifo_poll_descriptors_count,
+	.poll_descriptors = snd_pcm_volumiofifo_poll_descriptors,
+	.poll_revents = snd_pcm_volumiofifo_poll_revents,
+};
+
+/*
+ * With a control socket the reader is told about pauses and reports its
+ * depth, so only then does the PCM offer pause and its own delay
+ */
+static const snd_pcm_ioplug_callback_t volumiofifo_control_callback = {
+	.prepare = snd_pcm_volumiofifo_prepare,
+	.start = snd_pcm_volumiofifo_start,
+	.transfer = snd_pcm_volumiofifo_transfer,
+	.stop = snd_pcm_volumiofifo_stop,
+	.pointer = snd_pcm_volumiofifo_pointer,
+	.hw_free = snd_pcm_volumiofifo_free,
+	.close = snd_pcm_volumiofifo_close,
+	.poll_descriptors_count = snd_pcm_volumiofifo_poll_descriptors_count,
+	.poll_descriptors = snd_pcm_volumiofifo_poll_descriptors,
+	.poll_revents = snd_pcm_volumiofifo_poll_revents,
+	.pause = snd_pcm_volumiofifo_pause,
+	.delay = snd_pcm_volumiofifo_delay,
+};
+
+/*
+ * The playback callbacks of a PCM recording its session, each records its
+ * arguments and result around the callback itself
+ */
+static int snd_pcm_volumiofifo_record_prepare(snd_pcm_ioplug_t *io) {
+	snd_pcm_volumiofifo_t *volumio = io->private_data;
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_PREPARE, 0);
+	err = snd_pcm_volumiofifo_prepare(io);
+
+	// The boundary is only known once prepared
+	volumiofifo_session_params_t params = {
+		.type = VOLUMIOFIFO_SESSION_PARAMS,
+		.format = io->format,
+		.time_ns = call.time_ns,
+		.rate = io->rate,
+		.channels = io->channels,
+		.buffer_size = io->buffer_size,
+		.period_size = io->period_size,
+		.boundary = volumio->boundary,
+	};
+	_snd_pcm_volumiofifo_session_add(volumio->session, (volumiofifo_session_record_t *) &params);
+	_snd_pcm_volumiofifo_session_exit(volumio, &call, err);
+	return err;
+}
+
+static int snd_pcm_volumiofifo_record_start(snd_pcm_ioplug_t *io) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_START, 0);
+	err = snd_pcm_volumiofifo_start(io);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err);
+	return err;
+}
+
+static snd_pcm_sframes_t snd_pcm_volumiofifo_record_transfer(snd_pcm_ioplug_t *io,
+		const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t size) {
+	volumiofifo_session_call_t call;
+	snd_pcm_sframes_t transferred;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_TRANSFER, size);
+	transferred = snd_pcm_volumiofifo_transfer(io, areas, offset, size);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, transferred);
+	return transferred;
+}
+
+static int snd_pcm_volumiofifo_record_stop(snd_pcm_ioplug_t *io) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_STOP, 0);
+	err = snd_pcm_volumiofifo_stop(io);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err);
+	return err;
+}
+
+static snd_pcm_sframes_t snd_pcm_volumiofifo_record_pointer(snd_pcm_ioplug_t *io) {
+	volumiofifo_session_call_t call;
+	snd_pcm_sframes_t ptr;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_POINTER, 0);
+	ptr = snd_pcm_volumiofifo_pointer(io);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, ptr);
+	return ptr;
+}
+
+static int snd_pcm_volumiofifo_record_free(snd_pcm_ioplug_t *io) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_HW_FREE, 0);
+	err = snd_pcm_volumiofifo_free(io);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err);
+	return err;
+}
+
+static int snd_pcm_volumiofifo_record_poll_descriptors_count(snd_pcm_ioplug_t *io) {
+	volumiofifo_session_call_t call;
+	int count;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_POLL_COUNT, 0);
+	count = snd_pcm_volumiofifo_poll_descriptors_count(io);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, count);
+	return count;
+}
+
+static int snd_pcm_volumiofifo_record_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfds, unsigned int nfds) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_POLL_DESCRIPTORS, 0);
+	err = snd_pcm_volumiofifo_poll_descriptors(io, pfds, nfds);
+	if(err > 0)
+		call.arg = pfds[0].events;
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err);
+	return err;
+}
+
+static int snd_pcm_volumiofifo_record_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfds, unsigned int nfds,
+		unsigned short *revents) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_POLL_REVENTS, nfds > 0 ? pfds[0].revents : 0);
+	err = snd_pcm_volumiofifo_poll_revents(io, pfds, nfds, revents);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err < 0 ? err : *revents);
+	return err;
+}
+
+static int snd_pcm_volumiofifo_record_pause(snd_pcm_ioplug_t *io, int enable) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_PAUSE, enable);
+	err = snd_pcm_volumiofifo_pause(io, enable);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err);
+	return err;
+}
+
+static int snd_pcm_volumiofifo_record_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
+	volumiofifo_session_call_t call;
+	int err;
+
+	_snd_pcm_volumiofifo_session_enter(io, &call, VOLUMIOFIFO_SESSION_DELAY, 0);
+	err = snd_pcm_volumiofifo_delay(io, delayp);
+	_snd_pcm_volumiofifo_session_exit(io->private_data, &call, err < 0 ? err : *delayp);
+	return err;
+}
+
+static const snd_pcm_ioplug_callback_t volumiofifo_record_callback = {
+	.prepare = snd_pcm_volumiofifo_record_prepare,
+	.start = snd_pcm_volumiofifo_record_start,
+	.transfer = snd_pcm_volumiofifo_record_transfer,
+	.stop = snd_pcm_volumiofifo_record_stop,
+	.pointer = snd_pcm_volumiofifo_record_pointer,
+	.hw_free = snd_pcm_volumiofifo_record_free,
+	.close = snd_pcm_volumiofifo_close,
+	.poll_descriptors_count = snd_pcm_volumiofifo_record_poll_descriptors_count,
+	.poll_descriptors = snd_pcm_volumiofifo_record_poll_descriptors,
+	.poll_revents = snd_pcm_volumiofifo_record_poll_revents,
+};
+
+static const snd_pcm_ioplug_callback_t volumiofifo_record_control_callback = {
+	.prepare = snd_pcm_volumiofifo_record_prepare,
+	.start = snd_pcm_volumiofifo_record_start,
+	.transfer = snd_pcm_volumiofifo_record_transfer,
+	.stop = snd_pcm_volumiofifo_record_stop,
+	.pointer = snd_pcm_volumiofifo_record_pointer,
+	.hw_free = snd_pcm_volumiofifo_record_free,
+	.close = snd_pcm_volumiofifo_close,
+	.poll_descriptors_count = snd_pcm_volumiofifo_record_poll_descriptors_count,
+	.poll_descriptors = snd_pcm_volumiofifo_record_poll_descriptors,
+	.poll_revents = snd_pcm_volumiofifo_record_poll_revents,
+	.pause = snd_pcm_volumiofifo_record_pause,
+	.delay = snd_pcm_volumiofifo_record_delay,
+};
+
+static int _snd_pcm_volumiofifo_parse_channel(const char *id, long *channel) {
+	char *end;
+
+	errno = 0;
+	*channel = strtol(id, &end, 10);
+	if(errno != 0 || end == id || *end != '\0' || *channel < 0 || *channel >= VOLUMIOFIFO_MAX_CHANNELS)
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * Parse a route plugin style ttable, e.g. ttable.0.1 0.5 mixes half of
+ * client channel 0 into fifo channel 1
+ */
+static int _snd_pcm_volumiofifo_parse_ttable(snd_config_t *ttable, volumiofifo_dsp_t *dsp) {
+	snd_config_iterator_t i, next;
+	unsigned int in_channels = 0, out_channels = 0;
+
+	snd_config_for_each(i, next, ttable) {
+		snd_config_t *in = snd_config_iterator_entry(i);
+		snd_config_iterator_t j, jnext;
+		const char *id;
+		long cchannel;
+
+		if (snd_config_get_id(in, &id) < 0)
+			continue;
+		if (_snd_pcm_volumiofifo_parse_channel(id, &cchannel) < 0) {
+			SNDERR("Invalid client channel in ttable: %s", id);
+			return -EINVAL;
+		}
+		if (snd_config_get_type(in) != SND_CONFIG_TYPE_COMPOUND) {
+			SNDERR("Invalid type for ttable.%s", id);
+			return -EINVAL;
+		}
+		if (cchannel + 1 > in_channels)
+			in_channels = cchannel + 1;
+
+		snd_config_for_each(j, jnext, in) {
+			snd_config_t *out = snd_config_iterator_entry(j);
+			long fchannel;
+			double value;
+
+			if (snd_config_get_id(out, &id) < 0)
+				continue;
+			if (_snd_pcm_volumiofifo_parse_channel(id, &fchannel) < 0) {
+				SNDERR("Invalid fifo channel in ttable: %s", id);
+				return -EINVAL;
+			}
+			if (snd_config_get_ireal(out, &value) < 0) {
+				SNDERR("Invalid value for ttable.%ld.%s", cchannel, id);
+				return -EINVAL;
+			}
+			if (fchannel + 1 > out_channels)
+				out_channels = fchannel + 1;
+
+			dsp->matrix[fchannel][cchannel] = value;
+		}
+	}
+
+	if(in_channels == 0 || out_channels == 0) {
+		SNDERR("The ttable must route at least one channel");
+		return -EINVAL;
+	}
+
+	dsp->in_channels = in_channels;
+	if(dsp->out_channels < out_channels)
+		dsp->out_channels = out_channels;
+	dsp->matrix_enabled = 1;
+
+	return 0;
+}
+
+/* What the reader of the fifo accepts, a count of 0 meaning anything */
+typedef struct volumiofifo_caps {
+	unsigned int formats[64];
+	int format_count;
+	unsigned int rates[64];
+	int rate_count;
+	unsigned int channels[VOLUMIOFIFO_MAX_CHANNELS];
+	int channel_count;
+} volumiofifo_caps_t;
+
+/**
+ * Read the caps file that the reader publishes next to the fifo. Each line
+ * is a key followed by its values, e.g. "rates 44100 48000", and lines
+ * starting with # are ignored. The keys are formats, rates and channels.
+ *
+ * Returns 0, -ENOENT if the reader has not published a file, or -EINVAL
+ */
+static int _snd_pcm_volumiofifo_read_caps(const char *path, volumiofifo_caps_t *caps) {
+	FILE *file;
+	char *line = NULL;
+	size_t line_size = 0;
+	int err = 0;
+
+	memset(caps, 0, sizeof(*caps));
+
+	file = fopen(path, "re");
+	if(file == NULL) {
+		return -errno;
+	}
+
+	while(err == 0 && getline(&line, &line_size, file) >= 0) {
+		char *save = NULL;
+		char *key = strtok_r(line, " \t\r\n", &save);
+		char *value, *end;
+
+		if(key == NULL || key[0] == '#')
+			continue;
+
+		while(err == 0 && (value = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if(strcmp(key, "formats") == 0) {
+				snd_pcm_format_t format = snd_pcm_format_value(value);
+				if(format == SND_PCM_FORMAT_UNKNOWN || caps->format_count == 64) {
+					SNDERR("The reader caps %s list an invalid or excess format %s", path, value);
+					err = -EINVAL;
+				} else {
+					caps->formats[caps->format_count++] = format;
+				}
+			} else if(strcmp(key, "rates") == 0) {
+				long rate = strtol(value, &end, 10);
+				if(*end != '\0' || rate < 8000 || rate > 384000 || caps->rate_count == 64) {
+					SNDERR("The reader caps %s list an invalid or excess rate %s", path, value);
+					err = -EINVAL;
+				} else {
+					caps->rates[caps->rate_count++] = rate;
+				}
+			} else if(strcmp(key, "channels") == 0) {
+				long channels = strtol(value, &end, 10);
+				if(*end != '\0' || channels < 1 || channels > VOLUMIOFIFO_MAX_CHANNELS ||
+						caps->channel_count == VOLUMIOFIFO_MAX_CHANNELS) {
+					SNDERR("The reader caps %s list an invalid or excess channel count %s", path, value);
+					err = -EINVAL;
+				} else {
+					caps->channels[caps->channel_count++] = channels;
+				}
+			} else {
+				SNDERR("The reader caps %s have an unknown key %s", path, key);
+				err = -EINVAL;
+			}
+		}
+	}
+
+	free(line);
+	fclose(file);
+
+	return err;
+}
+
+SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
+{
+	snd_config_iterator_t i, next;
+	const char *fifo_name = 0;
+	unsigned int formats[64];
+	int format_count = 0, format_append = 0, clear_on_drop = 1;
+	long debug = 0, debug_rate = 500, lead_in_frames = 0, fifo_channels = 0, volume_ramp_ms = 20;
+	int volume = 0, dither = 0, noise_shaping = 0, dop = 0, dsd_to_pcm = 0, meter = 0;
+	long meter_period_ms = 50;
+	int tap = 0;
+	long standby_ms = 0, standby_wakeup_ms = 100;
+	int mix = 0, loopback = 0, framed = 0, timestamps = 0, control = 0, reader_caps = 0, stats = 0;
+	long flight_events = 2048, drain_timeout_ms = 3000;
+	const char *flight_dir = "/tmp";
+	const char *record_dir = NULL;
+	volumiofifo_caps_t caps = { .format_count = 0 };
+	long loopback_frames = 16384;
+	unsigned int loop_format = 0, loop_rate = 0, loop_channels = 0;
+	int loop_fixed = 0;
+	long mix_rate = 44100, mix_channels = 2, mix_frames = 4096;
+	snd_pcm_format_t mix_format = SND_PCM_FORMAT_S16;
+	long tap_channels = 2, tap_decimation = 1, tap_frames = 16384;
+	long dsd_pcm_rate = 88200;
+	snd_pcm_format_t output_format = SND_PCM_FORMAT_UNKNOWN, dop_format = SND_PCM_FORMAT_S32_LE;
+	snd_config_t *ttable = NULL;
+	int err;
+	snd_pcm_volumiofifo_t *volumio = NULL;
+
+	const snd_pcm_access_t access_list[] = {
+		SND_PCM_ACCESS_RW_INTERLEAVED,
+		SND_PCM_ACCESS_MMAP_INTERLEAVED
+	};
+
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *n = snd_config_iterator_entry(i);
+		const char *id;
+		const char *tmp;
+		if (snd_config_get_id(n, &id) < 0)
+			continue;
+		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
+			continue;
+		if (strcmp(id, "debug") == 0) {
+			if (snd_config_get_integer(n, &debug) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "debug_rate") == 0) {
+			if (snd_config_get_integer(n, &debug_rate) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(debug_rate < 0) {
+				SNDERR("Debug rate must be >= 0 lines per second");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "fifo") == 0) {
+			if (snd_config_get_string(n, &fifo_name) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "format_append") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				format_append = 1;
+			}
+			continue;
+		}
+		if (strcmp(id, "output_format") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			output_format = snd_pcm_format_value(tmp);
+			if(output_format == SND_PCM_FORMAT_UNKNOWN ||
+					(snd_pcm_format_linear(output_format) != 1 && snd_pcm_format_float(output_format) != 1)) {
+				SNDERR("The value %s for key %s is not a linear or floating point format", tmp, id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "dop") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				dop = 1;
+			} else {
+				dop = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "dop_format") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			dop_format = snd_pcm_format_value(tmp);
+			if(dop_format != SND_PCM_FORMAT_S24_3LE && dop_format != SND_PCM_FORMAT_S24_3BE &&
+					dop_format != SND_PCM_FORMAT_S32_LE && dop_format != SND_PCM_FORMAT_S32_BE) {
+				SNDERR("The value %s for key %s must be S24_3LE, S24_3BE, S32_LE or S32_BE", tmp, id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "dsd_to_pcm") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				dsd_to_pcm = 1;
+			} else {
+				dsd_to_pcm = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "dsd_pcm_rate") == 0) {
+			if (snd_config_get_integer(n, &dsd_pcm_rate) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(dsd_pcm_rate != 88200 && dsd_pcm_rate != 176400) {
+				SNDERR("DSD PCM rate must be 88200 or 176400");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "dither") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				dither = 1;
+			} else {
+				dither = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "noise_shaping") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				noise_shaping = 1;
+			} else {
+				noise_shaping = 0;
+			}
+			continue;
+		}
+		if (strncmp(id, "format_", 7) == 0) {
+			format_count++;
+			if(format_count > 63) {
+				SNDERR("Too many formats declared");
+				err = -EINVAL;
+				goto error;
+			}
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+
+			formats[format_count - 1] = snd_pcm_format_value(tmp);
+			if(formats[format_count -1] == SND_PCM_FORMAT_UNKNOWN) {
+				SNDERR("The value %s for key %s is not a valid format", tmp, id);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "clear_on_drop") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				clear_on_drop = 1;
+			} else {
+				clear_on_drop = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "lead_in_frames") == 0) {
+			if (snd_config_get_integer(n, &lead_in_frames) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(lead_in_frames < 0 || lead_in_frames > 16384) {
+				SNDERR("Lead in frames must be >= 0 and <= 16384");
+			}
+			continue;
+		}
+		if (strcmp(id, "ttable") == 0) {
+			if (snd_config_get_type(n) != SND_CONFIG_TYPE_COMPOUND) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			ttable = n;
+			continue;
+		}
+		if (strcmp(id, "fifo_channels") == 0) {
+			if (snd_config_get_integer(n, &fifo_channels) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(fifo_channels < 1 || fifo_channels > VOLUMIOFIFO_MAX_CHANNELS) {
+				SNDERR("Fifo channels must be >= 1 and <= %d", VOLUMIOFIFO_MAX_CHANNELS);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "volume") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				volume = 1;
+			} else {
+				volume = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "volume_ramp_ms") == 0) {
+			if (snd_config_get_integer(n, &volume_ramp_ms) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(volume_ramp_ms < 0 || volume_ramp_ms > 1000) {
+				SNDERR("Volume ramp must be >= 0 and <= 1000 ms");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "meter") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				meter = 1;
+			} else {
+				meter = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "meter_period_ms") == 0) {
+			if (snd_config_get_integer(n, &meter_period_ms) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(meter_period_ms < 10 || meter_period_ms > 1000) {
+				SNDERR("Meter period must be >= 10 and <= 1000 ms");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "tap") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				tap = 1;
+			} else {
+				tap = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "tap_channels") == 0) {
+			if (snd_config_get_integer(n, &tap_channels) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(tap_channels < 1 || tap_channels > 2) {
+				SNDERR("Tap channels must be 1 or 2");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "tap_decimation") == 0) {
+			if (snd_config_get_integer(n, &tap_decimation) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(tap_decimation < 1 || tap_decimation > 16) {
+				SNDERR("Tap decimation must be >= 1 and <= 16");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "tap_frames") == 0) {
+			if (snd_config_get_integer(n, &tap_frames) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(tap_frames < 1024 || tap_frames > 1048576 || (tap_frames & (tap_frames - 1)) != 0) {
+				SNDERR("Tap frames must be a power of two >= 1024 and <= 1048576");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "standby_ms") == 0) {
+			if (snd_config_get_integer(n, &standby_ms) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(standby_ms < 0 || standby_ms > 3600000) {
+				SNDERR("Standby must be >= 0 and <= 3600000 ms");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "standby_wakeup_ms") == 0) {
+			if (snd_config_get_integer(n, &standby_wakeup_ms) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(standby_wakeup_ms < 10 || standby_wakeup_ms > 1000) {
+				SNDERR("Standby wakeup must be >= 10 and <= 1000 ms");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "mix") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				mix = 1;
+			} else {
+				mix = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "mix_format") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			mix_format = snd_pcm_format_value(tmp);
+			// The mixer sums native endian samples
+			if(mix_format != SND_PCM_FORMAT_S16 && mix_format != SND_PCM_FORMAT_S32) {
+				SNDERR("Mix format must be native endian S16 or S32, not %s", tmp);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "mix_rate") == 0) {
+			if (snd_config_get_integer(n, &mix_rate) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(mix_rate < 8000 || mix_rate > 384000) {
+				SNDERR("Mix rate must be >= 8000 and <= 384000");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "mix_channels") == 0) {
+			if (snd_config_get_integer(n, &mix_channels) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(mix_channels < 1 || mix_channels > VOLUMIOFIFO_MAX_CHANNELS) {
+				SNDERR("Mix channels must be >= 1 and <= %d", VOLUMIOFIFO_MAX_CHANNELS);
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "mix_frames") == 0) {
+			if (snd_config_get_integer(n, &mix_frames) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(mix_frames < 1024 || mix_frames > 65536 || (mix_frames & (mix_frames - 1)) != 0) {
+				SNDERR("Mix frames must be a power of two >= 1024 and <= 65536");
+				err = -EINVAL;
+				goto error;
+			}
+			continue;
+		}
+		if (strcmp(id, "framed") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				framed = 1;
+			} else {
+				framed = 0;
+			}
 			continue;
-		if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0)
+		}
+		if (strcmp(id, "stats") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(strcmp(tmp, "true") == 0) {
+				stats = 1;
+			} else {
+				stats = 0;
+			}
 			continue;
-		if (strcmp(id, "debug") == 0) {
-			if (snd_config_get_integer(n, &debug) < 0) {
+		}
+		if (strcmp(id, "flight_recorder") == 0) {
+			if (snd_config_get_integer(n, &flight_events) < 0) {
 				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
+			if(flight_events < 0 || flight_events > 65536) {
+				SNDERR("Flight recorder must be >= 0 and <= 65536 events");
+				err = -EINVAL;
+				goto error;
+			}
 			continue;
 		}
-		if (strcmp(id, "fifo") == 0) {
-			if (snd_config_get_string(n, &fifo_name) < 0) {
+		if (strcmp(id, "flight_recorder_dir") == 0) {
+			if (snd_config_get_string(n, &flight_dir) < 0) {
 				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
 			continue;
 		}
-		if (strcmp(id, "format_append") == 0) {
-			if (snd_config_get_string(n, &tmp) < 0) {
+		if (strcmp(id, "drain_timeout_ms") == 0) {
+			if (snd_config_get_integer(n, &drain_timeout_ms) < 0) {
 				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
-			if(strcmp(tmp, "true") == 0) {
-				format_append = 1;
+			if(drain_timeout_ms < 0 || drain_timeout_ms > 600000) {
+				SNDERR("Drain timeout must be >= 0 and <= 600000 ms");
+				err = -EINVAL;
+				goto error;
 			}
 			continue;
 		}
-		if (strncmp(id, "format_", 7) == 0) {
-			format_count++;
-			if(format_count > 63) {
-				SNDERR("Too many formats declared");
+		if (strcmp(id, "record_dir") == 0) {
+			if (snd_config_get_string(n, &record_dir) < 0) {
+				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
+			continue;
+		}
+		if (strcmp(id, "reader_caps") == 0) {
 			if (snd_config_get_string(n, &tmp) < 0) {
 				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
-
-			formats[format_count - 1] = snd_pcm_format_value(tmp);
-			if(formats[format_count -1] == SND_PCM_FORMAT_UNKNOWN) {
-				SNDERR("The value %s for key %s is not a valid format", tmp, id);
+			if(strcmp(tmp, "true") == 0) {
+				reader_caps = 1;
+			} else {
+				reader_caps = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "control") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
+				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
+			if(strcmp(tmp, "true") == 0) {
+				control = 1;
+			} else {
+				control = 0;
+			}
 			continue;
 		}
-		if (strcmp(id, "clear_on_drop") == 0) {
+		if (strcmp(id, "timestamps") == 0) {
 			if (snd_config_get_string(n, &tmp) < 0) {
 				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
 			if(strcmp(tmp, "true") == 0) {
-				clear_on_drop = 1;
+				timestamps = 1;
 			} else {
-				clear_on_drop = 0;
+				timestamps = 0;
 			}
 			continue;
 		}
-		if (strcmp(id, "lead_in_frames") == 0) {
-			if (snd_config_get_integer(n, &lead_in_frames) < 0) {
+		if (strcmp(id, "loopback") == 0) {
+			if (snd_config_get_string(n, &tmp) < 0) {
 				SNDERR("Invalid type for %s", id);
 				err = -EINVAL;
 				goto error;
 			}
-			if(lead_in_frames < 0 || lead_in_frames > 16384) {
-				SNDERR("Lead in frames must be >= 0 and <= 16384");
+			if(strcmp(tmp, "true") == 0) {
+				loopback = 1;
+			} else {
+				loopback = 0;
+			}
+			continue;
+		}
+		if (strcmp(id, "loopback_frames") == 0) {
+			if (snd_config_get_integer(n, &loopback_frames) < 0) {
+				SNDERR("Invalid type for %s", id);
+				err = -EINVAL;
+				goto error;
+			}
+			if(loopback_frames < 1024 || loopback_frames > 1048576 ||
+					(loopback_frames & (loopback_frames - 1)) != 0) {
+				SNDERR("Loopback frames must be a power of two >= 1024 and <= 1048576");
+				err = -EINVAL;
+				goto error;
 			}
 			continue;
 		}
@@ -677,6 +3095,65 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 		goto error;
 	}
 
+	if(fifo_channels > 0 && !ttable) {
+		SNDERR("Setting fifo_channels requires a ttable");
+		err = -EINVAL;
+		goto error;
+	}
+
+	// Timestamps travel in the packets of a framed fifo
+	framed = framed || timestamps;
+
+	if(stream == SND_PCM_STREAM_CAPTURE && (ttable || volume || dop || dsd_to_pcm || meter || tap || mix ||
+			framed || control || reader_caps || stats || record_dir || standby_ms > 0 ||
+			output_format != SND_PCM_FORMAT_UNKNOWN)) {
+		SNDERR("Capture reads the fifo as it is, processing options are playback only");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if(loopback && mix) {
+		SNDERR("A loopback has no fifo to mix into");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if(framed && (mix || loopback)) {
+		SNDERR("Only a fifo written by a single PCM can be framed");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if(control && (mix || loopback)) {
+		SNDERR("Only a fifo written by a single PCM can have a control socket");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if(reader_caps && (mix || loopback || ttable || dop || dsd_to_pcm || output_format != SND_PCM_FORMAT_UNKNOWN)) {
+		SNDERR("Reader caps can only be used when the client format is written to the fifo unchanged");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if(mix && (dop || dsd_to_pcm || output_format != SND_PCM_FORMAT_UNKNOWN)) {
+		SNDERR("Mixing clients must send the mix format, so dop, dsd_to_pcm and output_format cannot be used");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if(dop && dsd_to_pcm) {
+		SNDERR("DSD can be converted to DoP or to PCM, but not both");
+		err = -EINVAL;
+		goto error;
+	}
+
+	if((dither || noise_shaping) && output_format == SND_PCM_FORMAT_UNKNOWN) {
+		SNDERR("Dither requires an output_format");
+		err = -EINVAL;
+		goto error;
+	}
+
 	if(format_count == 0 || format_append) {
 		if(format_count > 25) {
 			SNDERR("Too many sound formats specified");
@@ -721,6 +3198,52 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 
 	}
 
+	if(mix) {
+		// Clients are held to the mix format, as with dmix
+		formats[0] = mix_format;
+		format_count = 1;
+	}
+
+	if(reader_caps) {
+		char caps_name[PATH_MAX];
+
+		if(snprintf(caps_name, sizeof(caps_name), "%s.caps", fifo_name) >= (int) sizeof(caps_name)) {
+			SNDERR("The fifo name %s is too long for reader caps", fifo_name);
+			err = -EINVAL;
+			goto error;
+		}
+
+		err = _snd_pcm_volumiofifo_read_caps(caps_name, &caps);
+		if(err == -ENOENT) {
+			// The reader may not have started yet, so offer everything
+			if(debug)
+				SNDERR("No reader caps at %s, using the configured formats", caps_name);
+			err = 0;
+		} else if(err < 0) {
+			goto error;
+		}
+
+		if(caps.format_count > 0) {
+			int f, c, kept = 0;
+
+			// Only offer the configured formats that the reader accepts
+			for(f = 0; f < format_count; f++) {
+				for(c = 0; c < caps.format_count; c++) {
+					if(formats[f] == caps.formats[c]) {
+						formats[kept++] = formats[f];
+						break;
+					}
+				}
+			}
+			if(kept == 0) {
+				SNDERR("The reader of fifo %s accepts none of the configured formats", fifo_name);
+				err = -EINVAL;
+				goto error;
+			}
+			format_count = kept;
+		}
+	}
+
 	volumio = calloc(1, sizeof(*volumio));
 	if (! volumio) {
 		SNDERR("cannot allocate");
@@ -731,14 +3254,45 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 	// Inputs
 	volumio->fifo_name = NULL;
 	volumio->debug = debug <= 0 ? 0 : debug >= 127 ? 127 : debug;
+
+	if(volumio->debug) {
+		volumio->log = calloc(1, sizeof(*volumio->log));
+		if (volumio->log == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		err = _snd_pcm_volumiofifo_log_open(volumio->log, debug_rate, _snd_pcm_volumiofifo_log_emit);
+		if (err < 0) {
+			SNDERR("Failed to start the debug log, error %d", err);
+			free(volumio->log);
+			volumio->log = NULL;
+			goto error;
+		}
+	}
 	volumio->clear_on_drop = clear_on_drop;
 	volumio->lead_in_frames = lead_in_frames;
+	volumio->volume_ramp_ms = volume_ramp_ms;
+	volumio->output_format = output_format;
+	volumio->dop = dop;
+	volumio->dop_format = dop_format;
+	volumio->dsd_pcm_rate = dsd_to_pcm ? dsd_pcm_rate : 0;
+	volumio->meter_period_ms = meter_period_ms;
+	volumio->standby_ms = standby_ms;
+	volumio->mix_format = mix_format;
+	volumio->mix_rate = mix_rate;
+	volumio->mix_channels = mix_channels;
+	volumio->standby_wakeup_ms = standby_wakeup_ms;
+	volumio->framed = framed;
+	volumio->timestamps = timestamps;
 
 	// Generated
 	volumio->fifo_out_fd = -1;
 	volumio->fifo_in_fd = -1;
 	volumio->timer_fd = -1;
+	volumio->tap_fd = -1;
 	volumio->drained = 0;
+	volumio->fifo_frame_bytes = 1;
 
 	volumio->fifo_name = strdup(fifo_name);
 	if (volumio->fifo_name == NULL) {
@@ -747,20 +3301,40 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 		goto error;
 	}
 
-	volumio->fifo_in_fd = open(volumio->fifo_name, O_NONBLOCK | O_RDONLY | O_CLOEXEC);
+	if(loopback) {
+		// The fifo path only names the shared memory, no fifo is opened
+		volumio->loop = calloc(1, sizeof(*volumio->loop));
+		if (volumio->loop == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		err = _snd_pcm_volumiofifo_loop_open(volumio->loop, volumio->fifo_name,
+				stream == SND_PCM_STREAM_CAPTURE ? VOLUMIOFIFO_LOOP_CAPTURE : VOLUMIOFIFO_LOOP_PLAYBACK,
+				loopback_frames);
+		if (err < 0) {
+			SNDERR("Failed to open the %s end of loopback %s, error %d",
+					snd_pcm_stream_name(stream), volumio->fifo_name, err);
+			free(volumio->loop);
+			volumio->loop = NULL;
+			goto error;
+		}
+	} else {
+		volumio->fifo_in_fd = open(volumio->fifo_name, O_NONBLOCK | O_RDONLY | O_CLOEXEC);
 
-	if(volumio->fifo_in_fd < 0) {
-		SNDERR("Failed to open output fifo %s", volumio->fifo_name);
-		err = -errno;
-		goto error;
-	}
+		if(volumio->fifo_in_fd < 0) {
+			SNDERR("Failed to open output fifo %s", volumio->fifo_name);
+			err = -errno;
+			goto error;
+		}
 
-	volumio->fifo_out_fd = open(volumio->fifo_name, O_NONBLOCK | O_WRONLY | O_CLOEXEC);
+		volumio->fifo_out_fd = open(volumio->fifo_name, O_NONBLOCK | O_WRONLY | O_CLOEXEC);
 
-	if(volumio->fifo_out_fd < 0) {
-		SNDERR("Failed to open output fifo %s", volumio->fifo_name);
-		err = -errno;
-		goto error;
+		if(volumio->fifo_out_fd < 0) {
+			SNDERR("Failed to open output fifo %s", volumio->fifo_name);
+			err = -errno;
+			goto error;
+		}
 	}
 
 	volumio->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
@@ -771,9 +3345,259 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 		goto error;
 	}
 
+	if(ttable || volume || dop || dsd_to_pcm || output_format != SND_PCM_FORMAT_UNKNOWN) {
+		volumio->dsp = calloc(1, sizeof(*volumio->dsp));
+		volumio->out_buf = malloc(PIPE_BUF);
+		if (volumio->dsp == NULL || volumio->out_buf == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		volumio->dsp->gain = 1.0f;
+		volumio->dsp->gain_target = 1.0f;
+		// Noise shaping only makes sense on top of dither
+		volumio->dsp->dither = dither || noise_shaping;
+		volumio->dsp->noise_shaping = noise_shaping;
+	}
+
+	if(ttable) {
+		volumio->dsp->out_channels = fifo_channels;
+		err = _snd_pcm_volumiofifo_parse_ttable(ttable, volumio->dsp);
+		if (err < 0)
+			goto error;
+	}
+
+	if(volume) {
+		char shm_name[NAME_MAX];
+
+		err = _snd_pcm_volumiofifo_shm_name(volumio->fifo_name, "volume", shm_name, sizeof(shm_name));
+		if (err < 0) {
+			SNDERR("The fifo name %s is too long for a volume control", volumio->fifo_name);
+			goto error;
+		}
+		volumio->volume = _snd_pcm_volumiofifo_shm_map(shm_name, sizeof(*volumio->volume), 1);
+		if (volumio->volume == NULL) {
+			SNDERR("Failed to map the volume control %s", shm_name);
+			err = -errno;
+			goto error;
+		}
+		volumio->dsp->gain_enabled = 1;
+	}
+
+	if(meter) {
+		char shm_name[NAME_MAX];
+
+		err = _snd_pcm_volumiofifo_shm_name(volumio->fifo_name, "meter", shm_name, sizeof(shm_name));
+		if (err < 0) {
+			SNDERR("The fifo name %s is too long for a level meter", volumio->fifo_name);
+			goto error;
+		}
+		volumio->meter = calloc(1, sizeof(*volumio->meter));
+		if (volumio->meter == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		volumio->meter_page = _snd_pcm_volumiofifo_shm_map(shm_name, sizeof(*volumio->meter_page), 1);
+		if (volumio->meter_page == NULL) {
+			SNDERR("Failed to map the level meter %s", shm_name);
+			err = -errno;
+			goto error;
+		}
+		volumio->meter_page->magic = VOLUMIOFIFO_METER_MAGIC;
+		volumio->meter_page->version = VOLUMIOFIFO_METER_VERSION;
+		// Meter straight away in case a reader is already waiting
+		volumio->meter_heartbeat = volumio->meter_page->heartbeat;
+		volumio->meter_active = 1;
+	}
+
+	if(tap) {
+		char shm_name[NAME_MAX];
+
+		err = _snd_pcm_volumiofifo_shm_name(volumio->fifo_name, "tap", shm_name, sizeof(shm_name));
+		if (err < 0) {
+			SNDERR("The fifo name %s is too long for a visualizer tap", volumio->fifo_name);
+			goto error;
+		}
+		volumio->tap = calloc(1, sizeof(*volumio->tap));
+		if (volumio->tap == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		volumio->tap->out_channels = tap_channels;
+		volumio->tap->decimation = tap_decimation;
+		volumio->tap_frames = tap_frames;
+		volumio->tap_channels = tap_channels;
+		volumio->tap_page_size = sizeof(*volumio->tap_page) + tap_frames * tap_channels * sizeof(int16_t);
+		volumio->tap_page = _snd_pcm_volumiofifo_shm_map_fd(shm_name, volumio->tap_page_size, 1,
+				&volumio->tap_fd);
+		if (volumio->tap_page == NULL) {
+			SNDERR("Failed to map the visualizer tap %s", shm_name);
+			err = -errno;
+			goto error;
+		}
+		// The lock goes with the descriptor, so a writer that died leaves the page free
+		if (flock(volumio->tap_fd, LOCK_EX | LOCK_NB) < 0) {
+			SNDERR("The visualizer tap %s is already being written", shm_name);
+			err = -EBUSY;
+			goto error;
+		}
+		// Readers size their copy from the header, so a page they may be reading is never redescribed
+		volumiofifo_tap_page_t *page = volumio->tap_page;
+		if (page->magic == 0) {
+			page->version = VOLUMIOFIFO_TAP_VERSION;
+			page->channels = tap_channels;
+			page->frames = tap_frames;
+			__atomic_store_n(&page->magic, VOLUMIOFIFO_TAP_MAGIC, __ATOMIC_RELEASE);
+		} else if (page->magic != VOLUMIOFIFO_TAP_MAGIC || page->version != VOLUMIOFIFO_TAP_VERSION ||
+				page->channels != (uint32_t) tap_channels || page->frames != (uint32_t) tap_frames) {
+			SNDERR("The visualizer tap %s already has a different layout", shm_name);
+			err = -EBUSY;
+			goto error;
+		}
+		volumio->tap_page->rate = 0;
+		__atomic_store_n(&volumio->tap_page->write_start, volumio->tap_page->write_end, __ATOMIC_RELEASE);
+		volumio->tap_heartbeat = volumio->tap_page->heartbeat;
+	}
+
+	// Several PCMs in one process may use the same fifo, so number the files each one keeps
+	static unsigned int instances;
+	unsigned int instance = __atomic_fetch_add(&instances, 1, __ATOMIC_RELAXED);
+
+	if(stats) {
+		char suffix[32];
+		char shm_name[NAME_MAX];
+
+		snprintf(suffix, sizeof(suffix), "stats.%d.%u", (int) getpid(), instance);
+		err = _snd_pcm_volumiofifo_shm_name(volumio->fifo_name, suffix, shm_name, sizeof(shm_name));
+		if (err < 0) {
+			SNDERR("The fifo name %s is too long for statistics", volumio->fifo_name);
+			goto error;
+		}
+		volumio->stats_name = strdup(shm_name);
+		if (volumio->stats_name == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		volumio->stats = _snd_pcm_volumiofifo_shm_map(shm_name, sizeof(*volumio->stats), 1);
+		if (volumio->stats == NULL) {
+			SNDERR("Failed to map the statistics %s", shm_name);
+			err = -errno;
+			goto error;
+		}
+		volumio->stats->magic = VOLUMIOFIFO_STATS_MAGIC;
+		volumio->stats->version = VOLUMIOFIFO_STATS_VERSION;
+		volumio->stats->pid = getpid();
+		volumio->stats->state = SND_PCM_STATE_OPEN;
+		strncpy(volumio->stats->fifo, volumio->fifo_name, sizeof(volumio->stats->fifo) - 1);
+		if(volumio->fifo_in_fd >= 0) {
+			int size = fcntl(volumio->fifo_in_fd, F_GETPIPE_SZ);
+			volumio->stats->fifo_size = size > 0 ? size : 0;
+		}
+	}
+
+	if(flight_events > 0 && stream == SND_PCM_STREAM_PLAYBACK) {
+		char suffix[32];
+		char name[NAME_MAX];
+
+		snprintf(suffix, sizeof(suffix), "flight.%d.%u", (int) getpid(), instance);
+		err = _snd_pcm_volumiofifo_shm_name(volumio->fifo_name, suffix, name, sizeof(name));
+		if (err < 0) {
+			SNDERR("The fifo name %s is too long for a flight recorder", volumio->fifo_name);
+			goto error;
+		}
+		volumio->flight = calloc(1, sizeof(*volumio->flight));
+		if (volumio->flight == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		// The name starts with a slash
+		err = _snd_pcm_volumiofifo_flight_open(volumio->flight, flight_events, flight_dir, name + 1,
+				_snd_pcm_volumiofifo_state_name, _snd_pcm_volumiofifo_flight_report);
+		if (err < 0) {
+			SNDERR("Failed to start the flight recorder in %s, error %d", flight_dir, err);
+			free(volumio->flight);
+			volumio->flight = NULL;
+			goto error;
+		}
+		volumio->drain_timeout_ms = drain_timeout_ms;
+	}
+
+	if(record_dir) {
+		char suffix[32];
+		char name[NAME_MAX];
+		int fifo_size = 0;
+
+		snprintf(suffix, sizeof(suffix), "session.%d.%u", (int) getpid(), instance);
+		err = _snd_pcm_volumiofifo_shm_name(volumio->fifo_name, suffix, name, sizeof(name));
+		if (err < 0) {
+			SNDERR("The fifo name %s is too long for a session recording", volumio->fifo_name);
+			goto error;
+		}
+		volumio->session = calloc(1, sizeof(*volumio->session));
+		if (volumio->session == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		if(volumio->fifo_in_fd >= 0) {
+			fifo_size = fcntl(volumio->fifo_in_fd, F_GETPIPE_SZ);
+		}
+		// The name starts with a slash
+		err = _snd_pcm_volumiofifo_session_open(volumio->session, record_dir, name + 1,
+				fifo_size > 0 ? fifo_size : 0);
+		if (err < 0) {
+			SNDERR("Failed to create the session recording %s in %s, error %d", name + 1, record_dir, err);
+			free(volumio->session);
+			volumio->session = NULL;
+			goto error;
+		}
+	}
+
+	if(control) {
+		volumio->control = calloc(1, sizeof(*volumio->control));
+		if (volumio->control == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		err = _snd_pcm_volumiofifo_control_open(volumio->control, volumio->fifo_name);
+		if (err < 0) {
+			SNDERR("Failed to open the control socket for fifo %s, error %d", volumio->fifo_name, err);
+			free(volumio->control);
+			volumio->control = NULL;
+			goto error;
+		}
+	}
+
+	if(mix) {
+		volumio->mixer = calloc(1, sizeof(*volumio->mixer));
+		if (volumio->mixer == NULL) {
+			SNDERR("cannot allocate");
+			err = -ENOMEM;
+			goto error;
+		}
+		err = _snd_pcm_volumiofifo_mix_open(volumio->mixer, volumio->fifo_name, volumio->fifo_out_fd,
+				mix_format, snd_pcm_format_physical_width(mix_format) / 8, mix_rate, mix_channels, mix_frames);
+		if (err < 0) {
+			SNDERR("Failed to join the mixer for fifo %s, error %d", volumio->fifo_name, err);
+			free(volumio->mixer);
+			volumio->mixer = NULL;
+			goto error;
+		}
+	}
+
 	volumio->io.version = SND_PCM_IOPLUG_VERSION;
 	volumio->io.name = "Volumio ALSA Fifo Plugin";
-	volumio->io.callback = &volumiofifo_playback_callback;
+	if(stream == SND_PCM_STREAM_CAPTURE)
+		volumio->io.callback = &volumiofifo_capture_callback;
+	else if(volumio->session)
+		volumio->io.callback = volumio->control ? &volumiofifo_record_control_callback : &volumiofifo_record_callback;
+	else
+		volumio->io.callback = volumio->control ? &volumiofifo_control_callback : &volumiofifo_playback_callback;
 	volumio->io.private_data = volumio;
 	volumio->io.mmap_rw = 1;
 	volumio->io.flags = SND_PCM_IOPLUG_FLAG_BOUNDARY_WA;
@@ -782,16 +3606,52 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 	if (err < 0)
 		goto error;
 
+	// Like snd-aloop, a prepared other end fixes what this end can use
+	if(volumio->loop && volumio->dsp == NULL) {
+		loop_fixed = _snd_pcm_volumiofifo_loop_peer(volumio->loop, &loop_format, &loop_rate, &loop_channels);
+	}
+	if(loop_fixed) {
+		int f;
+		for(f = 0; f < format_count; f++) {
+			if(formats[f] == loop_format) {
+				formats[0] = loop_format;
+				format_count = 1;
+				break;
+			}
+		}
+	}
+
 	err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_PERIOD_BYTES, 512, 262144);
 	if (err < 0)
 		goto error;
 	err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_BUFFER_BYTES, 1024, 524288);
 	if (err < 0)
 		goto error;
-	err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_RATE, 8000, 384000);
+	if(volumio->mixer) {
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_RATE, mix_rate, mix_rate);
+	} else if(loop_fixed) {
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_RATE, loop_rate, loop_rate);
+	} else if(caps.rate_count > 0) {
+		err = snd_pcm_ioplug_set_param_list(&volumio->io, SND_PCM_IOPLUG_HW_RATE, caps.rate_count, caps.rates);
+	} else {
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_RATE, 8000, 384000);
+	}
 	if (err < 0)
 		goto error;
-	err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_CHANNELS, 1, 16);
+	if(volumio->dsp && volumio->dsp->matrix_enabled) {
+		// The matrix defines how many channels the client must send
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_CHANNELS,
+				volumio->dsp->in_channels, volumio->dsp->in_channels);
+	} else if(volumio->mixer) {
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_CHANNELS, mix_channels, mix_channels);
+	} else if(loop_fixed) {
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_CHANNELS, loop_channels, loop_channels);
+	} else if(caps.channel_count > 0) {
+		err = snd_pcm_ioplug_set_param_list(&volumio->io, SND_PCM_IOPLUG_HW_CHANNELS,
+				caps.channel_count, caps.channels);
+	} else {
+		err = snd_pcm_ioplug_set_param_minmax(&volumio->io, SND_PCM_IOPLUG_HW_CHANNELS, 1, VOLUMIOFIFO_MAX_CHANNELS);
+	}
 	if (err < 0)
 		goto error;
 
@@ -814,9 +3674,70 @@ SND_PCM_PLUGIN_DEFINE_FUNC(volumiofifo)
 			volumio->fifo_name = NULL;
 		}
 
+		if(volumio->mixer) {
+			_snd_pcm_volumiofifo_mix_close(volumio->mixer);
+			free(volumio->mixer);
+			volumio->mixer = NULL;
+		}
+
+		if(volumio->loop) {
+			_snd_pcm_volumiofifo_loop_close(volumio->loop);
+			free(volumio->loop);
+			volumio->loop = NULL;
+		}
+
+		if(volumio->control) {
+			_snd_pcm_volumiofifo_control_close(volumio->control);
+			free(volumio->control);
+			volumio->control = NULL;
+		}
+
+		if(volumio->log) {
+			_snd_pcm_volumiofifo_log_close(volumio->log);
+			free(volumio->log);
+			volumio->log = NULL;
+		}
+
+		_snd_pcm_volumiofifo_shm_unmap(volumio->stats, sizeof(*volumio->stats));
+		volumio->stats = NULL;
+		if(volumio->stats_name) {
+			shm_unlink(volumio->stats_name);
+			free(volumio->stats_name);
+			volumio->stats_name = NULL;
+		}
+
+		if(volumio->flight) {
+			_snd_pcm_volumiofifo_flight_close(volumio->flight);
+			free(volumio->flight);
+			volumio->flight = NULL;
+		}
+
+		if(volumio->session) {
+			_snd_pcm_volumiofifo_session_close(volumio->session);
+			free(volumio->session);
+			volumio->session = NULL;
+		}
+
 		snd_pcm_volumiofifo_close_fd(&volumio->fifo_out_fd);
 		snd_pcm_volumiofifo_close_fd(&volumio->fifo_in_fd);
 		snd_pcm_volumiofifo_close_fd(&volumio->timer_fd);
+		snd_pcm_volumiofifo_close_fd(&volumio->tap_fd);
+
+		_snd_pcm_volumiofifo_shm_unmap(volumio->volume, sizeof(*volumio->volume));
+		volumio->volume = NULL;
+		_snd_pcm_volumiofifo_shm_unmap(volumio->meter_page, sizeof(*volumio->meter_page));
+		volumio->meter_page = NULL;
+		_snd_pcm_volumiofifo_shm_unmap(volumio->tap_page, volumio->tap_page_size);
+		volumio->tap_page = NULL;
+
+		free(volumio->tap);
+		volumio->tap = NULL;
+		free(volumio->meter);
+		volumio->meter = NULL;
+		free(volumio->dsp);
+		volumio->dsp = NULL;
+		free(volumio->out_buf);
+		volumio->out_buf = NULL;
 
 		if(volumio->io.pcm)
 			snd_pcm_ioplug_delete(&volumio->io);
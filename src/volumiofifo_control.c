@@ -0,0 +1,105 @@
+/*
+ *  PCM - Volumio FIFO plugin - reader control socket
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "volumiofifo_control.h"
+
+static uint64_t _snd_pcm_volumiofifo_control_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int _snd_pcm_volumiofifo_control_open(volumiofifo_control_t *control, const char *fifo_name) {
+	sa_family_t family = AF_UNIX;
+	int len;
+
+	memset(control, 0, sizeof(*control));
+	control->fd = -1;
+
+	control->reader.sun_family = AF_UNIX;
+	len = snprintf(control->reader.sun_path, sizeof(control->reader.sun_path), "%s.ctl", fifo_name);
+	if(len < 0 || (size_t) len >= sizeof(control->reader.sun_path))
+		return -ENAMETOOLONG;
+	control->reader_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+	control->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(control->fd < 0)
+		return -errno;
+
+	// Binding just the family gets an abstract address that the reader can reply to
+	if(bind(control->fd, (struct sockaddr *) &family, sizeof(family)) < 0) {
+		int err = -errno;
+		_snd_pcm_volumiofifo_control_close(control);
+		return err;
+	}
+
+	return 0;
+}
+
+void _snd_pcm_volumiofifo_control_close(volumiofifo_control_t *control) {
+	if(control->fd >= 0) {
+		close(control->fd);
+		control->fd = -1;
+	}
+}
+
+void _snd_pcm_volumiofifo_control_send(volumiofifo_control_t *control, uint16_t type, uint64_t frame) {
+	volumiofifo_control_msg_t msg = {
+		.magic = VOLUMIOFIFO_CONTROL_MAGIC,
+		.version = VOLUMIOFIFO_CONTROL_VERSION,
+		.type = type,
+		.seq = control->seq++,
+		.frame = frame,
+		.time_ns = _snd_pcm_volumiofifo_control_now(),
+	};
+
+	sendto(control->fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL,
+			(struct sockaddr *) &control->reader, control->reader_len);
+}
+
+int _snd_pcm_volumiofifo_control_depth(volumiofifo_control_t *control, uint64_t max_age_ns, uint32_t *frames) {
+	volumiofifo_control_msg_t msg;
+	ssize_t got;
+
+	while((got = recv(control->fd, &msg, sizeof(msg), MSG_DONTWAIT)) >= 0) {
+		// Later versions may only append, so a longer message is truncated to what we know
+		if((size_t) got < sizeof(msg) || msg.magic != VOLUMIOFIFO_CONTROL_MAGIC)
+			continue;
+		if(msg.type == VOLUMIOFIFO_CONTROL_DEPTH) {
+			control->depth = msg.frames;
+			control->depth_time_ns = _snd_pcm_volumiofifo_control_now();
+		}
+	}
+
+	if(control->depth_time_ns == 0 ||
+			_snd_pcm_volumiofifo_control_now() - control->depth_time_ns > max_age_ns)
+		return 0;
+
+	*frames = control->depth;
+	return 1;
+}
@@ -0,0 +1,103 @@
+/*
+ *  PCM - Volumio FIFO plugin - reader control socket
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_CONTROL_H
+#define __VOLUMIOFIFO_CONTROL_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Messages exchanged with the reader of a fifo. The reader binds a Unix
+ * datagram socket at the fifo path with ".ctl" appended, and the plugin
+ * sends it events from an autobound socket, to which the reader replies.
+ * The same rules apply as for the shared memory pages: fields may only be
+ * appended and the version must be bumped whenever the meaning of a field
+ * changes. All fields are native endian.
+ */
+
+#define VOLUMIOFIFO_CONTROL_MAGIC 0x564c4f43 /* "VOLC" */
+#define VOLUMIOFIFO_CONTROL_VERSION 1
+
+/* Sent by the plugin. Everything written before frame should be discarded */
+#define VOLUMIOFIFO_CONTROL_FLUSH 1
+/* Sent by the plugin. Nothing more will be written until a resume */
+#define VOLUMIOFIFO_CONTROL_PAUSE 2
+#define VOLUMIOFIFO_CONTROL_RESUME 3
+/* Sent by the plugin. The stream ends at frame, after a drain */
+#define VOLUMIOFIFO_CONTROL_STOP 4
+/* Sent by the plugin. Only silence is played after frame, and nothing is written until an active */
+#define VOLUMIOFIFO_CONTROL_STANDBY 5
+#define VOLUMIOFIFO_CONTROL_ACTIVE 6
+/* Sent by the reader, giving the frames it holds but has not yet played */
+#define VOLUMIOFIFO_CONTROL_DEPTH 16
+
+typedef struct volumiofifo_control_msg {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	/* Counts the messages from each sender */
+	uint32_t seq;
+	/* The reader's depth in fifo frames, for a depth message */
+	uint32_t frames;
+	/* Frames written to the fifo when the event happened */
+	uint64_t frame;
+	/* CLOCK_MONOTONIC when the message was sent */
+	uint64_t time_ns;
+} volumiofifo_control_msg_t;
+
+typedef struct volumiofifo_control {
+	int fd;
+	struct sockaddr_un reader;
+	socklen_t reader_len;
+	uint32_t seq;
+
+	// The last depth reported by the reader, and when it arrived
+	uint32_t depth;
+	uint64_t depth_time_ns;
+} volumiofifo_control_t;
+
+/**
+ * Open the plugin end of the control socket for a fifo. The reader does
+ * not need to be listening yet.
+ *
+ * Returns 0 or -ve on error
+ */
+int _snd_pcm_volumiofifo_control_open(volumiofifo_control_t *control, const char *fifo_name);
+
+void _snd_pcm_volumiofifo_control_close(volumiofifo_control_t *control);
+
+/**
+ * Tell the reader about an event at a fifo frame. Messages are dropped if
+ * the reader is not listening or cannot keep up.
+ */
+void _snd_pcm_volumiofifo_control_send(volumiofifo_control_t *control, uint16_t type, uint64_t frame);
+
+/**
+ * Read any messages from the reader, then get the depth it last reported
+ * if that was within max_age_ns
+ *
+ * Returns 1 if a depth was found, otherwise 0
+ */
+int _snd_pcm_volumiofifo_control_depth(volumiofifo_control_t *control, uint64_t max_age_ns, uint32_t *frames);
+
+#endif
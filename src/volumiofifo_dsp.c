@@ -0,0 +1,1114 @@
+/*
+ *  PCM - Volumio FIFO plugin - sample processing
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "volumiofifo_dsp.h"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VOLUMIOFIFO_HOST_BIG_ENDIAN 0
+#else
+#define VOLUMIOFIFO_HOST_BIG_ENDIAN 1
+#endif
+
+static inline int _snd_pcm_volumiofifo_dsp_is_native(const volumiofifo_sample_layout_t *layout,
+		unsigned int phys_bytes, unsigned int width, int is_float) {
+	return layout->phys_bytes == phys_bytes && layout->width == width && layout->is_float == is_float
+			&& (is_float || layout->is_signed) && layout->big_endian == VOLUMIOFIFO_HOST_BIG_ENDIAN;
+}
+
+static inline uint64_t _snd_pcm_volumiofifo_dsp_read_raw(const volumiofifo_sample_layout_t *layout,
+		const unsigned char *p) {
+	uint64_t raw = 0;
+	unsigned int i;
+
+	for(i = 0; i < layout->phys_bytes; i++) {
+		unsigned int idx = layout->big_endian ? layout->phys_bytes - 1 - i : i;
+		raw |= ((uint64_t) p[idx]) << (8 * i);
+	}
+	return raw;
+}
+
+static inline void _snd_pcm_volumiofifo_dsp_write_raw(const volumiofifo_sample_layout_t *layout,
+		unsigned char *p, uint64_t raw) {
+	unsigned int i;
+
+	for(i = 0; i < layout->phys_bytes; i++) {
+		unsigned int idx = layout->big_endian ? layout->phys_bytes - 1 - i : i;
+		p[idx] = (raw >> (8 * i)) & 0xFF;
+	}
+}
+
+/**
+ * Read an integer sample as a signed value centred on zero
+ */
+static inline int64_t _snd_pcm_volumiofifo_dsp_read_int(const volumiofifo_sample_layout_t *layout,
+		const unsigned char *p) {
+	uint64_t raw = _snd_pcm_volumiofifo_dsp_read_raw(layout, p);
+	uint64_t half = 1ULL << (layout->width - 1);
+
+	raw &= (1ULL << layout->width) - 1;
+	if(layout->is_signed)
+		return (raw & half) ? (int64_t) raw - (int64_t) (half << 1) : (int64_t) raw;
+	return (int64_t) raw - (int64_t) half;
+}
+
+/**
+ * Write a signed value centred on zero as an integer sample, saturating
+ * anything out of range
+ */
+static inline void _snd_pcm_volumiofifo_dsp_write_int(const volumiofifo_sample_layout_t *layout,
+		unsigned char *p, int64_t val) {
+	int64_t half = 1LL << (layout->width - 1);
+
+	if(val >= half)
+		val = half - 1;
+	else if(val < -half)
+		val = -half;
+
+	if(!layout->is_signed)
+		val += half;
+
+	_snd_pcm_volumiofifo_dsp_write_raw(layout, p, ((uint64_t) val) & ((1ULL << layout->width) - 1));
+}
+
+static inline double _snd_pcm_volumiofifo_dsp_read_sample(const volumiofifo_sample_layout_t *layout,
+		const unsigned char *p) {
+	if(layout->is_float) {
+		uint64_t raw = _snd_pcm_volumiofifo_dsp_read_raw(layout, p);
+
+		if(layout->phys_bytes == 8) {
+			double d;
+			memcpy(&d, &raw, sizeof(d));
+			return d;
+		} else {
+			uint32_t bits = (uint32_t) raw;
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			return f;
+		}
+	}
+
+	return (double) _snd_pcm_volumiofifo_dsp_read_int(layout, p) / (double) (1ULL << (layout->width - 1));
+}
+
+static inline void _snd_pcm_volumiofifo_dsp_write_sample(const volumiofifo_sample_layout_t *layout,
+		unsigned char *p, double v) {
+	uint64_t raw;
+
+	if(layout->is_float) {
+		if(layout->phys_bytes == 8) {
+			memcpy(&raw, &v, sizeof(raw));
+		} else {
+			float f = (float) v;
+			uint32_t bits;
+			memcpy(&bits, &f, sizeof(bits));
+			raw = bits;
+		}
+		_snd_pcm_volumiofifo_dsp_write_raw(layout, p, raw);
+		return;
+	}
+
+	// Clamp first, a double too large for int64_t has no defined conversion
+	double half = (double) (1ULL << (layout->width - 1));
+	v *= half;
+	v = v > half ? half : v < -half ? -half : v;
+	_snd_pcm_volumiofifo_dsp_write_int(layout, p, llrint(v));
+}
+
+void _snd_pcm_volumiofifo_dsp_decode(const volumiofifo_sample_layout_t *layout, unsigned int channels,
+		const void *src, float planar[][VOLUMIOFIFO_DSP_BLOCK], unsigned int frames) {
+	unsigned int f, c;
+
+	if(_snd_pcm_volumiofifo_dsp_is_native(layout, 2, 16, 0)) {
+		const int16_t *in = src;
+		for(f = 0; f < frames; f++)
+			for(c = 0; c < channels; c++)
+				planar[c][f] = in[f * channels + c] * (1.0f / 32768.0f);
+	} else if(_snd_pcm_volumiofifo_dsp_is_native(layout, 4, 32, 0)) {
+		const int32_t *in = src;
+		for(f = 0; f < frames; f++)
+			for(c = 0; c < channels; c++)
+				planar[c][f] = in[f * channels + c] * (1.0f / 2147483648.0f);
+	} else if(_snd_pcm_volumiofifo_dsp_is_native(layout, 4, 32, 1)) {
+		const float *in = src;
+		for(f = 0; f < frames; f++)
+			for(c = 0; c < channels; c++)
+				planar[c][f] = in[f * channels + c];
+	} else {
+		const unsigned char *in = src;
+		for(f = 0; f < frames; f++) {
+			for(c = 0; c < channels; c++) {
+				planar[c][f] = (float) _snd_pcm_volumiofifo_dsp_read_sample(layout, in);
+				in += layout->phys_bytes;
+			}
+		}
+	}
+}
+
+void _snd_pcm_volumiofifo_dsp_encode(const volumiofifo_sample_layout_t *layout, unsigned int channels,
+		float planar[][VOLUMIOFIFO_DSP_BLOCK], void *dst, unsigned int frames) {
+	unsigned int f, c;
+
+	if(_snd_pcm_volumiofifo_dsp_is_native(layout, 2, 16, 0)) {
+		int16_t *out = dst;
+		for(f = 0; f < frames; f++) {
+			for(c = 0; c < channels; c++) {
+				float v = planar[c][f] * 32768.0f;
+				v = v > 32767.0f ? 32767.0f : v < -32768.0f ? -32768.0f : v;
+				out[f * channels + c] = (int16_t) lrintf(v);
+			}
+		}
+	} else if(_snd_pcm_volumiofifo_dsp_is_native(layout, 4, 32, 1)) {
+		float *out = dst;
+		for(f = 0; f < frames; f++)
+			for(c = 0; c < channels; c++)
+				out[f * channels + c] = planar[c][f];
+	} else {
+		unsigned char *out = dst;
+		for(f = 0; f < frames; f++) {
+			for(c = 0; c < channels; c++) {
+				_snd_pcm_volumiofifo_dsp_write_sample(layout, out, planar[c][f]);
+				out += layout->phys_bytes;
+			}
+		}
+	}
+}
+
+/**
+ * Apply the routing matrix, one output channel at a time so that each
+ * inner loop is a straight multiply-accumulate over the block
+ */
+static void _snd_pcm_volumiofifo_dsp_matrix(volumiofifo_dsp_t *dsp, unsigned int frames) {
+	unsigned int vecs = (frames + 3) / 4;
+	unsigned int o, i, v;
+
+	for(o = 0; o < dsp->out_channels; o++) {
+		volumiofifo_v4sf *out = (volumiofifo_v4sf *) dsp->out_block[o];
+
+		for(v = 0; v < vecs; v++)
+			out[v] = (volumiofifo_v4sf) { 0.0f, 0.0f, 0.0f, 0.0f };
+
+		for(i = 0; i < dsp->in_channels; i++) {
+			float coeff = dsp->matrix[o][i];
+			if(coeff == 0.0f)
+				continue;
+
+			const volumiofifo_v4sf *in = (const volumiofifo_v4sf *) dsp->in_block[i];
+			volumiofifo_v4sf c = { coeff, coeff, coeff, coeff };
+			for(v = 0; v < vecs; v++)
+				out[v] += c * in[v];
+		}
+	}
+}
+
+/**
+ * Work out the gain of each frame of a block while ramping, padded to a
+ * whole number of vectors, and advance the ramp past the block
+ */
+static void _snd_pcm_volumiofifo_dsp_ramp(volumiofifo_dsp_t *dsp, unsigned int frames) {
+	unsigned int ramp = frames < dsp->ramp_remaining ? frames : dsp->ramp_remaining;
+	unsigned int f;
+
+	for(f = 0; f < ramp; f++)
+		dsp->gains[f] = dsp->gain + dsp->gain_step * (f + 1);
+
+	dsp->ramp_remaining -= ramp;
+	if(dsp->ramp_remaining == 0) {
+		dsp->gain = dsp->gain_target;
+	} else {
+		dsp->gain = dsp->gains[ramp - 1];
+	}
+
+	for(f = ramp; f < (frames + 3) / 4 * 4; f++)
+		dsp->gains[f] = dsp->gain;
+}
+
+/**
+ * Apply the gain to every channel. While ramping, the per-frame gains are
+ * worked out once for the block and shared by all channels.
+ */
+static void _snd_pcm_volumiofifo_dsp_gain(volumiofifo_dsp_t *dsp, float block[][VOLUMIOFIFO_DSP_BLOCK],
+		unsigned int channels, unsigned int frames) {
+	unsigned int vecs = (frames + 3) / 4;
+	unsigned int c, v;
+
+	if(dsp->ramp_remaining > 0) {
+		_snd_pcm_volumiofifo_dsp_ramp(dsp, frames);
+
+		const volumiofifo_v4sf *g = (const volumiofifo_v4sf *) dsp->gains;
+		for(c = 0; c < channels; c++) {
+			volumiofifo_v4sf *s = (volumiofifo_v4sf *) block[c];
+			for(v = 0; v < vecs; v++)
+				s[v] *= g[v];
+		}
+	} else {
+		volumiofifo_v4sf g = { dsp->gain, dsp->gain, dsp->gain, dsp->gain };
+		for(c = 0; c < channels; c++) {
+			volumiofifo_v4sf *s = (volumiofifo_v4sf *) block[c];
+			for(v = 0; v < vecs; v++)
+				s[v] *= g;
+		}
+	}
+}
+
+/**
+ * Four lanes of xorshift32 giving uniform floats in [-0.5, 0.5). The top
+ * 23 bits become the mantissa of a float in [1, 2) to avoid a conversion.
+ */
+static inline volumiofifo_v4sf _snd_pcm_volumiofifo_dsp_rand(volumiofifo_v4su *state) {
+	volumiofifo_v4su x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return (volumiofifo_v4sf) ((x >> 9) | 0x3f800000) - 1.5f;
+}
+
+/**
+ * Add TPDF dither of one output LSB peak, optionally with first order
+ * error feedback to push the requantisation noise up the spectrum. The
+ * samples are left on the output grid so encoding only has to scale them.
+ */
+static void _snd_pcm_volumiofifo_dsp_dither(volumiofifo_dsp_t *dsp, float block[][VOLUMIOFIFO_DSP_BLOCK],
+		unsigned int channels, unsigned int frames) {
+	unsigned int vecs = (frames + 3) / 4;
+	float scale = (float) (1ULL << (dsp->out.width - 1));
+	float lsb = 1.0f / scale;
+	unsigned int c, f, v;
+
+	for(c = 0; c < channels; c++) {
+		volumiofifo_v4sf *noise = (volumiofifo_v4sf *) dsp->noise;
+		volumiofifo_v4sf *s = (volumiofifo_v4sf *) block[c];
+
+		for(v = 0; v < vecs; v++)
+			noise[v] = _snd_pcm_volumiofifo_dsp_rand(&dsp->dither_state) +
+					_snd_pcm_volumiofifo_dsp_rand(&dsp->dither_state);
+
+		if(!dsp->noise_shaping) {
+			for(v = 0; v < vecs; v++)
+				s[v] += noise[v] * lsb;
+			continue;
+		}
+
+		// The feedback makes each sample depend on the last, so this is serial
+		float error = dsp->shaping_error[c];
+		for(f = 0; f < frames; f++) {
+			float u = block[c][f] * scale - error;
+			float q = rintf(u + dsp->noise[f]);
+			if(q > scale - 1.0f)
+				q = scale - 1.0f;
+			else if(q < -scale)
+				q = -scale;
+			error = q - u;
+			block[c][f] = q * lsb;
+		}
+		dsp->shaping_error[c] = error;
+	}
+}
+
+/**
+ * Bits of precision in a sample of the layout
+ */
+static inline unsigned int _snd_pcm_volumiofifo_dsp_precision(const volumiofifo_sample_layout_t *layout) {
+	if(layout->is_float)
+		return layout->phys_bytes == 8 ? 53 : 24;
+	return layout->width;
+}
+
+void _snd_pcm_volumiofifo_dsp_configure(volumiofifo_dsp_t *dsp) {
+	unsigned int in_width = dsp->in.is_float || dsp->dsd_pcm ? 32 : dsp->in.width;
+	unsigned int o, i;
+
+	dsp->convert = memcmp(&dsp->in, &dsp->out, sizeof(dsp->in)) != 0 ||
+			dsp->in_channels != dsp->out_channels;
+
+	// Only dither when bits are actually being thrown away
+	dsp->dither_active = dsp->dither && !dsp->out.is_float &&
+			(dsp->in.is_float || dsp->out.width < in_width);
+
+	// A float has 24 bits of precision, wider samples are processed in double
+	dsp->wide = !dsp->dither_active &&
+			(_snd_pcm_volumiofifo_dsp_precision(&dsp->in) > 24 ||
+			_snd_pcm_volumiofifo_dsp_precision(&dsp->out) > 24);
+
+	// A table of only 0 and 1 in the client format picks and sums whole samples
+	dsp->route = dsp->matrix_enabled && memcmp(&dsp->in, &dsp->out, sizeof(dsp->in)) == 0;
+	for(o = 0; o < dsp->out_channels && dsp->route; o++) {
+		dsp->route_count[o] = 0;
+		for(i = 0; i < dsp->in_channels; i++) {
+			if(dsp->matrix[o][i] == 1.0f) {
+				dsp->route_src[o][dsp->route_count[o]++] = i;
+			} else if(dsp->matrix[o][i] != 0.0f) {
+				dsp->route = 0;
+				break;
+			}
+		}
+	}
+}
+
+void _snd_pcm_volumiofifo_dsp_set_gain(volumiofifo_dsp_t *dsp, float gain) {
+	if(gain == dsp->gain_target)
+		return;
+
+	dsp->gain_target = gain;
+	if(dsp->ramp_frames == 0) {
+		dsp->gain = gain;
+		dsp->ramp_remaining = 0;
+	} else {
+		dsp->gain_step = (gain - dsp->gain) / dsp->ramp_frames;
+		dsp->ramp_remaining = dsp->ramp_frames;
+	}
+}
+
+int _snd_pcm_volumiofifo_dsp_needed(const volumiofifo_dsp_t *dsp) {
+	return dsp->matrix_enabled || dsp->convert ||
+			(dsp->gain_enabled && (dsp->gain != 1.0f || dsp->ramp_remaining > 0));
+}
+
+void _snd_pcm_volumiofifo_dsp_reset(volumiofifo_dsp_t *dsp) {
+	memset(dsp->in_block, 0, sizeof(dsp->in_block));
+	memset(dsp->out_block, 0, sizeof(dsp->out_block));
+
+	// Start at the requested gain, there is nothing playing to ramp from
+	dsp->gain = dsp->gain_target;
+	dsp->ramp_remaining = 0;
+
+	memset(dsp->shaping_error, 0, sizeof(dsp->shaping_error));
+	dsp->dop_marker = 0x05;
+	dsp->dsd_carry = 0;
+
+	// Start the decimator from DSD idle, all zero bits would be full negative
+	memset(dsp->dsd_bytes, 0x69, sizeof(dsp->dsd_bytes));
+	memset(dsp->dsd_stage, 0, sizeof(dsp->dsd_stage));
+	memset(dsp->dsd_phase, 0, sizeof(dsp->dsd_phase));
+	if(dsp->dither_state[0] == 0) {
+		dsp->dither_state = (volumiofifo_v4su) { 0x9e3779b9, 0x243f6a88, 0xb7e15162, 0x6a09e667 };
+	}
+}
+
+/**
+ * Run the PCM stages on a block already decoded into in_block, and encode
+ * the result into the fifo format
+ */
+static void _snd_pcm_volumiofifo_dsp_finish(volumiofifo_dsp_t *dsp, unsigned char *out, unsigned int block) {
+	float (*result)[VOLUMIOFIFO_DSP_BLOCK] = dsp->in_block;
+
+	if(dsp->matrix_enabled) {
+		_snd_pcm_volumiofifo_dsp_matrix(dsp, block);
+		result = dsp->out_block;
+	}
+
+	if(dsp->gain_enabled && (dsp->gain != 1.0f || dsp->ramp_remaining > 0)) {
+		_snd_pcm_volumiofifo_dsp_gain(dsp, result, dsp->out_channels, block);
+	}
+
+	if(dsp->dither_active) {
+		_snd_pcm_volumiofifo_dsp_dither(dsp, result, dsp->out_channels, block);
+	}
+
+	_snd_pcm_volumiofifo_dsp_encode(&dsp->out, dsp->out_channels, result, out, block);
+}
+
+/**
+ * Blackman windowed sinc low pass with unity gain at DC, cutoff is a
+ * fraction of the sample rate
+ */
+static void _snd_pcm_volumiofifo_dsp_design(float *h, unsigned int taps, double cutoff) {
+	double sum = 0.0;
+	unsigned int i;
+
+	for(i = 0; i < taps; i++) {
+		double m = i - (taps - 1) / 2.0;
+		double sinc = m == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * m) / (M_PI * m);
+		double window = 0.42 - 0.5 * cos(2.0 * M_PI * i / (taps - 1)) + 0.08 * cos(4.0 * M_PI * i / (taps - 1));
+		h[i] = sinc * window;
+		sum += h[i];
+	}
+	for(i = 0; i < taps; i++)
+		h[i] /= sum;
+}
+
+int _snd_pcm_volumiofifo_dsp_dsd_pcm(volumiofifo_dsp_t *dsp, unsigned int stage_rate, unsigned int pcm_rate) {
+	float first[VOLUMIOFIFO_DSD_FIR_TAPS];
+	unsigned int stages = 0, j, byte, bit;
+
+	while(stages <= VOLUMIOFIFO_DSD_MAX_STAGES && (pcm_rate << stages) < stage_rate)
+		stages++;
+	if(stages == 0 || stages > VOLUMIOFIFO_DSD_MAX_STAGES || (pcm_rate << stages) != stage_rate)
+		return -EINVAL;
+
+	dsp->dsd_pcm = 1;
+	dsp->dsd_stages = stages;
+
+	// The bit stage keeps well clear of the first image at a quarter of its output rate
+	_snd_pcm_volumiofifo_dsp_design(first, VOLUMIOFIFO_DSD_FIR_TAPS, 0.03);
+	for(j = 0; j < VOLUMIOFIFO_DSD_LUT_BYTES; j++) {
+		for(byte = 0; byte < 256; byte++) {
+			float sum = 0.0f;
+			// Bits are sent MSB first, and the last byte in time is j == 0
+			for(bit = 0; bit < 8; bit++)
+				sum += first[8 * j + 7 - bit] * (((byte >> (7 - bit)) & 1) ? 1.0f : -1.0f);
+			dsp->dsd_lut[j][byte] = sum;
+		}
+	}
+
+	// Every halving stage can share one design
+	_snd_pcm_volumiofifo_dsp_design(dsp->dsd_fir, VOLUMIOFIFO_DSD_FIR_TAPS, 0.2);
+
+	return 0;
+}
+
+static inline float _snd_pcm_volumiofifo_dsp_dot(const float *x, const float *h) {
+	volumiofifo_v4sf acc = { 0.0f, 0.0f, 0.0f, 0.0f };
+	unsigned int k;
+
+	for(k = 0; k < VOLUMIOFIFO_DSD_FIR_TAPS; k += 4)
+		acc += *(const volumiofifo_v4sf_u *) (x + k) * *(const volumiofifo_v4sf *) (h + k);
+
+	return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+/**
+ * Copy the DSD bytes for one channel into its history buffer in time order
+ */
+static void _snd_pcm_volumiofifo_dsp_dsd_bytes(volumiofifo_dsp_t *dsp, const unsigned char *in,
+		unsigned int c, unsigned int frames) {
+	unsigned char *bytes = dsp->dsd_bytes[c] + VOLUMIOFIFO_DSD_LUT_BYTES - 1;
+	unsigned int channels = dsp->in_channels;
+	unsigned int f;
+
+	switch(dsp->dsd) {
+		case VOLUMIOFIFO_DSD_U8:
+			for(f = 0; f < frames; f++)
+				bytes[f] = in[f * channels + c];
+			break;
+		case VOLUMIOFIFO_DSD_U16_LE:
+			for(f = 0; f < frames; f++) {
+				bytes[2 * f] = in[2 * (f * channels + c) + 1];
+				bytes[2 * f + 1] = in[2 * (f * channels + c)];
+			}
+			break;
+		case VOLUMIOFIFO_DSD_U16_BE:
+			for(f = 0; f < frames; f++) {
+				bytes[2 * f] = in[2 * (f * channels + c)];
+				bytes[2 * f + 1] = in[2 * (f * channels + c) + 1];
+			}
+			break;
+		case VOLUMIOFIFO_DSD_U32_LE:
+			for(f = 0; f < frames; f++) {
+				const unsigned char *b = in + 4 * (f * channels + c);
+				bytes[4 * f] = b[3];
+				bytes[4 * f + 1] = b[2];
+				bytes[4 * f + 2] = b[1];
+				bytes[4 * f + 3] = b[0];
+			}
+			break;
+		case VOLUMIOFIFO_DSD_U32_BE:
+			for(f = 0; f < frames; f++)
+				memcpy(bytes + 4 * f, in + 4 * (f * channels + c), 4);
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Convert DSD to PCM. The first stage turns each DSD byte into one sample
+ * with a lookup per byte of filter, then each following stage low pass
+ * filters and drops every other sample. The last stage writes straight
+ * into in_block for the PCM stages.
+ *
+ * Returns the number of output frames
+ */
+static unsigned int _snd_pcm_volumiofifo_dsp_dsd_decimate(volumiofifo_dsp_t *dsp, const unsigned char *in,
+		unsigned char *out, unsigned int frames) {
+	unsigned int bytes_per_frame = dsp->in.phys_bytes;
+	unsigned int per_block = VOLUMIOFIFO_DSP_BLOCK / bytes_per_frame;
+	size_t in_frame_bytes = dsp->in.phys_bytes * dsp->in_channels;
+	size_t out_frame_bytes = dsp->out.phys_bytes * dsp->out_channels;
+	const unsigned int hist = VOLUMIOFIFO_DSD_FIR_TAPS - 1;
+	unsigned int produced = 0;
+	unsigned int c, i, j, s;
+
+	while(frames > 0) {
+		unsigned int block = frames > per_block ? per_block : frames;
+		unsigned int count = 0;
+		unsigned char phase[VOLUMIOFIFO_DSD_MAX_STAGES];
+
+		memcpy(phase, dsp->dsd_phase, sizeof(phase));
+
+		for(c = 0; c < dsp->in_channels; c++) {
+			unsigned char *bytes = dsp->dsd_bytes[c];
+			float *stage = dsp->dsd_stage[0][c];
+			unsigned int n = block * bytes_per_frame;
+
+			_snd_pcm_volumiofifo_dsp_dsd_bytes(dsp, in, c, block);
+
+			for(i = 0; i < n; i++) {
+				const unsigned char *b = bytes + VOLUMIOFIFO_DSD_LUT_BYTES - 1 + i;
+				float sum = 0.0f;
+				for(j = 0; j < VOLUMIOFIFO_DSD_LUT_BYTES; j++)
+					sum += dsp->dsd_lut[j][b[-(int) j]];
+				stage[hist + i] = sum;
+			}
+			memmove(bytes, bytes + n, VOLUMIOFIFO_DSD_LUT_BYTES - 1);
+
+			// Every channel starts each stage from the same phase
+			memcpy(phase, dsp->dsd_phase, sizeof(phase));
+			for(s = 0; s < dsp->dsd_stages; s++) {
+				float *x = dsp->dsd_stage[s][c];
+				int last = s + 1 == dsp->dsd_stages;
+				float *y = last ? dsp->in_block[c] : dsp->dsd_stage[s + 1][c] + hist;
+				unsigned int k = 0;
+
+				for(i = 0; i < n; i++) {
+					phase[s] ^= 1;
+					if(phase[s] == 0)
+						y[k++] = _snd_pcm_volumiofifo_dsp_dot(x + i, dsp->dsd_fir);
+				}
+				memmove(x, x + n, hist * sizeof(float));
+				n = k;
+			}
+			count = n;
+		}
+		memcpy(dsp->dsd_phase, phase, sizeof(phase));
+
+		if(count > 0)
+			_snd_pcm_volumiofifo_dsp_finish(dsp, out, count);
+
+		in += block * in_frame_bytes;
+		out += count * out_frame_bytes;
+		produced += count;
+		frames -= block;
+	}
+
+	return produced;
+}
+
+/**
+ * Gather the DSD bytes of each output sample as a time ordered pair, earliest
+ * byte in the high half, so that packing no longer depends on the input
+ * layout. The byte swaps are written as plain loops which the compiler turns
+ * into vector byte shuffles.
+ *
+ * Returns the number of output frames gathered, at most VOLUMIOFIFO_DSP_BLOCK
+ */
+static unsigned int _snd_pcm_volumiofifo_dsp_dsd_gather(volumiofifo_dsp_t *dsp, const unsigned char *in,
+		unsigned int frames) {
+	unsigned int channels = dsp->in_channels;
+	unsigned int samples = frames * channels;
+	uint16_t *pairs = dsp->dsd_pairs;
+	unsigned int i, c, k;
+
+	switch(dsp->dsd) {
+		case VOLUMIOFIFO_DSD_U8:
+			// Two client frames make one output frame, an odd frame is carried
+			k = 0;
+			if(dsp->dsd_carry && frames > 0) {
+				for(c = 0; c < channels; c++)
+					pairs[c] = (dsp->dsd_carry_bytes[c] << 8) | in[c];
+				in += channels;
+				frames--;
+				k = 1;
+			}
+			for(i = 0; i + 1 < frames; i += 2) {
+				uint16_t *out = pairs + (k + i / 2) * channels;
+				for(c = 0; c < channels; c++)
+					out[c] = (in[i * channels + c] << 8) | in[(i + 1) * channels + c];
+			}
+			k += i / 2;
+			dsp->dsd_carry = i < frames;
+			if(dsp->dsd_carry)
+				memcpy(dsp->dsd_carry_bytes, in + i * channels, channels);
+			return k;
+		case VOLUMIOFIFO_DSD_U16_LE:
+			for(i = 0; i < samples; i++)
+				pairs[i] = in[2 * i] | (in[2 * i + 1] << 8);
+			return frames;
+		case VOLUMIOFIFO_DSD_U16_BE:
+			for(i = 0; i < samples; i++)
+				pairs[i] = (in[2 * i] << 8) | in[2 * i + 1];
+			return frames;
+		case VOLUMIOFIFO_DSD_U32_LE:
+		case VOLUMIOFIFO_DSD_U32_BE: {
+			// Each client frame makes two output frames
+			int le = dsp->dsd == VOLUMIOFIFO_DSD_U32_LE;
+			for(i = 0; i < frames; i++) {
+				for(c = 0; c < channels; c++) {
+					const unsigned char *b = in + 4 * (i * channels + c);
+					uint16_t first = le ? (b[3] << 8) | b[2] : (b[0] << 8) | b[1];
+					uint16_t second = le ? (b[1] << 8) | b[0] : (b[2] << 8) | b[3];
+					pairs[(2 * i) * channels + c] = first;
+					pairs[(2 * i + 1) * channels + c] = second;
+				}
+			}
+			return 2 * frames;
+		}
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Pack time ordered DSD byte pairs into DoP samples, with the marker byte
+ * alternating between 0x05 and 0xFA on every frame
+ */
+static void _snd_pcm_volumiofifo_dsp_dop_pack(volumiofifo_dsp_t *dsp, unsigned char *out, unsigned int frames) {
+	unsigned int channels = dsp->out_channels;
+	unsigned int phys = dsp->out.phys_bytes;
+	const uint16_t *pairs = dsp->dsd_pairs;
+	unsigned int f, c;
+
+	for(f = 0; f < frames; f++) {
+		unsigned char marker = dsp->dop_marker;
+		dsp->dop_marker ^= 0xFF;
+
+		for(c = 0; c < channels; c++) {
+			uint32_t sample = ((uint32_t) marker << 16) | pairs[f * channels + c];
+			unsigned char *p = out + (f * channels + c) * phys;
+
+			// 24 bits of DoP, left justified in larger samples
+			if(dsp->out.big_endian) {
+				p[0] = sample >> 16;
+				p[1] = sample >> 8;
+				p[2] = sample;
+				if(phys == 4)
+					p[3] = 0;
+			} else if(phys == 4) {
+				p[0] = 0;
+				p[1] = sample;
+				p[2] = sample >> 8;
+				p[3] = sample >> 16;
+			} else {
+				p[0] = sample;
+				p[1] = sample >> 8;
+				p[2] = sample >> 16;
+			}
+		}
+	}
+}
+
+static unsigned int _snd_pcm_volumiofifo_dsp_dop(volumiofifo_dsp_t *dsp, const unsigned char *in,
+		unsigned char *out, unsigned int frames) {
+	size_t in_frame_bytes = dsp->in.phys_bytes * dsp->in_channels;
+	size_t out_frame_bytes = dsp->out.phys_bytes * dsp->out_channels;
+	unsigned int per_block;
+	unsigned int produced = 0;
+
+	switch(dsp->dsd) {
+		case VOLUMIOFIFO_DSD_U8:
+			per_block = 2 * VOLUMIOFIFO_DSP_BLOCK - 1;
+			break;
+		case VOLUMIOFIFO_DSD_U32_LE:
+		case VOLUMIOFIFO_DSD_U32_BE:
+			per_block = VOLUMIOFIFO_DSP_BLOCK / 2;
+			break;
+		default:
+			per_block = VOLUMIOFIFO_DSP_BLOCK;
+	}
+
+	while(frames > 0) {
+		unsigned int block = frames > per_block ? per_block : frames;
+		unsigned int gathered = _snd_pcm_volumiofifo_dsp_dsd_gather(dsp, in, block);
+
+		_snd_pcm_volumiofifo_dsp_dop_pack(dsp, out, gathered);
+
+		in += block * in_frame_bytes;
+		out += gathered * out_frame_bytes;
+		produced += gathered;
+		frames -= block;
+	}
+
+	return produced;
+}
+
+void _snd_pcm_volumiofifo_dsp_dsd_silence(volumiofifo_dsp_t *dsp, void *dst, unsigned int frames) {
+	unsigned char *out = dst;
+	size_t out_frame_bytes = dsp->out.phys_bytes * dsp->out_channels;
+	unsigned int i;
+
+	while(frames > 0) {
+		unsigned int block = frames > VOLUMIOFIFO_DSP_BLOCK ? VOLUMIOFIFO_DSP_BLOCK : frames;
+
+		// 0x69 is the DSD idle pattern
+		for(i = 0; i < block * dsp->out_channels; i++)
+			dsp->dsd_pairs[i] = 0x6969;
+		_snd_pcm_volumiofifo_dsp_dop_pack(dsp, out, block);
+
+		out += block * out_frame_bytes;
+		frames -= block;
+	}
+}
+
+unsigned int _snd_pcm_volumiofifo_dsp_max_input(const volumiofifo_dsp_t *dsp, unsigned int out_frames) {
+	if(dsp->dsd != VOLUMIOFIFO_DSD_NONE && dsp->dsd_pcm) {
+		// Whatever the stage phases, this never produces more than out_frames
+		unsigned int ratio = 1 << dsp->dsd_stages;
+		return (out_frames * ratio - (ratio - 1)) / dsp->in.phys_bytes;
+	}
+
+	switch(dsp->dsd) {
+		case VOLUMIOFIFO_DSD_U8:
+			return 2 * out_frames - (dsp->dsd_carry ? 1 : 0);
+		case VOLUMIOFIFO_DSD_U32_LE:
+		case VOLUMIOFIFO_DSD_U32_BE:
+			return out_frames / 2;
+		default:
+			return out_frames;
+	}
+}
+
+/**
+ * Route a block without any arithmetic on single sources, so that a table
+ * which only moves channels about is bit exact. Samples mixed into one
+ * output are summed as integers, or in double for float formats.
+ */
+static void _snd_pcm_volumiofifo_dsp_route(volumiofifo_dsp_t *dsp, const unsigned char *in,
+		unsigned char *out, unsigned int frames) {
+	const volumiofifo_sample_layout_t *layout = &dsp->out;
+	unsigned int bytes = layout->phys_bytes;
+	unsigned int f, o, k;
+
+	for(f = 0; f < frames; f++) {
+		for(o = 0; o < dsp->out_channels; o++) {
+			unsigned int count = dsp->route_count[o];
+
+			if(count == 1) {
+				memcpy(out, in + dsp->route_src[o][0] * bytes, bytes);
+			} else if(layout->is_float) {
+				double sum = 0.0;
+				for(k = 0; k < count; k++)
+					sum += _snd_pcm_volumiofifo_dsp_read_sample(layout, in + dsp->route_src[o][k] * bytes);
+				_snd_pcm_volumiofifo_dsp_write_sample(layout, out, sum);
+			} else {
+				int64_t sum = 0;
+				for(k = 0; k < count; k++)
+					sum += _snd_pcm_volumiofifo_dsp_read_int(layout, in + dsp->route_src[o][k] * bytes);
+				_snd_pcm_volumiofifo_dsp_write_int(layout, out, sum);
+			}
+			out += bytes;
+		}
+		in += dsp->in_channels * bytes;
+	}
+}
+
+/**
+ * Process a block one frame at a time in double, for samples with more
+ * precision than a float can hold
+ */
+static void _snd_pcm_volumiofifo_dsp_wide(volumiofifo_dsp_t *dsp, const unsigned char *in,
+		unsigned char *out, unsigned int frames) {
+	double in_frame[VOLUMIOFIFO_MAX_CHANNELS];
+	int gain = dsp->gain_enabled && (dsp->gain != 1.0f || dsp->ramp_remaining > 0);
+	int ramping = gain && dsp->ramp_remaining > 0;
+	double g = dsp->gain;
+	unsigned int f, o, i;
+
+	if(ramping)
+		_snd_pcm_volumiofifo_dsp_ramp(dsp, frames);
+
+	for(f = 0; f < frames; f++) {
+		for(i = 0; i < dsp->in_channels; i++) {
+			in_frame[i] = _snd_pcm_volumiofifo_dsp_read_sample(&dsp->in, in);
+			in += dsp->in.phys_bytes;
+		}
+		if(ramping)
+			g = dsp->gains[f];
+
+		for(o = 0; o < dsp->out_channels; o++) {
+			double v = 0.0;
+
+			if(dsp->matrix_enabled) {
+				for(i = 0; i < dsp->in_channels; i++)
+					v += (double) dsp->matrix[o][i] * in_frame[i];
+			} else {
+				v = in_frame[o];
+			}
+			if(gain)
+				v *= g;
+
+			_snd_pcm_volumiofifo_dsp_write_sample(&dsp->out, out, v);
+			out += dsp->out.phys_bytes;
+		}
+	}
+}
+
+unsigned int _snd_pcm_volumiofifo_dsp_process(volumiofifo_dsp_t *dsp, const void *src, void *dst, unsigned int frames) {
+	const unsigned char *in = src;
+	unsigned char *out = dst;
+	size_t in_frame_bytes = dsp->in.phys_bytes * dsp->in_channels;
+	size_t out_frame_bytes = dsp->out.phys_bytes * dsp->out_channels;
+	unsigned int produced = frames;
+
+	if(dsp->dsd != VOLUMIOFIFO_DSD_NONE) {
+		if(dsp->dsd_pcm)
+			return _snd_pcm_volumiofifo_dsp_dsd_decimate(dsp, in, out, frames);
+		return _snd_pcm_volumiofifo_dsp_dop(dsp, in, out, frames);
+	}
+
+	while(frames > 0) {
+		unsigned int block = frames > VOLUMIOFIFO_DSP_BLOCK ? VOLUMIOFIFO_DSP_BLOCK : frames;
+
+		if(dsp->route && !(dsp->gain_enabled && (dsp->gain != 1.0f || dsp->ramp_remaining > 0))) {
+			_snd_pcm_volumiofifo_dsp_route(dsp, in, out, block);
+		} else if(dsp->wide) {
+			_snd_pcm_volumiofifo_dsp_wide(dsp, in, out, block);
+		} else {
+			_snd_pcm_volumiofifo_dsp_decode(&dsp->in, dsp->in_channels, in, dsp->in_block, block);
+			_snd_pcm_volumiofifo_dsp_finish(dsp, out, block);
+		}
+
+		in += block * in_frame_bytes;
+		out += block * out_frame_bytes;
+		frames -= block;
+	}
+
+	return produced;
+}
+
+void _snd_pcm_volumiofifo_dsp_meter_reset(volumiofifo_meter_t *meter) {
+	meter->frames = 0;
+	memset(meter->peak, 0, sizeof(meter->peak));
+	memset(meter->sum_squares, 0, sizeof(meter->sum_squares));
+}
+
+void _snd_pcm_volumiofifo_dsp_meter(volumiofifo_meter_t *meter, const void *src, unsigned int frames) {
+	const unsigned char *in = src;
+	size_t frame_bytes = meter->layout.phys_bytes * meter->channels;
+	volumiofifo_v4su abs_mask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+	unsigned int c, f, v;
+
+	meter->frames += frames;
+
+	while(frames > 0) {
+		unsigned int block = frames > VOLUMIOFIFO_DSP_BLOCK ? VOLUMIOFIFO_DSP_BLOCK : frames;
+		unsigned int vecs = (block + 3) / 4;
+
+		_snd_pcm_volumiofifo_dsp_decode(&meter->layout, meter->channels, in, meter->block, block);
+
+		for(c = 0; c < meter->channels; c++) {
+			const volumiofifo_v4sf *s = (const volumiofifo_v4sf *) meter->block[c];
+			volumiofifo_v4su peak = { 0, 0, 0, 0 };
+			volumiofifo_v4sf sum = { 0.0f, 0.0f, 0.0f, 0.0f };
+			float max = meter->peak[c];
+
+			// Zero padding the last vector affects neither the peak nor the sum
+			for(f = block; f < vecs * 4; f++)
+				meter->block[c][f] = 0.0f;
+
+			// Magnitudes of non-negative floats order the same as their bits
+			for(v = 0; v < vecs; v++) {
+				volumiofifo_v4su a = (volumiofifo_v4su) s[v] & abs_mask;
+				volumiofifo_v4su gt = (volumiofifo_v4su) (a > peak);
+				peak = (a & gt) | (peak & ~gt);
+				sum += s[v] * s[v];
+			}
+
+			for(f = 0; f < 4; f++) {
+				float p;
+				uint32_t bits = peak[f];
+				memcpy(&p, &bits, sizeof(p));
+				if(p > max)
+					max = p;
+			}
+			meter->peak[c] = max;
+			meter->sum_squares[c] += sum[0] + sum[1] + sum[2] + sum[3];
+		}
+
+		in += block * frame_bytes;
+		frames -= block;
+	}
+}
+
+unsigned int _snd_pcm_volumiofifo_dsp_tap_max_output(const volumiofifo_tap_t *tap, unsigned int frames) {
+	return (tap->phase + frames) / tap->decimation;
+}
+
+unsigned int _snd_pcm_volumiofifo_dsp_tap(volumiofifo_tap_t *tap, const void *src, unsigned int frames,
+		int16_t *ring, unsigned int ring_mask, uint64_t pos) {
+	const unsigned char *in = src;
+	size_t frame_bytes = tap->layout.phys_bytes * tap->channels;
+	float scale = 32768.0f / tap->decimation;
+	unsigned int written = 0;
+	unsigned int c, f, o, v;
+
+	while(frames > 0) {
+		unsigned int block = frames > VOLUMIOFIFO_DSP_BLOCK ? VOLUMIOFIFO_DSP_BLOCK : frames;
+		unsigned int vecs = (block + 3) / 4;
+
+		_snd_pcm_volumiofifo_dsp_decode(&tap->layout, tap->channels, in, tap->block, block);
+
+		// Even channels fold to the left and odd ones to the right, mono takes everything
+		for(o = 0; o < tap->out_channels; o++) {
+			volumiofifo_v4sf *mix = (volumiofifo_v4sf *) tap->mix[o];
+			unsigned int step = tap->out_channels, first = o, count = 0;
+
+			if(tap->channels == 1)
+				first = 0;
+			for(v = 0; v < vecs; v++)
+				mix[v] = (volumiofifo_v4sf) { 0.0f, 0.0f, 0.0f, 0.0f };
+			for(c = first; c < tap->channels; c += step, count++) {
+				const volumiofifo_v4sf *s = (const volumiofifo_v4sf *) tap->block[c];
+				for(v = 0; v < vecs; v++)
+					mix[v] += s[v];
+			}
+			if(count > 1) {
+				float k = 1.0f / count;
+				volumiofifo_v4sf kv = { k, k, k, k };
+				for(v = 0; v < vecs; v++)
+					mix[v] *= kv;
+			}
+		}
+
+		// A box filter is crude, but visualizers only need the shape of the spectrum
+		for(f = 0; f < block; f++) {
+			for(o = 0; o < tap->out_channels; o++)
+				tap->sum[o] += tap->mix[o][f];
+
+			if(++tap->phase < tap->decimation)
+				continue;
+
+			int16_t *out = ring + ((pos + written) & ring_mask) * tap->out_channels;
+			for(o = 0; o < tap->out_channels; o++) {
+				float val = tap->sum[o] * scale;
+				val = val > 32767.0f ? 32767.0f : val < -32768.0f ? -32768.0f : val;
+				out[o] = (int16_t) lrintf(val);
+				tap->sum[o] = 0.0f;
+			}
+			tap->phase = 0;
+			written++;
+		}
+
+		in += block * frame_bytes;
+		frames -= block;
+	}
+
+	return written;
+}
+
+int _snd_pcm_volumiofifo_dsp_is_silent(const void *buf, size_t bytes, uint64_t pattern) {
+	typedef uint64_t v2du __attribute__((vector_size(16)));
+	const unsigned char *p = buf;
+	const unsigned char *pat = (const unsigned char *) &pattern;
+	v2du match = { pattern, pattern };
+	size_t i = 0, k;
+
+	// Most audio differs within the first few bytes, so check early and often
+	while(i + 64 <= bytes) {
+		v2du a, b, c, d;
+
+		memcpy(&a, p + i, 16);
+		memcpy(&b, p + i + 16, 16);
+		memcpy(&c, p + i + 32, 16);
+		memcpy(&d, p + i + 48, 16);
+		v2du diff = (a ^ match) | (b ^ match) | (c ^ match) | (d ^ match);
+		if((diff[0] | diff[1]) != 0)
+			return 0;
+		i += 64;
+	}
+
+	for(k = i; k < bytes; k++) {
+		if(p[k] != pat[k & 7])
+			return 0;
+	}
+	return 1;
+}
+
+typedef int16_t volumiofifo_v8hi __attribute__((vector_size(16)));
+typedef int32_t volumiofifo_v8si __attribute__((vector_size(32)));
+typedef int32_t volumiofifo_v4si __attribute__((vector_size(16)));
+typedef int64_t volumiofifo_v4di __attribute__((vector_size(32)));
+
+/*
+ * The mixing kernels load and store through memcpy because the rings hold
+ * frames of any size at any offset. Widening first means the sum of up to
+ * VOLUMIOFIFO_MIX_CLIENTS full scale clients cannot overflow.
+ */
+
+void _snd_pcm_volumiofifo_dsp_mix_s16(int32_t *acc, const int16_t *src, unsigned int samples) {
+	unsigned int i = 0;
+
+	for(; i + 8 <= samples; i += 8) {
+		volumiofifo_v8hi s;
+		volumiofifo_v8si a;
+
+		memcpy(&s, src + i, sizeof(s));
+		memcpy(&a, acc + i, sizeof(a));
+		a += __builtin_convertvector(s, volumiofifo_v8si);
+		memcpy(acc + i, &a, sizeof(a));
+	}
+	for(; i < samples; i++)
+		acc[i] += src[i];
+}
+
+void _snd_pcm_volumiofifo_dsp_mix_s16_out(const int32_t *acc, int16_t *dst, unsigned int samples) {
+	unsigned int i = 0;
+
+	for(; i + 8 <= samples; i += 8) {
+		volumiofifo_v8si a, hi, lo;
+
+		memcpy(&a, acc + i, sizeof(a));
+		hi = a > 32767;
+		lo = a < -32768;
+		a = (a & ~(hi | lo)) | (hi & 32767) | (lo & -32768);
+		volumiofifo_v8hi s = __builtin_convertvector(a, volumiofifo_v8hi);
+		memcpy(dst + i, &s, sizeof(s));
+	}
+	for(; i < samples; i++)
+		dst[i] = acc[i] > 32767 ? 32767 : acc[i] < -32768 ? -32768 : acc[i];
+}
+
+void _snd_pcm_volumiofifo_dsp_mix_s32(int64_t *acc, const int32_t *src, unsigned int samples) {
+	unsigned int i = 0;
+
+	for(; i + 4 <= samples; i += 4) {
+		volumiofifo_v4si s;
+		volumiofifo_v4di a;
+
+		memcpy(&s, src + i, sizeof(s));
+		memcpy(&a, acc + i, sizeof(a));
+		a += __builtin_convertvector(s, volumiofifo_v4di);
+		memcpy(acc + i, &a, sizeof(a));
+	}
+	for(; i < samples; i++)
+		acc[i] += src[i];
+}
+
+void _snd_pcm_volumiofifo_dsp_mix_s32_out(const int64_t *acc, int32_t *dst, unsigned int samples) {
+	unsigned int i = 0;
+
+	for(; i + 4 <= samples; i += 4) {
+		volumiofifo_v4di a, hi, lo;
+
+		memcpy(&a, acc + i, sizeof(a));
+		hi = a > INT32_MAX;
+		lo = a < INT32_MIN;
+		a = (a & ~(hi | lo)) | (hi & INT32_MAX) | (lo & INT32_MIN);
+		volumiofifo_v4si s = __builtin_convertvector(a, volumiofifo_v4si);
+		memcpy(dst + i, &s, sizeof(s));
+	}
+	for(; i < samples; i++)
+		dst[i] = acc[i] > INT32_MAX ? INT32_MAX : acc[i] < INT32_MIN ? INT32_MIN : acc[i];
+}
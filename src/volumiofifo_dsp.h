@@ -0,0 +1,268 @@
+/*
+ *  PCM - Volumio FIFO plugin - sample processing
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_DSP_H
+#define __VOLUMIOFIFO_DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The plugin never negotiates more channels than this */
+#define VOLUMIOFIFO_MAX_CHANNELS 16
+
+/* Frames processed per pass, small enough to keep the working set in L1 */
+#define VOLUMIOFIFO_DSP_BLOCK 256
+
+/* Halving stages after the first DSD stage, enough for DSD256 to 88.2kHz */
+#define VOLUMIOFIFO_DSD_MAX_STAGES 4
+
+/* Taps of every DSD decimation filter, the first stage uses a lookup per byte */
+#define VOLUMIOFIFO_DSD_FIR_TAPS 64
+#define VOLUMIOFIFO_DSD_LUT_BYTES (VOLUMIOFIFO_DSD_FIR_TAPS / 8)
+
+typedef float volumiofifo_v4sf __attribute__((vector_size(16)));
+typedef float volumiofifo_v4sf_u __attribute__((vector_size(16), aligned(4)));
+typedef uint32_t volumiofifo_v4su __attribute__((vector_size(16)));
+
+/**
+ * How a sample is laid out in memory. Filled in by the plugin from the
+ * ALSA format helpers so that this code does not need to link alsa-lib.
+ */
+typedef struct volumiofifo_sample_layout {
+	unsigned char phys_bytes;
+	unsigned char width;
+	unsigned char is_signed;
+	unsigned char big_endian;
+	unsigned char is_float;
+} volumiofifo_sample_layout_t;
+
+/* DSD input layouts, in the order the DSD bytes appear in memory */
+typedef enum volumiofifo_dsd {
+	VOLUMIOFIFO_DSD_NONE = 0,
+	VOLUMIOFIFO_DSD_U8,
+	VOLUMIOFIFO_DSD_U16_LE,
+	VOLUMIOFIFO_DSD_U16_BE,
+	VOLUMIOFIFO_DSD_U32_LE,
+	VOLUMIOFIFO_DSD_U32_BE,
+} volumiofifo_dsd_t;
+
+typedef struct volumiofifo_dsp {
+	volumiofifo_sample_layout_t in;
+	volumiofifo_sample_layout_t out;
+	unsigned int in_channels;
+	unsigned int out_channels;
+
+	int matrix_enabled;
+	float matrix[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_MAX_CHANNELS];
+
+	// Set when the matrix only picks and sums client channels, with their sources
+	int route;
+	unsigned char route_count[VOLUMIOFIFO_MAX_CHANNELS];
+	unsigned char route_src[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_MAX_CHANNELS];
+
+	int gain_enabled;
+	float gain;
+	float gain_target;
+	float gain_step;
+	unsigned int ramp_frames;
+	unsigned int ramp_remaining;
+	float gains[VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+
+	// Set when the fifo format differs from the client format
+	int convert;
+	// Set when samples need more precision than a float holds
+	int wide;
+
+	int dither;
+	int noise_shaping;
+	int dither_active;
+	volumiofifo_v4su dither_state;
+	float shaping_error[VOLUMIOFIFO_MAX_CHANNELS];
+	float noise[VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+
+	// DSD over PCM framing, used instead of the PCM stages when dsd is set
+	volumiofifo_dsd_t dsd;
+	unsigned char dop_marker;
+	int dsd_carry;
+	unsigned char dsd_carry_bytes[VOLUMIOFIFO_MAX_CHANNELS];
+	uint16_t dsd_pairs[VOLUMIOFIFO_DSP_BLOCK * VOLUMIOFIFO_MAX_CHANNELS];
+
+	// DSD to PCM decimation, used instead of DoP when dsd_pcm is set
+	int dsd_pcm;
+	unsigned int dsd_stages;
+	unsigned char dsd_phase[VOLUMIOFIFO_DSD_MAX_STAGES];
+	float dsd_lut[VOLUMIOFIFO_DSD_LUT_BYTES][256];
+	float dsd_fir[VOLUMIOFIFO_DSD_FIR_TAPS] __attribute__((aligned(16)));
+	unsigned char dsd_bytes[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_DSD_LUT_BYTES - 1 + VOLUMIOFIFO_DSP_BLOCK];
+	float dsd_stage[VOLUMIOFIFO_DSD_MAX_STAGES][VOLUMIOFIFO_MAX_CHANNELS]
+			[VOLUMIOFIFO_DSD_FIR_TAPS - 1 + VOLUMIOFIFO_DSP_BLOCK];
+
+	float in_block[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+	float out_block[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+} volumiofifo_dsp_t;
+
+/* Level metering of the samples written to the fifo */
+typedef struct volumiofifo_meter {
+	volumiofifo_sample_layout_t layout;
+	unsigned int channels;
+
+	// Frames measured since the last reset
+	unsigned int frames;
+	float peak[VOLUMIOFIFO_MAX_CHANNELS];
+	double sum_squares[VOLUMIOFIFO_MAX_CHANNELS];
+
+	float block[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+} volumiofifo_meter_t;
+
+/* A downmixed, decimated copy of the fifo samples for visualizers */
+typedef struct volumiofifo_tap {
+	volumiofifo_sample_layout_t layout;
+	unsigned int channels;
+	// 1 or 2
+	unsigned int out_channels;
+	unsigned int decimation;
+
+	// Averaging carried over between calls while decimating
+	unsigned int phase;
+	float sum[2];
+
+	float block[VOLUMIOFIFO_MAX_CHANNELS][VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+	float mix[2][VOLUMIOFIFO_DSP_BLOCK] __attribute__((aligned(16)));
+} volumiofifo_tap_t;
+
+/**
+ * Reset any state carried between calls, used when the PCM is prepared
+ */
+void _snd_pcm_volumiofifo_dsp_reset(volumiofifo_dsp_t *dsp);
+
+/**
+ * Set up anything that depends on the sample layouts, called once the
+ * layouts and channel counts have been filled in
+ */
+void _snd_pcm_volumiofifo_dsp_configure(volumiofifo_dsp_t *dsp);
+
+/**
+ * Set up DSD to PCM conversion where the first stage runs at stage_rate
+ * (the DSD bit rate / 8) and the output runs at pcm_rate
+ *
+ * Returns 0, or -EINVAL if the rates are not a supported power of two apart
+ */
+int _snd_pcm_volumiofifo_dsp_dsd_pcm(volumiofifo_dsp_t *dsp, unsigned int stage_rate, unsigned int pcm_rate);
+
+/**
+ * Set the gain to apply, ramping linearly from the current gain over
+ * ramp_frames if it has changed
+ */
+void _snd_pcm_volumiofifo_dsp_set_gain(volumiofifo_dsp_t *dsp, float gain);
+
+/**
+ * Returns non-zero if processing would change the samples, zero if the
+ * client frames could be written to the fifo untouched
+ */
+int _snd_pcm_volumiofifo_dsp_needed(const volumiofifo_dsp_t *dsp);
+
+/**
+ * Convert interleaved input samples to planar float in the range [-1, 1)
+ */
+void _snd_pcm_volumiofifo_dsp_decode(const volumiofifo_sample_layout_t *layout, unsigned int channels,
+		const void *src, float planar[][VOLUMIOFIFO_DSP_BLOCK], unsigned int frames);
+
+/**
+ * Convert planar float samples to interleaved output samples, clipping
+ * anything out of range
+ */
+void _snd_pcm_volumiofifo_dsp_encode(const volumiofifo_sample_layout_t *layout, unsigned int channels,
+		float planar[][VOLUMIOFIFO_DSP_BLOCK], void *dst, unsigned int frames);
+
+/**
+ * The most client frames that can be processed without producing more
+ * than out_frames fifo frames
+ */
+unsigned int _snd_pcm_volumiofifo_dsp_max_input(const volumiofifo_dsp_t *dsp, unsigned int out_frames);
+
+/**
+ * Process frames from the interleaved client buffer into interleaved
+ * fifo frames. All of the client frames are consumed.
+ *
+ * Returns the number of fifo frames produced
+ */
+unsigned int _snd_pcm_volumiofifo_dsp_process(volumiofifo_dsp_t *dsp, const void *src, void *dst, unsigned int frames);
+
+/**
+ * Fill dst with frames of DSD silence in the fifo format, continuing the
+ * DoP marker sequence. Only valid when dsd is set and dsd_pcm is not.
+ */
+void _snd_pcm_volumiofifo_dsp_dsd_silence(volumiofifo_dsp_t *dsp, void *dst, unsigned int frames);
+
+/**
+ * Start a new metering period
+ */
+void _snd_pcm_volumiofifo_dsp_meter_reset(volumiofifo_meter_t *meter);
+
+/**
+ * Add the peak and sum of squares of interleaved samples in the meter
+ * layout to the current period
+ */
+void _snd_pcm_volumiofifo_dsp_meter(volumiofifo_meter_t *meter, const void *src, unsigned int frames);
+
+/**
+ * The most tap frames that frames fifo frames can produce
+ */
+unsigned int _snd_pcm_volumiofifo_dsp_tap_max_output(const volumiofifo_tap_t *tap, unsigned int frames);
+
+/**
+ * Downmix and decimate interleaved samples in the tap layout into a ring
+ * of interleaved native S16 frames, starting at ring frame pos. ring_mask
+ * is the ring size in frames less one, the size being a power of two.
+ *
+ * Returns the number of tap frames written
+ */
+unsigned int _snd_pcm_volumiofifo_dsp_tap(volumiofifo_tap_t *tap, const void *src, unsigned int frames,
+		int16_t *ring, unsigned int ring_mask, uint64_t pos);
+
+/**
+ * Returns non-zero if every byte matches the repeating 64 bit silence
+ * pattern, as given by snd_pcm_format_silence_64 for the format, with
+ * buf starting on a sample boundary
+ */
+int _snd_pcm_volumiofifo_dsp_is_silent(const void *buf, size_t bytes, uint64_t pattern);
+
+/**
+ * Add native S16 samples to 32 bit accumulators
+ */
+void _snd_pcm_volumiofifo_dsp_mix_s16(int32_t *acc, const int16_t *src, unsigned int samples);
+
+/**
+ * Saturate 32 bit accumulators to native S16 samples
+ */
+void _snd_pcm_volumiofifo_dsp_mix_s16_out(const int32_t *acc, int16_t *dst, unsigned int samples);
+
+/**
+ * Add native S32 samples to 64 bit accumulators
+ */
+void _snd_pcm_volumiofifo_dsp_mix_s32(int64_t *acc, const int32_t *src, unsigned int samples);
+
+/**
+ * Saturate 64 bit accumulators to native S32 samples
+ */
+void _snd_pcm_volumiofifo_dsp_mix_s32_out(const int64_t *acc, int32_t *dst, unsigned int samples);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ *  PCM - Volumio FIFO plugin - flight recorder
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "volumiofifo_flight.h"
+
+static const char *volumiofifo_flight_types[VOLUMIOFIFO_FLIGHT_TYPES] = {
+	"prepare", "start", "stop", "transfer", "pointer", "wakeup", "write", "drain", "xrun"
+};
+
+int _snd_pcm_volumiofifo_private_dir(const char *dir, char *used, size_t used_len) {
+	char sub[32];
+	struct stat st;
+	int fd, sub_fd;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0)
+		return -errno;
+	if(fstat(fd, &st) < 0)
+		goto error;
+	if(!(st.st_mode & (S_IWGRP | S_IWOTH))) {
+		snprintf(used, used_len, "%s", dir);
+		return fd;
+	}
+
+	snprintf(sub, sizeof(sub), "volumiofifo-%u", (unsigned int) geteuid());
+	if(mkdirat(fd, sub, 0700) < 0 && errno != EEXIST)
+		goto error;
+	sub_fd = openat(fd, sub, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(sub_fd < 0)
+		goto error;
+	close(fd);
+
+	if(fstat(sub_fd, &st) < 0) {
+		int err = -errno;
+		close(sub_fd);
+		return err;
+	}
+	if(st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+		close(sub_fd);
+		return -EPERM;
+	}
+	snprintf(used, used_len, "%s/%s", dir, sub);
+	return sub_fd;
+
+ error:
+	{
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+}
+
+/**
+ * Format the snapshot into the next dump file, replacing the oldest
+ */
+static int _snd_pcm_volumiofifo_flight_write(volumiofifo_flight_t *flight, char *path, size_t path_len) {
+	const volumiofifo_flight_context_t *context = &flight->context;
+	char file_name[NAME_MAX + 1];
+	unsigned int i;
+	FILE *file;
+	int fd;
+
+	snprintf(file_name, sizeof(file_name), "%s.%u", flight->name, flight->snapshot_dump % VOLUMIOFIFO_FLIGHT_DUMPS);
+	snprintf(path, path_len, "%s/%s", flight->dir, file_name);
+
+	// Never write through whatever is there, it is replaced with a new file
+	if(unlinkat(flight->dir_fd, file_name, 0) < 0 && errno != ENOENT)
+		return -errno;
+	fd = openat(flight->dir_fd, file_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if(fd < 0)
+		return -errno;
+	file = fdopen(fd, "w");
+	if(file == NULL) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	fprintf(file, "# volumiofifo %s on PCM %s, fifo %s %s %uHz %uch, buffer %lu period %lu\n",
+			context->reason, context->pcm, context->fifo, context->format, context->rate,
+			context->channels, context->buffer_size, context->period_size);
+	fprintf(file, "# %u events, times in ms before the dump\n", flight->snapshot_events);
+	fprintf(file, "# %12s %-8s %-9s %12s %12s %8s %8s\n", "time", "event", "state", "ptr", "appl_ptr",
+			"result", "fifo");
+
+	for(i = 0; i < flight->snapshot_events; i++) {
+		const volumiofifo_flight_event_t *event = &flight->snapshot[i];
+
+		fprintf(file, "%14.3f %-8s %-9s %12lld %12llu %8d %8d\n",
+				((double) event->time_ns - (double) flight->snapshot_ns) / 1e6,
+				event->type < VOLUMIOFIFO_FLIGHT_TYPES ? volumiofifo_flight_types[event->type] : "?",
+				flight->state_name(event->state), (long long) event->ptr,
+				(unsigned long long) event->appl_ptr, event->result, event->fifo_bytes);
+	}
+
+	if(fclose(file) != 0)
+		return -errno;
+
+	return 0;
+}
+
+static void *_snd_pcm_volumiofifo_flight_thread(void *arg) {
+	volumiofifo_flight_t *flight = arg;
+	char path[PATH_MAX + NAME_MAX + 2];
+
+	pthread_mutex_lock(&flight->lock);
+	for(;;) {
+		while(!__atomic_load_n(&flight->pending, __ATOMIC_ACQUIRE) && !flight->stop)
+			pthread_cond_wait(&flight->wake, &flight->lock);
+		if(!__atomic_load_n(&flight->pending, __ATOMIC_ACQUIRE))
+			break;
+		pthread_mutex_unlock(&flight->lock);
+
+		int err = _snd_pcm_volumiofifo_flight_write(flight, path, sizeof(path));
+		flight->report(&flight->context, path, err);
+		__atomic_store_n(&flight->pending, 0, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&flight->lock);
+	}
+	pthread_mutex_unlock(&flight->lock);
+
+	return NULL;
+}
+
+int _snd_pcm_volumiofifo_flight_open(volumiofifo_flight_t *flight, unsigned int events, const char *dir,
+		const char *name, const char *(*state_name)(unsigned int state), volumiofifo_flight_report_t report) {
+	char used[PATH_MAX];
+	unsigned int size = 1;
+	int err;
+
+	while(size < events)
+		size <<= 1;
+
+	memset(flight, 0, sizeof(*flight));
+	flight->dir_fd = -1;
+	flight->state_name = state_name;
+	flight->report = report;
+	pthread_mutex_init(&flight->lock, NULL);
+	pthread_cond_init(&flight->wake, NULL);
+
+	flight->events = calloc(size, sizeof(*flight->events));
+	flight->snapshot = calloc(size, sizeof(*flight->snapshot));
+	flight->name = strdup(name);
+	if(flight->events == NULL || flight->snapshot == NULL || flight->name == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+	flight->mask = size - 1;
+
+	flight->dir_fd = _snd_pcm_volumiofifo_private_dir(dir, used, sizeof(used));
+	if(flight->dir_fd < 0) {
+		err = flight->dir_fd;
+		goto error;
+	}
+	flight->dir = strdup(used);
+	if(flight->dir == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+
+	err = -pthread_create(&flight->thread, NULL, _snd_pcm_volumiofifo_flight_thread, flight);
+	if(err < 0)
+		goto error;
+	flight->thread_started = 1;
+
+	return 0;
+
+ error:
+	_snd_pcm_volumiofifo_flight_close(flight);
+	return err;
+}
+
+void _snd_pcm_volumiofifo_flight_close(volumiofifo_flight_t *flight) {
+	if(flight->thread_started) {
+		pthread_mutex_lock(&flight->lock);
+		flight->stop = 1;
+		pthread_cond_signal(&flight->wake);
+		pthread_mutex_unlock(&flight->lock);
+		pthread_join(flight->thread, NULL);
+		flight->thread_started = 0;
+	}
+
+	if(flight->dir_fd >= 0) {
+		close(flight->dir_fd);
+		flight->dir_fd = -1;
+	}
+	free(flight->events);
+	flight->events = NULL;
+	free(flight->snapshot);
+	flight->snapshot = NULL;
+	free(flight->name);
+	flight->name = NULL;
+	free(flight->dir);
+	flight->dir = NULL;
+	pthread_cond_destroy(&flight->wake);
+	pthread_mutex_destroy(&flight->lock);
+}
+
+int _snd_pcm_volumiofifo_flight_dump(volumiofifo_flight_t *flight, const volumiofifo_flight_context_t *context) {
+	uint64_t end = __atomic_load_n(&flight->pos, __ATOMIC_RELAXED);
+	uint64_t start = end > flight->mask + 1 ? end - flight->mask - 1 : 0;
+	uint64_t now_ns, pos;
+	struct timespec now;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	if(flight->dumps > 0 && now_ns - flight->last_dump_ns < VOLUMIOFIFO_FLIGHT_DUMP_INTERVAL_NS)
+		return 0;
+	if(__atomic_load_n(&flight->pending, __ATOMIC_ACQUIRE))
+		return 0;
+	flight->last_dump_ns = now_ns;
+
+	// Oldest first, so the thread need not know where the ring wrapped
+	for(pos = start, i = 0; pos < end; pos++, i++)
+		flight->snapshot[i] = flight->events[pos & flight->mask];
+	flight->snapshot_events = i;
+	flight->snapshot_ns = now_ns;
+	flight->snapshot_dump = flight->dumps++;
+	flight->context = *context;
+
+	pthread_mutex_lock(&flight->lock);
+	__atomic_store_n(&flight->pending, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&flight->wake);
+	pthread_mutex_unlock(&flight->lock);
+
+	return 1;
+}
@@ -0,0 +1,169 @@
+/*
+ *  PCM - Volumio FIFO plugin - flight recorder
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_FLIGHT_H
+#define __VOLUMIOFIFO_FLIGHT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Dump files kept per PCM, the oldest is overwritten */
+#define VOLUMIOFIFO_FLIGHT_DUMPS 4
+
+/* However often things go wrong, dump at most once in this time */
+#define VOLUMIOFIFO_FLIGHT_DUMP_INTERVAL_NS 1000000000ULL
+
+typedef enum volumiofifo_flight_type {
+	VOLUMIOFIFO_FLIGHT_PREPARE = 0,
+	VOLUMIOFIFO_FLIGHT_START,
+	VOLUMIOFIFO_FLIGHT_STOP,
+	VOLUMIOFIFO_FLIGHT_TRANSFER,
+	VOLUMIOFIFO_FLIGHT_POINTER,
+	VOLUMIOFIFO_FLIGHT_WAKEUP,
+	VOLUMIOFIFO_FLIGHT_WRITE,
+	VOLUMIOFIFO_FLIGHT_DRAIN,
+	VOLUMIOFIFO_FLIGHT_XRUN,
+	VOLUMIOFIFO_FLIGHT_TYPES,
+} volumiofifo_flight_type_t;
+
+typedef struct volumiofifo_flight_event {
+	uint64_t time_ns;
+	/* The plugin's hw pointer, or a negative error */
+	int64_t ptr;
+	uint64_t appl_ptr;
+	/* Depends on the type, e.g. the bytes written or a negative error */
+	int32_t result;
+	/* Bytes in the fifo at the last wakeup */
+	int32_t fifo_bytes;
+	uint16_t type;
+	/* The alsa-lib snd_pcm_state_t */
+	uint16_t state;
+} volumiofifo_flight_event_t;
+
+/* What a dump is about, copied when the snapshot is taken */
+typedef struct volumiofifo_flight_context {
+	/* Strings that must outlive the recorder */
+	const char *reason;
+	const char *pcm;
+	const char *fifo;
+	const char *format;
+	unsigned int rate;
+	unsigned int channels;
+	unsigned long buffer_size;
+	unsigned long period_size;
+} volumiofifo_flight_context_t;
+
+/* Called by the writer thread after each dump, with its path or an error */
+typedef void (*volumiofifo_flight_report_t)(const volumiofifo_flight_context_t *context, const char *path, int err);
+
+/*
+ * The last events of one PCM, kept all the time so that there is
+ * something to look at after an intermittent fault. Recording is a few
+ * stores and a clock read. Events may come from more than one thread, each
+ * claims its own slot.
+ *
+ * A dump only copies the ring. A thread formats the copy and writes it to
+ * a file in a directory that only this user can write.
+ */
+typedef struct volumiofifo_flight {
+	volumiofifo_flight_event_t *events;
+	/* Events in the ring less one, the size being a power of two */
+	unsigned int mask;
+	uint64_t pos;
+
+	uint64_t last_dump_ns;
+	unsigned int dumps;
+
+	/* The copy being written, owned by the thread while pending is set */
+	volumiofifo_flight_event_t *snapshot;
+	unsigned int snapshot_events;
+	uint64_t snapshot_ns;
+	unsigned int snapshot_dump;
+	volumiofifo_flight_context_t context;
+	int pending;
+
+	int dir_fd;
+	/* The directory the dumps go in, and the start of their names */
+	char *dir;
+	char *name;
+	const char *(*state_name)(unsigned int state);
+	volumiofifo_flight_report_t report;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int thread_started;
+	int stop;
+} volumiofifo_flight_t;
+
+static inline void _snd_pcm_volumiofifo_flight_record(volumiofifo_flight_t *flight, unsigned int type,
+		unsigned int state, int64_t ptr, uint64_t appl_ptr, int32_t result, int32_t fifo_bytes) {
+	uint64_t pos = __atomic_fetch_add(&flight->pos, 1, __ATOMIC_RELAXED);
+	volumiofifo_flight_event_t *event = &flight->events[pos & flight->mask];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	event->time_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	event->ptr = ptr;
+	event->appl_ptr = appl_ptr;
+	event->result = result;
+	event->fifo_bytes = fifo_bytes;
+	event->type = type;
+	event->state = state;
+}
+
+/**
+ * Open a directory for files this user writes, such as the flight
+ * recorder's dumps. A directory others can write to, such as /tmp, could
+ * hold links planted to redirect them, so a subdirectory volumiofifo-<uid>
+ * which must belong to this user and be closed to others is used instead.
+ *
+ * Returns the directory descriptor or -ve on error, with its path in used
+ */
+int _snd_pcm_volumiofifo_private_dir(const char *dir, char *used, size_t used_len);
+
+/**
+ * Allocate a ring of at least the given number of events, and start the
+ * thread which writes the dumps to files in dir starting name. If dir can
+ * be written by other users the files go in a private subdirectory of it
+ * instead.
+ *
+ * Returns 0 or -ve on error, -EPERM if the private directory belongs to
+ * somebody else
+ */
+int _snd_pcm_volumiofifo_flight_open(volumiofifo_flight_t *flight, unsigned int events, const char *dir,
+		const char *name, const char *(*state_name)(unsigned int state), volumiofifo_flight_report_t report);
+
+/**
+ * Stop the thread, after it has written any dump still pending
+ */
+void _snd_pcm_volumiofifo_flight_close(volumiofifo_flight_t *flight);
+
+/**
+ * Copy the recorded events for the thread to write out. Does nothing if
+ * the last dump was too recent, or is still being written.
+ *
+ * Returns 1 if a dump was started, otherwise 0
+ */
+int _snd_pcm_volumiofifo_flight_dump(volumiofifo_flight_t *flight, const volumiofifo_flight_context_t *context);
+
+#endif
@@ -0,0 +1,449 @@
+/*
+ *  PCM - Volumio FIFO plugin - asynchronous debug log
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "volumiofifo_log.h"
+
+#define VOLUMIOFIFO_LOG_MASK (VOLUMIOFIFO_LOG_RECORDS - 1)
+#define VOLUMIOFIFO_LOG_LINE 512
+
+typedef enum volumiofifo_log_kind {
+	VOLUMIOFIFO_LOG_LITERAL = 0,
+	VOLUMIOFIFO_LOG_SIGNED,
+	VOLUMIOFIFO_LOG_UNSIGNED,
+	VOLUMIOFIFO_LOG_CHAR,
+	VOLUMIOFIFO_LOG_DOUBLE,
+	VOLUMIOFIFO_LOG_POINTER,
+	VOLUMIOFIFO_LOG_STRING,
+	// A conversion the log cannot defer, the rest of the format is copied as is
+	VOLUMIOFIFO_LOG_UNSUPPORTED,
+} volumiofifo_log_kind_t;
+
+typedef enum volumiofifo_log_length {
+	VOLUMIOFIFO_LOG_INT = 0,
+	VOLUMIOFIFO_LOG_LONG,
+	VOLUMIOFIFO_LOG_LONG_LONG,
+	VOLUMIOFIFO_LOG_SIZE,
+	VOLUMIOFIFO_LOG_INTMAX,
+	VOLUMIOFIFO_LOG_PTRDIFF,
+} volumiofifo_log_length_t;
+
+typedef struct volumiofifo_log_spec {
+	volumiofifo_log_kind_t kind;
+	volumiofifo_log_length_t length;
+	// The flags, width and precision, without the length
+	const char *options;
+	size_t options_len;
+	char conversion;
+} volumiofifo_log_spec_t;
+
+static uint64_t _snd_pcm_volumiofifo_log_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Parse the conversion following a %, so that the writer and the flusher
+ * walk a format in the same way
+ *
+ * Returns the character after the conversion
+ */
+static const char *_snd_pcm_volumiofifo_log_parse(const char *p, volumiofifo_log_spec_t *spec) {
+	spec->kind = VOLUMIOFIFO_LOG_UNSUPPORTED;
+	spec->length = VOLUMIOFIFO_LOG_INT;
+	spec->options = p;
+
+	while(*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+	while(*p >= '0' && *p <= '9')
+		p++;
+	if(*p == '.') {
+		p++;
+		while(*p >= '0' && *p <= '9')
+			p++;
+	}
+	spec->options_len = p - spec->options;
+
+	switch(*p) {
+		case 'h':
+			// Promoted to int
+			p += p[1] == 'h' ? 2 : 1;
+			break;
+		case 'l':
+			if(p[1] == 'l') {
+				spec->length = VOLUMIOFIFO_LOG_LONG_LONG;
+				p += 2;
+			} else {
+				spec->length = VOLUMIOFIFO_LOG_LONG;
+				p++;
+			}
+			break;
+		case 'q':
+			spec->length = VOLUMIOFIFO_LOG_LONG_LONG;
+			p++;
+			break;
+		case 'z':
+			spec->length = VOLUMIOFIFO_LOG_SIZE;
+			p++;
+			break;
+		case 'j':
+			spec->length = VOLUMIOFIFO_LOG_INTMAX;
+			p++;
+			break;
+		case 't':
+			spec->length = VOLUMIOFIFO_LOG_PTRDIFF;
+			p++;
+			break;
+	}
+
+	spec->conversion = *p;
+	switch(*p) {
+		case 'd':
+		case 'i':
+			spec->kind = VOLUMIOFIFO_LOG_SIGNED;
+			break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			spec->kind = VOLUMIOFIFO_LOG_UNSIGNED;
+			break;
+		case 'c':
+			spec->kind = VOLUMIOFIFO_LOG_CHAR;
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			spec->kind = VOLUMIOFIFO_LOG_DOUBLE;
+			break;
+		case 'p':
+			spec->kind = VOLUMIOFIFO_LOG_POINTER;
+			break;
+		case 's':
+			spec->kind = VOLUMIOFIFO_LOG_STRING;
+			break;
+		case '%':
+			spec->kind = VOLUMIOFIFO_LOG_LITERAL;
+			break;
+		default:
+			return p;
+	}
+	return p + 1;
+}
+
+static void _snd_pcm_volumiofifo_log_string(volumiofifo_log_record_t *record, volumiofifo_log_arg_t *arg,
+		const char *str) {
+	unsigned int room = record->string_bytes < VOLUMIOFIFO_LOG_STRINGS - 1 ?
+			VOLUMIOFIFO_LOG_STRINGS - 1 - record->string_bytes : 0;
+	size_t len;
+
+	if(str == NULL)
+		str = "(null)";
+	if(room == 0) {
+		// The last byte is always a terminator, so this reads as empty
+		arg->s = VOLUMIOFIFO_LOG_STRINGS - 1;
+		return;
+	}
+
+	len = strnlen(str, room);
+	memcpy(record->strings + record->string_bytes, str, len);
+	record->strings[record->string_bytes + len] = '\0';
+	arg->s = record->string_bytes;
+	record->string_bytes += len + 1;
+}
+
+void _snd_pcm_volumiofifo_log(volumiofifo_log_t *log, const char *fmt, ...) {
+	volumiofifo_log_record_t *record;
+	uint32_t pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+	unsigned int argc = 0;
+	const char *p = fmt;
+	va_list ap;
+
+	// Claim a record, or give up if the flusher has not freed the next one
+	for(;;) {
+		record = &log->records[pos & VOLUMIOFIFO_LOG_MASK];
+		int32_t diff = (int32_t) (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if(diff == 0) {
+			if(__atomic_compare_exchange_n(&log->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if(diff < 0) {
+			__atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	record->fmt = fmt;
+	record->time_ns = _snd_pcm_volumiofifo_log_now_ns();
+	record->string_bytes = 0;
+	record->strings[VOLUMIOFIFO_LOG_STRINGS - 1] = '\0';
+
+	va_start(ap, fmt);
+	while(argc < VOLUMIOFIFO_LOG_ARGS && (p = strchr(p, '%')) != NULL) {
+		volumiofifo_log_spec_t spec;
+		volumiofifo_log_arg_t *arg = &record->args[argc];
+
+		p = _snd_pcm_volumiofifo_log_parse(p + 1, &spec);
+		if(spec.kind == VOLUMIOFIFO_LOG_UNSUPPORTED)
+			break;
+
+		switch(spec.kind) {
+			case VOLUMIOFIFO_LOG_SIGNED:
+				switch(spec.length) {
+					case VOLUMIOFIFO_LOG_LONG: arg->i = va_arg(ap, long); break;
+					case VOLUMIOFIFO_LOG_LONG_LONG: arg->i = va_arg(ap, long long); break;
+					case VOLUMIOFIFO_LOG_SIZE: arg->i = va_arg(ap, ssize_t); break;
+					case VOLUMIOFIFO_LOG_INTMAX: arg->i = va_arg(ap, intmax_t); break;
+					case VOLUMIOFIFO_LOG_PTRDIFF: arg->i = va_arg(ap, ptrdiff_t); break;
+					default: arg->i = va_arg(ap, int); break;
+				}
+				break;
+			case VOLUMIOFIFO_LOG_UNSIGNED:
+				switch(spec.length) {
+					case VOLUMIOFIFO_LOG_LONG: arg->u = va_arg(ap, unsigned long); break;
+					case VOLUMIOFIFO_LOG_LONG_LONG: arg->u = va_arg(ap, unsigned long long); break;
+					case VOLUMIOFIFO_LOG_SIZE: arg->u = va_arg(ap, size_t); break;
+					case VOLUMIOFIFO_LOG_INTMAX: arg->u = va_arg(ap, uintmax_t); break;
+					case VOLUMIOFIFO_LOG_PTRDIFF: arg->u = va_arg(ap, ptrdiff_t); break;
+					default: arg->u = va_arg(ap, unsigned int); break;
+				}
+				break;
+			case VOLUMIOFIFO_LOG_CHAR:
+				arg->i = va_arg(ap, int);
+				break;
+			case VOLUMIOFIFO_LOG_DOUBLE:
+				arg->d = va_arg(ap, double);
+				break;
+			case VOLUMIOFIFO_LOG_POINTER:
+				arg->p = va_arg(ap, void *);
+				break;
+			case VOLUMIOFIFO_LOG_STRING:
+				_snd_pcm_volumiofifo_log_string(record, arg, va_arg(ap, const char *));
+				break;
+			default:
+				// %% takes no argument
+				continue;
+		}
+		argc++;
+	}
+	va_end(ap);
+
+	__atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format a record as printf would have done when it was logged
+ */
+static void _snd_pcm_volumiofifo_log_format(const volumiofifo_log_record_t *record, char *line, size_t len) {
+	const char *p = record->fmt;
+	unsigned int argc = 0;
+	size_t used;
+
+	used = snprintf(line, len, "[%llu.%06llu] ", (unsigned long long) (record->time_ns / 1000000000),
+			(unsigned long long) (record->time_ns % 1000000000 / 1000));
+
+	while(*p != '\0' && used < len - 1) {
+		const char *percent = strchr(p, '%');
+		volumiofifo_log_spec_t spec;
+		char conversion[32];
+		const volumiofifo_log_arg_t *arg = &record->args[argc];
+		int written = 0;
+
+		if(percent == NULL || argc == VOLUMIOFIFO_LOG_ARGS) {
+			// Anything past the arguments that were kept is copied as is
+			snprintf(line + used, len - used, "%s", p);
+			return;
+		}
+
+		if(percent > p) {
+			size_t n = percent - p;
+			if(n > len - 1 - used)
+				n = len - 1 - used;
+			memcpy(line + used, p, n);
+			used += n;
+			line[used] = '\0';
+		}
+
+		p = _snd_pcm_volumiofifo_log_parse(percent + 1, &spec);
+		if(spec.kind == VOLUMIOFIFO_LOG_UNSUPPORTED) {
+			snprintf(line + used, len - used, "%s", percent);
+			return;
+		}
+		if(spec.options_len > sizeof(conversion) - 5)
+			spec.options_len = sizeof(conversion) - 5;
+
+		// Rebuild the conversion with the length of the kept value
+		conversion[0] = '%';
+		memcpy(conversion + 1, spec.options, spec.options_len);
+		snprintf(conversion + 1 + spec.options_len, sizeof(conversion) - 1 - spec.options_len,
+				spec.kind == VOLUMIOFIFO_LOG_SIGNED || spec.kind == VOLUMIOFIFO_LOG_UNSIGNED ? "ll%c" : "%c",
+				spec.conversion);
+
+		switch(spec.kind) {
+			case VOLUMIOFIFO_LOG_SIGNED:
+				written = snprintf(line + used, len - used, conversion, arg->i);
+				break;
+			case VOLUMIOFIFO_LOG_UNSIGNED:
+				written = snprintf(line + used, len - used, conversion, arg->u);
+				break;
+			case VOLUMIOFIFO_LOG_CHAR:
+				written = snprintf(line + used, len - used, conversion, (int) arg->i);
+				break;
+			case VOLUMIOFIFO_LOG_DOUBLE:
+				written = snprintf(line + used, len - used, conversion, arg->d);
+				break;
+			case VOLUMIOFIFO_LOG_POINTER:
+				written = snprintf(line + used, len - used, conversion, arg->p);
+				break;
+			case VOLUMIOFIFO_LOG_STRING:
+				written = snprintf(line + used, len - used, conversion, record->strings + arg->s);
+				break;
+			default:
+				written = snprintf(line + used, len - used, "%%");
+				break;
+		}
+		if(spec.kind != VOLUMIOFIFO_LOG_LITERAL)
+			argc++;
+		if(written > 0)
+			used += (size_t) written < len - used ? (size_t) written : len - 1 - used;
+	}
+}
+
+/**
+ * Report what the rate limit and a full ring have cost since the last report
+ */
+static void _snd_pcm_volumiofifo_log_report(volumiofifo_log_t *log) {
+	uint64_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+	char line[128];
+
+	if(log->suppressed > 0) {
+		snprintf(line, sizeof(line), "%llu debug messages suppressed by the rate limit",
+				(unsigned long long) log->suppressed);
+		log->emit(line);
+		log->suppressed = 0;
+	}
+	if(dropped != log->dropped_reported) {
+		snprintf(line, sizeof(line), "%llu debug messages lost as the log was full",
+				(unsigned long long) (dropped - log->dropped_reported));
+		log->emit(line);
+		log->dropped_reported = dropped;
+	}
+}
+
+void _snd_pcm_volumiofifo_log_flush(volumiofifo_log_t *log) {
+	uint64_t now = _snd_pcm_volumiofifo_log_now_ns();
+	char line[VOLUMIOFIFO_LOG_LINE];
+
+	if(now - log->window_ns >= 1000000000) {
+		_snd_pcm_volumiofifo_log_report(log);
+		log->window_ns = now;
+		log->window_lines = 0;
+	}
+
+	for(;;) {
+		volumiofifo_log_record_t *record = &log->records[log->tail & VOLUMIOFIFO_LOG_MASK];
+
+		if((int32_t) (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - (log->tail + 1)) < 0)
+			break;
+
+		if(log->rate == 0 || log->window_lines < log->rate) {
+			_snd_pcm_volumiofifo_log_format(record, line, sizeof(line));
+			log->emit(line);
+			log->window_lines++;
+		} else {
+			log->suppressed++;
+		}
+
+		// Hand the record back to the writers for the next lap of the ring
+		__atomic_store_n(&record->seq, log->tail + VOLUMIOFIFO_LOG_RECORDS, __ATOMIC_RELEASE);
+		log->tail++;
+	}
+}
+
+static void *_snd_pcm_volumiofifo_log_thread(void *arg) {
+	volumiofifo_log_t *log = arg;
+	struct timespec interval = { 0, VOLUMIOFIFO_LOG_FLUSH_MS * 1000000 };
+
+	while(!__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+		_snd_pcm_volumiofifo_log_flush(log);
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+
+int _snd_pcm_volumiofifo_log_open(volumiofifo_log_t *log, unsigned int rate, volumiofifo_log_emit_t emit) {
+	uint32_t i;
+	int err;
+
+	memset(log, 0, sizeof(*log));
+	log->records = calloc(VOLUMIOFIFO_LOG_RECORDS, sizeof(*log->records));
+	if(log->records == NULL)
+		return -ENOMEM;
+	for(i = 0; i < VOLUMIOFIFO_LOG_RECORDS; i++)
+		log->records[i].seq = i;
+
+	log->rate = rate;
+	log->emit = emit;
+	log->window_ns = _snd_pcm_volumiofifo_log_now_ns();
+
+	err = -pthread_create(&log->thread, NULL, _snd_pcm_volumiofifo_log_thread, log);
+	if(err < 0) {
+		free(log->records);
+		log->records = NULL;
+		return err;
+	}
+	log->thread_started = 1;
+
+	return 0;
+}
+
+void _snd_pcm_volumiofifo_log_close(volumiofifo_log_t *log) {
+	if(log->thread_started) {
+		__atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(log->thread, NULL);
+		log->thread_started = 0;
+	}
+
+	if(log->records != NULL) {
+		// Nothing is lost at close, however fast it arrived
+		log->rate = 0;
+		_snd_pcm_volumiofifo_log_flush(log);
+		_snd_pcm_volumiofifo_log_report(log);
+		free(log->records);
+		log->records = NULL;
+	}
+}
@@ -0,0 +1,115 @@
+/*
+ *  PCM - Volumio FIFO plugin - asynchronous debug log
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_LOG_H
+#define __VOLUMIOFIFO_LOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* Records in the ring, a power of two */
+#define VOLUMIOFIFO_LOG_RECORDS 1024
+
+/* Arguments and bytes of string arguments kept per message, anything more is cut short */
+#define VOLUMIOFIFO_LOG_ARGS 8
+#define VOLUMIOFIFO_LOG_STRINGS 128
+
+/* How often the flusher thread empties the ring */
+#define VOLUMIOFIFO_LOG_FLUSH_MS 50
+
+typedef union volumiofifo_log_arg {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+	/* Offset of a copied string argument */
+	unsigned int s;
+} volumiofifo_log_arg_t;
+
+/*
+ * One message, the format string and its arguments as they were passed.
+ * The format must be a literal, as only the pointer is kept.
+ */
+typedef struct volumiofifo_log_record {
+	/* Sequences the record between the writers and the flusher */
+	uint32_t seq;
+	unsigned int string_bytes;
+	const char *fmt;
+	uint64_t time_ns;
+	volumiofifo_log_arg_t args[VOLUMIOFIFO_LOG_ARGS];
+	char strings[VOLUMIOFIFO_LOG_STRINGS];
+} volumiofifo_log_record_t;
+
+/* Called by the flusher with each formatted line */
+typedef void (*volumiofifo_log_emit_t)(const char *line);
+
+/*
+ * Debug messages are recorded without locks or formatting into a ring,
+ * from any thread, and a thread formats and emits them a little later.
+ * Messages which find the ring full, or arrive faster than the rate limit,
+ * are counted and reported rather than emitted.
+ */
+typedef struct volumiofifo_log {
+	volumiofifo_log_record_t *records;
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+
+	volumiofifo_log_emit_t emit;
+	/* Lines emitted per second, 0 for no limit */
+	unsigned int rate;
+	uint64_t window_ns;
+	unsigned int window_lines;
+	uint64_t suppressed;
+	uint64_t dropped_reported;
+
+	pthread_t thread;
+	int thread_started;
+	int stop;
+} volumiofifo_log_t;
+
+/**
+ * Allocate the ring and start the flusher thread
+ *
+ * Returns 0 or -ve on error
+ */
+int _snd_pcm_volumiofifo_log_open(volumiofifo_log_t *log, unsigned int rate, volumiofifo_log_emit_t emit);
+
+/**
+ * Stop the flusher thread and emit anything still in the ring
+ */
+void _snd_pcm_volumiofifo_log_close(volumiofifo_log_t *log);
+
+/**
+ * Record a message. Supports the printf conversions other than * widths
+ * and %n, and is safe to call from any thread. The format must outlive
+ * the log, string arguments are copied.
+ */
+void _snd_pcm_volumiofifo_log(volumiofifo_log_t *log, const char *fmt, ...)
+		__attribute__((format(printf, 2, 3)));
+
+/**
+ * Format and emit the recorded messages. Only one thread may flush at a
+ * time, which is the flusher thread while it is running.
+ */
+void _snd_pcm_volumiofifo_log_flush(volumiofifo_log_t *log);
+
+#endif
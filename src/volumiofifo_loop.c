@@ -0,0 +1,272 @@
+/*
+ *  PCM - Volumio FIFO plugin - shared memory loopback
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "volumiofifo_loop.h"
+
+static inline uint64_t _snd_pcm_volumiofifo_loop_fill(uint64_t write_pos, uint64_t read_pos) {
+	// The playback end restarting while the capture end reads can briefly leave the reader ahead
+	return (int64_t) (write_pos - read_pos) > 0 ? write_pos - read_pos : 0;
+}
+
+/**
+ * Whether an end is held by a process that still exists
+ */
+static int _snd_pcm_volumiofifo_loop_alive(volumiofifo_loop_side_t *side) {
+	pid_t pid = __atomic_load_n(&side->pid, __ATOMIC_ACQUIRE);
+
+	return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+static void _snd_pcm_volumiofifo_loop_describe(volumiofifo_loop_page_t *page, unsigned int frames) {
+	page->magic = VOLUMIOFIFO_LOOP_MAGIC;
+	page->version = VOLUMIOFIFO_LOOP_VERSION;
+	page->frames = frames;
+	page->format = 0;
+	page->rate = 0;
+	page->channels = 0;
+	page->frame_bytes = 0;
+	__atomic_store_n(&page->state, VOLUMIOFIFO_LOOP_READY, __ATOMIC_RELEASE);
+}
+
+int _snd_pcm_volumiofifo_loop_open(volumiofifo_loop_t *loop, const char *fifo_name, unsigned int side,
+		unsigned int frames) {
+	char shm_name[NAME_MAX];
+	volumiofifo_loop_page_t *page;
+	uint32_t expected = 0;
+	int32_t pid;
+	unsigned int i;
+	int err;
+
+	memset(loop, 0, sizeof(*loop));
+	loop->shm_fd = -1;
+	loop->side = side;
+	loop->size = sizeof(*page) + (size_t) frames * VOLUMIOFIFO_LOOP_MAX_FRAME_BYTES;
+
+	err = _snd_pcm_volumiofifo_shm_name(fifo_name, "loop", shm_name, sizeof(shm_name));
+	if(err < 0)
+		return err;
+
+	page = _snd_pcm_volumiofifo_shm_map_fd(shm_name, loop->size, 1, &loop->shm_fd);
+	if(page == NULL) {
+		err = -errno;
+		goto error;
+	}
+	loop->page = page;
+
+	if(__atomic_compare_exchange_n(&page->state, &expected, VOLUMIOFIFO_LOOP_INITIALISING, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		_snd_pcm_volumiofifo_loop_describe(page, frames);
+	} else {
+		for(i = 0; __atomic_load_n(&page->state, __ATOMIC_ACQUIRE) != VOLUMIOFIFO_LOOP_READY; i++) {
+			struct timespec ts = { 0, 1000000 };
+			if(i == 1000) {
+				err = -ETIMEDOUT;
+				goto error;
+			}
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	if(page->magic != VOLUMIOFIFO_LOOP_MAGIC || page->version != VOLUMIOFIFO_LOOP_VERSION ||
+			page->frames != frames) {
+		// A segment left behind with neither end open can be described again
+		expected = VOLUMIOFIFO_LOOP_READY;
+		if(_snd_pcm_volumiofifo_loop_alive(&page->sides[VOLUMIOFIFO_LOOP_PLAYBACK]) ||
+				_snd_pcm_volumiofifo_loop_alive(&page->sides[VOLUMIOFIFO_LOOP_CAPTURE]) ||
+				!__atomic_compare_exchange_n(&page->state, &expected, VOLUMIOFIFO_LOOP_INITIALISING, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			err = -EINVAL;
+			goto error;
+		}
+		_snd_pcm_volumiofifo_loop_describe(page, frames);
+	}
+
+	// An end left behind by a process that died can be taken over
+	pid = __atomic_load_n(&page->sides[side].pid, __ATOMIC_ACQUIRE);
+	if(_snd_pcm_volumiofifo_loop_alive(&page->sides[side]) ||
+			!__atomic_compare_exchange_n(&page->sides[side].pid, &pid, getpid(), 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		err = -EBUSY;
+		goto error;
+	}
+	__atomic_store_n(&page->sides[side].prepared, 0, __ATOMIC_RELEASE);
+	loop->ring = (unsigned char *) (page + 1);
+	loop->frames = frames;
+	loop->mask = frames - 1;
+
+	return 0;
+
+ error:
+	_snd_pcm_volumiofifo_loop_close(loop);
+	return err;
+}
+
+void _snd_pcm_volumiofifo_loop_close(volumiofifo_loop_t *loop) {
+	if(loop->ring != NULL) {
+		_snd_pcm_volumiofifo_loop_release(loop);
+		__atomic_store_n(&loop->page->sides[loop->side].pid, 0, __ATOMIC_RELEASE);
+		loop->ring = NULL;
+	}
+
+	_snd_pcm_volumiofifo_shm_unmap(loop->page, loop->size);
+	loop->page = NULL;
+
+	if(loop->shm_fd >= 0) {
+		close(loop->shm_fd);
+		loop->shm_fd = -1;
+	}
+}
+
+int _snd_pcm_volumiofifo_loop_peer(volumiofifo_loop_t *loop, unsigned int *format, unsigned int *rate,
+		unsigned int *channels) {
+	volumiofifo_loop_page_t *page = loop->page;
+	volumiofifo_loop_side_t *peer = &page->sides[loop->side ^ 1];
+	int fixed = 0;
+
+	if(flock(loop->shm_fd, LOCK_EX) < 0)
+		return 0;
+
+	if(_snd_pcm_volumiofifo_loop_alive(peer) && __atomic_load_n(&peer->prepared, __ATOMIC_ACQUIRE)) {
+		*format = page->format;
+		*rate = page->rate;
+		*channels = page->channels;
+		fixed = 1;
+	}
+
+	flock(loop->shm_fd, LOCK_UN);
+
+	return fixed;
+}
+
+int _snd_pcm_volumiofifo_loop_prepare(volumiofifo_loop_t *loop, unsigned int format, unsigned int rate,
+		unsigned int channels, unsigned int frame_bytes) {
+	volumiofifo_loop_page_t *page = loop->page;
+	volumiofifo_loop_side_t *self = &page->sides[loop->side];
+	volumiofifo_loop_side_t *peer = &page->sides[loop->side ^ 1];
+	int err = 0;
+
+	if(frame_bytes == 0 || frame_bytes > VOLUMIOFIFO_LOOP_MAX_FRAME_BYTES)
+		return -EINVAL;
+
+	if(flock(loop->shm_fd, LOCK_EX) < 0)
+		return -errno;
+
+	if(_snd_pcm_volumiofifo_loop_alive(peer) && __atomic_load_n(&peer->prepared, __ATOMIC_ACQUIRE)) {
+		if(page->format != format || page->rate != rate || page->channels != channels ||
+				page->frame_bytes != frame_bytes)
+			err = -EINVAL;
+	} else {
+		page->format = format;
+		page->rate = rate;
+		page->channels = channels;
+		page->frame_bytes = frame_bytes;
+	}
+
+	if(err == 0) {
+		loop->frame_bytes = frame_bytes;
+		__atomic_store_n(&self->pos, __atomic_load_n(&peer->pos, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+		__atomic_store_n(&self->prepared, 1, __ATOMIC_RELEASE);
+	}
+
+	flock(loop->shm_fd, LOCK_UN);
+
+	return err;
+}
+
+void _snd_pcm_volumiofifo_loop_release(volumiofifo_loop_t *loop) {
+	__atomic_store_n(&loop->page->sides[loop->side].prepared, 0, __ATOMIC_RELEASE);
+}
+
+unsigned int _snd_pcm_volumiofifo_loop_write(volumiofifo_loop_t *loop, const void *buf, unsigned int frames) {
+	volumiofifo_loop_page_t *page = loop->page;
+	volumiofifo_loop_side_t *self = &page->sides[VOLUMIOFIFO_LOOP_PLAYBACK];
+	unsigned int frame_bytes = loop->frame_bytes;
+	uint64_t write_pos = self->pos;
+	uint64_t fill = _snd_pcm_volumiofifo_loop_fill(write_pos,
+			__atomic_load_n(&page->sides[VOLUMIOFIFO_LOOP_CAPTURE].pos, __ATOMIC_ACQUIRE));
+	unsigned int space = fill < loop->frames ? loop->frames - fill : 0;
+	unsigned int done = 0;
+
+	if(frames > space)
+		frames = space;
+
+	// At most two runs, either side of the end of the ring
+	while(done < frames) {
+		unsigned int offset = (write_pos + done) & loop->mask;
+		unsigned int run = frames - done;
+		if(run > loop->frames - offset)
+			run = loop->frames - offset;
+
+		memcpy(loop->ring + (size_t) offset * frame_bytes,
+				(const unsigned char *) buf + (size_t) done * frame_bytes, (size_t) run * frame_bytes);
+		done += run;
+	}
+
+	__atomic_store_n(&self->pos, write_pos + frames, __ATOMIC_RELEASE);
+
+	return frames;
+}
+
+unsigned int _snd_pcm_volumiofifo_loop_read(volumiofifo_loop_t *loop, void *buf, unsigned int frames) {
+	volumiofifo_loop_page_t *page = loop->page;
+	volumiofifo_loop_side_t *self = &page->sides[VOLUMIOFIFO_LOOP_CAPTURE];
+	unsigned int frame_bytes = loop->frame_bytes;
+	uint64_t read_pos = self->pos;
+	uint64_t fill = _snd_pcm_volumiofifo_loop_fill(
+			__atomic_load_n(&page->sides[VOLUMIOFIFO_LOOP_PLAYBACK].pos, __ATOMIC_ACQUIRE), read_pos);
+	unsigned int done = 0;
+
+	if(frames > fill)
+		frames = fill;
+
+	while(done < frames) {
+		unsigned int offset = (read_pos + done) & loop->mask;
+		unsigned int run = frames - done;
+		if(run > loop->frames - offset)
+			run = loop->frames - offset;
+
+		memcpy((unsigned char *) buf + (size_t) done * frame_bytes,
+				loop->ring + (size_t) offset * frame_bytes, (size_t) run * frame_bytes);
+		done += run;
+	}
+
+	__atomic_store_n(&self->pos, read_pos + frames, __ATOMIC_RELEASE);
+
+	return frames;
+}
+
+unsigned int _snd_pcm_volumiofifo_loop_pending(volumiofifo_loop_t *loop) {
+	volumiofifo_loop_page_t *page = loop->page;
+	volumiofifo_loop_side_t *capture = &page->sides[VOLUMIOFIFO_LOOP_CAPTURE];
+
+	if(!_snd_pcm_volumiofifo_loop_alive(capture))
+		return 0;
+
+	return _snd_pcm_volumiofifo_loop_fill(__atomic_load_n(&page->sides[VOLUMIOFIFO_LOOP_PLAYBACK].pos,
+			__ATOMIC_ACQUIRE), __atomic_load_n(&capture->pos, __ATOMIC_ACQUIRE));
+}
@@ -0,0 +1,109 @@
+/*
+ *  PCM - Volumio FIFO plugin - shared memory loopback
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_LOOP_H
+#define __VOLUMIOFIFO_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "volumiofifo_shm.h"
+
+/*
+ * One end of a loopback, a playback PCM and a capture PCM sharing a ring
+ * in a shared memory segment instead of a fifo. Whichever end is prepared
+ * first chooses the stream parameters, and the other end must match them
+ * until both have been freed.
+ */
+typedef struct volumiofifo_loop {
+	volumiofifo_loop_page_t *page;
+	size_t size;
+	int shm_fd;
+	// VOLUMIOFIFO_LOOP_PLAYBACK or VOLUMIOFIFO_LOOP_CAPTURE
+	unsigned int side;
+	unsigned char *ring;
+
+	// The layout this end opened and prepared with, the page header is writable by anyone so is never trusted
+	unsigned int frames;
+	unsigned int mask;
+	unsigned int frame_bytes;
+} volumiofifo_loop_t;
+
+/**
+ * Open one end of the loopback named after a fifo path, creating the
+ * shared segment with a ring of frames frames (a power of two) if needed
+ *
+ * Returns 0 or -ve on error, -EBUSY if the end is already open and
+ * -EINVAL if the segment has a different ring size
+ */
+int _snd_pcm_volumiofifo_loop_open(volumiofifo_loop_t *loop, const char *fifo_name, unsigned int side,
+		unsigned int frames);
+
+/**
+ * Close this end of the loopback
+ */
+void _snd_pcm_volumiofifo_loop_close(volumiofifo_loop_t *loop);
+
+/**
+ * Get the stream parameters fixed by the other end, if it is prepared
+ *
+ * Returns 1 if the parameters are fixed, otherwise 0
+ */
+int _snd_pcm_volumiofifo_loop_peer(volumiofifo_loop_t *loop, unsigned int *format, unsigned int *rate,
+		unsigned int *channels);
+
+/**
+ * Prepare this end, fixing the stream parameters if the other end has not.
+ * The ring is emptied from this end's point of view, the playback end
+ * starting at the capture position and the capture end skipping anything
+ * left over.
+ *
+ * Returns 0 or -ve on error, -EINVAL if the parameters differ from those
+ * of the other end
+ */
+int _snd_pcm_volumiofifo_loop_prepare(volumiofifo_loop_t *loop, unsigned int format, unsigned int rate,
+		unsigned int channels, unsigned int frame_bytes);
+
+/**
+ * Release the stream parameters held by this end
+ */
+void _snd_pcm_volumiofifo_loop_release(volumiofifo_loop_t *loop);
+
+/**
+ * Copy as many whole frames as fit into the ring. Playback end only.
+ *
+ * Returns the frames copied
+ */
+unsigned int _snd_pcm_volumiofifo_loop_write(volumiofifo_loop_t *loop, const void *buf, unsigned int frames);
+
+/**
+ * Copy up to frames frames out of the ring. Capture end only.
+ *
+ * Returns the frames copied
+ */
+unsigned int _snd_pcm_volumiofifo_loop_read(volumiofifo_loop_t *loop, void *buf, unsigned int frames);
+
+/**
+ * The frames written that the capture end has not read, or 0 if the
+ * capture end is not open
+ */
+unsigned int _snd_pcm_volumiofifo_loop_pending(volumiofifo_loop_t *loop);
+
+#endif
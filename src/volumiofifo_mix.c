@@ -0,0 +1,414 @@
+/*
+ *  PCM - Volumio FIFO plugin - shared memory mixer
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include "volumiofifo_dsp.h"
+#include "volumiofifo_mix.h"
+
+/* Slot state between claiming it and resetting its counters */
+#define VOLUMIOFIFO_MIX_CLAIMED 2
+
+/* How long an idle mixer waits for a client before looking for dead ones */
+#define VOLUMIOFIFO_MIX_REAP_MS 1000
+
+/* How often a thread that is not mixing tries for the lock */
+#define VOLUMIOFIFO_MIX_ELECT_MS 100
+
+static void _snd_pcm_volumiofifo_mix_sleep(long ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * The page is shared with other processes, so the wait and wake are not
+ * process private
+ */
+static void _snd_pcm_volumiofifo_mix_futex_wait(uint32_t *addr, uint32_t value, long ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	syscall(SYS_futex, addr, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void _snd_pcm_volumiofifo_mix_futex_wake(uint32_t *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Wake the mixer if it is waiting for a client to write
+ */
+static void _snd_pcm_volumiofifo_mix_wake(volumiofifo_mix_page_t *page) {
+	__atomic_add_fetch(&page->wake, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&page->waiting, __ATOMIC_SEQ_CST))
+		_snd_pcm_volumiofifo_mix_futex_wake(&page->wake);
+}
+
+static inline unsigned char *_snd_pcm_volumiofifo_mix_ring(volumiofifo_mixer_t *mixer, unsigned int slot) {
+	return (unsigned char *) (mixer->page + 1) + (size_t) slot * mixer->frames * mixer->frame_bytes;
+}
+
+/**
+ * Frames waiting in a slot. A client that joins while the mixer is
+ * finishing with the previous owner can briefly see the mixer ahead.
+ */
+static inline uint64_t _snd_pcm_volumiofifo_mix_fill(uint64_t write_pos, uint64_t read_pos) {
+	return (int64_t) (write_pos - read_pos) > 0 ? write_pos - read_pos : 0;
+}
+
+static void _snd_pcm_volumiofifo_mix_describe(volumiofifo_mix_page_t *page, unsigned int format,
+		unsigned int rate, unsigned int channels, unsigned int frames, unsigned int frame_bytes) {
+	page->magic = VOLUMIOFIFO_MIX_MAGIC;
+	page->version = VOLUMIOFIFO_MIX_VERSION;
+	page->format = format;
+	page->rate = rate;
+	page->channels = channels;
+	page->frames = frames;
+	page->frame_bytes = frame_bytes;
+	__atomic_store_n(&page->state, VOLUMIOFIFO_MIX_READY, __ATOMIC_RELEASE);
+}
+
+static int _snd_pcm_volumiofifo_mix_unused(volumiofifo_mix_page_t *page) {
+	unsigned int i;
+
+	for(i = 0; i < VOLUMIOFIFO_MIX_CLIENTS; i++) {
+		if(__atomic_load_n(&page->clients[i].state, __ATOMIC_ACQUIRE) != VOLUMIOFIFO_MIX_FREE)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Free the slots of clients that died without closing
+ */
+static void _snd_pcm_volumiofifo_mix_reap(volumiofifo_mix_page_t *page) {
+	unsigned int i;
+
+	for(i = 0; i < VOLUMIOFIFO_MIX_CLIENTS; i++) {
+		volumiofifo_mix_client_t *client = &page->clients[i];
+		pid_t pid = __atomic_load_n(&client->pid, __ATOMIC_RELAXED);
+
+		if(__atomic_load_n(&client->state, __ATOMIC_ACQUIRE) == VOLUMIOFIFO_MIX_FREE || pid <= 0)
+			continue;
+		if(kill(pid, 0) < 0 && errno == ESRCH)
+			__atomic_store_n(&client->state, VOLUMIOFIFO_MIX_FREE, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Sum up to chunk frames from every active client, recording how many
+ * frames each one gave. Clients with less to give are padded with silence.
+ *
+ * Returns the frames mixed into out
+ */
+static unsigned int _snd_pcm_volumiofifo_mix_chunk(volumiofifo_mixer_t *mixer, void *acc, void *out,
+		unsigned int chunk, unsigned int *used) {
+	volumiofifo_mix_page_t *page = mixer->page;
+	unsigned int channels = mixer->channels;
+	unsigned int mask = mixer->frames - 1;
+	unsigned int mixed = 0;
+	unsigned int i;
+
+	memset(acc, 0, (size_t) chunk * channels * (mixer->sample_bytes == 2 ? sizeof(int32_t) : sizeof(int64_t)));
+
+	for(i = 0; i < VOLUMIOFIFO_MIX_CLIENTS; i++) {
+		volumiofifo_mix_client_t *client = &page->clients[i];
+		const unsigned char *ring = _snd_pcm_volumiofifo_mix_ring(mixer, i);
+		unsigned int done = 0;
+
+		used[i] = 0;
+		if(__atomic_load_n(&client->state, __ATOMIC_ACQUIRE) != VOLUMIOFIFO_MIX_ACTIVE)
+			continue;
+
+		// Only the mixer may move read_pos, so it carries out the client's discards
+		uint64_t read_pos = client->read_pos;
+		uint64_t discard_pos = __atomic_load_n(&client->discard_pos, __ATOMIC_ACQUIRE);
+		if((int64_t) (discard_pos - read_pos) > 0) {
+			read_pos = discard_pos;
+			__atomic_store_n(&client->read_pos, read_pos, __ATOMIC_RELEASE);
+		}
+
+		uint64_t fill = _snd_pcm_volumiofifo_mix_fill(__atomic_load_n(&client->write_pos, __ATOMIC_ACQUIRE), read_pos);
+		unsigned int frames = fill < chunk ? fill : chunk;
+
+		// At most two runs, either side of the end of the ring
+		while(done < frames) {
+			unsigned int offset = (read_pos + done) & mask;
+			unsigned int run = frames - done;
+			if(run > mixer->frames - offset)
+				run = mixer->frames - offset;
+
+			if(mixer->sample_bytes == 2)
+				_snd_pcm_volumiofifo_dsp_mix_s16((int32_t *) acc + (size_t) done * channels,
+						(const int16_t *) (ring + (size_t) offset * mixer->frame_bytes), run * channels);
+			else
+				_snd_pcm_volumiofifo_dsp_mix_s32((int64_t *) acc + (size_t) done * channels,
+						(const int32_t *) (ring + (size_t) offset * mixer->frame_bytes), run * channels);
+			done += run;
+		}
+
+		used[i] = frames;
+		if(frames > mixed)
+			mixed = frames;
+	}
+
+	if(mixer->sample_bytes == 2)
+		_snd_pcm_volumiofifo_dsp_mix_s16_out(acc, out, mixed * channels);
+	else
+		_snd_pcm_volumiofifo_dsp_mix_s32_out(acc, out, mixed * channels);
+
+	return mixed;
+}
+
+static void *_snd_pcm_volumiofifo_mix_thread(void *arg) {
+	volumiofifo_mixer_t *mixer = arg;
+	volumiofifo_mix_page_t *page = mixer->page;
+	unsigned int chunk = PIPE_BUF / mixer->frame_bytes;
+	unsigned int used[VOLUMIOFIFO_MIX_CLIENTS];
+	int leader = 0;
+	void *acc, *out;
+
+	acc = malloc((size_t) chunk * mixer->channels * sizeof(int64_t));
+	out = malloc(PIPE_BUF);
+	if(acc == NULL || out == NULL)
+		goto done;
+
+	while(!__atomic_load_n(&mixer->stop, __ATOMIC_ACQUIRE)) {
+		if(!leader) {
+			if(flock(mixer->shm_fd, LOCK_EX | LOCK_NB) < 0) {
+				_snd_pcm_volumiofifo_mix_sleep(VOLUMIOFIFO_MIX_ELECT_MS);
+				continue;
+			}
+			leader = 1;
+			_snd_pcm_volumiofifo_mix_reap(page);
+		}
+
+		struct pollfd pfd = { mixer->fifo_fd, POLLOUT, 0 };
+		if(poll(&pfd, 1, VOLUMIOFIFO_MIX_ELECT_MS) <= 0)
+			continue;
+
+		// Announce the wait before looking, so that a client writing after the look wakes us
+		__atomic_store_n(&page->waiting, 1, __ATOMIC_SEQ_CST);
+		uint32_t wake = __atomic_load_n(&page->wake, __ATOMIC_SEQ_CST);
+
+		unsigned int frames = _snd_pcm_volumiofifo_mix_chunk(mixer, acc, out, chunk, used);
+		if(frames == 0) {
+			if(!__atomic_load_n(&mixer->stop, __ATOMIC_ACQUIRE))
+				_snd_pcm_volumiofifo_mix_futex_wait(&page->wake, wake, VOLUMIOFIFO_MIX_REAP_MS);
+			if(__atomic_load_n(&page->wake, __ATOMIC_RELAXED) == wake)
+				_snd_pcm_volumiofifo_mix_reap(page);
+			continue;
+		}
+		__atomic_store_n(&page->waiting, 0, __ATOMIC_RELAXED);
+
+		// Writes of up to PIPE_BUF are all or nothing, so the clients only move on success
+		if(write(mixer->fifo_fd, out, (size_t) frames * mixer->frame_bytes) < 0)
+			continue;
+
+		unsigned int i;
+		for(i = 0; i < VOLUMIOFIFO_MIX_CLIENTS; i++) {
+			if(used[i] > 0)
+				__atomic_store_n(&page->clients[i].read_pos, page->clients[i].read_pos + used[i],
+						__ATOMIC_RELEASE);
+		}
+	}
+
+ done:
+	if(leader)
+		flock(mixer->shm_fd, LOCK_UN);
+	free(acc);
+	free(out);
+	return NULL;
+}
+
+int _snd_pcm_volumiofifo_mix_open(volumiofifo_mixer_t *mixer, const char *fifo_name, int fifo_fd,
+		unsigned int format, unsigned int sample_bytes, unsigned int rate, unsigned int channels,
+		unsigned int frames) {
+	char shm_name[NAME_MAX];
+	volumiofifo_mix_page_t *page;
+	unsigned int frame_bytes = sample_bytes * channels;
+	uint32_t expected = 0;
+	unsigned int i;
+	int err;
+
+	memset(mixer, 0, sizeof(*mixer));
+	mixer->shm_fd = -1;
+	mixer->sample_bytes = sample_bytes;
+	mixer->channels = channels;
+	mixer->frames = frames;
+	mixer->frame_bytes = frame_bytes;
+
+	// The PCM closes its descriptors in hw_free, but the mixer may still be serving others
+	mixer->fifo_fd = fcntl(fifo_fd, F_DUPFD_CLOEXEC, 0);
+	if(mixer->fifo_fd < 0)
+		return -errno;
+	mixer->size = sizeof(*page) + (size_t) VOLUMIOFIFO_MIX_CLIENTS * frames * frame_bytes;
+
+	err = _snd_pcm_volumiofifo_shm_name(fifo_name, "mix", shm_name, sizeof(shm_name));
+	if(err < 0)
+		return err;
+
+	page = _snd_pcm_volumiofifo_shm_map_fd(shm_name, mixer->size, 1, &mixer->shm_fd);
+	if(page == NULL)
+		return -errno;
+	mixer->page = page;
+
+	// The first client in describes the stream, everybody else must match it
+	if(__atomic_compare_exchange_n(&page->state, &expected, VOLUMIOFIFO_MIX_INITIALISING, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		_snd_pcm_volumiofifo_mix_describe(page, format, rate, channels, frames, frame_bytes);
+	} else {
+		for(i = 0; __atomic_load_n(&page->state, __ATOMIC_ACQUIRE) != VOLUMIOFIFO_MIX_READY; i++) {
+			if(i == 1000) {
+				err = -ETIMEDOUT;
+				goto error;
+			}
+			_snd_pcm_volumiofifo_mix_sleep(1);
+		}
+	}
+
+	if(page->magic != VOLUMIOFIFO_MIX_MAGIC || page->version != VOLUMIOFIFO_MIX_VERSION ||
+			page->format != format || page->rate != rate || page->channels != channels ||
+			page->frames != frames || page->frame_bytes != frame_bytes) {
+		// A segment left behind with nobody using it can be described again
+		expected = VOLUMIOFIFO_MIX_READY;
+		if(!_snd_pcm_volumiofifo_mix_unused(page) ||
+				!__atomic_compare_exchange_n(&page->state, &expected, VOLUMIOFIFO_MIX_INITIALISING, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			err = -EINVAL;
+			goto error;
+		}
+		_snd_pcm_volumiofifo_mix_describe(page, format, rate, channels, frames, frame_bytes);
+	}
+
+	for(i = 0; i < VOLUMIOFIFO_MIX_CLIENTS; i++) {
+		expected = VOLUMIOFIFO_MIX_FREE;
+		if(__atomic_compare_exchange_n(&page->clients[i].state, &expected, VOLUMIOFIFO_MIX_CLAIMED, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if(i == VOLUMIOFIFO_MIX_CLIENTS) {
+		err = -EBUSY;
+		goto error;
+	}
+
+	mixer->slot = i;
+	mixer->ring = _snd_pcm_volumiofifo_mix_ring(mixer, i);
+	page->clients[i].pid = getpid();
+	page->clients[i].write_pos = __atomic_load_n(&page->clients[i].read_pos, __ATOMIC_ACQUIRE);
+	page->clients[i].discard_pos = page->clients[i].write_pos;
+	__atomic_store_n(&page->clients[i].state, VOLUMIOFIFO_MIX_ACTIVE, __ATOMIC_RELEASE);
+
+	err = -pthread_create(&mixer->thread, NULL, _snd_pcm_volumiofifo_mix_thread, mixer);
+	if(err < 0)
+		goto error;
+	mixer->thread_started = 1;
+
+	return 0;
+
+ error:
+	_snd_pcm_volumiofifo_mix_close(mixer);
+	return err;
+}
+
+void _snd_pcm_volumiofifo_mix_close(volumiofifo_mixer_t *mixer) {
+	if(mixer->thread_started) {
+		__atomic_store_n(&mixer->stop, 1, __ATOMIC_RELEASE);
+		// Move wake on as well, in case the thread is about to wait
+		__atomic_add_fetch(&mixer->page->wake, 1, __ATOMIC_SEQ_CST);
+		_snd_pcm_volumiofifo_mix_futex_wake(&mixer->page->wake);
+		pthread_join(mixer->thread, NULL);
+		mixer->thread_started = 0;
+	}
+
+	if(mixer->ring != NULL) {
+		__atomic_store_n(&mixer->page->clients[mixer->slot].state, VOLUMIOFIFO_MIX_FREE, __ATOMIC_RELEASE);
+		mixer->ring = NULL;
+	}
+
+	_snd_pcm_volumiofifo_shm_unmap(mixer->page, mixer->size);
+	mixer->page = NULL;
+
+	if(mixer->shm_fd >= 0) {
+		close(mixer->shm_fd);
+		mixer->shm_fd = -1;
+	}
+
+	if(mixer->fifo_fd >= 0) {
+		close(mixer->fifo_fd);
+		mixer->fifo_fd = -1;
+	}
+}
+
+unsigned int _snd_pcm_volumiofifo_mix_write(volumiofifo_mixer_t *mixer, const void *buf, unsigned int frames) {
+	volumiofifo_mix_page_t *page = mixer->page;
+	volumiofifo_mix_client_t *client = &page->clients[mixer->slot];
+	uint64_t write_pos = client->write_pos;
+	uint64_t fill = _snd_pcm_volumiofifo_mix_fill(write_pos, __atomic_load_n(&client->read_pos, __ATOMIC_ACQUIRE));
+	unsigned int space = fill < mixer->frames ? mixer->frames - fill : 0;
+	unsigned int done = 0;
+
+	if(frames > space)
+		frames = space;
+
+	while(done < frames) {
+		unsigned int offset = (write_pos + done) & (mixer->frames - 1);
+		unsigned int run = frames - done;
+		if(run > mixer->frames - offset)
+			run = mixer->frames - offset;
+
+		memcpy(mixer->ring + (size_t) offset * mixer->frame_bytes,
+				(const unsigned char *) buf + (size_t) done * mixer->frame_bytes,
+				(size_t) run * mixer->frame_bytes);
+		done += run;
+	}
+
+	__atomic_store_n(&client->write_pos, write_pos + frames, __ATOMIC_RELEASE);
+	if(frames > 0)
+		_snd_pcm_volumiofifo_mix_wake(page);
+
+	return frames;
+}
+
+void _snd_pcm_volumiofifo_mix_discard(volumiofifo_mixer_t *mixer) {
+	volumiofifo_mix_client_t *client = &mixer->page->clients[mixer->slot];
+
+	__atomic_store_n(&client->discard_pos, client->write_pos, __ATOMIC_RELEASE);
+	_snd_pcm_volumiofifo_mix_wake(mixer->page);
+}
+
+unsigned int _snd_pcm_volumiofifo_mix_pending(volumiofifo_mixer_t *mixer) {
+	volumiofifo_mix_client_t *client = &mixer->page->clients[mixer->slot];
+	uint64_t read_pos = __atomic_load_n(&client->read_pos, __ATOMIC_ACQUIRE);
+
+	// Frames up to discard_pos are as good as gone, even if the mixer has yet to skip them
+	if((int64_t) (client->discard_pos - read_pos) > 0)
+		read_pos = client->discard_pos;
+	return _snd_pcm_volumiofifo_mix_fill(client->write_pos, read_pos);
+}
@@ -0,0 +1,92 @@
+/*
+ *  PCM - Volumio FIFO plugin - shared memory mixer
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_MIX_H
+#define __VOLUMIOFIFO_MIX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "volumiofifo_shm.h"
+
+/*
+ * Lets several PCMs share one fifo. Each PCM writes to its own ring in a
+ * shared memory segment, and a thread in every PCM competes for a lock on
+ * the segment. Whichever holds it sums the rings into the fifo, and when
+ * that process goes away another thread takes over.
+ */
+typedef struct volumiofifo_mixer {
+	volumiofifo_mix_page_t *page;
+	size_t size;
+	int shm_fd;
+	// A duplicate of the PCM's fifo descriptor
+	int fifo_fd;
+	// This PCM's slot
+	unsigned int slot;
+	unsigned char *ring;
+
+	// The layout this PCM joined with, the page header is writable by anyone so is never trusted
+	unsigned int sample_bytes;
+	unsigned int channels;
+	unsigned int frames;
+	unsigned int frame_bytes;
+
+	pthread_t thread;
+	int thread_started;
+	int stop;
+} volumiofifo_mixer_t;
+
+/**
+ * Join the mixer for a fifo, creating the shared segment if this is the
+ * first client. Every client must use the same format, rate, channels and
+ * ring size, format being the alsa-lib format value and sample_bytes 2 or 4.
+ *
+ * Returns 0 or -ve on error, -EBUSY if every slot is taken and -EINVAL if
+ * the segment was created with different parameters
+ */
+int _snd_pcm_volumiofifo_mix_open(volumiofifo_mixer_t *mixer, const char *fifo_name, int fifo_fd,
+		unsigned int format, unsigned int sample_bytes, unsigned int rate, unsigned int channels,
+		unsigned int frames);
+
+/**
+ * Leave the mixer, releasing the slot and handing over the mixing
+ */
+void _snd_pcm_volumiofifo_mix_close(volumiofifo_mixer_t *mixer);
+
+/**
+ * Copy as many whole frames as fit into this client's ring
+ *
+ * Returns the frames copied
+ */
+unsigned int _snd_pcm_volumiofifo_mix_write(volumiofifo_mixer_t *mixer, const void *buf, unsigned int frames);
+
+/**
+ * Drop the frames this client has written but the mixer has not yet taken.
+ * The mixer skips them the next time it looks at the ring.
+ */
+void _snd_pcm_volumiofifo_mix_discard(volumiofifo_mixer_t *mixer);
+
+/**
+ * The frames written by this client that have not yet been mixed
+ */
+unsigned int _snd_pcm_volumiofifo_mix_pending(volumiofifo_mixer_t *mixer);
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ *  PCM - Volumio FIFO plugin - session recording
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include "volumiofifo_flight.h"
+#include "volumiofifo_session.h"
+
+static int _snd_pcm_volumiofifo_session_write(volumiofifo_session_t *session, const void *buf, size_t length) {
+	while(length > 0) {
+		ssize_t written = write(session->fd, buf, length);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf = (const char *) buf + written;
+		length -= written;
+	}
+	return 0;
+}
+
+static void *_snd_pcm_volumiofifo_session_thread(void *arg) {
+	volumiofifo_session_t *session = arg;
+
+	pthread_mutex_lock(&session->lock);
+	for(;;) {
+		while(session->pending == 0 && !session->stop)
+			pthread_cond_wait(&session->wake, &session->lock);
+		if(session->pending == 0)
+			break;
+
+		// The callbacks only touch the current buffer, so the other is ours until pending is cleared
+		const volumiofifo_session_record_t *records = session->records[session->current ^ 1];
+		size_t length = session->pending * sizeof(records[0]);
+		pthread_mutex_unlock(&session->lock);
+
+		int err = _snd_pcm_volumiofifo_session_write(session, records, length);
+
+		pthread_mutex_lock(&session->lock);
+		if(err < 0 && session->error == 0)
+			session->error = err;
+		session->pending = 0;
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	return NULL;
+}
+
+int _snd_pcm_volumiofifo_session_open(volumiofifo_session_t *session, const char *dir, const char *name,
+		uint32_t fifo_size) {
+	volumiofifo_session_header_t header = {
+		.magic = VOLUMIOFIFO_SESSION_MAGIC,
+		.version = VOLUMIOFIFO_SESSION_VERSION,
+		.record_bytes = sizeof(volumiofifo_session_record_t),
+		.fifo_size = fifo_size,
+	};
+	char used[PATH_MAX];
+	int dir_fd, err;
+
+	session->current = 0;
+	session->used = 0;
+	session->pending = 0;
+	session->error = 0;
+	session->thread_started = 0;
+	session->stop = 0;
+
+	dir_fd = _snd_pcm_volumiofifo_private_dir(dir, used, sizeof(used));
+	if(dir_fd < 0)
+		return dir_fd;
+
+	// Never write through whatever is there, it is replaced with a new file
+	if(unlinkat(dir_fd, name, 0) < 0 && errno != ENOENT) {
+		err = -errno;
+		close(dir_fd);
+		return err;
+	}
+	session->fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	err = session->fd < 0 ? -errno : 0;
+	close(dir_fd);
+	if(err < 0)
+		return err;
+
+	err = _snd_pcm_volumiofifo_session_write(session, &header, sizeof(header));
+	if(err < 0) {
+		close(session->fd);
+		return err;
+	}
+
+	pthread_mutex_init(&session->lock, NULL);
+	pthread_cond_init(&session->wake, NULL);
+
+	err = -pthread_create(&session->thread, NULL, _snd_pcm_volumiofifo_session_thread, session);
+	if(err < 0) {
+		pthread_cond_destroy(&session->wake);
+		pthread_mutex_destroy(&session->lock);
+		close(session->fd);
+		return err;
+	}
+	session->thread_started = 1;
+
+	return 0;
+}
+
+int _snd_pcm_volumiofifo_session_close(volumiofifo_session_t *session) {
+	pthread_mutex_lock(&session->lock);
+	session->stop = 1;
+	pthread_cond_signal(&session->wake);
+	pthread_mutex_unlock(&session->lock);
+	pthread_join(session->thread, NULL);
+	session->thread_started = 0;
+
+	// The thread has gone, so the last partly filled buffer is written here
+	if(session->error == 0 && session->used > 0)
+		session->error = _snd_pcm_volumiofifo_session_write(session, session->records[session->current],
+				session->used * sizeof(session->records[0][0]));
+	session->used = 0;
+
+	pthread_cond_destroy(&session->wake);
+	pthread_mutex_destroy(&session->lock);
+	if(close(session->fd) < 0 && session->error == 0)
+		session->error = -errno;
+	session->fd = -1;
+
+	return session->error;
+}
+
+void _snd_pcm_volumiofifo_session_add(volumiofifo_session_t *session, const volumiofifo_session_record_t *record) {
+	pthread_mutex_lock(&session->lock);
+	if(session->error == 0) {
+		session->records[session->current][session->used++] = *record;
+		if(session->used == VOLUMIOFIFO_SESSION_RECORDS) {
+			if(session->pending > 0) {
+				// Waiting for the thread would stall the client, so the recording ends here instead
+				session->error = -ENOBUFS;
+			} else {
+				session->pending = session->used;
+				session->current ^= 1;
+				session->used = 0;
+				pthread_cond_signal(&session->wake);
+			}
+		}
+	}
+	pthread_mutex_unlock(&session->lock);
+}
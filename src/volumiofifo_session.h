@@ -0,0 +1,170 @@
+/*
+ *  PCM - Volumio FIFO plugin - session recording
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_SESSION_H
+#define __VOLUMIOFIFO_SESSION_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define VOLUMIOFIFO_SESSION_MAGIC 0x53465856 /* "VXFS" */
+#define VOLUMIOFIFO_SESSION_VERSION 1
+
+/* Records buffered before they are written to the file */
+#define VOLUMIOFIFO_SESSION_RECORDS 1024
+
+typedef enum volumiofifo_session_type {
+	VOLUMIOFIFO_SESSION_PARAMS = 0,
+	VOLUMIOFIFO_SESSION_PREPARE,
+	VOLUMIOFIFO_SESSION_START,
+	VOLUMIOFIFO_SESSION_STOP,
+	VOLUMIOFIFO_SESSION_TRANSFER,
+	VOLUMIOFIFO_SESSION_POINTER,
+	VOLUMIOFIFO_SESSION_HW_FREE,
+	VOLUMIOFIFO_SESSION_POLL_COUNT,
+	VOLUMIOFIFO_SESSION_POLL_DESCRIPTORS,
+	VOLUMIOFIFO_SESSION_POLL_REVENTS,
+	VOLUMIOFIFO_SESSION_PAUSE,
+	VOLUMIOFIFO_SESSION_DELAY,
+	VOLUMIOFIFO_SESSION_WRITE,
+	VOLUMIOFIFO_SESSION_TYPES,
+} volumiofifo_session_type_t;
+
+/*
+ * Set in the type of a record made inside another callback, such as the
+ * pointer callback alsa-lib makes while the plugin syncs in poll_revents.
+ * Replaying the outer callback repeats the nested ones.
+ */
+#define VOLUMIOFIFO_SESSION_NESTED 0x8000
+
+/*
+ * The file starts with this header, followed by records of record_bytes.
+ * Everything is in the recording machine's byte order.
+ */
+typedef struct volumiofifo_session_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_bytes;
+	/* Capacity of the fifo when the PCM was opened, 0 if unknown */
+	uint32_t fifo_size;
+} volumiofifo_session_header_t;
+
+/*
+ * A callback, recorded as it returns, or a write to the fifo. The writes a
+ * callback makes come before the callback's own record.
+ *
+ *   prepare, start, stop, hw_free - result is the return value
+ *   transfer - arg is the frames offered, result the return value
+ *   pointer - result is the pointer returned
+ *   poll_count - result is the descriptor count
+ *   poll_descriptors - arg is the events asked for, result the return value
+ *   poll_revents - arg is the revents from poll, result the revents
+ *                  returned or a negative error
+ *   pause - arg is enable
+ *   delay - result is the delay or a negative error
+ *   write - arg is the bytes offered, result the bytes written or a
+ *           negative errno
+ */
+typedef struct volumiofifo_session_call {
+	uint16_t type;
+	/* The alsa-lib snd_pcm_state_t on entry */
+	uint16_t state;
+	uint32_t arg;
+	/* CLOCK_MONOTONIC on entry */
+	uint64_t time_ns;
+	/* alsa-lib's pointers on entry */
+	uint64_t hw_ptr;
+	uint64_t appl_ptr;
+	int64_t result;
+} volumiofifo_session_call_t;
+
+/* The hw params, recorded on every prepare ahead of the prepare itself */
+typedef struct volumiofifo_session_params {
+	uint16_t type;
+	uint16_t pad;
+	/* The client's snd_pcm_format_t */
+	uint32_t format;
+	uint64_t time_ns;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t buffer_size;
+	uint32_t period_size;
+	uint64_t boundary;
+} volumiofifo_session_params_t;
+
+typedef union volumiofifo_session_record {
+	uint16_t type;
+	volumiofifo_session_call_t call;
+	volumiofifo_session_params_t params;
+} volumiofifo_session_record_t;
+
+/*
+ * Records every callback of one PCM to a file, for volumiofifo-replay.
+ * Records are buffered, and a full buffer is handed to a thread of the
+ * recorder's own to write while the callbacks fill the other, so no file
+ * I/O happens in a callback. The lock is only held to add a record or swap
+ * the buffers.
+ */
+typedef struct volumiofifo_session {
+	int fd;
+	pthread_mutex_t lock;
+	/* The buffer being filled, and the records in it */
+	unsigned int current;
+	unsigned int used;
+	/* The records in the other buffer for the thread to write, 0 once written */
+	unsigned int pending;
+	/*
+	 * The first error writing the file, or -ENOBUFS if a buffer filled
+	 * before the thread had written the other, after which nothing more is
+	 * recorded
+	 */
+	int error;
+
+	pthread_t thread;
+	pthread_cond_t wake;
+	int thread_started;
+	int stop;
+
+	volumiofifo_session_record_t records[2][VOLUMIOFIFO_SESSION_RECORDS];
+} volumiofifo_session_t;
+
+/**
+ * Create the file name in dir, write its header and start the thread which
+ * writes the records. If dir can be written by other users the file goes
+ * in a private subdirectory of it instead. The file is always created anew,
+ * never written through whatever was there.
+ *
+ * Returns 0 or -ve on error, -EPERM if the private directory belongs to
+ * somebody else
+ */
+int _snd_pcm_volumiofifo_session_open(volumiofifo_session_t *session, const char *dir, const char *name,
+		uint32_t fifo_size);
+
+/**
+ * Stop the thread, write out anything buffered and close the file
+ *
+ * Returns 0 or the first error writing the file
+ */
+int _snd_pcm_volumiofifo_session_close(volumiofifo_session_t *session);
+
+void _snd_pcm_volumiofifo_session_add(volumiofifo_session_t *session, const volumiofifo_session_record_t *record);
+
+#endif
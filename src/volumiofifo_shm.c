@@ -0,0 +1,123 @@
+/*
+ *  PCM - Volumio FIFO plugin - shared memory
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "volumiofifo_shm.h"
+
+int _snd_pcm_volumiofifo_shm_name(const char *fifo_name, const char *suffix, char *buf, size_t len) {
+	size_t i;
+	int written = snprintf(buf, len, "/volumiofifo%s.%s", fifo_name, suffix);
+
+	if(written < 0 || (size_t) written >= len)
+		return -ENAMETOOLONG;
+
+	// Only the leading slash is allowed in a shared memory name
+	for(i = 1; buf[i] != '\0'; i++) {
+		if(buf[i] == '/')
+			buf[i] = '_';
+	}
+	return 0;
+}
+
+void *_snd_pcm_volumiofifo_shm_map_fd(const char *shm_name, size_t size, int create, int *fdp) {
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = shm_open(shm_name, create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0666);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if((size_t) st.st_size < size) {
+		// A reader must not map past the end of a page the plugin has not sized yet
+		int err = create ? 0 : EINVAL;
+
+		if(err == 0 && ftruncate(fd, size) < 0)
+			err = errno;
+		if(err != 0) {
+			close(fd);
+			errno = err;
+			return NULL;
+		}
+		// Readers and writers often run as different users
+		fchmod(fd, 0666);
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	if(fdp != NULL)
+		*fdp = fd;
+	else
+		close(fd);
+
+	return addr;
+}
+
+void *_snd_pcm_volumiofifo_shm_map(const char *shm_name, size_t size, int create) {
+	return _snd_pcm_volumiofifo_shm_map_fd(shm_name, size, create, NULL);
+}
+
+void _snd_pcm_volumiofifo_shm_unmap(void *addr, size_t size) {
+	if(addr != NULL)
+		munmap(addr, size);
+}
+
+uint64_t _snd_pcm_volumiofifo_histogram_percentile(const volumiofifo_histogram_t *histogram, double fraction) {
+	uint64_t counts[VOLUMIOFIFO_HISTOGRAM_BUCKETS];
+	uint64_t total = 0, seen = 0, rank;
+	int i;
+
+	// Take a copy, the plugin may be adding to it
+	for(i = 0; i < VOLUMIOFIFO_HISTOGRAM_BUCKETS; i++) {
+		counts[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+		total += counts[i];
+	}
+	if(total == 0)
+		return 0;
+
+	rank = (uint64_t) (fraction * total);
+	if(rank >= total)
+		rank = total - 1;
+
+	for(i = 0; i < VOLUMIOFIFO_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += counts[i];
+		if(seen > rank)
+			break;
+	}
+	return i == 0 ? 0 : (uint64_t) 1 << i;
+}
@@ -0,0 +1,292 @@
+/*
+ *  PCM - Volumio FIFO plugin - shared memory
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_SHM_H
+#define __VOLUMIOFIFO_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Layouts of the shared memory pages published by the plugin. These are
+ * read by other processes, so fields may only be appended and the version
+ * must be bumped whenever the meaning of an existing field changes.
+ */
+
+#define VOLUMIOFIFO_VOLUME_MAGIC 0x564c4f56 /* "VOLV" */
+#define VOLUMIOFIFO_VOLUME_VERSION 1
+
+typedef struct volumiofifo_volume_page {
+	uint32_t magic;
+	uint32_t version;
+	/* Set once the control has written a value */
+	uint32_t initialised;
+	/* The raw control value, and the linear gain it maps to as float bits */
+	int32_t value;
+	uint32_t gain_bits;
+} volumiofifo_volume_page_t;
+
+#define VOLUMIOFIFO_METER_MAGIC 0x564c4f4d /* "VOLM" */
+#define VOLUMIOFIFO_METER_VERSION 1
+#define VOLUMIOFIFO_METER_CHANNELS 16
+
+/*
+ * Levels are published under a sequence lock. The plugin makes seq odd
+ * while it updates the page, so a reader copies the levels and retries
+ * if seq was odd or changed in the meantime. Readers must also change
+ * heartbeat at least once a second, otherwise the plugin stops metering.
+ */
+typedef struct volumiofifo_meter_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t heartbeat;
+	/* The fifo rate and channels, and the frames in each update */
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t period_frames;
+	uint32_t reserved;
+	/* Frames metered since the plugin was opened */
+	uint64_t frames;
+	/* Linear levels relative to full scale */
+	float peak[VOLUMIOFIFO_METER_CHANNELS];
+	float rms[VOLUMIOFIFO_METER_CHANNELS];
+	/* Non-zero while the plugin has stopped writing digital silence */
+	uint32_t standby;
+} volumiofifo_meter_page_t;
+
+#define VOLUMIOFIFO_TAP_MAGIC 0x564c4f54 /* "VOLT" */
+#define VOLUMIOFIFO_TAP_VERSION 1
+
+/*
+ * A lossy ring of recent audio for visualizers, never holding up the
+ * fifo. The plugin raises write_start before it overwrites any frames and
+ * write_end once they are complete. To read the newest n frames, load
+ * write_end, copy the n frames before it, then check that write_start
+ * has not moved more than frames past the first frame copied. Readers
+ * must change heartbeat at least once a second to keep the tap running.
+ */
+typedef struct volumiofifo_tap_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t heartbeat;
+	/* The tap rate, 0 while the plugin is not producing audio */
+	uint32_t rate;
+	uint32_t channels;
+	/* The ring size in frames, a power of two */
+	uint32_t frames;
+	uint64_t write_start;
+	uint64_t write_end;
+	/* Interleaved native endian S16 frames, frame n at n % frames */
+	int16_t data[];
+} volumiofifo_tap_page_t;
+
+#define VOLUMIOFIFO_MIX_MAGIC 0x564c4f58 /* "VOLX" */
+#define VOLUMIOFIFO_MIX_VERSION 3
+#define VOLUMIOFIFO_MIX_CLIENTS 8
+
+/* Slot states */
+#define VOLUMIOFIFO_MIX_FREE 0
+#define VOLUMIOFIFO_MIX_ACTIVE 1
+
+/* Page states */
+#define VOLUMIOFIFO_MIX_INITIALISING 1
+#define VOLUMIOFIFO_MIX_READY 2
+
+/*
+ * One client of the mixer. The client owns write_pos and discard_pos and
+ * the mixer owns read_pos, all count frames since the slot was claimed.
+ * The mixer skips read_pos forward to discard_pos when it is behind.
+ */
+typedef struct volumiofifo_mix_client {
+	uint32_t state;
+	int32_t pid;
+	uint64_t write_pos;
+	uint64_t read_pos;
+	uint64_t discard_pos;
+	/* Keep the client and mixer counters of neighbouring slots apart */
+	uint8_t pad[32];
+} volumiofifo_mix_client_t;
+
+/*
+ * Shared by every PCM mixing into one fifo. Each client slot has a ring
+ * of frames frames after the page, slot n starting at n * frames frames.
+ * The process holding an exclusive flock on the segment does the mixing.
+ * Clients bump wake after each write, and futex wake it if the mixer has
+ * set waiting.
+ */
+typedef struct volumiofifo_mix_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t state;
+	/* The sample format, as the alsa-lib snd_pcm_format_t value */
+	uint32_t format;
+	uint32_t rate;
+	uint32_t channels;
+	/* Frames per client ring, a power of two */
+	uint32_t frames;
+	uint32_t frame_bytes;
+	uint32_t wake;
+	uint32_t waiting;
+	volumiofifo_mix_client_t clients[VOLUMIOFIFO_MIX_CLIENTS];
+} volumiofifo_mix_page_t;
+
+#define VOLUMIOFIFO_LOOP_MAGIC 0x564c4f4c /* "VOLL" */
+#define VOLUMIOFIFO_LOOP_VERSION 1
+
+/* The two ends of a loopback */
+#define VOLUMIOFIFO_LOOP_PLAYBACK 0
+#define VOLUMIOFIFO_LOOP_CAPTURE 1
+
+/* Page states */
+#define VOLUMIOFIFO_LOOP_INITIALISING 1
+#define VOLUMIOFIFO_LOOP_READY 2
+
+/* The largest frame a loopback ring may hold, 16 channels of 64 bit samples */
+#define VOLUMIOFIFO_LOOP_MAX_FRAME_BYTES 128
+
+/*
+ * One end of a loopback. Each end only writes its own pos, which counts
+ * the frames it has written or read.
+ */
+typedef struct volumiofifo_loop_side {
+	int32_t pid;
+	/* Set while the end is prepared, fixing the stream parameters */
+	uint32_t prepared;
+	uint64_t pos;
+	uint8_t pad[48];
+} volumiofifo_loop_side_t;
+
+/*
+ * A userspace replacement for snd-aloop. The ring of frames frames follows
+ * the page, and is sized for the largest frame so that the stream format
+ * can be chosen when an end is prepared. Only the pages that the format
+ * uses are ever touched. The parameters are changed under an exclusive
+ * flock on the segment.
+ */
+typedef struct volumiofifo_loop_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t state;
+	/* Frames in the ring, a power of two */
+	uint32_t frames;
+	/* The sample format, as the alsa-lib snd_pcm_format_t value */
+	uint32_t format;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t frame_bytes;
+	volumiofifo_loop_side_t sides[2];
+} volumiofifo_loop_page_t;
+
+#define VOLUMIOFIFO_STATS_MAGIC 0x564c4f53 /* "VOLS" */
+#define VOLUMIOFIFO_STATS_VERSION 3
+
+/* Histogram buckets, enough for durations in ns up to about nine minutes */
+#define VOLUMIOFIFO_HISTOGRAM_BUCKETS 40
+
+/*
+ * A log2 histogram. Bucket 0 counts zeros and bucket i counts values from
+ * 2^(i-1) up to 2^i, the last bucket taking anything larger.
+ */
+typedef struct volumiofifo_histogram {
+	uint64_t buckets[VOLUMIOFIFO_HISTOGRAM_BUCKETS];
+} volumiofifo_histogram_t;
+
+/*
+ * Counters kept by one PCM, in a page of its own named after the fifo,
+ * the pid and a count of the PCMs opened by the process. The plugin
+ * updates every field with relaxed atomics, so any field may be read at
+ * any time. The page is removed when the PCM closes, but is left behind
+ * if the process dies.
+ */
+typedef struct volumiofifo_stats_page {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	/* The alsa-lib snd_pcm_state_t of the PCM */
+	uint32_t state;
+	/* The fifo format, as the alsa-lib snd_pcm_format_t value */
+	uint32_t format;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t frame_bytes;
+	char fifo[256];
+	uint64_t bytes_written;
+	uint64_t frames_written;
+	/* Write system calls, those that found the fifo full, and writes of less than was offered */
+	uint64_t writes;
+	uint64_t eagains;
+	uint64_t partial_writes;
+	/* Poll wakeups, and those that found less than a period to do */
+	uint64_t wakeups;
+	uint64_t wasted_wakeups;
+	uint64_t xruns;
+	/* Completed drains and drops, with their total and longest durations */
+	uint64_t drains;
+	uint64_t drain_ns;
+	uint64_t drain_max_ns;
+	uint64_t drops;
+	uint64_t drop_ns;
+	uint64_t drop_max_ns;
+	/* Bytes in the fifo at the last wakeup, and its capacity */
+	uint32_t fifo_bytes;
+	uint32_t fifo_size;
+	/* ns spent moving the hw pointer, and the frames it moved */
+	volumiofifo_histogram_t advance_ns;
+	volumiofifo_histogram_t advance_frames;
+	/* ns spent in each write system call */
+	volumiofifo_histogram_t write_ns;
+	/* ns from a timer expiring to the client servicing the wakeup */
+	volumiofifo_histogram_t wakeup_ns;
+	/* 1 while the PCM is in standby, discarding silence rather than writing it */
+	uint32_t standby;
+} volumiofifo_stats_page_t;
+
+/**
+ * Build the shared memory name for one of the pages belonging to a fifo,
+ * e.g. "/tmp/output/fifo" and "volume" give "/volumiofifo_tmp_output_fifo.volume"
+ *
+ * Returns 0 or -ve on error
+ */
+int _snd_pcm_volumiofifo_shm_name(const char *fifo_name, const char *suffix, char *buf, size_t len);
+
+/**
+ * Map a shared memory page, creating and zero filling it if needed
+ *
+ * Returns the mapping, or NULL with errno set
+ */
+void *_snd_pcm_volumiofifo_shm_map(const char *shm_name, size_t size, int create);
+
+/**
+ * As _snd_pcm_volumiofifo_shm_map, also returning the open descriptor in
+ * *fdp, e.g. for flock. The caller must close it.
+ */
+void *_snd_pcm_volumiofifo_shm_map_fd(const char *shm_name, size_t size, int create, int *fdp);
+
+void _snd_pcm_volumiofifo_shm_unmap(void *addr, size_t size);
+
+/**
+ * The upper bound of the bucket holding the given fraction of the values
+ * in a histogram, e.g. 0.99 for p99, or 0 if it is empty
+ */
+uint64_t _snd_pcm_volumiofifo_histogram_percentile(const volumiofifo_histogram_t *histogram, double fraction);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ *  PCM - Volumio FIFO plugin - framed fifo stream
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_STREAM_H
+#define __VOLUMIOFIFO_STREAM_H
+
+#include <stdint.h>
+
+/*
+ * Layout of a framed fifo, as read by other processes. The same rules
+ * apply as for the shared memory pages: fields may only be appended and
+ * the version must be bumped whenever the meaning of a field changes.
+ * All fields are native endian.
+ *
+ * The fifo carries a sequence of packets, each a header followed by
+ * length bytes of payload. A packet is written in one go and is never
+ * longer than PIPE_BUF, so packets are never split by the plugin. A reader
+ * which loses its place, e.g. after a clear on drop, finds the next packet
+ * by looking for the magic and checking the sequence number.
+ */
+
+#define VOLUMIOFIFO_STREAM_MAGIC 0x564c4f46 /* "VOLF" */
+#define VOLUMIOFIFO_STREAM_VERSION 1
+
+/* Packet types */
+#define VOLUMIOFIFO_STREAM_FORMAT 1
+#define VOLUMIOFIFO_STREAM_AUDIO 2
+#define VOLUMIOFIFO_STREAM_TIMED_AUDIO 3
+
+typedef struct volumiofifo_stream_packet {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	/* Counts every packet, so gaps show where packets were lost */
+	uint32_t seq;
+	/* Bytes of payload after the header, whole frames for audio */
+	uint32_t length;
+} volumiofifo_stream_packet_t;
+
+/*
+ * The payload of a format packet, sent whenever the PCM is prepared and
+ * describing every audio packet up to the next format packet
+ */
+typedef struct volumiofifo_stream_format {
+	/* The sample format, as the alsa-lib snd_pcm_format_t value */
+	uint32_t format;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t frame_bytes;
+	/* Audio frames written before this format took effect */
+	uint64_t frame;
+} volumiofifo_stream_format_t;
+
+/*
+ * Starts the payload of a timed audio packet, padded with zeros to bytes
+ * bytes so that the frames which follow stay aligned to the frame size.
+ */
+typedef struct volumiofifo_stream_timing {
+	/* CLOCK_MONOTONIC when the packet was written */
+	uint64_t time_ns;
+	/* Audio frames written before this packet, counted as in the format packet */
+	uint64_t frame;
+	/* Frames the client had queued in the PCM that were not yet written */
+	uint32_t delay;
+	/* Bytes of this block including padding, a whole number of frames */
+	uint32_t bytes;
+} volumiofifo_stream_timing_t;
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ *  PCM - Volumio FIFO plugin - static tracepoints
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_TRACE_H
+#define __VOLUMIOFIFO_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * USDT probes in the volumiofifo provider, for bpftrace, perf or
+ * systemtap. A probe that nothing is attached to is a single nop, so they
+ * are always compiled in when sys/sdt.h is available and compile to
+ * nothing otherwise. Every probe carries the same five arguments:
+ *
+ *   arg0 - the plugin's hw pointer, or a negative error
+ *   arg1 - the application pointer
+ *   arg2 - client frames not yet handed to the fifo
+ *   arg3 - bytes, frames or a result, depending on the probe
+ *   arg4 - bytes in the fifo at the last wakeup
+ *
+ * e.g. bpftrace -e 'usdt:/usr/lib/alsa-lib/libasound_module_pcm_volumiofifo.so:volumiofifo:xrun { print(arg2) }'
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define VOLUMIOFIFO_TRACE_ENABLED 1
+#define VOLUMIOFIFO_TRACE(name, ptr, appl_ptr, buffered, arg, fifo_bytes) \
+	DTRACE_PROBE5(volumiofifo, name, (int64_t) (ptr), (uint64_t) (appl_ptr), (int64_t) (buffered), (int64_t) (arg), \
+			(int64_t) (fifo_bytes))
+#else
+#define VOLUMIOFIFO_TRACE_ENABLED 0
+#define VOLUMIOFIFO_TRACE(name, ptr, appl_ptr, buffered, arg, fifo_bytes) do { } while(0)
+#endif
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ *  PCM - Volumio FIFO plugin - fifo reader emulator
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Reads a fifo in place of snapcast or another player, the way a real
+ * consumer would, and checks what arrives. Does not need alsa-lib.
+ *
+ * Usage: volumiofifo-reader [-m mode] [-r rate] [-c channels] [-f format] [-p period_ms]
+ *            [-D ppm] [-e stall_every_s] [-d stall_ms] [-i interval_ms] [-s seconds]
+ *            [-S seed] [-n] [-x] fifo
+ *        volumiofifo-reader -g [-r rate] [-c channels] [-f format] [-s seconds]
+ *
+ * The modes are
+ *
+ *  realtime  reads what the clock says has played every period, 5ms
+ *  bursty    the same, but every 100ms, as a reader sending chunks would
+ *  stall     realtime, but stopping for stall_ms at random, on average
+ *            every stall_every_s, then catching up
+ *  drift     realtime with a clock ppm away from the rate, -500 by default
+ *  absent    opens the fifo but never reads it
+ *
+ * Playback starts when audio first arrives. When the audio due is not
+ * there the reader counts an underrun and plays on, unless nothing comes
+ * for a second, when it counts the stream as stopped and waits for it to
+ * start again.
+ *
+ * Given -g it instead writes a test signal to stdout for playing into the
+ * fifo, e.g. with aplay -t raw, which the reader checks unless given -n.
+ * Every sample holds its channel and a frame counter, so the reader finds
+ * frames split or shifted by a partial write, swapped channels and audio
+ * that was lost or repeated, and tells apart the silence the plugin writes
+ * itself. The counter repeats every 2^24 frames, or 4096 with one channel.
+ * The signal is full scale, so do not send it to speakers. Any processing
+ * in the plugin, such as volume or dither, will make it fail the check.
+ *
+ * Exits with 2 if any frame was corrupt, or with -x if any audio was lost
+ * or the reader underran.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define READER_MAX_CHANNELS 32
+#define READER_READ_BYTES 65536
+/* Silence from the reader's point of view ends the stream after this long */
+#define READER_IDLE_NS 1000000000ULL
+
+enum { READER_REALTIME, READER_BURSTY, READER_STALL, READER_DRIFT, READER_ABSENT, READER_MODES };
+static const char *reader_modes[READER_MODES] = { "realtime", "bursty", "stall", "drift", "absent" };
+
+/* Little endian formats, the test signal is in the top 16 bits of each sample */
+static const struct {
+	const char *name;
+	unsigned int bytes;
+} reader_formats[] = {
+	{ "S16_LE", 2 },
+	{ "S24_3LE", 3 },
+	{ "S32_LE", 4 },
+};
+
+typedef struct reader_check {
+	unsigned int channels;
+	unsigned int sample_bytes;
+	unsigned int frame_bytes;
+	uint32_t counter_mask;
+
+	/* A partial frame carried to the next read */
+	unsigned char partial[READER_MAX_CHANNELS * 4];
+	unsigned int partial_bytes;
+
+	int synced;
+	int have_last;
+	uint32_t last;
+
+	uint64_t frames;
+	uint64_t silent_frames;
+	uint64_t jumps;
+	uint64_t jumped_frames;
+	uint64_t corrupt;
+	uint64_t skipped_bytes;
+} reader_check_t;
+
+typedef struct reader_stats {
+	uint64_t bytes;
+	uint64_t underruns;
+	uint64_t underrun_frames;
+	uint64_t starts;
+	uint64_t stops;
+	uint64_t stalls;
+} reader_stats_t;
+
+static volatile sig_atomic_t reader_stop;
+
+static void reader_signal(int sig) {
+	reader_stop = 1;
+}
+
+static void reader_usage(void) {
+	fprintf(stderr, "Usage: volumiofifo-reader [-m mode] [-r rate] [-c channels] [-f format] [-p period_ms] "
+			"[-D ppm] [-e stall_every_s] [-d stall_ms] [-i interval_ms] [-s seconds] [-S seed] [-n] [-x] fifo\n"
+			"       volumiofifo-reader -g [-r rate] [-c channels] [-f format] [-s seconds]\n");
+}
+
+static uint64_t reader_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void reader_sleep_until(uint64_t due_ns) {
+	struct timespec ts = { due_ns / 1000000000ULL, due_ns % 1000000000ULL };
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !reader_stop)
+		;
+}
+
+/* splitmix64, so a seed gives the same stalls on every run */
+static uint64_t reader_random(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* The 16 bit word carried by channel c of frame n: a marker bit, the channel and 12 bits of the counter */
+static inline uint16_t reader_word(uint32_t n, unsigned int c) {
+	return 0x8000 | (c & 7) << 12 | ((n >> (12 * (c & 1))) & 0xfff);
+}
+
+static void reader_put_frame(unsigned char *out, uint32_t n, unsigned int channels, unsigned int sample_bytes) {
+	unsigned int c;
+
+	for(c = 0; c < channels; c++) {
+		uint16_t word = reader_word(n, c);
+
+		memset(out, 0, sample_bytes - 2);
+		out[sample_bytes - 2] = word & 0xff;
+		out[sample_bytes - 1] = word >> 8;
+		out += sample_bytes;
+	}
+}
+
+/*
+ * The frame's counter, -1 if the frame is silent or -2 if it is not a
+ * frame of the test signal
+ */
+static int64_t reader_get_frame(reader_check_t *check, const unsigned char *in) {
+	unsigned int c, b;
+	uint32_t n = 0;
+	int silent = 1;
+
+	for(b = 0; b < check->frame_bytes && silent; b++)
+		silent = in[b] == 0;
+	if(silent)
+		return -1;
+
+	for(c = 0; c < check->channels && c < 2; c++) {
+		const unsigned char *sample = in + c * check->sample_bytes;
+
+		n |= (((sample[check->sample_bytes - 1] << 8) | sample[check->sample_bytes - 2]) & 0xfff) << (12 * c);
+	}
+	for(c = 0; c < check->channels; c++) {
+		const unsigned char *sample = in + c * check->sample_bytes;
+		uint16_t word = reader_word(n, c);
+
+		for(b = 0; b < check->sample_bytes - 2; b++) {
+			if(sample[b] != 0)
+				return -2;
+		}
+		if(sample[check->sample_bytes - 2] != (word & 0xff) || sample[check->sample_bytes - 1] != word >> 8)
+			return -2;
+	}
+	return n;
+}
+
+static void reader_check_frame(reader_check_t *check, int64_t n) {
+	uint32_t expected = (check->last + 1) & check->counter_mask;
+
+	check->frames++;
+	if(n == -1) {
+		// The plugin's own silence, such as lead in, standby or a drain's padding
+		check->silent_frames++;
+		return;
+	}
+	if(n != expected && check->have_last) {
+		check->jumps++;
+		check->jumped_frames += ((uint32_t) n - expected) & check->counter_mask;
+	}
+	check->last = n;
+	check->have_last = 1;
+}
+
+/* Checks a run of bytes, finding the frames again if they are not where they should be */
+static void reader_check(reader_check_t *check, const unsigned char *buf, size_t size) {
+	int64_t n;
+
+	while(size > 0) {
+		size_t take = check->frame_bytes - check->partial_bytes;
+
+		if(take > size)
+			take = size;
+		memcpy(check->partial + check->partial_bytes, buf, take);
+		check->partial_bytes += take;
+		buf += take;
+		size -= take;
+		if(check->partial_bytes < check->frame_bytes)
+			break;
+
+		n = reader_get_frame(check, check->partial);
+		if(n == -2) {
+			// Slide along a byte at a time until the frames line up again
+			if(check->synced)
+				check->corrupt++;
+			check->synced = 0;
+			check->skipped_bytes++;
+			memmove(check->partial, check->partial + 1, --check->partial_bytes);
+			continue;
+		}
+		check->synced = 1;
+		check->partial_bytes = 0;
+		reader_check_frame(check, n);
+	}
+}
+
+/* Reads up to size bytes without waiting, returns the bytes read */
+static size_t reader_read(int fd, size_t size, reader_check_t *check) {
+	static unsigned char buf[READER_READ_BYTES];
+	size_t got = 0;
+
+	while(got < size) {
+		ssize_t count = read(fd, buf, size - got > sizeof(buf) ? sizeof(buf) : size - got);
+
+		// Empty, or no writer has it open
+		if(count <= 0)
+			break;
+		if(check)
+			reader_check(check, buf, count);
+		got += count;
+	}
+	return got;
+}
+
+static int reader_generate(unsigned int rate, unsigned int channels, unsigned int sample_bytes, double seconds) {
+	static unsigned char buf[READER_READ_BYTES];
+	unsigned int frame_bytes = channels * sample_bytes;
+	unsigned int block = sizeof(buf) / frame_bytes;
+	uint64_t frames = seconds > 0 ? (uint64_t) (seconds * rate) : UINT64_MAX;
+	uint64_t n = 0;
+
+	while(n < frames && !reader_stop) {
+		unsigned int count = frames - n < block ? frames - n : block;
+		size_t done = 0;
+		unsigned int i;
+
+		for(i = 0; i < count; i++)
+			reader_put_frame(buf + i * frame_bytes, n + i, channels, sample_bytes);
+		while(done < count * frame_bytes) {
+			ssize_t written = write(STDOUT_FILENO, buf + done, count * frame_bytes - done);
+
+			if(written < 0) {
+				if(errno == EINTR)
+					continue;
+				// The player went away
+				return errno == EPIPE ? 0 : 1;
+			}
+			done += written;
+		}
+		n += count;
+	}
+	return 0;
+}
+
+static void reader_print(const char *when, double seconds, int fd, unsigned int frame_bytes, unsigned int rate,
+		const reader_stats_t *stats, const reader_check_t *check) {
+	int queued = 0;
+
+	if(ioctl(fd, FIONREAD, &queued) < 0)
+		queued = 0;
+	printf("%s %8.1f s  %8.1f MiB  fifo %7.1f ms  starts %llu  stops %llu  underruns %llu (%llu frames)  "
+			"stalls %llu", when, seconds, stats->bytes / 1048576.0, queued * 1000.0 / frame_bytes / rate,
+			(unsigned long long) stats->starts, (unsigned long long) stats->stops,
+			(unsigned long long) stats->underruns, (unsigned long long) stats->underrun_frames,
+			(unsigned long long) stats->stalls);
+	if(check)
+		printf("  silent %llu  jumps %llu (%llu frames)  corrupt %llu (%llu bytes)",
+				(unsigned long long) check->silent_frames, (unsigned long long) check->jumps,
+				(unsigned long long) check->jumped_frames, (unsigned long long) check->corrupt,
+				(unsigned long long) check->skipped_bytes);
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	unsigned int rate = 48000, channels = 2, sample_bytes = 2, f;
+	long period_ms = -1, interval_ms = 1000, stall_ms = 500;
+	double seconds = 0, ppm = 0, stall_every_s = 5;
+	uint64_t seed = 1, start_ns, next_print_ns, next_stall_ns = UINT64_MAX;
+	int opt, mode = READER_REALTIME, generate = 0, checking = 1, strict = 0, ppm_set = 0, fd;
+	reader_stats_t stats = { 0 };
+	reader_check_t check;
+	struct sigaction sa;
+
+	while((opt = getopt(argc, argv, "m:r:c:f:p:D:e:d:i:s:S:nxg")) != -1) {
+		switch(opt) {
+			case 'm':
+				for(mode = 0; mode < READER_MODES && strcmp(optarg, reader_modes[mode]) != 0; mode++)
+					;
+				if(mode == READER_MODES) {
+					fprintf(stderr, "Unknown mode %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'c':
+				channels = atoi(optarg);
+				break;
+			case 'f':
+				for(f = 0; f < sizeof(reader_formats) / sizeof(reader_formats[0]) &&
+						strcmp(optarg, reader_formats[f].name) != 0; f++)
+					;
+				if(f == sizeof(reader_formats) / sizeof(reader_formats[0])) {
+					fprintf(stderr, "The format must be S16_LE, S24_3LE or S32_LE, not %s\n", optarg);
+					return 1;
+				}
+				sample_bytes = reader_formats[f].bytes;
+				break;
+			case 'p':
+				period_ms = strtol(optarg, NULL, 10);
+				break;
+			case 'D':
+				ppm = atof(optarg);
+				ppm_set = 1;
+				break;
+			case 'e':
+				stall_every_s = atof(optarg);
+				break;
+			case 'd':
+				stall_ms = strtol(optarg, NULL, 10);
+				break;
+			case 'i':
+				interval_ms = strtol(optarg, NULL, 10);
+				break;
+			case 's':
+				seconds = atof(optarg);
+				break;
+			case 'S':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'n':
+				checking = 0;
+				break;
+			case 'x':
+				strict = 1;
+				break;
+			case 'g':
+				generate = 1;
+				break;
+			default:
+				reader_usage();
+				return 1;
+		}
+	}
+	if(rate == 0 || channels == 0 || channels > READER_MAX_CHANNELS || seconds < 0 || interval_ms < 1 ||
+			stall_ms < 0 || stall_every_s <= 0 || optind != argc - (generate ? 0 : 1)) {
+		reader_usage();
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reader_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if(generate) {
+		signal(SIGPIPE, SIG_IGN);
+		return reader_generate(rate, channels, sample_bytes, seconds);
+	}
+
+	if(period_ms < 0)
+		period_ms = mode == READER_BURSTY ? 100 : 5;
+	if(period_ms < 1) {
+		fprintf(stderr, "The period must be at least 1 ms\n");
+		return 1;
+	}
+	if(mode == READER_DRIFT && !ppm_set)
+		ppm = -500;
+
+	memset(&check, 0, sizeof(check));
+	check.channels = channels;
+	check.sample_bytes = sample_bytes;
+	check.frame_bytes = channels * sample_bytes;
+	check.counter_mask = channels > 1 ? 0xffffff : 0xfff;
+	check.synced = 1;
+
+	// Without a writer a blocking open would wait for one
+	fd = open(argv[optind], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0) {
+		fprintf(stderr, "Failed to open the fifo %s, error %d\n", argv[optind], errno);
+		return 1;
+	}
+
+	printf("Reading %s as %s at %u Hz%s%.0f ppm, %u channels of %u bytes, every %ld ms\n", argv[optind],
+			reader_modes[mode], rate, ppm < 0 ? " " : " +", ppm, channels, sample_bytes, period_ms);
+	fflush(stdout);
+
+	{
+		double bytes_per_ns = rate * (1 + ppm / 1e6) * check.frame_bytes / 1e9;
+		uint64_t period_ns = period_ms * 1000000ULL, now_ns, tick_ns;
+		uint64_t play_start_ns = 0, played = 0, last_audio_ns = 0, short_bytes = 0;
+		int playing = 0;
+
+		start_ns = reader_now_ns();
+		tick_ns = start_ns;
+		next_print_ns = start_ns + interval_ms * 1000000ULL;
+		if(mode == READER_STALL)
+			next_stall_ns = start_ns + (uint64_t) (stall_every_s * 2e9 *
+					(reader_random(&seed) >> 11) / 9007199254740992.0);
+
+		while(!reader_stop && (seconds == 0 || reader_now_ns() - start_ns < seconds * 1e9)) {
+			tick_ns += period_ns;
+			reader_sleep_until(tick_ns);
+			now_ns = reader_now_ns();
+
+			if(now_ns >= next_stall_ns) {
+				// Stop reading altogether, then catch up with the clock
+				stats.stalls++;
+				reader_sleep_until(now_ns + stall_ms * 1000000ULL);
+				now_ns = reader_now_ns();
+				tick_ns = now_ns;
+				next_stall_ns = now_ns + (uint64_t) (stall_every_s * 2e9 *
+						(reader_random(&seed) >> 11) / 9007199254740992.0);
+			}
+
+			if(mode != READER_ABSENT && !playing) {
+				size_t got = reader_read(fd, READER_READ_BYTES, checking ? &check : NULL);
+
+				if(got > 0) {
+					// The first audio starts the clock, as a sound card starting on its first period
+					playing = 1;
+					stats.starts++;
+					play_start_ns = now_ns;
+					played = got;
+					last_audio_ns = now_ns;
+					short_bytes = 0;
+					stats.bytes += got;
+				}
+			} else if(mode != READER_ABSENT) {
+				uint64_t due = (uint64_t) ((now_ns - play_start_ns) * bytes_per_ns);
+				size_t got = due > played ? reader_read(fd, due - played, checking ? &check : NULL) : 0;
+
+				stats.bytes += got;
+				if(got > 0) {
+					// Audio after a shortfall makes it an underrun rather than the end of the stream
+					if(short_bytes > 0) {
+						stats.underruns++;
+						stats.underrun_frames += short_bytes / check.frame_bytes;
+						short_bytes = 0;
+					}
+					last_audio_ns = now_ns;
+				}
+				if(due > played + got)
+					short_bytes += due - played - got;
+				played = due > played ? due : played;
+
+				if(now_ns - last_audio_ns >= READER_IDLE_NS) {
+					playing = 0;
+					stats.stops++;
+					short_bytes = 0;
+					// The next stream may start its counter again
+					check.have_last = 0;
+				}
+			}
+
+			if(now_ns >= next_print_ns) {
+				reader_print("  ", (now_ns - start_ns) / 1e9, fd, check.frame_bytes, rate, &stats,
+						checking ? &check : NULL);
+				next_print_ns += interval_ms * 1000000ULL;
+			}
+		}
+		reader_print("End", (reader_now_ns() - start_ns) / 1e9, fd, check.frame_bytes, rate, &stats,
+				checking ? &check : NULL);
+	}
+
+	close(fd);
+	if(checking && (check.corrupt > 0 || check.skipped_bytes > 0))
+		return 2;
+	if(strict && (stats.underruns > 0 || (checking && check.jumps > 0)))
+		return 2;
+	return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ *  PCM - Volumio FIFO plugin - session replay
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Drives the plugin's callbacks through a session recorded with
+ * record_dir, in the order and at the virtual times they were recorded,
+ * against a simulated fifo. The client's side is replayed as recorded and
+ * the plugin's side is run again, so the same session can be replayed
+ * against a changed plugin, or changed options, and the results compared.
+ * Nothing waits, so a session replays in a fraction of the time it took.
+ *
+ * Usage: volumiofifo-replay [-s fifo_bytes] [-r reader_bytes_per_second]
+ *            [-c reader_chunk_bytes] [-p reader_ppm] [-z] [-v] file [option=value ...]
+ *
+ * The options are plugin options, e.g. lead_in_frames=1024. The fifo size
+ * defaults to the recorded one, and the reader to one taking 10 ms chunks
+ * at the client's byte rate. -z fills the client's buffer with silence
+ * rather than a signal, and -v prints each callback whose result differs
+ * from the recording. The exit status is 1 if the recording cannot be
+ * replayed in full, whether it is unreadable or cut short, has records of
+ * an unknown type, or has hw params the plugin refuses.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "volumiofifo_session.h"
+#include "volumiofifo_shm.h"
+#include "volumiofifo_sim.h"
+
+#define REPLAY_FIFO "/volumiofifo-replay"
+
+static const char *replay_types[VOLUMIOFIFO_SESSION_TYPES] = {
+	"params", "prepare", "start", "stop", "transfer", "pointer", "hw_free", "poll_count",
+	"poll_descriptors", "poll_revents", "pause", "delay", "write"
+};
+
+/* Plugin options that need something the simulation does not have */
+static const char *replay_unsupported[] = { "fifo", "mix", "loopback", "control", "record_dir" };
+
+typedef struct replay_callback {
+	uint64_t calls;
+	uint64_t diverged;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	volumiofifo_histogram_t ns;
+} replay_callback_t;
+
+typedef struct replay_writes {
+	uint64_t writes;
+	uint64_t eagains;
+	uint64_t bytes;
+} replay_writes_t;
+
+static replay_callback_t replay_callbacks[VOLUMIOFIFO_SESSION_TYPES];
+
+static void replay_histogram(volumiofifo_histogram_t *histogram, uint64_t value) {
+	int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+
+	if(bucket >= VOLUMIOFIFO_HISTOGRAM_BUCKETS)
+		bucket = VOLUMIOFIFO_HISTOGRAM_BUCKETS - 1;
+	histogram->buckets[bucket]++;
+}
+
+static void replay_usage(void) {
+	fprintf(stderr, "Usage: volumiofifo-replay [-s fifo_bytes] [-r reader_bytes_per_second] "
+			"[-c reader_chunk_bytes] [-p reader_ppm] [-z] [-v] file [option=value ...]\n");
+}
+
+/**
+ * Call the callback a record is of, as alsa-lib would have
+ *
+ * Returns the result in the form it was recorded
+ */
+static int64_t replay_call(snd_pcm_t *pcm, const volumiofifo_session_call_t *call, int *poll_fd) {
+	snd_pcm_ioplug_t *io = volumiofifo_sim_pcm_io(pcm);
+	const snd_pcm_ioplug_callback_t *callback = io->callback;
+
+	switch(call->type) {
+		case VOLUMIOFIFO_SESSION_PREPARE:
+			volumiofifo_sim_pcm_reset(pcm, call->hw_ptr, call->appl_ptr);
+			return callback->prepare(io);
+		case VOLUMIOFIFO_SESSION_START:
+			return callback->start(io);
+		case VOLUMIOFIFO_SESSION_STOP:
+			return callback->stop(io);
+		case VOLUMIOFIFO_SESSION_TRANSFER:
+			return callback->transfer(io, snd_pcm_ioplug_mmap_areas(io), io->appl_ptr % io->buffer_size, call->arg);
+		case VOLUMIOFIFO_SESSION_POINTER:
+			return volumiofifo_sim_pcm_hw_ptr_update(pcm);
+		case VOLUMIOFIFO_SESSION_HW_FREE:
+			return callback->hw_free(io);
+		case VOLUMIOFIFO_SESSION_POLL_COUNT:
+			return callback->poll_descriptors_count(io);
+		case VOLUMIOFIFO_SESSION_POLL_DESCRIPTORS: {
+			struct pollfd pfd = { -1, 0, 0 };
+			int err = callback->poll_descriptors(io, &pfd, 1);
+			*poll_fd = pfd.fd;
+			return err;
+		}
+		case VOLUMIOFIFO_SESSION_POLL_REVENTS: {
+			struct pollfd pfd = { *poll_fd, 0, call->arg };
+			unsigned short revents = 0;
+			int err = callback->poll_revents(io, &pfd, 1, &revents);
+			return err < 0 ? err : revents;
+		}
+		case VOLUMIOFIFO_SESSION_PAUSE:
+			return callback->pause(io, call->arg);
+		case VOLUMIOFIFO_SESSION_DELAY: {
+			snd_pcm_sframes_t delay = 0;
+			int err = callback->delay(io, &delay);
+			return err < 0 ? err : delay;
+		}
+		default:
+			return 0;
+	}
+}
+
+int main(int argc, char **argv) {
+	volumiofifo_session_header_t header;
+	volumiofifo_session_record_t record;
+	volumiofifo_session_params_t params = { .type = VOLUMIOFIFO_SESSION_PARAMS };
+	volumiofifo_sim_t sim;
+	replay_writes_t recorded = { 0 };
+	snd_config_t *config;
+	snd_pcm_t *pcm = NULL;
+	snd_pcm_ioplug_t *io;
+	unsigned int fifo_size = 0, reader_chunk = 0, frame_bytes = 0;
+	double reader_rate = 0, reader_ppm = 0;
+	int silence = 0, verbose = 0, poll_fd = -1, status = 0, opt, err, i;
+	size_t got;
+	uint64_t calls = 0, nested_calls = 0, overwrites = 0, appl_skew = 0, first_ns = 0, last_ns = 0, replay_ns;
+	FILE *file;
+
+	while((opt = getopt(argc, argv, "s:r:c:p:zv")) != -1) {
+		switch(opt) {
+			case 's':
+				fifo_size = atoi(optarg);
+				break;
+			case 'r':
+				reader_rate = atof(optarg);
+				break;
+			case 'c':
+				reader_chunk = atoi(optarg);
+				break;
+			case 'p':
+				reader_ppm = atof(optarg);
+				break;
+			case 'z':
+				silence = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				replay_usage();
+				return 1;
+		}
+	}
+	if(optind >= argc) {
+		replay_usage();
+		return 1;
+	}
+
+	file = fopen(argv[optind], "rb");
+	if(file == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != VOLUMIOFIFO_SESSION_MAGIC ||
+			header.version != VOLUMIOFIFO_SESSION_VERSION || header.record_bytes != sizeof(record)) {
+		fprintf(stderr, "%s is not a session recording this version can replay\n", argv[optind]);
+		fclose(file);
+		return 1;
+	}
+	if(fifo_size == 0)
+		fifo_size = header.fifo_size > 0 ? header.fifo_size : 65536;
+
+	// The flight recorder's dumps would go to /tmp, an option after the file can turn it back on
+	config = volumiofifo_sim_config_new();
+	if(config == NULL || volumiofifo_sim_config_set(config, "fifo=" REPLAY_FIFO) < 0 ||
+			volumiofifo_sim_config_set(config, "flight_recorder=0") < 0) {
+		fprintf(stderr, "Cannot allocate\n");
+		return 1;
+	}
+	for(i = optind + 1; i < argc; i++) {
+		unsigned int u;
+
+		for(u = 0; u < sizeof(replay_unsupported) / sizeof(replay_unsupported[0]); u++) {
+			size_t length = strlen(replay_unsupported[u]);
+			if(strncmp(argv[i], replay_unsupported[u], length) == 0 && argv[i][length] == '=') {
+				fprintf(stderr, "The option %s cannot be replayed\n", replay_unsupported[u]);
+				return 1;
+			}
+		}
+		if(volumiofifo_sim_config_set(config, argv[i]) < 0) {
+			fprintf(stderr, "Options are option=value, not %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	volumiofifo_sim_init(&sim, REPLAY_FIFO, fifo_size, 0);
+	err = volumiofifo_sim_pcm_open(&pcm, config);
+	volumiofifo_sim_config_free(config);
+	if(err < 0) {
+		fprintf(stderr, "The plugin failed to open, error %d\n", err);
+		return 1;
+	}
+	io = volumiofifo_sim_pcm_io(pcm);
+
+	replay_ns = volumiofifo_sim_real_ns();
+	while((got = fread(&record, 1, sizeof(record), file)) == sizeof(record)) {
+		const volumiofifo_session_call_t *call = &record.call;
+		uint64_t start_ns, ns;
+		int64_t result;
+		int nested;
+
+		nested = record.type & VOLUMIOFIFO_SESSION_NESTED;
+		record.type &= ~VOLUMIOFIFO_SESSION_NESTED;
+		if(record.type >= VOLUMIOFIFO_SESSION_TYPES) {
+			fprintf(stderr, "Unknown record type %u, stopping\n", record.type);
+			status = 1;
+			break;
+		}
+
+		if(record.type == VOLUMIOFIFO_SESSION_PARAMS) {
+			// Every prepare records the params, only a change needs anything doing
+			record.params.time_ns = 0;
+			if(frame_bytes && memcmp(&record.params, &params, sizeof(params)) == 0)
+				continue;
+			params = record.params;
+
+			frame_bytes = params.channels * snd_pcm_format_physical_width(params.format) / 8;
+			{
+				char fill[64];
+				size_t fill_bytes = silence ? frame_bytes : sizeof(fill);
+
+				memset(fill, 0x5a, sizeof(fill));
+				if(silence)
+					snd_pcm_format_set_silence(params.format, fill, params.channels);
+				err = volumiofifo_sim_pcm_hw_params(pcm, params.format, params.rate, params.channels,
+						params.period_size, params.buffer_size, fill, fill_bytes);
+			}
+			if(err < 0) {
+				fprintf(stderr, "The plugin does not accept %s, %u channels at %u Hz, period %u buffer %u\n",
+						snd_pcm_format_name(params.format), params.channels, params.rate,
+						params.period_size, params.buffer_size);
+				status = 1;
+				break;
+			}
+			volumiofifo_sim_reader(&sim, reader_rate > 0 ? reader_rate : (double) params.rate * frame_bytes,
+					reader_chunk > 0 ? reader_chunk : (params.rate / 100) * frame_bytes, reader_ppm);
+			continue;
+		}
+
+		if(first_ns == 0)
+			first_ns = call->time_ns;
+		last_ns = call->time_ns;
+		volumiofifo_sim_set_time(&sim, call->time_ns);
+
+		if(record.type == VOLUMIOFIFO_SESSION_WRITE) {
+			recorded.writes++;
+			if(call->result == -EAGAIN)
+				recorded.eagains++;
+			else if(call->result > 0)
+				recorded.bytes += call->result;
+			continue;
+		}
+
+		if(nested) {
+			// Replaying the callback this was inside makes it again
+			nested_calls++;
+			continue;
+		}
+
+		if(frame_bytes == 0 && record.type != VOLUMIOFIFO_SESSION_POLL_COUNT &&
+				record.type != VOLUMIOFIFO_SESSION_HW_FREE) {
+			// Only the first prepare has params ahead of it
+			continue;
+		}
+
+		// The client and alsa-lib are replayed as they were
+		io->state = call->state;
+		if(record.type == VOLUMIOFIFO_SESSION_PREPARE)
+			appl_skew = 0;
+		io->appl_ptr = call->appl_ptr;
+		if(frame_bytes) {
+			uint64_t ahead;
+
+			io->appl_ptr = (call->appl_ptr + params.boundary - appl_skew) % params.boundary;
+			ahead = (io->appl_ptr + params.boundary - io->hw_ptr) % params.boundary;
+			if(ahead > io->buffer_size) {
+				// The client has run ahead of what this plugin has sent, the
+				// frames it wrote over are dropped from here on
+				overwrites++;
+				appl_skew = (appl_skew + ahead - io->buffer_size) % params.boundary;
+				io->appl_ptr = (io->appl_ptr + params.boundary - (ahead - io->buffer_size)) % params.boundary;
+			}
+		}
+		sim.expect_audio = call->state == SND_PCM_STATE_RUNNING;
+
+		start_ns = volumiofifo_sim_real_ns();
+		result = replay_call(pcm, call, &poll_fd);
+		ns = volumiofifo_sim_real_ns() - start_ns;
+
+		replay_callback_t *callback = &replay_callbacks[record.type];
+		callback->calls++;
+		callback->total_ns += ns;
+		if(ns > callback->max_ns)
+			callback->max_ns = ns;
+		replay_histogram(&callback->ns, ns);
+		if(result != call->result) {
+			callback->diverged++;
+			if(verbose)
+				printf("%.6f %s in %s returned %lld, recorded %lld\n", (call->time_ns - first_ns) / 1e9,
+						replay_types[record.type], snd_pcm_state_name(call->state),
+						(long long) result, (long long) call->result);
+		}
+		calls++;
+	}
+	replay_ns = volumiofifo_sim_real_ns() - replay_ns;
+	if(status == 0 && (ferror(file) || got > 0)) {
+		fprintf(stderr, "%s is cut short, replayed up to the last whole record\n", argv[optind]);
+		status = 1;
+	}
+	fclose(file);
+
+	printf("Replayed %llu callbacks, and %llu made within them, from %.3f s of session in %.3f s\n",
+			(unsigned long long) calls, (unsigned long long) nested_calls, (last_ns - first_ns) / 1e9,
+			replay_ns / 1e9);
+	printf("%-17s %10s %10s %10s %10s %10s\n", "callback", "calls", "diverged", "mean ns", "p99 ns", "max ns");
+	for(i = 0; i < VOLUMIOFIFO_SESSION_TYPES; i++) {
+		replay_callback_t *callback = &replay_callbacks[i];
+
+		if(callback->calls == 0)
+			continue;
+		printf("%-17s %10llu %10llu %10llu %10llu %10llu\n", replay_types[i],
+				(unsigned long long) callback->calls, (unsigned long long) callback->diverged,
+				(unsigned long long) (callback->total_ns / callback->calls),
+				(unsigned long long) _snd_pcm_volumiofifo_histogram_percentile(&callback->ns, 0.99),
+				(unsigned long long) callback->max_ns);
+	}
+	printf("fifo writes       recorded %llu, %llu EAGAIN, %llu bytes\n", (unsigned long long) recorded.writes,
+			(unsigned long long) recorded.eagains, (unsigned long long) recorded.bytes);
+	printf("                  replayed %llu, %llu EAGAIN, %llu bytes\n", (unsigned long long) sim.writes,
+			(unsigned long long) sim.eagains, (unsigned long long) sim.bytes_written);
+	printf("reader            %llu reads, %llu underruns, at most %u bytes queued\n",
+			(unsigned long long) sim.reader.reads, (unsigned long long) sim.reader.underruns, sim.reader.level_max);
+	if(overwrites > 0)
+		printf("The client ran ahead of the plugin %llu times\n", (unsigned long long) overwrites);
+
+	volumiofifo_sim_pcm_close(pcm);
+
+	return status;
+}
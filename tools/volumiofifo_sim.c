@@ -0,0 +1,454 @@
+/*
+ *  PCM - Volumio FIFO plugin - simulated fifo, timerfd and clock
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The wrapped system calls. The simulated descriptors are real ones open
+ * on /dev/null, so their numbers cannot clash with anything else the
+ * process opens.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include "volumiofifo_sim.h"
+
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+int __real_ioctl(int fd, unsigned long request, ...);
+int __real_fcntl(int fd, int cmd, ...);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_timerfd_create(int clockid, int flags);
+int __real_timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value);
+int __real_timerfd_gettime(int fd, struct itimerspec *curr_value);
+int __real_clock_gettime(clockid_t clockid, struct timespec *tp);
+
+static volumiofifo_sim_t *sim_active;
+
+static int sim_placeholder_fd(void) {
+	return __real_open("/dev/null", O_RDWR | O_CLOEXEC);
+}
+
+static int sim_fifo_fd(int fd) {
+	return sim_active && fd >= 0 && (fd == sim_active->read_fd || fd == sim_active->write_fd);
+}
+
+static int sim_timer_fd(int fd) {
+	return sim_active && fd >= 0 && fd == sim_active->timer_fd;
+}
+
+static uint64_t sim_timespec_ns(const struct timespec *ts) {
+	return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void sim_ns_timespec(uint64_t ns, struct timespec *ts) {
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/*
+ * When the next chunk is due. Each wakeup's lateness comes from its number,
+ * so it is the same however lazily the reader is run.
+ */
+static uint64_t sim_reader_due(volumiofifo_sim_reader_t *reader) {
+	uint64_t wakeup = reader->chunks_since_start / reader->burst;
+	double ns = (double) wakeup * reader->burst * reader->chunk * 1e9 /
+			(reader->rate * (1 + reader->ppm / 1e6));
+	uint64_t due = reader->start_ns + (uint64_t) ns;
+
+	if(reader->jitter_ns > 0)
+		due += volumiofifo_sim_random(reader->seed, wakeup) % reader->jitter_ns;
+	if(reader->stall_every_ns > 0 && reader->stall_ns > 0 &&
+			due % reader->stall_every_ns >= reader->stall_every_ns - reader->stall_ns)
+		due += reader->stall_every_ns - due % reader->stall_every_ns;
+	return due;
+}
+
+/**
+ * Run the reader up to the current time. The fifo only changes when the
+ * plugin calls in, so reading lazily gives the same result as reading on
+ * time.
+ */
+static void sim_reader_run(volumiofifo_sim_t *sim) {
+	volumiofifo_sim_reader_t *reader = &sim->reader;
+
+	if(reader->rate <= 0)
+		return;
+
+	while(reader->playing && reader->next_read_ns <= sim->now_ns) {
+		if(sim->level > reader->level_max)
+			reader->level_max = sim->level;
+		reader->reads++;
+		if(sim->level < reader->chunk) {
+			if(sim->expect_audio)
+				reader->underruns++;
+			reader->bytes_read += sim->level;
+			sim->level = 0;
+			reader->playing = 0;
+			break;
+		}
+		sim->level -= reader->chunk;
+		reader->bytes_read += reader->chunk;
+		reader->chunks_since_start++;
+		reader->next_read_ns = sim_reader_due(reader);
+	}
+
+	if(!reader->playing && sim->level >= reader->chunk * reader->burst) {
+		reader->playing = 1;
+		reader->start_ns = sim->now_ns;
+		reader->chunks_since_start = 0;
+		reader->next_read_ns = sim->now_ns;
+	}
+}
+
+void volumiofifo_sim_init(volumiofifo_sim_t *sim, const char *path, unsigned int capacity, uint64_t now_ns) {
+	memset(sim, 0, sizeof(*sim));
+	sim->now_ns = now_ns;
+	sim->path = path;
+	sim->read_fd = -1;
+	sim->write_fd = -1;
+	sim->timer_fd = -1;
+	sim->capacity = capacity;
+	sim_active = sim;
+}
+
+void volumiofifo_sim_reader(volumiofifo_sim_t *sim, double rate, unsigned int chunk, double ppm) {
+	memset(&sim->reader, 0, sizeof(sim->reader));
+	sim->reader.rate = rate;
+	sim->reader.chunk = chunk > 0 ? chunk : 1;
+	sim->reader.ppm = ppm;
+	sim->reader.burst = 1;
+}
+
+void volumiofifo_sim_set_time(volumiofifo_sim_t *sim, uint64_t now_ns) {
+	if(now_ns > sim->now_ns)
+		sim->now_ns = now_ns;
+	sim_reader_run(sim);
+}
+
+uint64_t volumiofifo_sim_next_event_ns(const volumiofifo_sim_t *sim) {
+	uint64_t next = UINT64_MAX;
+
+	if(sim->reader.rate > 0 && sim->reader.playing)
+		next = sim->reader.next_read_ns;
+	if(sim->timer_fd >= 0 && sim->timer_next_ns != 0) {
+		uint64_t timer = sim->timer_next_ns;
+
+		// An expiry the plugin has not read yet has already woken it
+		if(timer <= sim->now_ns) {
+			if(sim->timer_interval_ns == 0)
+				return next;
+			timer += ((sim->now_ns - timer) / sim->timer_interval_ns + 1) * sim->timer_interval_ns;
+		}
+		if(timer < next)
+			next = timer;
+	}
+	return next;
+}
+
+uint64_t volumiofifo_sim_random(uint64_t seed, uint64_t n) {
+	// splitmix64
+	uint64_t z = seed + (n + 1) * 0x9e3779b97f4a7c15ULL;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+uint64_t volumiofifo_sim_real_ns(void) {
+	struct timespec now;
+
+	__real_clock_gettime(CLOCK_MONOTONIC, &now);
+	return sim_timespec_ns(&now);
+}
+
+/*
+ * A pipe write of up to PIPE_BUF is all or nothing, anything longer may be
+ * partial. Returns the bytes accepted or -1 with errno set.
+ */
+static ssize_t sim_fifo_write(volumiofifo_sim_t *sim, size_t count) {
+	unsigned int room;
+
+	sim_reader_run(sim);
+	sim->syscalls[VOLUMIOFIFO_SIM_WRITE]++;
+	sim->writes++;
+
+	if(sim->read_fd < 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	room = sim->capacity - sim->level;
+	if(count > room && (count <= PIPE_BUF || room == 0)) {
+		sim->eagains++;
+		errno = EAGAIN;
+		return -1;
+	}
+	if(count > room)
+		count = room;
+	sim->level += count;
+	sim->bytes_written += count;
+	sim_reader_run(sim);
+
+	return count;
+}
+
+int __wrap_open(const char *path, int flags, ...) {
+	mode_t mode = 0;
+	int fd;
+
+	if(flags & O_CREAT) {
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+
+	if(sim_active == NULL || strcmp(path, sim_active->path) != 0)
+		return __real_open(path, flags, mode);
+
+	fd = sim_placeholder_fd();
+	if(fd < 0)
+		return fd;
+	if((flags & O_ACCMODE) == O_RDONLY)
+		sim_active->read_fd = fd;
+	else
+		sim_active->write_fd = fd;
+	return fd;
+}
+
+int __wrap_close(int fd) {
+	if(sim_fifo_fd(fd)) {
+		if(fd == sim_active->read_fd)
+			sim_active->read_fd = -1;
+		else
+			sim_active->write_fd = -1;
+	} else if(sim_timer_fd(fd)) {
+		sim_active->timer_fd = -1;
+	}
+	return __real_close(fd);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+	volumiofifo_sim_t *sim = sim_active;
+
+	if(sim_timer_fd(fd)) {
+		uint64_t expiries;
+
+		sim->syscalls[VOLUMIOFIFO_SIM_TIMERFD]++;
+		if(count < sizeof(expiries)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if(sim->timer_next_ns == 0 || sim->now_ns < sim->timer_next_ns) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if(sim->timer_interval_ns > 0) {
+			expiries = 1 + (sim->now_ns - sim->timer_next_ns) / sim->timer_interval_ns;
+			sim->timer_next_ns += expiries * sim->timer_interval_ns;
+		} else {
+			expiries = 1;
+			sim->timer_next_ns = 0;
+		}
+		memcpy(buf, &expiries, sizeof(expiries));
+		return sizeof(expiries);
+	}
+
+	if(sim_fifo_fd(fd)) {
+		sim_reader_run(sim);
+		sim->syscalls[VOLUMIOFIFO_SIM_READ]++;
+		if(sim->level == 0) {
+			if(sim->write_fd < 0)
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		if(count > sim->level)
+			count = sim->level;
+		sim->level -= count;
+		memset(buf, 0, count);
+		return count;
+	}
+
+	return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+	if(sim_fifo_fd(fd))
+		return sim_fifo_write(sim_active, count);
+	return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+	size_t count = 0;
+	int i;
+
+	if(!sim_fifo_fd(fd))
+		return __real_writev(fd, iov, iovcnt);
+
+	for(i = 0; i < iovcnt; i++)
+		count += iov[i].iov_len;
+	return sim_fifo_write(sim_active, count);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if(!sim_fifo_fd(fd))
+		return __real_ioctl(fd, request, arg);
+
+	sim_reader_run(sim_active);
+	sim_active->syscalls[VOLUMIOFIFO_SIM_IOCTL]++;
+	if(request != FIONREAD) {
+		errno = ENOTTY;
+		return -1;
+	}
+	*(int *) arg = sim_active->level;
+	return 0;
+}
+
+int __wrap_fcntl(int fd, int cmd, ...) {
+	va_list args;
+	long arg;
+
+	va_start(args, cmd);
+	arg = va_arg(args, long);
+	va_end(args);
+
+	if(!sim_fifo_fd(fd))
+		return __real_fcntl(fd, cmd, arg);
+
+	sim_active->syscalls[VOLUMIOFIFO_SIM_FCNTL]++;
+	switch(cmd) {
+		case F_GETPIPE_SZ:
+			return sim_active->capacity;
+		case F_SETPIPE_SZ:
+			if(arg < (long) sim_active->level) {
+				errno = EBUSY;
+				return -1;
+			}
+			sim_active->capacity = arg;
+			return sim_active->capacity;
+		case F_GETFL:
+			return O_NONBLOCK;
+		default:
+			return 0;
+	}
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	volumiofifo_sim_t *sim = sim_active;
+	int simulated = 0, ready = 0;
+	nfds_t i;
+
+	for(i = 0; i < nfds; i++)
+		simulated |= sim_fifo_fd(fds[i].fd) || sim_timer_fd(fds[i].fd);
+	if(!simulated)
+		return __real_poll(fds, nfds, timeout);
+
+	// Time only passes when the harness says so, so this never waits
+	sim_reader_run(sim);
+	sim->syscalls[VOLUMIOFIFO_SIM_POLL]++;
+	for(i = 0; i < nfds; i++) {
+		fds[i].revents = 0;
+		if(fds[i].fd == sim->read_fd && sim->level > 0)
+			fds[i].revents |= POLLIN;
+		if(fds[i].fd == sim->write_fd && sim->capacity - sim->level >= PIPE_BUF)
+			fds[i].revents |= POLLOUT;
+		if(fds[i].fd == sim->timer_fd && sim->timer_next_ns != 0 && sim->now_ns >= sim->timer_next_ns)
+			fds[i].revents |= POLLIN;
+		fds[i].revents &= fds[i].events;
+		if(fds[i].revents)
+			ready++;
+	}
+	return ready;
+}
+
+int __wrap_timerfd_create(int clockid, int flags) {
+	if(sim_active == NULL || clockid != CLOCK_MONOTONIC)
+		return __real_timerfd_create(clockid, flags);
+
+	sim_active->syscalls[VOLUMIOFIFO_SIM_TIMERFD]++;
+	sim_active->timer_fd = sim_placeholder_fd();
+	sim_active->timer_next_ns = 0;
+	return sim_active->timer_fd;
+}
+
+int __wrap_timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value) {
+	volumiofifo_sim_t *sim = sim_active;
+	uint64_t value;
+
+	if(!sim_timer_fd(fd))
+		return __real_timerfd_settime(fd, flags, new_value, old_value);
+
+	sim->syscalls[VOLUMIOFIFO_SIM_TIMERFD]++;
+	if(old_value)
+		memset(old_value, 0, sizeof(*old_value));
+	value = sim_timespec_ns(&new_value->it_value);
+	if(value == 0) {
+		sim->timer_next_ns = 0;
+	} else {
+		sim->timer_next_ns = (flags & TFD_TIMER_ABSTIME) ? value : sim->now_ns + value;
+	}
+	sim->timer_interval_ns = sim_timespec_ns(&new_value->it_interval);
+	return 0;
+}
+
+int __wrap_timerfd_gettime(int fd, struct itimerspec *curr_value) {
+	volumiofifo_sim_t *sim = sim_active;
+	uint64_t next = sim->timer_next_ns;
+
+	if(!sim_timer_fd(fd))
+		return __real_timerfd_gettime(fd, curr_value);
+
+	sim->syscalls[VOLUMIOFIFO_SIM_TIMERFD]++;
+	// A periodic timer reports the time to its next expiry, even if earlier ones are unread
+	if(next != 0 && next <= sim->now_ns && sim->timer_interval_ns > 0)
+		next += ((sim->now_ns - next) / sim->timer_interval_ns + 1) * sim->timer_interval_ns;
+	sim_ns_timespec(next > sim->now_ns ? next - sim->now_ns : 0, &curr_value->it_value);
+	sim_ns_timespec(sim->timer_interval_ns, &curr_value->it_interval);
+	return 0;
+}
+
+int __wrap_clock_gettime(clockid_t clockid, struct timespec *tp) {
+	if(sim_active == NULL || (clockid != CLOCK_MONOTONIC && clockid != CLOCK_MONOTONIC_RAW &&
+			clockid != CLOCK_BOOTTIME))
+		return __real_clock_gettime(clockid, tp);
+
+	sim_ns_timespec(sim_active->now_ns, tp);
+	return 0;
+}
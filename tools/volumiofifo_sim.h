@@ -0,0 +1,232 @@
+/*
+ *  PCM - Volumio FIFO plugin - simulated alsa-lib, fifo and clock
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef __VOLUMIOFIFO_SIM_H
+#define __VOLUMIOFIFO_SIM_H
+
+/*
+ * Runs the plugin without alsa-lib, a fifo or real time passing. The
+ * plugin's sources are linked with a stand-in for the parts of alsa-lib
+ * they use, and with -Wl,--wrap for the system calls they make, which are
+ * redirected to a simulated fifo and timerfd when made on the simulated
+ * descriptors and passed on otherwise. CLOCK_MONOTONIC is a virtual clock
+ * that only moves when the harness moves it.
+ *
+ * Mixing, loopback and the control socket are not simulated.
+ */
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+typedef enum volumiofifo_sim_syscall {
+	VOLUMIOFIFO_SIM_WRITE = 0,
+	VOLUMIOFIFO_SIM_READ,
+	VOLUMIOFIFO_SIM_IOCTL,
+	VOLUMIOFIFO_SIM_POLL,
+	VOLUMIOFIFO_SIM_FCNTL,
+	VOLUMIOFIFO_SIM_TIMERFD,
+	VOLUMIOFIFO_SIM_SYSCALLS,
+} volumiofifo_sim_syscall_t;
+
+/*
+ * Empties the fifo a chunk at a time at a steady rate, like a player
+ * feeding a sound card. It starts when a wakeup's worth of chunks has
+ * arrived, and stops when a read finds less than a chunk. The behaviours below default to off, and
+ * are set by the harness after volumiofifo_sim_reader().
+ */
+typedef struct volumiofifo_sim_reader {
+	/* Bytes a second, 0 for a reader that never reads */
+	double rate;
+	/* How far the reader's clock runs fast, in parts per million */
+	double ppm;
+	unsigned int chunk;
+
+	/* Chunks read at each wakeup, the wakeups being spaced to keep the rate */
+	unsigned int burst;
+	/* Each wakeup comes up to this late, without the lateness accumulating */
+	uint64_t jitter_ns;
+	uint64_t seed;
+	/* The reader stops for stall_ns at the end of every stall_every_ns */
+	uint64_t stall_every_ns;
+	uint64_t stall_ns;
+
+	int playing;
+	uint64_t start_ns;
+	uint64_t chunks_since_start;
+	uint64_t next_read_ns;
+
+	uint64_t reads;
+	uint64_t bytes_read;
+	/* Reads that found less than a chunk while audio was expected */
+	uint64_t underruns;
+	unsigned int level_max;
+} volumiofifo_sim_reader_t;
+
+typedef struct volumiofifo_sim {
+	uint64_t now_ns;
+
+	/* The simulated fifo, opened by path, -1 when closed */
+	const char *path;
+	int read_fd;
+	int write_fd;
+	unsigned int capacity;
+	unsigned int level;
+	/* Set by the harness while a stall of the reader would be an underrun */
+	int expect_audio;
+
+	/* The simulated timerfd, 0 when disarmed */
+	int timer_fd;
+	uint64_t timer_next_ns;
+	uint64_t timer_interval_ns;
+
+	volumiofifo_sim_reader_t reader;
+
+	/* Calls the plugin made on the simulated descriptors */
+	uint64_t syscalls[VOLUMIOFIFO_SIM_SYSCALLS];
+	uint64_t writes;
+	uint64_t eagains;
+	uint64_t bytes_written;
+
+	/* Counted by the emulated client, those reporting nothing to do are idle */
+	uint64_t wakeups;
+	uint64_t idle_wakeups;
+} volumiofifo_sim_t;
+
+/**
+ * Make sim the simulation the wrapped system calls use, with a fifo of
+ * capacity bytes at path and a reader which never reads
+ */
+void volumiofifo_sim_init(volumiofifo_sim_t *sim, const char *path, unsigned int capacity, uint64_t now_ns);
+
+/**
+ * Have the reader consume rate bytes a second, chunk bytes at a time
+ */
+void volumiofifo_sim_reader(volumiofifo_sim_t *sim, double rate, unsigned int chunk, double ppm);
+
+/**
+ * Move the virtual clock forwards to now_ns, running the reader up to then
+ */
+void volumiofifo_sim_set_time(volumiofifo_sim_t *sim, uint64_t now_ns);
+
+/**
+ * The first time after now that the reader reads or the timer expires,
+ * which are the only things that can wake a client, or UINT64_MAX if
+ * neither ever will
+ */
+uint64_t volumiofifo_sim_next_event_ns(const volumiofifo_sim_t *sim);
+
+/**
+ * The nth of a repeatable sequence of pseudo random numbers
+ */
+uint64_t volumiofifo_sim_random(uint64_t seed, uint64_t n);
+
+/* The real CLOCK_MONOTONIC, for timing the plugin */
+uint64_t volumiofifo_sim_real_ns(void);
+
+/* A plugin configuration node and its children */
+snd_config_t *volumiofifo_sim_config_new(void);
+void volumiofifo_sim_config_free(snd_config_t *config);
+
+/**
+ * Add key=value to a configuration, the value being an integer if it
+ * looks like one and a string otherwise
+ *
+ * Returns 0 or -ve on error
+ */
+int volumiofifo_sim_config_set(snd_config_t *config, const char *setting);
+
+/**
+ * Open a playback PCM through the plugin, configured by config
+ *
+ * Returns 0 or -ve on error
+ */
+int volumiofifo_sim_pcm_open(snd_pcm_t **pcmp, snd_config_t *config);
+
+/**
+ * Set the hw params as a client would, checking them against the
+ * plugin's constraints. The buffer is filled with fill, which is repeated.
+ *
+ * Returns 0 or -ve on error
+ */
+int volumiofifo_sim_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_format_t format, unsigned int rate,
+		unsigned int channels, snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size,
+		const void *fill, size_t fill_bytes);
+
+snd_pcm_ioplug_t *volumiofifo_sim_pcm_io(snd_pcm_t *pcm);
+
+/**
+ * Reset the pointers, as alsa-lib does ahead of the prepare callback
+ */
+void volumiofifo_sim_pcm_reset(snd_pcm_t *pcm, snd_pcm_uframes_t hw_ptr, snd_pcm_uframes_t appl_ptr);
+
+/**
+ * Call the pointer callback and move the hw pointer on, as alsa-lib does
+ * whenever it syncs. An error from the callback is an xrun.
+ *
+ * Returns the pointer callback's result
+ */
+snd_pcm_sframes_t volumiofifo_sim_pcm_hw_ptr_update(snd_pcm_t *pcm);
+
+/**
+ * Prepare the PCM as snd_pcm_prepare does, which also recovers from an xrun
+ *
+ * Returns 0 or -ve on error
+ */
+int volumiofifo_sim_pcm_prepare(snd_pcm_t *pcm);
+
+/**
+ * Wait as snd_pcm_wait does, moving the virtual clock on to each event
+ * that could wake the plugin's poll descriptor until the plugin reports
+ * POLLOUT or leaves the running and draining states
+ *
+ * Returns 1 when woken, 0 if deadline_ns came first or -ve on error
+ */
+int volumiofifo_sim_pcm_wait(volumiofifo_sim_t *sim, snd_pcm_t *pcm, uint64_t deadline_ns);
+
+/**
+ * Write frames as a blocking snd_pcm_writei does, starting the PCM once
+ * the buffer is full. The frames are the pattern the buffer was filled
+ * with by volumiofifo_sim_pcm_hw_params.
+ *
+ * Returns the frames written, fewer if deadline_ns passed while waiting,
+ * or -ve on error, -EPIPE being an xrun
+ */
+snd_pcm_sframes_t volumiofifo_sim_pcm_writei(volumiofifo_sim_t *sim, snd_pcm_t *pcm, snd_pcm_uframes_t frames,
+		uint64_t deadline_ns);
+
+/**
+ * Drain as a blocking snd_pcm_drain does, leaving the PCM in the setup state
+ *
+ * Returns 0, -ETIMEDOUT if deadline_ns passed first or -ve on error
+ */
+int volumiofifo_sim_pcm_drain(volumiofifo_sim_t *sim, snd_pcm_t *pcm, uint64_t deadline_ns);
+
+/**
+ * Close the PCM through the close callback
+ */
+void volumiofifo_sim_pcm_close(snd_pcm_t *pcm);
+
+/* The plugin's entry point */
+int _snd_pcm_volumiofifo_open(snd_pcm_t **pcmp, const char *name, snd_config_t *root, snd_config_t *conf,
+		snd_pcm_stream_t stream, int mode);
+
+#endif
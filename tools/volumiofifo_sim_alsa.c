@@ -0,0 +1,778 @@
+/*
+ *  PCM - Volumio FIFO plugin - simulated alsa-lib
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The parts of alsa-lib the plugin uses: configuration nodes, the ioplug
+ * core's pointer keeping and the format helpers. The pointer arithmetic
+ * follows alsa-lib's pcm_ioplug.c, with a boundary wrapped hw pointer.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "volumiofifo_sim.h"
+
+struct _snd_config {
+	char *id;
+	snd_config_type_t type;
+	long integer;
+	double real;
+	char *string;
+	struct _snd_config *children;
+	struct _snd_config *next;
+};
+
+struct _snd_pcm_sw_params {
+	snd_pcm_uframes_t boundary;
+};
+
+typedef struct sim_constraint {
+	unsigned int min;
+	unsigned int max;
+	unsigned int count;
+	unsigned int *list;
+} sim_constraint_t;
+
+struct _snd_pcm {
+	char *name;
+	snd_pcm_ioplug_t *io;
+	sim_constraint_t constraints[SND_PCM_IOPLUG_HW_PARAMS];
+	unsigned int frame_bytes;
+	snd_pcm_uframes_t boundary;
+	snd_pcm_uframes_t last_hw;
+	char *buffer;
+	snd_pcm_channel_area_t *areas;
+};
+
+static void sim_error(const char *file, int line, const char *function, int err, const char *fmt, ...) {
+	va_list args;
+
+	fprintf(stderr, "ALSA lib %s:%i:(%s) ", file, line, function);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	if(err)
+		fprintf(stderr, ": %s", strerror(err > 0 ? err : -err));
+	fputc('\n', stderr);
+}
+
+snd_lib_error_handler_t snd_lib_error = sim_error;
+
+/* Configuration */
+
+snd_config_t *volumiofifo_sim_config_new(void) {
+	snd_config_t *config = calloc(1, sizeof(*config));
+
+	if(config)
+		config->type = SND_CONFIG_TYPE_COMPOUND;
+	return config;
+}
+
+void volumiofifo_sim_config_free(snd_config_t *config) {
+	while(config) {
+		snd_config_t *next = config->next;
+
+		volumiofifo_sim_config_free(config->children);
+		free(config->id);
+		free(config->string);
+		free(config);
+		config = next;
+	}
+}
+
+static snd_config_t *sim_config_child(snd_config_t *parent, const char *id, size_t length) {
+	snd_config_t **pos = &parent->children;
+
+	for(; *pos; pos = &(*pos)->next) {
+		if(strlen((*pos)->id) == length && strncmp((*pos)->id, id, length) == 0)
+			return *pos;
+	}
+	*pos = volumiofifo_sim_config_new();
+	if(*pos)
+		(*pos)->id = strndup(id, length);
+	return *pos;
+}
+
+int volumiofifo_sim_config_set(snd_config_t *config, const char *setting) {
+	const char *value = strchr(setting, '=');
+	const char *key = setting;
+	char *end;
+
+	if(value == NULL || value == setting)
+		return -EINVAL;
+
+	// a.b=c sets c in the compound a
+	for(;;) {
+		const char *dot = memchr(key, '.', value - key);
+
+		config = sim_config_child(config, key, dot ? dot - key : value - key);
+		if(config == NULL)
+			return -ENOMEM;
+		if(dot == NULL)
+			break;
+		config->type = SND_CONFIG_TYPE_COMPOUND;
+		key = dot + 1;
+	}
+	value++;
+
+	config->integer = strtol(value, &end, 0);
+	if(*value && *end == 0) {
+		config->type = SND_CONFIG_TYPE_INTEGER;
+		return 0;
+	}
+	config->real = strtod(value, &end);
+	if(*value && *end == 0) {
+		config->type = SND_CONFIG_TYPE_REAL;
+		return 0;
+	}
+	config->type = SND_CONFIG_TYPE_STRING;
+	free(config->string);
+	config->string = strdup(value);
+	return config->string ? 0 : -ENOMEM;
+}
+
+snd_config_iterator_t snd_config_iterator_first(const snd_config_t *node) {
+	return (snd_config_iterator_t) node->children;
+}
+
+snd_config_iterator_t snd_config_iterator_next(const snd_config_iterator_t iterator) {
+	return iterator ? (snd_config_iterator_t) ((snd_config_t *) iterator)->next : NULL;
+}
+
+snd_config_iterator_t snd_config_iterator_end(const snd_config_t *node) {
+	return NULL;
+}
+
+snd_config_t *snd_config_iterator_entry(const snd_config_iterator_t iterator) {
+	return (snd_config_t *) iterator;
+}
+
+int snd_config_get_id(const snd_config_t *config, const char **value) {
+	*value = config->id;
+	return 0;
+}
+
+snd_config_type_t snd_config_get_type(const snd_config_t *config) {
+	return config->type;
+}
+
+int snd_config_get_integer(const snd_config_t *config, long *value) {
+	if(config->type != SND_CONFIG_TYPE_INTEGER)
+		return -EINVAL;
+	*value = config->integer;
+	return 0;
+}
+
+int snd_config_get_ireal(const snd_config_t *config, double *value) {
+	if(config->type == SND_CONFIG_TYPE_INTEGER)
+		*value = config->integer;
+	else if(config->type == SND_CONFIG_TYPE_REAL)
+		*value = config->real;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+int snd_config_get_string(const snd_config_t *config, const char **value) {
+	if(config->type != SND_CONFIG_TYPE_STRING)
+		return -EINVAL;
+	*value = config->string;
+	return 0;
+}
+
+/* Names */
+
+static const char *sim_states[] = {
+	"OPEN", "SETUP", "PREPARED", "RUNNING", "XRUN", "DRAINING", "PAUSED", "SUSPENDED", "DISCONNECTED"
+};
+
+const char *snd_pcm_state_name(const snd_pcm_state_t state) {
+	return state <= SND_PCM_STATE_LAST ? sim_states[state] : NULL;
+}
+
+const char *snd_pcm_stream_name(const snd_pcm_stream_t stream) {
+	return stream == SND_PCM_STREAM_PLAYBACK ? "PLAYBACK" : "CAPTURE";
+}
+
+const char *snd_pcm_name(snd_pcm_t *pcm) {
+	return pcm->name;
+}
+
+/* Formats */
+
+typedef struct sim_format {
+	snd_pcm_format_t format;
+	const char *name;
+	int width;
+	int physical_width;
+	/* 1 if signed, 0 if unsigned */
+	int is_signed;
+	int big_endian;
+	int is_float;
+	int dsd;
+} sim_format_t;
+
+static const sim_format_t sim_formats[] = {
+	{ SND_PCM_FORMAT_S8, "S8", 8, 8, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U8, "U8", 8, 8, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S16_LE, "S16_LE", 16, 16, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S16_BE, "S16_BE", 16, 16, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U16_LE, "U16_LE", 16, 16, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U16_BE, "U16_BE", 16, 16, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_S24_LE, "S24_LE", 24, 32, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S24_BE, "S24_BE", 24, 32, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U24_LE, "U24_LE", 24, 32, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U24_BE, "U24_BE", 24, 32, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_S32_LE, "S32_LE", 32, 32, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S32_BE, "S32_BE", 32, 32, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U32_LE, "U32_LE", 32, 32, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U32_BE, "U32_BE", 32, 32, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_FLOAT_LE, "FLOAT_LE", 32, 32, 1, 0, 1, 0 },
+	{ SND_PCM_FORMAT_FLOAT_BE, "FLOAT_BE", 32, 32, 1, 1, 1, 0 },
+	{ SND_PCM_FORMAT_FLOAT64_LE, "FLOAT64_LE", 64, 64, 1, 0, 1, 0 },
+	{ SND_PCM_FORMAT_FLOAT64_BE, "FLOAT64_BE", 64, 64, 1, 1, 1, 0 },
+	{ SND_PCM_FORMAT_S20_LE, "S20_LE", 20, 32, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S20_BE, "S20_BE", 20, 32, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U20_LE, "U20_LE", 20, 32, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U20_BE, "U20_BE", 20, 32, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_S24_3LE, "S24_3LE", 24, 24, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S24_3BE, "S24_3BE", 24, 24, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U24_3LE, "U24_3LE", 24, 24, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U24_3BE, "U24_3BE", 24, 24, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_S20_3LE, "S20_3LE", 20, 24, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S20_3BE, "S20_3BE", 20, 24, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U20_3LE, "U20_3LE", 20, 24, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U20_3BE, "U20_3BE", 20, 24, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_S18_3LE, "S18_3LE", 18, 24, 1, 0, 0, 0 },
+	{ SND_PCM_FORMAT_S18_3BE, "S18_3BE", 18, 24, 1, 1, 0, 0 },
+	{ SND_PCM_FORMAT_U18_3LE, "U18_3LE", 18, 24, 0, 0, 0, 0 },
+	{ SND_PCM_FORMAT_U18_3BE, "U18_3BE", 18, 24, 0, 1, 0, 0 },
+	{ SND_PCM_FORMAT_DSD_U8, "DSD_U8", 8, 8, 0, 0, 0, 1 },
+	{ SND_PCM_FORMAT_DSD_U16_LE, "DSD_U16_LE", 16, 16, 0, 0, 0, 1 },
+	{ SND_PCM_FORMAT_DSD_U32_LE, "DSD_U32_LE", 32, 32, 0, 0, 0, 1 },
+	{ SND_PCM_FORMAT_DSD_U16_BE, "DSD_U16_BE", 16, 16, 0, 1, 0, 1 },
+	{ SND_PCM_FORMAT_DSD_U32_BE, "DSD_U32_BE", 32, 32, 0, 1, 0, 1 },
+};
+
+static const sim_format_t *sim_format(snd_pcm_format_t format) {
+	unsigned int i;
+
+	for(i = 0; i < sizeof(sim_formats) / sizeof(sim_formats[0]); i++) {
+		if(sim_formats[i].format == format)
+			return &sim_formats[i];
+	}
+	return NULL;
+}
+
+const char *snd_pcm_format_name(const snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f ? f->name : NULL;
+}
+
+snd_pcm_format_t snd_pcm_format_value(const char *name) {
+	unsigned int i;
+
+	for(i = 0; i < sizeof(sim_formats) / sizeof(sim_formats[0]); i++) {
+		if(strcasecmp(sim_formats[i].name, name) == 0)
+			return sim_formats[i].format;
+	}
+	return SND_PCM_FORMAT_UNKNOWN;
+}
+
+int snd_pcm_format_width(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f ? f->width : -EINVAL;
+}
+
+int snd_pcm_format_physical_width(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f ? f->physical_width : -EINVAL;
+}
+
+ssize_t snd_pcm_format_size(snd_pcm_format_t format, size_t samples) {
+	const sim_format_t *f = sim_format(format);
+	return f ? (ssize_t) (samples * f->physical_width / 8) : -EINVAL;
+}
+
+int snd_pcm_format_signed(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f ? f->is_signed : -EINVAL;
+}
+
+int snd_pcm_format_linear(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f != NULL && !f->is_float;
+}
+
+int snd_pcm_format_float(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f != NULL && f->is_float;
+}
+
+int snd_pcm_format_big_endian(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	return f ? f->big_endian : -EINVAL;
+}
+
+/* One sample of silence, physical_width / 8 bytes */
+static void sim_format_silence(const sim_format_t *f, unsigned char *sample) {
+	int bytes = f->physical_width / 8;
+	uint64_t value = 0;
+	int i;
+
+	if(f->dsd) {
+		memset(sample, 0x69, bytes);
+		return;
+	}
+	if(!f->is_signed)
+		value = 1ULL << (f->width - 1);
+	for(i = 0; i < bytes; i++)
+		sample[f->big_endian ? bytes - 1 - i : i] = value >> (8 * i);
+}
+
+uint64_t snd_pcm_format_silence_64(snd_pcm_format_t format) {
+	const sim_format_t *f = sim_format(format);
+	unsigned char sample[8];
+	union {
+		uint64_t value;
+		unsigned char bytes[8];
+	} silence;
+	int i;
+
+	if(f == NULL)
+		return 0;
+	sim_format_silence(f, sample);
+	for(i = 0; i < 8; i++)
+		silence.bytes[i] = sample[i % (f->physical_width / 8)];
+	return silence.value;
+}
+
+int snd_pcm_format_set_silence(snd_pcm_format_t format, void *buf, unsigned int samples) {
+	const sim_format_t *f = sim_format(format);
+	unsigned char sample[8];
+	unsigned int i;
+
+	if(f == NULL)
+		return -EINVAL;
+	sim_format_silence(f, sample);
+	for(i = 0; i < samples; i++)
+		memcpy((char *) buf + i * (f->physical_width / 8), sample, f->physical_width / 8);
+	return 0;
+}
+
+/* The PCM */
+
+ssize_t snd_pcm_frames_to_bytes(snd_pcm_t *pcm, snd_pcm_sframes_t frames) {
+	return frames * pcm->frame_bytes;
+}
+
+snd_pcm_sframes_t snd_pcm_bytes_to_frames(snd_pcm_t *pcm, ssize_t bytes) {
+	return bytes / pcm->frame_bytes;
+}
+
+size_t snd_pcm_sw_params_sizeof(void) {
+	return sizeof(snd_pcm_sw_params_t);
+}
+
+int snd_pcm_sw_params_current(snd_pcm_t *pcm, snd_pcm_sw_params_t *params) {
+	params->boundary = pcm->boundary;
+	return 0;
+}
+
+int snd_pcm_sw_params_get_boundary(const snd_pcm_sw_params_t *params, snd_pcm_uframes_t *val) {
+	*val = params->boundary;
+	return 0;
+}
+
+snd_pcm_uframes_t snd_pcm_ioplug_avail(const snd_pcm_ioplug_t * const io, const snd_pcm_uframes_t hw_ptr,
+		const snd_pcm_uframes_t appl_ptr) {
+	snd_pcm_sframes_t avail;
+
+	if(io->stream == SND_PCM_STREAM_PLAYBACK)
+		avail = hw_ptr + io->buffer_size - appl_ptr;
+	else
+		avail = hw_ptr - appl_ptr;
+	if(avail < 0)
+		avail += io->pcm->boundary;
+	else if((snd_pcm_uframes_t) avail >= io->pcm->boundary)
+		avail -= io->pcm->boundary;
+	return avail;
+}
+
+snd_pcm_uframes_t snd_pcm_ioplug_hw_avail(const snd_pcm_ioplug_t * const io, const snd_pcm_uframes_t hw_ptr,
+		const snd_pcm_uframes_t appl_ptr) {
+	return io->buffer_size - snd_pcm_ioplug_avail(io, hw_ptr, appl_ptr);
+}
+
+int snd_pcm_ioplug_set_state(snd_pcm_ioplug_t *io, snd_pcm_state_t state) {
+	io->state = state;
+	return 0;
+}
+
+const snd_pcm_channel_area_t *snd_pcm_ioplug_mmap_areas(snd_pcm_ioplug_t *ioplug) {
+	return ioplug->pcm->areas;
+}
+
+int snd_pcm_ioplug_set_param_minmax(snd_pcm_ioplug_t *io, int type, unsigned int min, unsigned int max) {
+	sim_constraint_t *constraint;
+
+	if(type < 0 || type >= SND_PCM_IOPLUG_HW_PARAMS || min > max)
+		return -EINVAL;
+	constraint = &io->pcm->constraints[type];
+	free(constraint->list);
+	constraint->list = NULL;
+	constraint->count = 0;
+	constraint->min = min;
+	constraint->max = max;
+	return 0;
+}
+
+int snd_pcm_ioplug_set_param_list(snd_pcm_ioplug_t *io, int type, unsigned int num_list, const unsigned int *list) {
+	sim_constraint_t *constraint;
+
+	if(type < 0 || type >= SND_PCM_IOPLUG_HW_PARAMS || num_list == 0)
+		return -EINVAL;
+	constraint = &io->pcm->constraints[type];
+	free(constraint->list);
+	constraint->list = malloc(num_list * sizeof(*list));
+	if(constraint->list == NULL)
+		return -ENOMEM;
+	memcpy(constraint->list, list, num_list * sizeof(*list));
+	constraint->count = num_list;
+	return 0;
+}
+
+int snd_pcm_ioplug_create(snd_pcm_ioplug_t *io, const char *name, snd_pcm_stream_t stream, int mode) {
+	snd_pcm_t *pcm = calloc(1, sizeof(*pcm));
+	int i;
+
+	if(pcm == NULL)
+		return -ENOMEM;
+	pcm->name = strdup(name);
+	if(pcm->name == NULL) {
+		free(pcm);
+		return -ENOMEM;
+	}
+	for(i = 0; i < SND_PCM_IOPLUG_HW_PARAMS; i++)
+		pcm->constraints[i].max = UINT_MAX;
+	pcm->io = io;
+	pcm->frame_bytes = 1;
+	io->pcm = pcm;
+	io->stream = stream;
+	io->state = SND_PCM_STATE_OPEN;
+	io->nonblock = 1;
+	return 0;
+}
+
+static void sim_pcm_free(snd_pcm_t *pcm) {
+	int i;
+
+	for(i = 0; i < SND_PCM_IOPLUG_HW_PARAMS; i++)
+		free(pcm->constraints[i].list);
+	free(pcm->areas);
+	free(pcm->buffer);
+	free(pcm->name);
+	free(pcm);
+}
+
+int snd_pcm_ioplug_delete(snd_pcm_ioplug_t *io) {
+	snd_pcm_t *pcm = io->pcm;
+
+	// The close callback frees io
+	if(io->callback->close)
+		io->callback->close(io);
+	sim_pcm_free(pcm);
+	return 0;
+}
+
+snd_pcm_sframes_t volumiofifo_sim_pcm_hw_ptr_update(snd_pcm_t *pcm) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	snd_pcm_sframes_t hw = io->callback->pointer(io);
+
+	if(hw >= 0) {
+		snd_pcm_uframes_t delta;
+
+		if((snd_pcm_uframes_t) hw >= pcm->last_hw)
+			delta = hw - pcm->last_hw;
+		else
+			delta = pcm->boundary + hw - pcm->last_hw;
+		io->hw_ptr += delta;
+		if(io->hw_ptr >= pcm->boundary)
+			io->hw_ptr -= pcm->boundary;
+		pcm->last_hw = hw;
+	} else {
+		io->state = SND_PCM_STATE_XRUN;
+	}
+	return hw;
+}
+
+int snd_pcm_hwsync(snd_pcm_t *pcm) {
+	snd_pcm_sframes_t hw = volumiofifo_sim_pcm_hw_ptr_update(pcm);
+	return hw < 0 ? hw : 0;
+}
+
+/* The harness' side */
+
+static int sim_pcm_allowed(const sim_constraint_t *constraint, unsigned int value) {
+	unsigned int i;
+
+	if(constraint->count == 0)
+		return value >= constraint->min && value <= constraint->max;
+	for(i = 0; i < constraint->count; i++) {
+		if(constraint->list[i] == value)
+			return 1;
+	}
+	return 0;
+}
+
+int volumiofifo_sim_pcm_open(snd_pcm_t **pcmp, snd_config_t *config) {
+	return _snd_pcm_volumiofifo_open(pcmp, "volumiofifo-sim", NULL, config, SND_PCM_STREAM_PLAYBACK, 0);
+}
+
+int volumiofifo_sim_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_format_t format, unsigned int rate,
+		unsigned int channels, snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size,
+		const void *fill, size_t fill_bytes) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	int width = snd_pcm_format_physical_width(format);
+	unsigned int frame_bytes, c;
+	size_t i;
+
+	if(width <= 0 || channels == 0 || period_size == 0 || buffer_size < period_size)
+		return -EINVAL;
+	frame_bytes = channels * width / 8;
+
+	if(!sim_pcm_allowed(&pcm->constraints[SND_PCM_IOPLUG_HW_ACCESS], SND_PCM_ACCESS_RW_INTERLEAVED) ||
+			!sim_pcm_allowed(&pcm->constraints[SND_PCM_IOPLUG_HW_FORMAT], format) ||
+			!sim_pcm_allowed(&pcm->constraints[SND_PCM_IOPLUG_HW_RATE], rate) ||
+			!sim_pcm_allowed(&pcm->constraints[SND_PCM_IOPLUG_HW_CHANNELS], channels) ||
+			!sim_pcm_allowed(&pcm->constraints[SND_PCM_IOPLUG_HW_PERIOD_BYTES], period_size * frame_bytes) ||
+			!sim_pcm_allowed(&pcm->constraints[SND_PCM_IOPLUG_HW_BUFFER_BYTES], buffer_size * frame_bytes))
+		return -EINVAL;
+
+	free(pcm->buffer);
+	free(pcm->areas);
+	pcm->buffer = malloc(buffer_size * frame_bytes);
+	pcm->areas = calloc(channels, sizeof(*pcm->areas));
+	if(pcm->buffer == NULL || pcm->areas == NULL)
+		return -ENOMEM;
+	for(i = 0; i < buffer_size * frame_bytes; i++)
+		pcm->buffer[i] = fill_bytes > 0 ? ((const char *) fill)[i % fill_bytes] : 0;
+	for(c = 0; c < channels; c++) {
+		pcm->areas[c].addr = pcm->buffer;
+		pcm->areas[c].first = c * width;
+		pcm->areas[c].step = channels * width;
+	}
+
+	// As alsa-lib, the largest multiple of the buffer that leaves room for another buffer
+	pcm->boundary = buffer_size;
+	while(pcm->boundary * 2 <= LONG_MAX - buffer_size)
+		pcm->boundary *= 2;
+
+	pcm->frame_bytes = frame_bytes;
+	io->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	io->format = format;
+	io->rate = rate;
+	io->channels = channels;
+	io->period_size = period_size;
+	io->buffer_size = buffer_size;
+	io->state = SND_PCM_STATE_SETUP;
+	return 0;
+}
+
+snd_pcm_ioplug_t *volumiofifo_sim_pcm_io(snd_pcm_t *pcm) {
+	return pcm->io;
+}
+
+void volumiofifo_sim_pcm_reset(snd_pcm_t *pcm, snd_pcm_uframes_t hw_ptr, snd_pcm_uframes_t appl_ptr) {
+	pcm->io->hw_ptr = hw_ptr;
+	pcm->io->appl_ptr = appl_ptr;
+	pcm->last_hw = hw_ptr;
+}
+
+int volumiofifo_sim_pcm_prepare(snd_pcm_t *pcm) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	int err;
+
+	io->state = SND_PCM_STATE_SETUP;
+	volumiofifo_sim_pcm_reset(pcm, 0, 0);
+	err = io->callback->prepare(io);
+	if(err == 0)
+		io->state = SND_PCM_STATE_PREPARED;
+	return err;
+}
+
+static int sim_pcm_start(snd_pcm_t *pcm) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	int err = io->callback->start(io);
+
+	if(err == 0)
+		io->state = SND_PCM_STATE_RUNNING;
+	return err;
+}
+
+/* As snd_pcm_drop, the stop callback then the setup state */
+static void sim_pcm_drop(snd_pcm_t *pcm) {
+	snd_pcm_ioplug_t *io = pcm->io;
+
+	io->callback->stop(io);
+	io->state = SND_PCM_STATE_SETUP;
+}
+
+int volumiofifo_sim_pcm_wait(volumiofifo_sim_t *sim, snd_pcm_t *pcm, uint64_t deadline_ns) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	struct pollfd pfd;
+	int err;
+
+	// Asked for once a wait, the plugin arms its timer as it answers
+	err = io->callback->poll_descriptors(io, &pfd, 1);
+	if(err < 0)
+		return err;
+
+	for(;;) {
+		uint64_t next;
+
+		// Goes to the simulation, which never blocks
+		err = poll(&pfd, 1, -1);
+		if(err < 0)
+			return -errno;
+		if(err > 0) {
+			unsigned short revents = 0;
+
+			sim->wakeups++;
+			err = io->callback->poll_revents(io, &pfd, 1, &revents);
+			if(err < 0)
+				return err;
+			if(revents & POLLERR)
+				return -EIO;
+			if((revents & POLLOUT) || (io->state != SND_PCM_STATE_RUNNING &&
+					io->state != SND_PCM_STATE_DRAINING))
+				return 1;
+			sim->idle_wakeups++;
+		}
+
+		next = volumiofifo_sim_next_event_ns(sim);
+		if(next > deadline_ns) {
+			volumiofifo_sim_set_time(sim, deadline_ns);
+			return 0;
+		}
+		volumiofifo_sim_set_time(sim, next);
+	}
+}
+
+snd_pcm_sframes_t volumiofifo_sim_pcm_writei(volumiofifo_sim_t *sim, snd_pcm_t *pcm, snd_pcm_uframes_t frames,
+		uint64_t deadline_ns) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	snd_pcm_uframes_t done = 0;
+
+	if(io->state != SND_PCM_STATE_PREPARED && io->state != SND_PCM_STATE_RUNNING)
+		return io->state == SND_PCM_STATE_XRUN ? -EPIPE : -EBADFD;
+
+	while(done < frames) {
+		snd_pcm_uframes_t avail, size;
+		int err;
+
+		// As snd_pcm_avail_update
+		volumiofifo_sim_pcm_hw_ptr_update(pcm);
+		if(io->state == SND_PCM_STATE_XRUN)
+			return done > 0 ? (snd_pcm_sframes_t) done : -EPIPE;
+		avail = snd_pcm_ioplug_avail(io, io->hw_ptr, io->appl_ptr);
+
+		if(avail == 0) {
+			if(io->state == SND_PCM_STATE_PREPARED) {
+				err = sim_pcm_start(pcm);
+				if(err < 0)
+					return err;
+			}
+			err = volumiofifo_sim_pcm_wait(sim, pcm, deadline_ns);
+			if(err < 0)
+				return err;
+			if(err == 0)
+				break;
+			continue;
+		}
+
+		// With mmap_rw and RW access alsa-lib only moves the application
+		// pointer, the plugin picks the frames up when the pointer is next asked for
+		size = frames - done < avail ? frames - done : avail;
+		io->appl_ptr += size;
+		if(io->appl_ptr >= pcm->boundary)
+			io->appl_ptr -= pcm->boundary;
+		done += size;
+
+		// The default start threshold is the buffer size
+		if(io->state == SND_PCM_STATE_PREPARED &&
+				snd_pcm_ioplug_hw_avail(io, io->hw_ptr, io->appl_ptr) >= io->buffer_size) {
+			err = sim_pcm_start(pcm);
+			if(err < 0)
+				return err;
+		}
+	}
+	return done;
+}
+
+int volumiofifo_sim_pcm_drain(volumiofifo_sim_t *sim, snd_pcm_t *pcm, uint64_t deadline_ns) {
+	snd_pcm_ioplug_t *io = pcm->io;
+	int err = 0;
+
+	switch(io->state) {
+		case SND_PCM_STATE_PREPARED:
+			err = sim_pcm_start(pcm);
+			if(err < 0)
+				return err;
+			io->state = SND_PCM_STATE_DRAINING;
+			break;
+		case SND_PCM_STATE_RUNNING:
+			io->state = SND_PCM_STATE_DRAINING;
+			break;
+		case SND_PCM_STATE_OPEN:
+			return -EBADFD;
+		default:
+			break;
+	}
+
+	// The plugin has no drain callback, so alsa-lib polls until the pointer fails
+	while(io->state == SND_PCM_STATE_DRAINING) {
+		volumiofifo_sim_pcm_hw_ptr_update(pcm);
+		if(io->state != SND_PCM_STATE_DRAINING)
+			break;
+		err = volumiofifo_sim_pcm_wait(sim, pcm, deadline_ns);
+		if(err <= 0) {
+			if(err == 0)
+				err = -ETIMEDOUT;
+			break;
+		}
+		err = 0;
+	}
+
+	if(io->state != SND_PCM_STATE_SETUP)
+		sim_pcm_drop(pcm);
+	return err;
+}
+
+void volumiofifo_sim_pcm_close(snd_pcm_t *pcm) {
+	snd_pcm_ioplug_delete(pcm->io);
+}
@@ -0,0 +1,246 @@
+/*
+ *  PCM - Volumio FIFO plugin - statistics viewer
+ *
+ *  Copyright (c) 2022 by Volumio SRL
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as
+ *   published by the Free Software Foundation; either version 2.1 of
+ *   the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Lists the PCMs keeping statistics, i.e. those configured with stats,
+ * and prints their rates over an interval. The pages are found in
+ * /dev/shm and read without any locking, so this does not disturb the
+ * audio. Does not need alsa-lib.
+ *
+ * Usage: volumiofifo-stat [-i interval_ms] [-c count] [-H]
+ *
+ * A count of 0 repeats until interrupted. -H adds the percentiles of the
+ * latency histograms, counted since the PCM was opened.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "volumiofifo_shm.h"
+
+#define STAT_MAX_PCMS 64
+
+typedef struct stat_pcm {
+	char name[NAME_MAX + 2];
+	volumiofifo_stats_page_t *page;
+	volumiofifo_stats_page_t before;
+} stat_pcm_t;
+
+/* The alsa-lib snd_pcm_state_t names */
+static const char *stat_states[] = {
+	"OPEN", "SETUP", "PREPARED", "RUNNING", "XRUN", "DRAINING", "PAUSED", "SUSPENDED", "DISCONNECTED"
+};
+
+/* The alsa-lib snd_pcm_format_t names of the common fifo formats */
+static const struct {
+	unsigned int value;
+	const char *name;
+} stat_formats[] = {
+	{ 0, "S8" }, { 1, "U8" }, { 2, "S16_LE" }, { 3, "S16_BE" }, { 6, "S24_LE" }, { 7, "S24_BE" },
+	{ 10, "S32_LE" }, { 11, "S32_BE" }, { 14, "FLOAT_LE" }, { 15, "FLOAT_BE" }, { 16, "FLOAT64_LE" },
+	{ 32, "S24_3LE" }, { 33, "S24_3BE" }, { 48, "DSD_U8" }, { 49, "DSD_U16_LE" }, { 50, "DSD_U32_LE" },
+	{ 51, "DSD_U16_BE" }, { 52, "DSD_U32_BE" },
+};
+
+static void stat_copy(volumiofifo_stats_page_t *dst, volumiofifo_stats_page_t *src) {
+	// Field by field, as the plugin updates them with relaxed atomics
+	dst->state = __atomic_load_n(&src->state, __ATOMIC_RELAXED);
+	dst->standby = __atomic_load_n(&src->standby, __ATOMIC_RELAXED);
+	dst->format = __atomic_load_n(&src->format, __ATOMIC_RELAXED);
+	dst->rate = __atomic_load_n(&src->rate, __ATOMIC_RELAXED);
+	dst->channels = __atomic_load_n(&src->channels, __ATOMIC_RELAXED);
+	dst->bytes_written = __atomic_load_n(&src->bytes_written, __ATOMIC_RELAXED);
+	dst->frames_written = __atomic_load_n(&src->frames_written, __ATOMIC_RELAXED);
+	dst->writes = __atomic_load_n(&src->writes, __ATOMIC_RELAXED);
+	dst->eagains = __atomic_load_n(&src->eagains, __ATOMIC_RELAXED);
+	dst->partial_writes = __atomic_load_n(&src->partial_writes, __ATOMIC_RELAXED);
+	dst->wakeups = __atomic_load_n(&src->wakeups, __ATOMIC_RELAXED);
+	dst->wasted_wakeups = __atomic_load_n(&src->wasted_wakeups, __ATOMIC_RELAXED);
+	dst->xruns = __atomic_load_n(&src->xruns, __ATOMIC_RELAXED);
+	dst->drains = __atomic_load_n(&src->drains, __ATOMIC_RELAXED);
+	dst->drain_ns = __atomic_load_n(&src->drain_ns, __ATOMIC_RELAXED);
+	dst->drain_max_ns = __atomic_load_n(&src->drain_max_ns, __ATOMIC_RELAXED);
+	dst->drops = __atomic_load_n(&src->drops, __ATOMIC_RELAXED);
+	dst->drop_ns = __atomic_load_n(&src->drop_ns, __ATOMIC_RELAXED);
+	dst->drop_max_ns = __atomic_load_n(&src->drop_max_ns, __ATOMIC_RELAXED);
+	dst->fifo_bytes = __atomic_load_n(&src->fifo_bytes, __ATOMIC_RELAXED);
+	dst->fifo_size = __atomic_load_n(&src->fifo_size, __ATOMIC_RELAXED);
+}
+
+static const char *stat_format_name(unsigned int format, char *buf, size_t len) {
+	size_t i;
+
+	for(i = 0; i < sizeof(stat_formats) / sizeof(stat_formats[0]); i++) {
+		if(stat_formats[i].value == format)
+			return stat_formats[i].name;
+	}
+	snprintf(buf, len, "format %u", format);
+	return buf;
+}
+
+static int stat_find(stat_pcm_t *pcms) {
+	DIR *dir = opendir("/dev/shm");
+	struct dirent *entry;
+	int count = 0;
+
+	if(dir == NULL) {
+		fprintf(stderr, "Unable to list /dev/shm: %s\n", strerror(errno));
+		return -1;
+	}
+
+	while((entry = readdir(dir)) != NULL && count < STAT_MAX_PCMS) {
+		stat_pcm_t *pcm = &pcms[count];
+
+		if(strncmp(entry->d_name, "volumiofifo", 11) != 0 || strstr(entry->d_name, ".stats.") == NULL)
+			continue;
+
+		snprintf(pcm->name, sizeof(pcm->name), "/%s", entry->d_name);
+		pcm->page = _snd_pcm_volumiofifo_shm_map(pcm->name, sizeof(*pcm->page), 0);
+		if(pcm->page == NULL)
+			continue;
+		if(pcm->page->magic != VOLUMIOFIFO_STATS_MAGIC || pcm->page->version != VOLUMIOFIFO_STATS_VERSION) {
+			_snd_pcm_volumiofifo_shm_unmap(pcm->page, sizeof(*pcm->page));
+			continue;
+		}
+		count++;
+	}
+
+	closedir(dir);
+	return count;
+}
+
+static double stat_ms(uint64_t ns, uint64_t count) {
+	return count > 0 ? ns / 1e6 / count : 0;
+}
+
+static void stat_print_histogram(const char *what, const volumiofifo_histogram_t *histogram, double scale,
+		const char *unit) {
+	uint64_t count = 0;
+	int i;
+
+	for(i = 0; i < VOLUMIOFIFO_HISTOGRAM_BUCKETS; i++)
+		count += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+	if(count == 0)
+		return;
+
+	printf("  %-18s %10llu  p50 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f %s\n", what, (unsigned long long) count,
+			_snd_pcm_volumiofifo_histogram_percentile(histogram, 0.5) * scale,
+			_snd_pcm_volumiofifo_histogram_percentile(histogram, 0.99) * scale,
+			_snd_pcm_volumiofifo_histogram_percentile(histogram, 0.999) * scale,
+			_snd_pcm_volumiofifo_histogram_percentile(histogram, 1) * scale, unit);
+}
+
+static void stat_print(stat_pcm_t *pcm, double seconds, int histograms) {
+	volumiofifo_stats_page_t now;
+	volumiofifo_stats_page_t *was = &pcm->before;
+	char format[32];
+	const char *state;
+	int alive = kill(pcm->page->pid, 0) == 0 || errno != ESRCH;
+
+	memset(&now, 0, sizeof(now));
+	stat_copy(&now, pcm->page);
+	state = now.state < sizeof(stat_states) / sizeof(stat_states[0]) ? stat_states[now.state] : "UNKNOWN";
+
+	printf("%s  pid %d%s  %s%s  %s %uHz %uch\n", pcm->page->fifo, pcm->page->pid, alive ? "" : " (exited)",
+			state, now.standby ? " (standby)" : "", stat_format_name(now.format, format, sizeof(format)),
+			now.rate, now.channels);
+
+	if(alive) {
+		uint64_t wakeups = now.wakeups - was->wakeups;
+
+		printf("  written %.1f kB/s %.0f frames/s  writes %.1f/s  full %.1f/s  partial %llu\n",
+				(now.bytes_written - was->bytes_written) / seconds / 1000,
+				(now.frames_written - was->frames_written) / seconds,
+				(now.writes - was->writes) / seconds, (now.eagains - was->eagains) / seconds,
+				(unsigned long long) now.partial_writes);
+		printf("  wakeups %.1f/s  wasted %.1f%%  xruns %llu  fifo %u/%u bytes\n",
+				wakeups / seconds, wakeups > 0 ? 100.0 * (now.wasted_wakeups - was->wasted_wakeups) / wakeups : 0,
+				(unsigned long long) now.xruns, now.fifo_bytes, now.fifo_size);
+	}
+	printf("  drains %llu avg %.1f ms max %.1f ms  drops %llu avg %.2f ms max %.2f ms\n",
+			(unsigned long long) now.drains, stat_ms(now.drain_ns, now.drains), now.drain_max_ns / 1e6,
+			(unsigned long long) now.drops, stat_ms(now.drop_ns, now.drops), now.drop_max_ns / 1e6);
+
+	// Percentiles are bucket upper bounds, so within a factor of two
+	if(histograms) {
+		stat_print_histogram("pointer advance", &pcm->page->advance_ns, 1e-3, "us");
+		stat_print_histogram("frames per advance", &pcm->page->advance_frames, 1, "frames");
+		stat_print_histogram("write", &pcm->page->write_ns, 1e-3, "us");
+		stat_print_histogram("wakeup delay", &pcm->page->wakeup_ns, 1e-3, "us");
+	}
+
+	*was = now;
+}
+
+int main(int argc, char **argv) {
+	static stat_pcm_t pcms[STAT_MAX_PCMS];
+	long interval_ms = 1000, count = 1, pass;
+	int opt, found, i, histograms = 0;
+
+	while((opt = getopt(argc, argv, "i:c:H")) != -1) {
+		switch(opt) {
+			case 'i':
+				interval_ms = strtol(optarg, NULL, 10);
+				break;
+			case 'c':
+				count = strtol(optarg, NULL, 10);
+				break;
+			case 'H':
+				histograms = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-i interval_ms] [-c count] [-H]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(interval_ms < 1) {
+		fprintf(stderr, "The interval must be at least 1 ms\n");
+		return 1;
+	}
+
+	found = stat_find(pcms);
+	if(found <= 0) {
+		if(found == 0)
+			printf("No volumiofifo PCMs are keeping statistics\n");
+		return found < 0 ? 1 : 0;
+	}
+
+	for(i = 0; i < found; i++)
+		stat_copy(&pcms[i].before, pcms[i].page);
+
+	for(pass = 0; count == 0 || pass < count; pass++) {
+		struct timespec ts = { interval_ms / 1000, (interval_ms % 1000) * 1000000 };
+
+		nanosleep(&ts, NULL);
+		for(i = 0; i < found; i++)
+			stat_print(&pcms[i], interval_ms / 1000.0, histograms);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	return 0;
+}